@@ -23,9 +23,13 @@
 #include "qemu/cutils.h"
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
+#include "qemu/hbitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
 #define SLICE_TIME 100000000ULL /* ns */
+#define BACKUP_MAX_WORKERS_DEFAULT 16
+#define BACKUP_MAX_WORKERS 256
+#define BACKUP_BUF_SIZE_DEFAULT (16 << 20)
 
 typedef struct CowRequest {
     int64_t start;
@@ -49,8 +53,27 @@ typedef struct BackupBlockJob {
     int64_t cluster_size;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Clusters the background copy still has to look at */
+    HBitmap *copy_bitmap;
+    /* Limits for the background copy: number of requests, bytes in flight
+     * and bytes per request (a multiple of cluster_size) */
+    int max_workers;
+    int64_t buf_size;
+    int64_t max_chunk;
+    int in_flight;
+    int64_t bytes_in_flight;
+    bool waiting_for_io;
+    /* First error that a background copy request failed with */
+    int ret;
 } BackupBlockJob;
 
+typedef struct BackupOp {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int64_t nb_clusters;
+} BackupOp;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -104,72 +127,126 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     struct iovec iov;
     QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
+    size_t bounce_size;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
+    int64_t total_sectors = job->common.len / BDRV_SECTOR_SIZE;
+    int64_t start, end, run_end;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
     start = sector_num / sectors_per_cluster;
     end = DIV_ROUND_UP(sector_num + nb_sectors, sectors_per_cluster);
+    bounce_size = MIN(job->max_chunk, (end - start) * job->cluster_size);
 
     trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
 
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start = run_end) {
+        bool is_zero = false;
+
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            run_end = start + 1;
             continue; /* already copied */
         }
 
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(sectors_per_cluster,
-                job->common.len / BDRV_SECTOR_SIZE -
-                start * sectors_per_cluster);
-
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        ret = blk_co_preadv(blk, start * job->cluster_size,
-                            bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        /* Copy adjacent clusters that are not done yet in one request */
+        run_end = MIN(end, start + job->max_chunk / job->cluster_size);
+        run_end = find_next_bit(job->done_bitmap, run_end, start);
+        n = MIN((run_end - start) * sectors_per_cluster,
+                total_sectors - start * sectors_per_cluster);
+
+        /* Guest writes are waiting for us, so don't bother to look for
+         * zeroes there.  In the background, never transfer areas that the
+         * source knows to read as zeroes. */
+        if (!is_write_notifier) {
+            BlockDriverState *file;
+            int64_t status;
+            int pnum;
+
+            status = bdrv_get_block_status_above(blk_bs(blk), NULL,
+                                                 start * sectors_per_cluster,
+                                                 n, &pnum, &file);
+            if (status >= 0 && pnum > 0 && pnum < n) {
+                if (status & BDRV_BLOCK_ZERO) {
+                    /* Only whole clusters can be skipped */
+                    run_end = start + pnum / sectors_per_cluster;
+                } else {
+                    run_end = start + DIV_ROUND_UP(pnum, sectors_per_cluster);
+                }
+                if (run_end == start) {
+                    run_end = start + 1;
+                    status &= ~BDRV_BLOCK_ZERO;
+                }
+                n = MIN((run_end - start) * sectors_per_cluster,
+                        total_sectors - start * sectors_per_cluster);
             }
-            goto out;
+            is_zero = status >= 0 && (status & BDRV_BLOCK_ZERO);
         }
 
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+        if (is_zero) {
             ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
+                                       n * BDRV_SECTOR_SIZE,
+                                       BDRV_REQ_MAY_UNMAP);
+            if (ret < 0) {
+                trace_backup_do_cow_write_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = false;
+                }
+                goto out;
+            }
         } else {
-            ret = blk_co_pwritev(job->target, start * job->cluster_size,
-                                 bounce_qiov.size, &bounce_qiov, 0);
-        }
-        if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+            if (!bounce_buffer) {
+                bounce_buffer = blk_blockalign(blk, bounce_size);
             }
-            goto out;
+            iov.iov_base = bounce_buffer;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            assert(iov.iov_len <= bounce_size);
+            qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+            ret = blk_co_preadv(blk, start * job->cluster_size,
+                                bounce_qiov.size, &bounce_qiov,
+                                is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+            if (ret < 0) {
+                trace_backup_do_cow_read_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = true;
+                }
+                goto out;
+            }
+
+            if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+                ret = blk_co_pwrite_zeroes(job->target,
+                                           start * job->cluster_size,
+                                           bounce_qiov.size,
+                                           BDRV_REQ_MAY_UNMAP);
+            } else {
+                ret = blk_co_pwritev(job->target, start * job->cluster_size,
+                                     bounce_qiov.size, &bounce_qiov, 0);
+            }
+            if (ret < 0) {
+                trace_backup_do_cow_write_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = false;
+                }
+                goto out;
+            }
+
+            /* Only data that was actually read counts for the rate limit */
+            job->sectors_read += n;
         }
 
-        set_bit(start, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start, run_end - start);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
          */
-        job->sectors_read += n;
         job->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
@@ -314,65 +391,198 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+static inline void backup_wait_for_io(BackupBlockJob *job)
 {
+    assert(!job->waiting_for_io);
+    job->waiting_for_io = true;
+    qemu_coroutine_yield();
+    job->waiting_for_io = false;
+}
+
+/* Worker coroutine copying one run of clusters in the background */
+static void coroutine_fn backup_op_co(void *opaque)
+{
+    BackupOp *op = opaque;
+    BackupBlockJob *job = op->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
     bool error_is_read;
-    int ret = 0;
-    int clusters_per_iter;
-    uint32_t granularity;
-    int64_t sector;
-    int64_t cluster;
-    int64_t end;
-    int64_t last_cluster = -1;
+    int ret;
+
+    ret = backup_do_cow(job, op->cluster * sectors_per_cluster,
+                        op->nb_clusters * sectors_per_cluster,
+                        &error_is_read, false);
+    if (ret < 0) {
+        /* Depending on error action, fail now or retry the run later */
+        BlockErrorAction action =
+            backup_error_action(job, error_is_read, -ret);
+        if (action == BLOCK_ERROR_ACTION_REPORT) {
+            if (job->ret >= 0) {
+                job->ret = ret;
+            }
+        } else {
+            hbitmap_set(job->copy_bitmap, op->cluster, op->nb_clusters);
+        }
+    }
+
+    job->in_flight--;
+    job->bytes_in_flight -= op->nb_clusters * job->cluster_size;
+    g_free(op);
+
+    if (job->waiting_for_io) {
+        qemu_coroutine_enter(job->common.co);
+    }
+}
+
+/* For sync=top, check whether any sector of @cluster is allocated in the
+ * topmost image. */
+static bool coroutine_fn backup_cluster_allocated(BackupBlockJob *job,
+                                                  int64_t cluster)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
     int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced =
+            bdrv_is_allocated(bs,
+                    cluster * sectors_per_cluster + i,
+                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    return alloced != 0;
+}
+
+static bool coroutine_fn backup_cluster_wanted(BackupBlockJob *job,
+                                               int64_t cluster)
+{
+    if (!hbitmap_get(job->copy_bitmap, cluster)) {
+        return false;
+    }
+
+    /* If the cluster is not in the topmost image, skip it for good */
+    if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+        !backup_cluster_allocated(job, cluster)) {
+        hbitmap_reset(job->copy_bitmap, cluster, 1);
+        return false;
+    }
+
+    return true;
+}
+
+/* Mark the clusters touched by the sync bitmap for copying */
+static void backup_incremental_init_copy_bitmap(BackupBlockJob *job)
+{
+    uint32_t granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
+    int64_t clusters_per_iter = MAX((granularity / job->cluster_size), 1);
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int64_t sector, cluster;
     HBitmapIter hbi;
 
-    granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
-    clusters_per_iter = MAX((granularity / job->cluster_size), 1);
     bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
-
-    /* Find the next dirty sector(s) */
     while ((sector = hbitmap_iter_next(&hbi)) != -1) {
         cluster = sector / sectors_per_cluster;
+        hbitmap_set(job->copy_bitmap, cluster,
+                    MIN(clusters_per_iter, end - cluster));
 
-        /* Fake progress updates for any clusters we skipped */
-        if (cluster != last_cluster + 1) {
-            job->common.offset += ((cluster - last_cluster - 1) *
-                                   job->cluster_size);
+        /* If the bitmap granularity is smaller than the backup granularity,
+         * we need to advance the iterator pointer to the next cluster. */
+        if (cluster + clusters_per_iter < end) {
+            bdrv_set_dirty_iter(&hbi, (cluster + clusters_per_iter) *
+                                      sectors_per_cluster);
+        } else {
+            break;
         }
+    }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(job, cluster * sectors_per_cluster,
-                                    sectors_per_cluster, &error_is_read,
-                                    false);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
-                }
-            } while (ret < 0);
-        }
+    /* Fake progress updates for the clusters that are skipped */
+    job->common.offset += (end - hbitmap_count(job->copy_bitmap)) *
+                          job->cluster_size;
+}
 
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
+/*
+ * Copy everything in copy_bitmap to the target.  Runs of adjacent clusters
+ * are coalesced into requests of up to max_chunk bytes, which are handed to
+ * worker coroutines so that up to max_workers requests and buf_size bytes
+ * are in flight at the same time.
+ */
+static int coroutine_fn backup_run_copy(BackupBlockJob *job)
+{
+    int64_t clusters_per_chunk = job->max_chunk / job->cluster_size;
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    HBitmapIter hbi;
+    int64_t cluster;
+
+    /* Failed requests put their clusters back, so go over the bitmap until
+     * it is empty */
+    while (hbitmap_count(job->copy_bitmap) > 0) {
+        hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
+        while ((cluster = hbitmap_iter_next(&hbi)) != -1) {
+            BackupOp *op;
+            Coroutine *co;
+            int64_t nb_clusters, bytes;
+
+            if (yield_and_check(job) || job->ret < 0) {
+                goto out;
+            }
+
+            /* The iterator may be stale */
+            if (!backup_cluster_wanted(job, cluster)) {
+                continue;
+            }
+
+            nb_clusters = 1;
+            while (nb_clusters < clusters_per_chunk &&
+                   cluster + nb_clusters < end &&
+                   backup_cluster_wanted(job, cluster + nb_clusters)) {
+                nb_clusters++;
+            }
+            hbitmap_reset(job->copy_bitmap, cluster, nb_clusters);
+            bytes = nb_clusters * job->cluster_size;
+
+            while (job->in_flight > 0 &&
+                   (job->in_flight >= job->max_workers ||
+                    job->bytes_in_flight + bytes > job->buf_size)) {
+                backup_wait_for_io(job);
+            }
+
+            op = g_new(BackupOp, 1);
+            op->job = job;
+            op->cluster = cluster;
+            op->nb_clusters = nb_clusters;
+
+            job->in_flight++;
+            job->bytes_in_flight += bytes;
+            co = qemu_coroutine_create(backup_op_co, op);
+            qemu_coroutine_enter(co);
         }
 
-        last_cluster = cluster - 1;
+        while (job->in_flight > 0) {
+            backup_wait_for_io(job);
+        }
+        if (job->ret < 0) {
+            break;
+        }
     }
 
-    /* Play some final catchup with the progress meter */
-    end = DIV_ROUND_UP(job->common.len, job->cluster_size);
-    if (last_cluster + 1 < end) {
-        job->common.offset += ((end - last_cluster - 1) * job->cluster_size);
+out:
+    while (job->in_flight > 0) {
+        backup_wait_for_io(job);
     }
 
-    return ret;
+    return job->ret;
 }
 
 static void coroutine_fn backup_run(void *opaque)
@@ -381,14 +591,12 @@ static void coroutine_fn backup_run(void *opaque)
     BackupCompleteData *data;
     BlockDriverState *bs = blk_bs(job->common.blk);
     BlockBackend *target = job->target;
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
@@ -402,62 +610,21 @@ static void coroutine_fn backup_run(void *opaque)
              * notify callback service CoW requests. */
             block_job_yield(&job->common);
         }
-    } else if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
-        ret = backup_run_incremental(job);
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
+        /* FULL and TOP copy the whole drive (TOP skips clusters that are
+         * not allocated in the topmost image), INCREMENTAL the clusters
+         * that are dirty in the sync bitmap. */
+        job->copy_bitmap = hbitmap_alloc(end, 0);
+        if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+            backup_incremental_init_copy_bitmap(job);
+        } else {
+            hbitmap_set(job->copy_bitmap, 0, end);
+        }
 
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
+        ret = backup_run_copy(job);
 
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        hbitmap_free(job->copy_bitmap);
+        job->copy_bitmap = NULL;
     }
 
     notifier_with_return_remove(&job->before_write);
@@ -476,6 +643,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
+                  int64_t max_workers, int64_t buf_size,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
@@ -515,6 +683,19 @@ void backup_start(const char *job_id, BlockDriverState *bs,
         return;
     }
 
+    if (max_workers < 0 || max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(BACKUP_MAX_WORKERS)
+                   ", or 0 for the default");
+        return;
+    }
+
+    if (buf_size < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "buf-size",
+                   "a positive value, or 0 for the default");
+        return;
+    }
+
     if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
         if (!sync_bitmap) {
             error_setg(errp, "must provide a valid bitmap name for "
@@ -574,6 +755,13 @@ void backup_start(const char *job_id, BlockDriverState *bs,
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
 
+    job->max_workers = max_workers ?: BACKUP_MAX_WORKERS_DEFAULT;
+    job->buf_size = MAX(buf_size ?: BACKUP_BUF_SIZE_DEFAULT, job->cluster_size);
+    job->max_chunk = QEMU_ALIGN_DOWN(MIN(job->buf_size / job->max_workers,
+                                         INT_MAX),
+                                     job->cluster_size);
+    job->max_chunk = MAX(job->max_chunk, job->cluster_size);
+
     bdrv_op_block_all(target, job->common.blocker);
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run, job);
@@ -508,6 +508,17 @@ static BlockAIOCB *blkdebug_aio_flush(BlockDriverState *bs,
     return bdrv_aio_flush(bs->file->bs, cb, opaque);
 }
 
+/* Report the status of the image, so that blkdebug does not hide holes */
+static int64_t coroutine_fn blkdebug_co_get_block_status(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 int nb_sectors, int *pnum,
+                                                 BlockDriverState **file)
+{
+    *pnum = nb_sectors;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID |
+           (sector_num << BDRV_SECTOR_BITS);
+}
 
 static void blkdebug_close(BlockDriverState *bs)
 {
@@ -761,6 +772,8 @@ static BlockDriver bdrv_blkdebug = {
     .bdrv_aio_writev        = blkdebug_aio_writev,
     .bdrv_aio_flush         = blkdebug_aio_flush,
 
+    .bdrv_co_get_block_status = blkdebug_co_get_block_status,
+
     .bdrv_debug_event           = blkdebug_debug_event,
     .bdrv_debug_breakpoint      = blkdebug_debug_breakpoint,
     .bdrv_debug_remove_breakpoint
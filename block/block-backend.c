@@ -61,8 +61,13 @@ struct BlockBackend {
     bool allow_write_beyond_eof;
 
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
+
+    /* multiqueue requests waiting for the end of a drained section */
+    QSIMPLEQ_HEAD(, BlkMqRequest) mq_held;
 };
 
+typedef struct BlkMqRequest BlkMqRequest;
+
 typedef struct BlockBackendAIOCB {
     BlockAIOCB common;
     QEMUBH *bh;
@@ -95,6 +100,7 @@ static void blk_root_inherit_options(int *child_flags, QDict *child_options,
 }
 static void blk_root_drained_begin(BdrvChild *child);
 static void blk_root_drained_end(BdrvChild *child);
+static void blk_mq_resubmit_held(BlockBackend *blk);
 
 static void blk_root_change_media(BdrvChild *child, bool load);
 static void blk_root_resize(BdrvChild *child);
@@ -127,12 +133,14 @@ BlockBackend *blk_new(void)
     blk = g_new0(BlockBackend, 1);
     blk->refcnt = 1;
     blk_set_enable_write_cache(blk, true);
+    block_acct_init(&blk->stats);
 
     qemu_co_queue_init(&blk->public.throttled_reqs[0]);
     qemu_co_queue_init(&blk->public.throttled_reqs[1]);
 
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
+    QSIMPLEQ_INIT(&blk->mq_held);
 
     QTAILQ_INSERT_TAIL(&block_backends, blk, link);
     return blk;
@@ -1471,6 +1479,280 @@ void blk_io_unplug(BlockBackend *blk)
     }
 }
 
+/*
+ * Multiqueue requests
+ *
+ * A device with one AioContext per queue submits each request from the
+ * AioContext of its queue, and gets the completion there.  Reads and writes
+ * go straight to the driver when bdrv_mq_begin() allows it.  Everything
+ * else is bounced to the BlockBackend's AioContext and back, and held there
+ * while the node is in a drained section, since the device's handlers in
+ * the other AioContexts are not disabled by it.
+ */
+typedef enum BlkMqType {
+    BLK_MQ_READ,
+    BLK_MQ_WRITE,
+    BLK_MQ_FLUSH,
+    BLK_MQ_IOCTL,
+} BlkMqType;
+
+struct BlkMqRequest {
+    BlockBackend *blk;
+    AioContext *ctx;
+    BlkMqType type;
+    int64_t offset;
+    QEMUIOVector *qiov;
+    BdrvRequestFlags flags;
+    unsigned long int ioctl_req;
+    void *buf;
+    BlockCompletionFunc *cb;
+    void *opaque;
+    int ret;
+    bool has_returned;
+    QEMUBH *bh;
+    QSIMPLEQ_ENTRY(BlkMqRequest) next;
+};
+
+/* Whether multiqueue reads and writes can ever bypass the bounce */
+bool blk_mq_supported(BlockBackend *blk)
+{
+    BlockDriverState *bs;
+
+    for (bs = blk_bs(blk); bs; bs = bs->file ? bs->file->bs : NULL) {
+        if (!bs->drv || !bs->drv->bdrv_co_preadv_mq || bs->backing) {
+            return false;
+        }
+    }
+    return blk_bs(blk) != NULL;
+}
+
+static void blk_mq_complete_bh(void *opaque)
+{
+    BlkMqRequest *r = opaque;
+
+    qemu_bh_delete(r->bh);
+    r->cb(r->opaque, r->ret);
+    g_free(r);
+}
+
+/* Called in the BlockBackend's AioContext */
+static void blk_mq_bounce_cb(void *opaque, int ret)
+{
+    BlkMqRequest *r = opaque;
+
+    r->ret = ret;
+    r->bh = aio_bh_new(r->ctx, blk_mq_complete_bh, r);
+    qemu_bh_schedule(r->bh);
+}
+
+static void blk_mq_bounce_submit(BlkMqRequest *r)
+{
+    switch (r->type) {
+    case BLK_MQ_READ:
+        blk_aio_preadv(r->blk, r->offset, r->qiov, r->flags,
+                       blk_mq_bounce_cb, r);
+        break;
+    case BLK_MQ_WRITE:
+        blk_aio_pwritev(r->blk, r->offset, r->qiov, r->flags,
+                        blk_mq_bounce_cb, r);
+        break;
+    case BLK_MQ_FLUSH:
+        blk_aio_flush(r->blk, blk_mq_bounce_cb, r);
+        break;
+    case BLK_MQ_IOCTL:
+        blk_aio_ioctl(r->blk, r->ioctl_req, r->buf, blk_mq_bounce_cb, r);
+        break;
+    default:
+        abort();
+    }
+}
+
+static void blk_mq_bounce_bh(void *opaque)
+{
+    BlkMqRequest *r = opaque;
+    BlockDriverState *bs = blk_bs(r->blk);
+
+    qemu_bh_delete(r->bh);
+    if (bs && bs->quiesce_counter) {
+        QSIMPLEQ_INSERT_TAIL(&r->blk->mq_held, r, next);
+        return;
+    }
+    blk_mq_bounce_submit(r);
+}
+
+static void blk_mq_resubmit_held(BlockBackend *blk)
+{
+    BlkMqRequest *r;
+
+    while ((r = QSIMPLEQ_FIRST(&blk->mq_held))) {
+        QSIMPLEQ_REMOVE_HEAD(&blk->mq_held, next);
+        blk_mq_bounce_submit(r);
+    }
+}
+
+static void blk_mq_bounce(BlkMqRequest *r)
+{
+    r->bh = aio_bh_new(blk_get_aio_context(r->blk), blk_mq_bounce_bh, r);
+    qemu_bh_schedule(r->bh);
+}
+
+static BlkMqRequest *blk_mq_request_new(BlockBackend *blk, AioContext *ctx,
+                                        BlkMqType type,
+                                        BlockCompletionFunc *cb,
+                                        void *opaque)
+{
+    BlkMqRequest *r = g_new0(BlkMqRequest, 1);
+
+    r->blk = blk;
+    r->ctx = ctx;
+    r->type = type;
+    r->cb = cb;
+    r->opaque = opaque;
+    r->ret = NOT_DONE;
+    return r;
+}
+
+static void blk_mq_rw_entry(void *opaque)
+{
+    BlkMqRequest *r = opaque;
+    BlockBackend *blk = r->blk;
+
+    if (r->type == BLK_MQ_READ) {
+        r->ret = bdrv_co_preadv_mq(blk->root, r->ctx, r->offset,
+                                   r->qiov->size, r->qiov, r->flags);
+    } else {
+        r->ret = bdrv_co_pwritev_mq(blk->root, r->ctx, r->offset,
+                                    r->qiov->size, r->qiov, r->flags);
+    }
+    bdrv_mq_end(blk_bs(blk));
+
+    if (r->has_returned) {
+        r->cb(r->opaque, r->ret);
+        g_free(r);
+    }
+}
+
+static void blk_mq_aio_prwv(BlockBackend *blk, AioContext *ctx,
+                            int64_t offset, QEMUIOVector *qiov,
+                            BdrvRequestFlags flags, BlkMqType type,
+                            BlockCompletionFunc *cb, void *opaque)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    BdrvRequestFlags bs_flags = flags;
+    bool is_write = type == BLK_MQ_WRITE;
+    BlkMqRequest *r;
+    Coroutine *co;
+
+    r = blk_mq_request_new(blk, ctx, type, cb, opaque);
+    r->offset = offset;
+    r->qiov = qiov;
+    r->flags = flags;
+
+    if (is_write && !blk->enable_write_cache) {
+        bs_flags |= BDRV_REQ_FUA;
+    }
+    /* The bounce reports errors such as a missing medium or a request past
+     * the end of the device */
+    if (!bs || qiov->size > INT_MAX ||
+        !bdrv_mq_begin(bs, offset, qiov->size, bs_flags, is_write)) {
+        blk_mq_bounce(r);
+        return;
+    }
+    /* Read after bdrv_mq_begin(), see blk_io_limits_enable().  The node
+     * is only replaced in a drained section, so if it is still ours, it
+     * stays so until bdrv_mq_end(). */
+    if (atomic_read(&blk->public.throttle_state) ||
+        atomic_read(&blk->root->bs) != bs) {
+        bdrv_mq_end(bs);
+        blk_mq_bounce(r);
+        return;
+    }
+
+    r->flags = bs_flags;
+    co = qemu_coroutine_create(blk_mq_rw_entry, r);
+    qemu_coroutine_enter(co);
+
+    r->has_returned = true;
+    if (r->ret != NOT_DONE) {
+        r->bh = aio_bh_new(ctx, blk_mq_complete_bh, r);
+        qemu_bh_schedule(r->bh);
+    }
+}
+
+/*
+ * Read from AioContext @ctx, which may differ from the BlockBackend's;
+ * @cb is called in @ctx.  The request cannot be cancelled.
+ */
+void blk_mq_aio_preadv(BlockBackend *blk, AioContext *ctx, int64_t offset,
+                       QEMUIOVector *qiov, BdrvRequestFlags flags,
+                       BlockCompletionFunc *cb, void *opaque)
+{
+    if (ctx == blk_get_aio_context(blk)) {
+        blk_aio_preadv(blk, offset, qiov, flags, cb, opaque);
+        return;
+    }
+    blk_mq_aio_prwv(blk, ctx, offset, qiov, flags, BLK_MQ_READ, cb, opaque);
+}
+
+void blk_mq_aio_pwritev(BlockBackend *blk, AioContext *ctx, int64_t offset,
+                        QEMUIOVector *qiov, BdrvRequestFlags flags,
+                        BlockCompletionFunc *cb, void *opaque)
+{
+    if (ctx == blk_get_aio_context(blk)) {
+        blk_aio_pwritev(blk, offset, qiov, flags, cb, opaque);
+        return;
+    }
+    blk_mq_aio_prwv(blk, ctx, offset, qiov, flags, BLK_MQ_WRITE, cb, opaque);
+}
+
+void blk_mq_aio_flush(BlockBackend *blk, AioContext *ctx,
+                      BlockCompletionFunc *cb, void *opaque)
+{
+    if (ctx == blk_get_aio_context(blk)) {
+        blk_aio_flush(blk, cb, opaque);
+        return;
+    }
+    blk_mq_bounce(blk_mq_request_new(blk, ctx, BLK_MQ_FLUSH, cb, opaque));
+}
+
+void blk_mq_aio_ioctl(BlockBackend *blk, AioContext *ctx,
+                      unsigned long int req, void *buf,
+                      BlockCompletionFunc *cb, void *opaque)
+{
+    BlkMqRequest *r;
+
+    if (ctx == blk_get_aio_context(blk)) {
+        blk_aio_ioctl(blk, req, buf, cb, opaque);
+        return;
+    }
+    r = blk_mq_request_new(blk, ctx, BLK_MQ_IOCTL, cb, opaque);
+    r->ioctl_req = req;
+    r->buf = buf;
+    blk_mq_bounce(r);
+}
+
+void blk_mq_io_plug(BlockBackend *blk, AioContext *ctx)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (ctx == blk_get_aio_context(blk)) {
+        blk_io_plug(blk);
+    } else if (bs) {
+        bdrv_io_plug_mq(bs, ctx);
+    }
+}
+
+void blk_mq_io_unplug(BlockBackend *blk, AioContext *ctx)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (ctx == blk_get_aio_context(blk)) {
+        blk_io_unplug(blk);
+    } else if (bs) {
+        bdrv_io_unplug_mq(bs, ctx);
+    }
+}
+
 BlockAcctStats *blk_get_stats(BlockBackend *blk)
 {
     return &blk->stats;
@@ -1649,6 +1931,9 @@ void blk_io_limits_enable(BlockBackend *blk, const char *group)
 {
     assert(!blk->public.throttle_state);
     throttle_group_register_blk(blk, group);
+    if (blk_bs(blk)) {
+        bdrv_mq_wait(blk_bs(blk));
+    }
 }
 
 void blk_io_limits_update_group(BlockBackend *blk, const char *group)
@@ -1686,4 +1971,8 @@ static void blk_root_drained_end(BdrvChild *child)
 
     assert(blk->public.io_limits_disabled);
     --blk->public.io_limits_disabled;
+
+    if (!child->bs->quiesce_counter) {
+        blk_mq_resubmit_held(blk);
+    }
 }
@@ -130,6 +130,7 @@ void bdrv_refresh_limits(BlockDriverState *bs, Error **errp)
 void bdrv_enable_copy_on_read(BlockDriverState *bs)
 {
     bs->copy_on_read++;
+    bdrv_mq_wait(bs);
 }
 
 void bdrv_disable_copy_on_read(BlockDriverState *bs)
@@ -179,6 +180,9 @@ static void bdrv_drain_poll(BlockDriverState *bs)
 {
     bool busy = true;
 
+    /* The node is quiesced, so no new multiqueue requests can start */
+    bdrv_mq_wait(bs);
+
     while (busy) {
         /* Keep iterating */
         busy = bdrv_requests_pending(bs);
@@ -302,6 +306,7 @@ void bdrv_drain_all(void)
         bdrv_parent_drained_begin(bs);
         bdrv_io_unplugged_begin(bs);
         bdrv_drain_recurse(bs);
+        bdrv_mq_wait(bs);
         aio_context_release(aio_context);
 
         if (!g_slist_find(aio_ctxs, aio_context)) {
@@ -489,6 +494,12 @@ static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
         return false;
     }
 
+    /* Multiqueue requests that started before this one became serialising
+     * don't know about it */
+    if (self->serialising) {
+        bdrv_mq_wait(bs);
+    }
+
     do {
         retry = false;
         QLIST_FOREACH(req, &bs->tracked_requests, list) {
@@ -1349,7 +1360,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     }
     bdrv_debug_event(bs, BLKDBG_PWRITEV_DONE);
 
-    ++bs->write_gen;
+    atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, start_sector, end_sector - start_sector);
 
     if (bs->wr_highest_offset < offset + bytes) {
@@ -1926,6 +1937,9 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
+    if (drv->bdrv_co_write_compressed && qemu_in_coroutine()) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
@@ -2535,7 +2549,7 @@ int coroutine_fn bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset,
     }
     ret = 0;
 out:
-    ++bs->write_gen;
+    atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, req.offset >> BDRV_SECTOR_BITS,
                    req.bytes >> BDRV_SECTOR_BITS);
     tracked_request_end(&req);
@@ -2716,6 +2730,7 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier)
 {
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
+    bdrv_mq_wait(bs);
 }
 
 void bdrv_io_plug(BlockDriverState *bs)
@@ -2783,3 +2798,205 @@ void bdrv_io_unplugged_end(BlockDriverState *bs)
         }
     }
 }
+
+/*
+ * Multiqueue requests
+ *
+ * A device with several queues may read and write a node from AioContexts
+ * other than the node's own, one per queue, as long as every node on the
+ * path implements the bdrv_*_mq callbacks and nothing needs the per-node
+ * state that only the node's AioContext may touch: request tracking and
+ * serialisation, dirty bitmaps, before-write notifiers, copy-on-read and
+ * drained sections.  bdrv_mq_begin() checks this for each request; when it
+ * fails, the caller must submit the request from the node's AioContext
+ * instead (see blk_mq_aio_preadv()).
+ *
+ * Multiqueue requests are counted in bs->mq_in_flight.  Whoever turns on
+ * one of the features above calls bdrv_mq_wait() afterwards, so that no
+ * request that missed the change is still running when it returns.
+ */
+static bool bdrv_mq_usable(BlockDriverState *bs, int64_t offset,
+                           unsigned int bytes, BdrvRequestFlags flags,
+                           bool is_write)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv || !drv->bdrv_co_preadv_mq || bs->backing || flags) {
+        return false;
+    }
+    if (atomic_read(&bs->quiesce_counter) ||
+        atomic_read(&bs->copy_on_read) ||
+        atomic_read(&bs->serialising_in_flight) ||
+        !QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        return false;
+    }
+    if (offset < 0 ||
+        !QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment) ||
+        offset + bytes > bs->total_sectors * BDRV_SECTOR_SIZE) {
+        return false;
+    }
+    if (is_write &&
+        (bs->read_only ||
+         bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF ||
+         !QLIST_EMPTY(&bs->before_write_notifiers.notifiers))) {
+        return false;
+    }
+    return true;
+}
+
+typedef struct BdrvMqWakeData {
+    BlockDriverState *bs;
+    QEMUBH *bh;
+} BdrvMqWakeData;
+
+/* Restart the coroutines in bdrv_mq_wait(), in the node's AioContext */
+static void bdrv_mq_wake_bh(void *opaque)
+{
+    BdrvMqWakeData *data = opaque;
+
+    qemu_bh_delete(data->bh);
+    while (qemu_co_enter_next(&data->bs->mq_waiters)) {
+        /* Keep going */
+    }
+    g_free(data);
+}
+
+static void bdrv_mq_dec(BlockDriverState *bs)
+{
+    BdrvMqWakeData *data;
+
+    if (atomic_fetch_dec(&bs->mq_in_flight) == 1) {
+        qemu_event_set(&bs->mq_idle);
+
+        /* A full barrier, pairs with the one in bdrv_mq_wait() */
+        if (atomic_xchg(&bs->mq_co_waiting, false)) {
+            data = g_new(BdrvMqWakeData, 1);
+            data->bs = bs;
+            data->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_mq_wake_bh,
+                                  data);
+            qemu_bh_schedule(data->bh);
+        }
+    }
+}
+
+/*
+ * Start a multiqueue request on @bs and the nodes below it.  Returns false
+ * if the request must go through the normal path instead.
+ */
+bool bdrv_mq_begin(BlockDriverState *bs, int64_t offset, unsigned int bytes,
+                   BdrvRequestFlags flags, bool is_write)
+{
+    BlockDriverState *node, *failed = NULL;
+
+    for (node = bs; node; node = node->file ? node->file->bs : NULL) {
+        /* A full barrier, pairs with the one in bdrv_mq_wait() */
+        atomic_inc(&node->mq_in_flight);
+        if (!bdrv_mq_usable(node, offset, bytes, flags, is_write)) {
+            failed = node;
+            break;
+        }
+    }
+    if (!failed) {
+        return true;
+    }
+
+    for (node = bs; node != failed; node = node->file->bs) {
+        bdrv_mq_dec(node);
+    }
+    bdrv_mq_dec(failed);
+    return false;
+}
+
+void bdrv_mq_end(BlockDriverState *bs)
+{
+    BlockDriverState *node;
+
+    for (node = bs; node; node = node->file ? node->file->bs : NULL) {
+        bdrv_mq_dec(node);
+    }
+}
+
+/*
+ * Wait for the multiqueue requests on @bs and its children to complete.
+ * They run in other AioContexts, so there is no need to poll the node's.
+ * A coroutine, which runs in the node's AioContext, yields until the last
+ * request schedules bdrv_mq_wake_bh() there; the bottom half cannot run
+ * before the coroutine is in mq_waiters.
+ */
+void bdrv_mq_wait(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    /* Pairs with the barrier in bdrv_mq_begin() */
+    smp_mb();
+    while (atomic_read(&bs->mq_in_flight)) {
+        if (qemu_in_coroutine()) {
+            /* A full barrier, pairs with the one in bdrv_mq_dec() */
+            atomic_mb_set(&bs->mq_co_waiting, true);
+            if (atomic_read(&bs->mq_in_flight)) {
+                qemu_co_queue_wait(&bs->mq_waiters);
+            }
+        } else {
+            qemu_event_reset(&bs->mq_idle);
+            if (atomic_read(&bs->mq_in_flight)) {
+                qemu_event_wait(&bs->mq_idle);
+            }
+        }
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_mq_wait(child->bs);
+    }
+}
+
+int coroutine_fn bdrv_co_preadv_mq(BdrvChild *child, AioContext *ctx,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
+{
+    BlockDriverState *bs = child->bs;
+
+    return bs->drv->bdrv_co_preadv_mq(bs, ctx, offset, bytes, qiov, flags);
+}
+
+int coroutine_fn bdrv_co_pwritev_mq(BdrvChild *child, AioContext *ctx,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
+{
+    BlockDriverState *bs = child->bs;
+    int ret;
+
+    ret = bs->drv->bdrv_co_pwritev_mq(bs, ctx, offset, bytes, qiov, flags);
+
+    atomic_inc(&bs->write_gen);
+    /* Only a statistic; an update racing with another queue may be lost */
+    if (bs->wr_highest_offset < offset + bytes) {
+        bs->wr_highest_offset = offset + bytes;
+    }
+    return ret;
+}
+
+void bdrv_io_plug_mq(BlockDriverState *bs, AioContext *ctx)
+{
+    BdrvChild *child;
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_io_plug_mq(child->bs, ctx);
+    }
+
+    if (bs->drv && bs->drv->bdrv_io_plug_mq) {
+        bs->drv->bdrv_io_plug_mq(bs, ctx);
+    }
+}
+
+void bdrv_io_unplug_mq(BlockDriverState *bs, AioContext *ctx)
+{
+    BdrvChild *child;
+
+    if (bs->drv && bs->drv->bdrv_io_unplug_mq) {
+        bs->drv->bdrv_io_unplug_mq(bs, ctx);
+    }
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_io_unplug_mq(child->bs, ctx);
+    }
+}
@@ -0,0 +1,1289 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+#include "qemu/range.h"
+
+/* NOTICE: BME here means Bitmaps Extension and used as a namespace for
+ * _internal_ constants. Please do not use this _internal_ abbreviation for
+ * other needs and/or outside of this file. */
+
+/* Bitmap directory entry constraints */
+#define BME_MAX_TABLE_SIZE 0x8000000
+#define BME_MAX_PHYS_SIZE 0x20000000 /* restrict BdrvDirtyBitmap size in RAM */
+#define BME_MAX_GRANULARITY_BITS 31
+#define BME_MIN_GRANULARITY_BITS 9
+#define BME_MAX_NAME_SIZE 1023
+
+/* Bitmap directory entry flags */
+#define BME_RESERVED_FLAGS 0xfffffff8U
+#define BME_FLAG_IN_USE (1U << 0)
+#define BME_FLAG_AUTO   (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPATIBLE (1U << 2)
+
+/* Bitmap table entry flags and masks */
+#define BME_TABLE_ENTRY_RESERVED_MASK 0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES (1ULL << 0)
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows  */
+    /* name follows  */
+} Qcow2BitmapDirEntry;
+
+typedef enum BitmapType {
+    BT_DIRTY_TRACKING_BITMAP = 1
+} BitmapType;
+
+/* In-memory copy of one bitmap directory entry */
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    char *name;
+
+    /* Opaque extra data of entries this version does not interpret */
+    uint32_t extra_data_size;
+    uint8_t *extra_data;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static inline size_t calc_dir_entry_size(size_t name_size,
+                                         size_t extra_data_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) +
+                        name_size + extra_data_size, 8);
+}
+
+static inline size_t dir_entry_size(Qcow2Bitmap *bm)
+{
+    return calc_dir_entry_size(strlen(bm->name), bm->extra_data_size);
+}
+
+/* Whether this version knows how to load and store the bitmap itself; other
+ * entries are carried over unchanged whenever the directory is rewritten. */
+static bool bitmap_is_owned(Qcow2Bitmap *bm)
+{
+    return bm->type == BT_DIRTY_TRACKING_BITMAP &&
+           (bm->extra_data_size == 0 ||
+            (bm->flags & BME_FLAG_EXTRA_DATA_COMPATIBLE));
+}
+
+/* Whether an owned entry is hidden by a bitmap of the same name that is not
+ * persistent, as happens when such a bitmap already existed at open.  Those
+ * entries are kept in the image as they are. */
+static bool bitmap_is_shadowed(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+
+    return bitmap && !bdrv_dirty_bitmap_get_persistent(bitmap);
+}
+
+static void bitmap_free(Qcow2Bitmap *bm)
+{
+    g_free(bm->name);
+    g_free(bm->extra_data);
+    g_free(bm);
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (bm_list == NULL) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        bitmap_free(bm);
+    }
+
+    g_free(bm_list);
+}
+
+static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
+                                        const char *name)
+{
+    Qcow2Bitmap *bm;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (!strcmp(bm->name, name)) {
+            return bm;
+        }
+    }
+
+    return NULL;
+}
+
+/* Number of bytes of bitmap data needed to cover the whole virtual disk */
+static uint64_t get_bitmap_bytes_needed(int64_t len_sectors,
+                                        uint32_t granularity)
+{
+    uint64_t num_bits = DIV_ROUND_UP(len_sectors * BDRV_SECTOR_SIZE,
+                                     granularity);
+
+    return DIV_ROUND_UP(num_bits, 8);
+}
+
+static int check_table_entry(uint64_t entry, int cluster_size)
+{
+    uint64_t offset;
+
+    if (entry & BME_TABLE_ENTRY_RESERVED_MASK) {
+        return -EINVAL;
+    }
+
+    offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+    if (offset != 0) {
+        /* if offset specified, bit 0 is reserved */
+        if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            return -EINVAL;
+        }
+
+        if (offset % cluster_size != 0) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int check_constraints_on_bitmap(BlockDriverState *bs,
+                                       const char *name,
+                                       uint32_t granularity,
+                                       Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int granularity_bits = ctz32(granularity);
+    int64_t len = bdrv_getlength(bs);
+    uint64_t bitmap_bytes;
+
+    assert(granularity > 0);
+    assert((granularity & (granularity - 1)) == 0);
+
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Failed to get size of '%s'",
+                         bdrv_get_device_or_node_name(bs));
+        return len;
+    }
+
+    if (granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity exceeds maximum (%llu bytes)",
+                   1ULL << BME_MAX_GRANULARITY_BITS);
+        return -EINVAL;
+    }
+    if (granularity_bits < BME_MIN_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity is under minimum (%llu bytes)",
+                   1ULL << BME_MIN_GRANULARITY_BITS);
+        return -EINVAL;
+    }
+
+    bitmap_bytes = get_bitmap_bytes_needed(len >> BDRV_SECTOR_BITS,
+                                           granularity);
+    if (bitmap_bytes > BME_MAX_PHYS_SIZE ||
+        DIV_ROUND_UP(bitmap_bytes, s->cluster_size) > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Too much space will be occupied by the bitmap. "
+                   "Use larger granularity");
+        return -EINVAL;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Name length exceeds maximum (%u characters)",
+                   BME_MAX_NAME_SIZE);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Bitmap table
+ */
+
+static int bitmap_table_load(BlockDriverState *bs, Qcow2Bitmap *bm,
+                             uint64_t **bitmap_table)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+    uint64_t *table;
+
+    assert(bm->table_size != 0);
+    table = g_try_new(uint64_t, bm->table_size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    assert(bm->table_size <= BME_MAX_TABLE_SIZE);
+    ret = bdrv_pread(bs->file, bm->table_offset,
+                     table, bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < bm->table_size; ++i) {
+        be64_to_cpus(&table[i]);
+        ret = check_table_entry(table[i], s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    *bitmap_table = table;
+    return 0;
+
+fail:
+    g_free(table);
+
+    return ret;
+}
+
+/* Drop the references held by a bitmap table and by the data clusters it
+ * points to. */
+static void free_bitmap_clusters(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *bitmap_table;
+    uint32_t i;
+    int ret;
+
+    if (bm->table_size == 0) {
+        return;
+    }
+
+    ret = bitmap_table_load(bs, bm, &bitmap_table);
+    if (ret < 0) {
+        /* Leak the clusters; qemu-img check can recover them */
+        return;
+    }
+
+    for (i = 0; i < bm->table_size; ++i) {
+        uint64_t addr = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (addr != 0) {
+            qcow2_free_clusters(bs, addr, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(bitmap_table);
+
+    qcow2_free_clusters(bs, bm->table_offset,
+                        bm->table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+    bm->table_offset = 0;
+    bm->table_size = 0;
+}
+
+/*
+ * Bitmap data
+ */
+
+/* Load the on-disk bitmap data described by @bitmap_table into @bitmap */
+static int load_bitmap_data(BlockDriverState *bs,
+                            const uint64_t *bitmap_table,
+                            uint32_t bitmap_table_size,
+                            BdrvDirtyBitmap *bitmap)
+{
+    int ret = 0;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t sector, sbc;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint8_t *buf = NULL;
+    uint64_t i, tab_size =
+            size_to_clusters(s,
+                bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
+
+    if (tab_size != bitmap_table_size || tab_size > BME_MAX_TABLE_SIZE) {
+        return -EINVAL;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    /* sectors covered by one cluster of bitmap data */
+    sbc = (uint64_t)s->cluster_size * 8 *
+          (bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS);
+    for (i = 0, sector = 0; i < tab_size; ++i, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        uint64_t entry = bitmap_table[i];
+        uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        assert(check_table_entry(entry, s->cluster_size) == 0);
+
+        if (offset == 0) {
+            if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+                bdrv_set_dirty_bitmap(bitmap, sector, count);
+            }
+            /* all-zero clusters need no work on a fresh bitmap */
+        } else {
+            ret = bdrv_pread(bs->file, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto finish;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count,
+                                               false);
+        }
+    }
+    ret = 0;
+
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+
+finish:
+    g_free(buf);
+
+    return ret;
+}
+
+static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
+                                    Qcow2Bitmap *bm, Error **errp)
+{
+    int ret;
+    uint64_t *bitmap_table = NULL;
+    uint32_t granularity;
+    BdrvDirtyBitmap *bitmap = NULL;
+
+    ret = bitmap_table_load(bs, bm, &bitmap_table);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Could not read bitmap_table table from image for "
+                         "bitmap '%s'", bm->name);
+        goto fail;
+    }
+
+    granularity = 1U << bm->granularity_bits;
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, bm->name, errp);
+    if (bitmap == NULL) {
+        goto fail;
+    }
+
+    ret = load_bitmap_data(bs, bitmap_table, bm->table_size, bitmap);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
+                         bm->name);
+        goto fail;
+    }
+
+    g_free(bitmap_table);
+    return bitmap;
+
+fail:
+    g_free(bitmap_table);
+    if (bitmap != NULL) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+
+    return NULL;
+}
+
+/*
+ * Bitmap directory
+ */
+
+static int check_dir_entry(BlockDriverState *bs, Qcow2BitmapDirEntry *entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t phys_bitmap_bytes;
+    int64_t len;
+
+    bool fail = (entry->bitmap_table_size == 0) ||
+                (entry->bitmap_table_offset == 0) ||
+                (entry->bitmap_table_offset % s->cluster_size) ||
+                (entry->bitmap_table_size > BME_MAX_TABLE_SIZE) ||
+                (entry->flags & BME_RESERVED_FLAGS) ||
+                (entry->name_size > BME_MAX_NAME_SIZE) ||
+                (entry->name_size == 0) ||
+                (entry->granularity_bits > BME_MAX_GRANULARITY_BITS) ||
+                (entry->granularity_bits < BME_MIN_GRANULARITY_BITS);
+
+    if (fail) {
+        return -EINVAL;
+    }
+
+    if (entry->type != BT_DIRTY_TRACKING_BITMAP) {
+        /* Only the layout of dirty tracking bitmaps is known */
+        return 0;
+    }
+
+    phys_bitmap_bytes = (uint64_t)entry->bitmap_table_size * s->cluster_size;
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        return len;
+    }
+
+    fail = (phys_bitmap_bytes > BME_MAX_PHYS_SIZE) ||
+           (len > ((phys_bitmap_bytes * 8) << entry->granularity_bits));
+
+    return fail ? -EINVAL : 0;
+}
+
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t size,
+                                         Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *dir, *dir_end;
+    Qcow2BitmapDirEntry *e;
+    uint32_t nb_dir_entries = 0;
+    Qcow2BitmapList *bm_list = NULL;
+
+    if (size == 0) {
+        error_setg(errp, "Requested bitmap directory size is zero");
+        return NULL;
+    }
+
+    if (size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Requested bitmap directory size is too big");
+        return NULL;
+    }
+
+    dir = g_try_malloc(size);
+    if (dir == NULL) {
+        error_setg(errp, "Failed to allocate space for bitmap directory");
+        return NULL;
+    }
+    dir_end = dir + size;
+
+    ret = bdrv_pread(bs->file, offset, dir, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read bitmap directory");
+        goto fail;
+    }
+
+    bm_list = g_new0(Qcow2BitmapList, 1);
+    QSIMPLEQ_INIT(bm_list);
+
+    for (e = (Qcow2BitmapDirEntry *)dir;
+         (uint8_t *)e + sizeof(*e) <= dir_end;
+         e = (Qcow2BitmapDirEntry *)((uint8_t *)e +
+             calc_dir_entry_size(e->name_size, e->extra_data_size))) {
+        Qcow2Bitmap *bm;
+
+        if (++nb_dir_entries > s->nb_bitmaps) {
+            error_setg(errp, "More bitmaps found than specified in header"
+                       " extension");
+            goto fail;
+        }
+
+        be64_to_cpus(&e->bitmap_table_offset);
+        be32_to_cpus(&e->bitmap_table_size);
+        be32_to_cpus(&e->flags);
+        be16_to_cpus(&e->name_size);
+        be32_to_cpus(&e->extra_data_size);
+
+        if ((uint8_t *)e + calc_dir_entry_size(e->name_size,
+                                               e->extra_data_size) > dir_end) {
+            error_setg(errp, "Broken bitmap directory");
+            goto fail;
+        }
+
+        ret = check_dir_entry(bs, e);
+        if (ret < 0) {
+            error_setg(errp, "Bitmap '%.*s' doesn't satisfy the constraints",
+                       e->name_size,
+                       (char *)(e + 1) + e->extra_data_size);
+            goto fail;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->table_offset = e->bitmap_table_offset;
+        bm->table_size = e->bitmap_table_size;
+        bm->flags = e->flags;
+        bm->type = e->type;
+        bm->granularity_bits = e->granularity_bits;
+        bm->extra_data_size = e->extra_data_size;
+        if (bm->extra_data_size) {
+            bm->extra_data = g_memdup(e + 1, bm->extra_data_size);
+        }
+        bm->name = g_strndup((char *)(e + 1) + e->extra_data_size,
+                             e->name_size);
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+    }
+
+    if (nb_dir_entries != s->nb_bitmaps) {
+        error_setg(errp, "Less bitmaps found than specified in header"
+                         " extension");
+        goto fail;
+    }
+
+    if ((uint8_t *)e != dir_end) {
+        error_setg(errp, "Broken bitmap directory");
+        goto fail;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+fail:
+    g_free(dir);
+    bitmap_list_free(bm_list);
+
+    return NULL;
+}
+
+/* Serialize @bm_list into @dir, which must be zeroed and large enough to hold
+ * all entries */
+static void bitmap_list_serialize(Qcow2BitmapList *bm_list, uint8_t *dir)
+{
+    Qcow2Bitmap *bm;
+    Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)dir;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        size_t name_size = strlen(bm->name);
+
+        e->bitmap_table_offset = cpu_to_be64(bm->table_offset);
+        e->bitmap_table_size = cpu_to_be32(bm->table_size);
+        e->flags = cpu_to_be32(bm->flags);
+        e->type = bm->type;
+        e->granularity_bits = bm->granularity_bits;
+        e->name_size = cpu_to_be16(name_size);
+        e->extra_data_size = cpu_to_be32(bm->extra_data_size);
+        if (bm->extra_data_size) {
+            memcpy(e + 1, bm->extra_data, bm->extra_data_size);
+        }
+        memcpy((uint8_t *)(e + 1) + bm->extra_data_size, bm->name, name_size);
+
+        e = (Qcow2BitmapDirEntry *)((uint8_t *)e + dir_entry_size(bm));
+    }
+}
+
+/* Serialize @bm_list and write it to freshly allocated clusters.  On success
+ * the new location is returned in @offset and @size; nothing is referenced by
+ * the image header yet. */
+static int bitmap_list_store(BlockDriverState *bs, Qcow2BitmapList *bm_list,
+                             uint64_t *offset, uint64_t *size)
+{
+    int ret;
+    uint8_t *dir;
+    int64_t dir_offset;
+    uint64_t dir_size = 0;
+    Qcow2Bitmap *bm;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        dir_size += dir_entry_size(bm);
+    }
+
+    if (dir_size == 0 || dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        return -EINVAL;
+    }
+
+    /* Allocate space for the new bitmap directory */
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        return dir_offset;
+    }
+
+    /* Allocation doesn't initialize the memory, so the padding must be
+     * zeroed explicitly */
+    dir = g_try_malloc0(dir_size);
+    if (dir == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    bitmap_list_serialize(bm_list, dir);
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    g_free(dir);
+
+    *offset = dir_offset;
+    *size = dir_size;
+
+    return 0;
+
+fail:
+    g_free(dir);
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+
+    return ret;
+}
+
+/*
+ * Bitmap List end
+ */
+
+/* Point the header extension at a new copy of the directory (or drop it if
+ * @bm_list is empty) and free the clusters of the old one. */
+static int update_ext_header_and_dir(BlockDriverState *bs,
+                                     Qcow2BitmapList *bm_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+    uint64_t new_offset = 0;
+    uint64_t new_size = 0;
+    uint32_t new_nb_bitmaps = 0;
+    uint64_t old_offset = s->bitmap_directory_offset;
+    uint64_t old_size = s->bitmap_directory_size;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_autocl = s->autoclear_features;
+    Qcow2Bitmap *bm;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        new_nb_bitmaps++;
+    }
+
+    if (new_nb_bitmaps > QCOW2_MAX_BITMAPS) {
+        return -EINVAL;
+    }
+
+    if (new_nb_bitmaps > 0) {
+        ret = bitmap_list_store(bs, bm_list, &new_offset, &new_size);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* The refcounts of the new structures must be on disk before the
+         * header refers to them */
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    s->bitmap_directory_offset = new_offset;
+    s->bitmap_directory_size = new_size;
+    s->nb_bitmaps = new_nb_bitmaps;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (old_size > 0) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+    return 0;
+
+fail:
+    if (new_offset > 0) {
+        qcow2_free_clusters(bs, new_offset, new_size, QCOW2_DISCARD_OTHER);
+    }
+
+    s->bitmap_directory_offset = old_offset;
+    s->bitmap_directory_size = old_size;
+    s->nb_bitmaps = old_nb_bitmaps;
+    s->autoclear_features = old_autocl;
+
+    return ret;
+}
+
+/* Rewrite the directory at its current location.  Only valid when the
+ * serialized size does not change, i.e. for flag updates. */
+static int update_dir_in_place(BlockDriverState *bs, Qcow2BitmapList *bm_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t dir_size = 0;
+    uint8_t *dir;
+    Qcow2Bitmap *bm;
+    int ret;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        dir_size += dir_entry_size(bm);
+    }
+    assert(dir_size == s->bitmap_directory_size);
+
+    dir = g_malloc0(dir_size);
+    bitmap_list_serialize(bm_list, dir);
+
+    ret = bdrv_pwrite_sync(bs->file, s->bitmap_directory_offset, dir,
+                           dir_size);
+    g_free(dir);
+
+    return ret < 0 ? ret : 0;
+}
+
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, NULL);
+    if (bm_list == NULL) {
+        res->corruptions++;
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *bitmap_table = NULL;
+        uint32_t i;
+
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       bm->table_offset,
+                                       bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, bm, &bitmap_table);
+        if (ret < 0) {
+            res->corruptions++;
+            goto out;
+        }
+
+        for (i = 0; i < bm->table_size; ++i) {
+            uint64_t entry = bitmap_table[i];
+            uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset == 0) {
+                continue;
+            }
+
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           offset, s->cluster_size);
+            if (ret < 0) {
+                g_free(bitmap_table);
+                goto out;
+            }
+        }
+
+        g_free(bitmap_table);
+    }
+
+out:
+    bitmap_list_free(bm_list);
+
+    return ret;
+}
+
+/*
+ * Load all dirty tracking bitmaps stored in the image and attach them to
+ * @bs as persistent bitmaps.  Bitmaps with the 'auto' flag are enabled, the
+ * others are loaded disabled.
+ *
+ * When the image is opened read-write, the loaded bitmaps are marked in_use
+ * in the image until they are stored back, so that a crash is detected on the
+ * next open: bitmaps still marked in_use at that point are inconsistent with
+ * the disk contents and are dropped from the image.
+ */
+void qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm, *next;
+    bool writable = !bs->read_only;
+    bool changed = false;
+    bool dropped = false;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        /* No bitmaps - nothing to do */
+        return;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, errp);
+    if (bm_list == NULL) {
+        return;
+    }
+
+    QSIMPLEQ_FOREACH_SAFE(bm, bm_list, entry, next) {
+        BdrvDirtyBitmap *bitmap;
+
+        if (!bitmap_is_owned(bm)) {
+            continue;
+        }
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("WARNING: bitmap '%s' in image '%s' was not saved "
+                         "correctly and is inconsistent%s", bm->name,
+                         bdrv_get_device_or_node_name(bs),
+                         writable ? "; dropping it" : "");
+            if (writable) {
+                QSIMPLEQ_REMOVE(bm_list, bm, Qcow2Bitmap, entry);
+                free_bitmap_clusters(bs, bm);
+                bitmap_free(bm);
+                changed = dropped = true;
+            }
+            continue;
+        }
+
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            error_report("WARNING: bitmap '%s' in image '%s' is shadowed by "
+                         "a bitmap of the same name and is not loaded; it "
+                         "stays in the image unchanged",
+                         bm->name, bdrv_get_device_or_node_name(bs));
+            continue;
+        }
+
+        bitmap = load_bitmap(bs, bm, errp);
+        if (bitmap == NULL) {
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_persistent(bitmap, true);
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+
+        if (writable) {
+            bm->flags |= BME_FLAG_IN_USE;
+            changed = true;
+        }
+    }
+
+    if (!changed) {
+        goto out;
+    }
+
+    if (dropped) {
+        /* The directory shrinks, so it needs a new home */
+        ret = update_ext_header_and_dir(bs, bm_list);
+    } else {
+        ret = update_dir_in_place(bs, bm_list);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Can't update bitmap directory");
+        goto fail;
+    }
+
+out:
+    bitmap_list_free(bm_list);
+    return;
+
+fail:
+    /* The bitmaps that did get loaded are not trustworthy without the
+     * in_use flag on disk, so detach them again */
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+
+        if (bitmap && bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+        }
+    }
+    bitmap_list_free(bm_list);
+}
+
+/* Write the data of @bitmap to newly allocated clusters and fill in the
+ * bitmap table @tb.  Clusters without set bits are not allocated. */
+static int store_bitmap_data(BlockDriverState *bs,
+                             BdrvDirtyBitmap *bitmap,
+                             uint64_t *tb, uint32_t tb_size)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t sector, sbc;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint8_t *buf = NULL;
+    uint32_t i;
+
+    memset(tb, 0, tb_size * sizeof(tb[0]));
+
+    buf = g_malloc(s->cluster_size);
+    sbc = (uint64_t)s->cluster_size * 8 *
+          (bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS);
+    assert(DIV_ROUND_UP(bm_size, sbc) == tb_size);
+
+    for (i = 0, sector = 0; i < tb_size; ++i, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        uint64_t write_size =
+            bdrv_dirty_bitmap_serialization_size(bitmap, sector, count);
+        int64_t off;
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+        if (buffer_is_zero(buf, write_size)) {
+            continue;
+        }
+
+        off = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (off < 0) {
+            ret = off;
+            goto fail;
+        }
+        tb[i] = off;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    g_free(buf);
+    return 0;
+
+fail:
+    for (i = 0; i < tb_size; ++i) {
+        if (tb[i] != 0) {
+            qcow2_free_clusters(bs, tb[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(buf);
+
+    return ret;
+}
+
+/* Store the data and the bitmap table of @bitmap and fill in the location in
+ * @bm */
+static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm,
+                        BdrvDirtyBitmap *bitmap, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    int64_t tb_offset;
+    uint64_t *tb;
+    uint32_t tb_size, i;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+
+    tb_size = size_to_clusters(s,
+        bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
+    if (tb_size == 0 || tb_size > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap '%s' is too large to be stored",
+                   bm->name);
+        return -EINVAL;
+    }
+
+    tb = g_try_new(uint64_t, tb_size);
+    if (tb == NULL) {
+        error_setg(errp, "No memory");
+        return -ENOMEM;
+    }
+
+    ret = store_bitmap_data(bs, bitmap, tb, tb_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                         bm->name);
+        g_free(tb);
+        return ret;
+    }
+
+    tb_offset = qcow2_alloc_clusters(bs, tb_size * sizeof(tb[0]));
+    if (tb_offset < 0) {
+        error_setg_errno(errp, -tb_offset, "Failed to allocate clusters");
+        ret = tb_offset;
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, tb_offset,
+                                        tb_size * sizeof(tb[0]));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        goto fail;
+    }
+
+    for (i = 0; i < tb_size; ++i) {
+        cpu_to_be64s(&tb[i]);
+    }
+    ret = bdrv_pwrite(bs->file, tb_offset, tb, tb_size * sizeof(tb[0]));
+    for (i = 0; i < tb_size; ++i) {
+        be64_to_cpus(&tb[i]);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                         bm->name);
+        goto fail;
+    }
+
+    g_free(tb);
+
+    bm->table_offset = tb_offset;
+    bm->table_size = tb_size;
+
+    return 0;
+
+fail:
+    for (i = 0; i < tb_size; ++i) {
+        if (tb[i] != 0) {
+            qcow2_free_clusters(bs, tb[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (tb_offset > 0) {
+        qcow2_free_clusters(bs, tb_offset, tb_size * sizeof(tb[0]),
+                            QCOW2_DISCARD_OTHER);
+    }
+    g_free(tb);
+
+    return ret;
+}
+
+/*
+ * Write all persistent bitmaps attached to @bs into the image and replace the
+ * bitmap directory.  Entries of bitmaps this version cannot handle are
+ * carried over; the previously stored versions of owned bitmaps (and of
+ * persistent bitmaps that were removed at runtime) are freed.
+ */
+void qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *old_list = NULL;
+    Qcow2BitmapList *new_list;
+    Qcow2Bitmap *bm, *next;
+    bool has_persistent = false;
+    int ret;
+
+    if (bs->read_only) {
+        return;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            has_persistent = true;
+            break;
+        }
+    }
+
+    if (!has_persistent && s->nb_bitmaps == 0) {
+        return;
+    }
+
+    new_list = g_new0(Qcow2BitmapList, 1);
+    QSIMPLEQ_INIT(new_list);
+
+    if (s->nb_bitmaps > 0) {
+        old_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                                    s->bitmap_directory_size, errp);
+        if (old_list == NULL) {
+            goto out;
+        }
+
+        /* Keep what we do not understand, and what we could not load */
+        QSIMPLEQ_FOREACH_SAFE(bm, old_list, entry, next) {
+            if (!bitmap_is_owned(bm) || bitmap_is_shadowed(bs, bm)) {
+                QSIMPLEQ_REMOVE(old_list, bm, Qcow2Bitmap, entry);
+                QSIMPLEQ_INSERT_TAIL(new_list, bm, entry);
+            }
+        }
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+        uint32_t granularity = bdrv_dirty_bitmap_granularity(bitmap);
+
+        if (!bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            continue;
+        }
+
+        if (check_constraints_on_bitmap(bs, name, granularity, errp) < 0) {
+            goto fail;
+        }
+
+        if (find_bitmap_by_name(new_list, name)) {
+            error_setg(errp, "Bitmap '%s' conflicts with a bitmap of the "
+                       "same name that is kept in the image", name);
+            goto fail;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strdup(name);
+        bm->type = BT_DIRTY_TRACKING_BITMAP;
+        bm->granularity_bits = ctz32(granularity);
+        bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ||
+                    bdrv_dirty_bitmap_frozen(bitmap) ? BME_FLAG_AUTO : 0;
+        QSIMPLEQ_INSERT_TAIL(new_list, bm, entry);
+
+        ret = store_bitmap(bs, bm, bitmap, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = update_ext_header_and_dir(bs, new_list);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update bitmap extension");
+        goto fail;
+    }
+
+    /* The new directory is in place; free what the old one referenced */
+    if (old_list != NULL) {
+        QSIMPLEQ_FOREACH(bm, old_list, entry) {
+            free_bitmap_clusters(bs, bm);
+        }
+    }
+
+    goto out;
+
+fail:
+    /* Only the entries of @new_list that are not in the image have been
+     * written by us */
+    QSIMPLEQ_FOREACH(bm, new_list, entry) {
+        if (bitmap_is_owned(bm) && !bitmap_is_shadowed(bs, bm)) {
+            free_bitmap_clusters(bs, bm);
+        }
+    }
+
+out:
+    bitmap_list_free(old_list);
+    bitmap_list_free(new_list);
+}
+
+/* Returns 1 if [@offset, @offset + @size) overlaps with a bitmap table */
+int qcow2_check_bitmap_tables_overlap(BlockDriverState *bs, int64_t offset,
+                                      int64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    int ret = 0;
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, NULL);
+    if (bm_list == NULL) {
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (ranges_overlap(offset, size, bm->table_offset,
+                           bm->table_size * sizeof(uint64_t))) {
+            ret = 1;
+            break;
+        }
+    }
+    bitmap_list_free(bm_list);
+
+    return ret;
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    uint32_t nb_bitmaps = 0;
+    bool conflict = false;
+
+    if (s->qcow_version < 3) {
+        /* Without autoclear_features, we would always have to assume
+         * that a program without persistent dirty bitmap support has
+         * accessed this qcow2 file when opening it, and would thus
+         * have to drop all dirty bitmaps (defeating their purpose).
+         */
+        error_setg(errp, "Cannot store dirty bitmaps in qcow2 v2 files");
+        return false;
+    }
+
+    if (bs->read_only) {
+        error_setg(errp, "Cannot store dirty bitmaps in read-only image '%s'",
+                   bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+
+    if (check_constraints_on_bitmap(bs, name, granularity, errp) < 0) {
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+
+    if (s->nb_bitmaps > 0) {
+        bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                                   s->bitmap_directory_size, errp);
+        if (bm_list == NULL) {
+            return false;
+        }
+
+        /* Owned entries are replaced by the in-memory bitmaps on store, the
+         * others stay in the image */
+        QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+            if (bitmap_is_owned(bm) && !bitmap_is_shadowed(bs, bm)) {
+                continue;
+            }
+            nb_bitmaps++;
+            if (!strcmp(bm->name, name)) {
+                conflict = true;
+            }
+        }
+        bitmap_list_free(bm_list);
+    }
+
+    if (conflict) {
+        error_setg(errp, "Bitmap with the same name is already stored in "
+                   "image '%s'", bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Maximum number of persistent bitmaps is already "
+                   "reached");
+        return false;
+    }
+
+    return true;
+}
@@ -1353,6 +1353,19 @@ static int inc_refcounts(BlockDriverState *bs,
     return 0;
 }
 
+/*
+ * Same as inc_refcounts(), for metadata structures described outside of this
+ * file (such as the persistent bitmaps in qcow2-bitmap.c).
+ */
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
+{
+    return inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                         offset, size);
+}
+
 /* Flags for check_refcounts_l1() and check_refcounts_l2() */
 enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
@@ -1843,6 +1856,12 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -2362,6 +2381,13 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
+    if ((chk & QCOW2_OL_BITMAP_DIRECTORY) && s->nb_bitmaps) {
+        if (overlaps_with(s->bitmap_directory_offset,
+                          s->bitmap_directory_size)) {
+            return QCOW2_OL_BITMAP_DIRECTORY;
+        }
+    }
+
     if ((chk & QCOW2_OL_INACTIVE_L1) && s->snapshots) {
         for (i = 0; i < s->nb_snapshots; i++) {
             if (s->snapshots[i].l1_size &&
@@ -2422,6 +2448,16 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
+    if ((chk & QCOW2_OL_BITMAP_TABLE) && s->nb_bitmaps) {
+        int ret = qcow2_check_bitmap_tables_overlap(bs, offset, size);
+
+        if (ret < 0) {
+            return ret;
+        } else if (ret > 0) {
+            return QCOW2_OL_BITMAP_TABLE;
+        }
+    }
+
     return 0;
 }
 
@@ -2434,6 +2470,8 @@ static const char *metadata_ol_names[] = {
     [QCOW2_OL_SNAPSHOT_TABLE_BITNR] = "snapshot table",
     [QCOW2_OL_INACTIVE_L1_BITNR]    = "inactive L1 table",
     [QCOW2_OL_INACTIVE_L2_BITNR]    = "inactive L2 table",
+    [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = "bitmap directory",
+    [QCOW2_OL_BITMAP_TABLE_BITNR]   = "bitmap table",
 };
 
 /*
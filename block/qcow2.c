@@ -37,6 +37,7 @@
 #include "qemu/option_int.h"
 #include "qemu/cutils.h"
 #include "qemu/bswap.h"
+#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -63,6 +64,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -92,6 +94,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     QCowExtension ext;
     uint64_t offset;
     int ret;
+    Qcow2BitmapHeaderExt bitmaps_ext;
 
 #ifdef DEBUG_EXT
     printf("qcow2_read_extensions: start=%ld end=%ld\n", start_offset, end_offset);
@@ -162,6 +165,79 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Invalid extension length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                error_report("WARNING: a program lacking bitmap support "
+                             "modified this file, so all bitmaps are now "
+                             "considered inconsistent");
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Image has %" PRIu32 " bitmaps, "
+                           "exceeding the QEMU supported maximum of %d",
+                           bitmaps_ext.nb_bitmaps, QCOW2_MAX_BITMAPS);
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.nb_bitmaps == 0) {
+                error_setg(errp, "found bitmaps extension with zero bitmaps");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_offset & (s->cluster_size - 1)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "invalid bitmap directory offset");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "bitmap directory size (%" PRIu64 ") exceeds "
+                           "the maximum supported size (%d)",
+                           bitmaps_ext.bitmap_directory_size,
+                           QCOW2_MAX_BITMAP_DIRECTORY_SIZE);
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_offset =
+                    bitmaps_ext.bitmap_directory_offset;
+            s->bitmap_directory_size =
+                    bitmaps_ext.bitmap_directory_size;
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got bitmaps extension: "
+                   "offset=%" PRIu64 " nb_bitmaps=%" PRIu32 "\n",
+                   s->bitmap_directory_offset, s->nb_bitmaps);
+#endif
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -440,6 +516,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into an inactive L2 table",
         },
+        {
+            .name = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into the bitmap directory",
+        },
+        {
+            .name = QCOW2_OPT_OVERLAP_BITMAP_TABLE,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into a bitmap table",
+        },
         {
             .name = QCOW2_OPT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -474,6 +560,8 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_SNAPSHOT_TABLE_BITNR] = QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE,
     [QCOW2_OL_INACTIVE_L1_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L1,
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
+    [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    [QCOW2_OL_BITMAP_TABLE_BITNR]   = QCOW2_OPT_OVERLAP_BITMAP_TABLE,
 };
 
 static void cache_clean_timer_cb(void *opaque)
@@ -815,6 +903,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     QCowHeader header;
     Error *local_err = NULL;
     uint64_t ext_end;
+    uint64_t update_header;
     uint64_t l1_vm_state_index;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
@@ -1143,8 +1232,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    update_header = s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK;
+    if (s->nb_bitmaps == 0) {
+        update_header |= s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && update_header) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
+        if (s->nb_bitmaps == 0) {
+            s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_BITMAPS;
+        }
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1167,6 +1263,16 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* Persistent dirty bitmaps */
+    if (!(flags & BDRV_O_INACTIVE)) {
+        qcow2_load_persistent_dirty_bitmaps(bs, &local_err);
+        if (local_err != NULL) {
+            error_propagate(errp, local_err);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1311,6 +1417,8 @@ static void qcow2_join_options(QDict *options, QDict *old_options)
         qdict_del(old_options, QCOW2_OPT_OVERLAP_SNAPSHOT_TABLE);
         qdict_del(old_options, QCOW2_OPT_OVERLAP_INACTIVE_L1);
         qdict_del(old_options, QCOW2_OPT_OVERLAP_INACTIVE_L2);
+        qdict_del(old_options, QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY);
+        qdict_del(old_options, QCOW2_OPT_OVERLAP_BITMAP_TABLE);
     }
 
     /* New total cache size overrides all old options */
@@ -1700,6 +1808,16 @@ static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
+    Error *local_err = NULL;
+
+    qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+    if (local_err != NULL) {
+        result = -EINVAL;
+        error_report_err(local_err);
+        error_report("Persistent bitmaps are lost for node '%s'",
+                     bdrv_get_device_or_node_name(bs));
+    }
+    bdrv_release_persistent_dirty_bitmaps(bs);
 
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
@@ -1929,6 +2047,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1940,6 +2063,25 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmap extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                    cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                    cpu_to_be64(s->bitmap_directory_offset)
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -2584,22 +2726,88 @@ static int qcow2_write(BlockDriverState *bs, int64_t sector_num,
     return data.ret;
 }
 
+/*
+ * Compress one cluster from @src into @dest, both @cluster_size bytes long.
+ *
+ * Returns the compressed length on success, 0 if the data does not compress
+ * into less than a cluster, and -EINVAL on zlib errors.
+ */
+static ssize_t qcow2_compress(uint8_t *dest, const uint8_t *src,
+                              size_t cluster_size)
+{
+    z_stream strm;
+    ssize_t out_len;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = cluster_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = cluster_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    out_len = strm.next_out - dest;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= cluster_size) {
+        return 0;
+    }
+    return out_len;
+}
+
+typedef struct Qcow2CompressData {
+    uint8_t *dest;
+    const uint8_t *src;
+    size_t cluster_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = qcow2_compress(data->dest, data->src, data->cluster_size);
+    return 0;
+}
+
+/* Align end of file to a sector boundary to ease reading with sector based
+ * I/Os; this is what a zero-length compressed write requests. */
+static int qcow2_compressed_write_eof(BlockDriverState *bs)
+{
+    int64_t len = bdrv_getlength(bs->file->bs);
+
+    if (len < 0) {
+        return len;
+    }
+    return bdrv_truncate(bs->file->bs, len);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
+    int ret;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
     if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file->bs);
-        return bdrv_truncate(bs->file->bs, cluster_offset);
+        return qcow2_compressed_write_eof(bs);
     }
 
     if (nb_sectors != s->cluster_sectors) {
@@ -2620,32 +2828,13 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    out_len = qcow2_compress(out_buf, buf, s->cluster_size);
+    if (out_len < 0) {
+        ret = out_len;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len == 0) {
         /* could not compress: write normal cluster */
         ret = qcow2_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
@@ -2678,6 +2867,106 @@ fail:
     return ret;
 }
 
+/*
+ * Coroutine version of qcow2_write_compressed().  The cluster is deflated in
+ * the thread pool without holding s->lock, so that concurrent callers
+ * compress on several host CPUs; only the cluster allocation is serialized.
+ * Compressed clusters are therefore laid out in completion order.
+ */
+static int coroutine_fn qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    Qcow2CompressData data;
+    ThreadPool *pool;
+    uint8_t *out_buf;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (nb_sectors == 0) {
+        return qcow2_compressed_write_eof(bs);
+    }
+
+    if (nb_sectors != s->cluster_sectors) {
+        ret = -EINVAL;
+
+        /* Zero-pad last write if image size is not cluster aligned */
+        if (sector_num + nb_sectors == bs->total_sectors &&
+            nb_sectors < s->cluster_sectors) {
+            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
+            memset(pad_buf, 0, s->cluster_size);
+            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
+            ret = qcow2_co_write_compressed(bs, sector_num,
+                                            pad_buf, s->cluster_sectors);
+            qemu_vfree(pad_buf);
+        }
+        return ret;
+    }
+
+    out_buf = g_malloc(s->cluster_size);
+
+    data = (Qcow2CompressData) {
+        .dest           = out_buf,
+        .src            = buf,
+        .cluster_size   = s->cluster_size,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    if (data.ret < 0) {
+        ret = data.ret;
+        goto fail;
+    }
+
+    if (data.ret == 0) {
+        /* could not compress: write normal cluster */
+        iov = (struct iovec) {
+            .iov_base   = (uint8_t *) buf,
+            .iov_len    = s->cluster_size,
+        };
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = qcow2_co_pwritev(bs, sector_num << BDRV_SECTOR_BITS,
+                               s->cluster_size, &qiov, 0);
+        goto fail;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, data.ret);
+    if (!cluster_offset) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
+        goto fail;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, data.ret);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    iov = (struct iovec) {
+        .iov_base   = out_buf,
+        .iov_len    = data.ret,
+    };
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_co_pwritev(bs->file, cluster_offset, data.ret, &qiov, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    g_free(out_buf);
+    return ret;
+}
+
 static int make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -2834,13 +3123,14 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
-    if (s->qcow_version >= 3 && !s->snapshots &&
+    if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
-         * the dirty flag) and only as long as there are no snapshots (because
-         * it completely empties the image). Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one refcount
-         * block) have to fit inside one refcount block. */
+         * the dirty flag) and only as long as there are no snapshots or
+         * bitmaps (because it completely empties the image). Furthermore,
+         * the L1 table and three additional clusters (image header,
+         * refcount table, one refcount block) have to fit inside one
+         * refcount block. */
         return make_completely_empty(bs);
     }
 
@@ -2999,6 +3289,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->nb_bitmaps) {
+        error_report("compat=0.10 does not support persistent bitmaps");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3419,6 +3714,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_pdiscard       = qcow2_co_pdiscard,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
@@ -3439,6 +3735,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
 
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
@@ -1188,7 +1188,7 @@ static int aio_worker(void *arg)
     return ret;
 }
 
-static int paio_submit_co(BlockDriverState *bs, int fd,
+static int paio_submit_co(BlockDriverState *bs, AioContext *ctx, int fd,
                           int64_t offset, QEMUIOVector *qiov,
                           int count, int type)
 {
@@ -1209,7 +1209,7 @@ static int paio_submit_co(BlockDriverState *bs, int fd,
     }
 
     trace_paio_submit_co(offset, count, type);
-    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    pool = aio_get_thread_pool(ctx);
     return thread_pool_submit_co(pool, aio_worker, acb);
 }
 
@@ -1238,8 +1238,11 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
-static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
-                                   uint64_t bytes, QEMUIOVector *qiov, int type)
+/* Submit in @ctx, which is the node's own AioContext except for multiqueue
+ * requests; the Linux AIO state and the thread pool are per AioContext */
+static int coroutine_fn raw_co_prw(BlockDriverState *bs, AioContext *ctx,
+                                   uint64_t offset, uint64_t bytes,
+                                   QEMUIOVector *qiov, int type)
 {
     BDRVRawState *s = bs->opaque;
 
@@ -1257,21 +1260,22 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
             type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_AIO
         } else if (bs->open_flags & BDRV_O_NATIVE_AIO) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+            LinuxAioState *aio = aio_get_linux_aio(ctx);
             assert(qiov->size == bytes);
             return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
         }
     }
 
-    return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
+    return paio_submit_co(bs, ctx, s->fd, offset, qiov, bytes, type);
 }
 
 static int coroutine_fn raw_co_preadv(BlockDriverState *bs, uint64_t offset,
                                       uint64_t bytes, QEMUIOVector *qiov,
                                       int flags)
 {
-    return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_READ);
+    return raw_co_prw(bs, bdrv_get_aio_context(bs), offset, bytes, qiov,
+                      QEMU_AIO_READ);
 }
 
 static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
@@ -1279,29 +1283,57 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                        int flags)
 {
     assert(flags == 0);
-    return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
+    return raw_co_prw(bs, bdrv_get_aio_context(bs), offset, bytes, qiov,
+                      QEMU_AIO_WRITE);
 }
 
-static void raw_aio_plug(BlockDriverState *bs)
+static int coroutine_fn raw_co_preadv_mq(BlockDriverState *bs,
+                                         AioContext *ctx, uint64_t offset,
+                                         uint64_t bytes, QEMUIOVector *qiov,
+                                         int flags)
+{
+    return raw_co_prw(bs, ctx, offset, bytes, qiov, QEMU_AIO_READ);
+}
+
+static int coroutine_fn raw_co_pwritev_mq(BlockDriverState *bs,
+                                          AioContext *ctx, uint64_t offset,
+                                          uint64_t bytes, QEMUIOVector *qiov,
+                                          int flags)
+{
+    assert(flags == 0);
+    return raw_co_prw(bs, ctx, offset, bytes, qiov, QEMU_AIO_WRITE);
+}
+
+static void raw_aio_plug_mq(BlockDriverState *bs, AioContext *ctx)
 {
 #ifdef CONFIG_LINUX_AIO
     if (bs->open_flags & BDRV_O_NATIVE_AIO) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        LinuxAioState *aio = aio_get_linux_aio(ctx);
         laio_io_plug(bs, aio);
     }
 #endif
 }
 
-static void raw_aio_unplug(BlockDriverState *bs)
+static void raw_aio_unplug_mq(BlockDriverState *bs, AioContext *ctx)
 {
 #ifdef CONFIG_LINUX_AIO
     if (bs->open_flags & BDRV_O_NATIVE_AIO) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        LinuxAioState *aio = aio_get_linux_aio(ctx);
         laio_io_unplug(bs, aio);
     }
 #endif
 }
 
+static void raw_aio_plug(BlockDriverState *bs)
+{
+    raw_aio_plug_mq(bs, bdrv_get_aio_context(bs));
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+    raw_aio_unplug_mq(bs, bdrv_get_aio_context(bs));
+}
+
 static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockCompletionFunc *cb, void *opaque)
 {
@@ -1803,11 +1835,11 @@ static int coroutine_fn raw_co_pwrite_zeroes(
     BDRVRawState *s = bs->opaque;
 
     if (!(flags & BDRV_REQ_MAY_UNMAP)) {
-        return paio_submit_co(bs, s->fd, offset, NULL, count,
-                              QEMU_AIO_WRITE_ZEROES);
+        return paio_submit_co(bs, bdrv_get_aio_context(bs), s->fd, offset,
+                              NULL, count, QEMU_AIO_WRITE_ZEROES);
     } else if (s->discard_zeroes) {
-        return paio_submit_co(bs, s->fd, offset, NULL, count,
-                              QEMU_AIO_DISCARD);
+        return paio_submit_co(bs, bdrv_get_aio_context(bs), s->fd, offset,
+                              NULL, count, QEMU_AIO_DISCARD);
     }
     return -ENOTSUP;
 }
@@ -1868,6 +1900,10 @@ BlockDriver bdrv_file = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_co_preadv_mq      = raw_co_preadv_mq,
+    .bdrv_co_pwritev_mq     = raw_co_pwritev_mq,
+    .bdrv_io_plug_mq        = raw_aio_plug_mq,
+    .bdrv_io_unplug_mq      = raw_aio_unplug_mq,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -2227,10 +2263,12 @@ static coroutine_fn int hdev_co_pwrite_zeroes(BlockDriverState *bs,
         return rc;
     }
     if (!(flags & BDRV_REQ_MAY_UNMAP)) {
-        return paio_submit_co(bs, s->fd, offset, NULL, count,
+        return paio_submit_co(bs, bdrv_get_aio_context(bs), s->fd, offset,
+                              NULL, count,
                               QEMU_AIO_WRITE_ZEROES|QEMU_AIO_BLKDEV);
     } else if (s->discard_zeroes) {
-        return paio_submit_co(bs, s->fd, offset, NULL, count,
+        return paio_submit_co(bs, bdrv_get_aio_context(bs), s->fd, offset,
+                              NULL, count,
                               QEMU_AIO_DISCARD|QEMU_AIO_BLKDEV);
     }
     return -ENOTSUP;
@@ -2311,6 +2349,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_co_preadv_mq      = raw_co_preadv_mq,
+    .bdrv_co_pwritev_mq     = raw_co_pwritev_mq,
+    .bdrv_io_plug_mq        = raw_aio_plug_mq,
+    .bdrv_io_unplug_mq      = raw_aio_unplug_mq,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
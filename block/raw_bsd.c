@@ -58,9 +58,19 @@ static int coroutine_fn raw_co_preadv(BlockDriverState *bs, uint64_t offset,
     return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
 }
 
-static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
-                                       uint64_t bytes, QEMUIOVector *qiov,
-                                       int flags)
+static int coroutine_fn raw_co_preadv_mq(BlockDriverState *bs,
+                                         AioContext *ctx, uint64_t offset,
+                                         uint64_t bytes, QEMUIOVector *qiov,
+                                         int flags)
+{
+    return bdrv_co_preadv_mq(bs->file, ctx, offset, bytes, qiov, flags);
+}
+
+/* @ctx is NULL for a write from the node's own AioContext */
+static int coroutine_fn raw_co_do_pwritev(BlockDriverState *bs,
+                                          AioContext *ctx, uint64_t offset,
+                                          uint64_t bytes, QEMUIOVector *qiov,
+                                          int flags)
 {
     void *buf = NULL;
     BlockDriver *drv;
@@ -101,8 +111,12 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
         qiov = &local_qiov;
     }
 
-    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    if (ctx) {
+        ret = bdrv_co_pwritev_mq(bs->file, ctx, offset, bytes, qiov, flags);
+    } else {
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    }
 
 fail:
     if (qiov == &local_qiov) {
@@ -112,6 +126,21 @@ fail:
     return ret;
 }
 
+static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes, QEMUIOVector *qiov,
+                                       int flags)
+{
+    return raw_co_do_pwritev(bs, NULL, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn raw_co_pwritev_mq(BlockDriverState *bs,
+                                          AioContext *ctx, uint64_t offset,
+                                          uint64_t bytes, QEMUIOVector *qiov,
+                                          int flags)
+{
+    return raw_co_do_pwritev(bs, ctx, offset, bytes, qiov, flags);
+}
+
 static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
                                             int64_t sector_num,
                                             int nb_sectors, int *pnum,
@@ -248,6 +277,8 @@ BlockDriver bdrv_raw = {
     .bdrv_create          = &raw_create,
     .bdrv_co_preadv       = &raw_co_preadv,
     .bdrv_co_pwritev      = &raw_co_pwritev,
+    .bdrv_co_preadv_mq    = &raw_co_preadv_mq,
+    .bdrv_co_pwritev_mq   = &raw_co_pwritev_mq,
     .bdrv_co_pwrite_zeroes = &raw_co_pwrite_zeroes,
     .bdrv_co_pdiscard     = &raw_co_pdiscard,
     .bdrv_co_get_block_status = &raw_co_get_block_status,
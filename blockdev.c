@@ -606,7 +606,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             autostart = 0;
         }
 
-        block_acct_init(blk_get_stats(blk), account_invalid, account_failed);
+        block_acct_setup(blk_get_stats(blk), account_invalid, account_failed);
 
         if (!parse_stats_intervals(blk_get_stats(blk), interval_list, errp)) {
             blk_unref(blk);
@@ -1848,6 +1848,8 @@ static void do_drive_backup(const char *job_id, const char *device,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
+                            bool has_buf_size, int64_t buf_size,
                             BlockJobTxn *txn, Error **errp);
 
 static void drive_backup_prepare(BlkActionState *common, Error **errp)
@@ -1887,6 +1889,8 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
                     backup->has_bitmap, backup->bitmap,
                     backup->has_on_source_error, backup->on_source_error,
                     backup->has_on_target_error, backup->on_target_error,
+                    backup->has_max_workers, backup->max_workers,
+                    backup->has_buf_size, backup->buf_size,
                     common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -1931,6 +1935,8 @@ static void do_blockdev_backup(const char *job_id, const char *device,
                                BlockdevOnError on_source_error,
                                bool has_on_target_error,
                                BlockdevOnError on_target_error,
+                               bool has_max_workers, int64_t max_workers,
+                               bool has_buf_size, int64_t buf_size,
                                BlockJobTxn *txn, Error **errp);
 
 static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
@@ -1976,6 +1982,8 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
                        backup->has_speed, backup->speed,
                        backup->has_on_source_error, backup->on_source_error,
                        backup->has_on_target_error, backup->on_target_error,
+                       backup->has_max_workers, backup->max_workers,
+                       backup->has_buf_size, backup->buf_size,
                        common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2031,6 +2039,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2734,10 +2743,12 @@ out:
 
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2763,7 +2774,21 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap == NULL) {
+        goto out;
+    }
+
+    bdrv_dirty_bitmap_set_persistent(bitmap, persistent);
 
  out:
     aio_context_release(aio_context);
@@ -3165,6 +3190,8 @@ static void do_drive_backup(const char *job_id, const char *device,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
+                            bool has_buf_size, int64_t buf_size,
                             BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3190,6 +3217,12 @@ static void do_drive_backup(const char *job_id, const char *device,
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (!has_max_workers) {
+        max_workers = 0;
+    }
+    if (!has_buf_size) {
+        buf_size = 0;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3276,8 +3309,8 @@ static void do_drive_backup(const char *job_id, const char *device,
         }
     }
 
-    backup_start(job_id, bs, target_bs, speed, sync, bmap,
-                 on_source_error, on_target_error,
+    backup_start(job_id, bs, target_bs, speed, max_workers, buf_size,
+                 sync, bmap, on_source_error, on_target_error,
                  block_job_cb, bs, txn, &local_err);
     bdrv_unref(target_bs);
     if (local_err != NULL) {
@@ -3298,6 +3331,8 @@ void qmp_drive_backup(bool has_job_id, const char *job_id,
                       bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_max_workers, int64_t max_workers,
+                      bool has_buf_size, int64_t buf_size,
                       Error **errp)
 {
     return do_drive_backup(has_job_id ? job_id : NULL, device, target,
@@ -3306,6 +3341,8 @@ void qmp_drive_backup(bool has_job_id, const char *job_id,
                            has_bitmap, bitmap,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
+                           has_max_workers, max_workers,
+                           has_buf_size, buf_size,
                            NULL, errp);
 }
 
@@ -3321,6 +3358,8 @@ void do_blockdev_backup(const char *job_id, const char *device,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
+                         bool has_buf_size, int64_t buf_size,
                          BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3338,6 +3377,12 @@ void do_blockdev_backup(const char *job_id, const char *device,
     if (!has_on_target_error) {
         on_target_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_workers) {
+        max_workers = 0;
+    }
+    if (!has_buf_size) {
+        buf_size = 0;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3370,8 +3415,9 @@ void do_blockdev_backup(const char *job_id, const char *device,
             goto out;
         }
     }
-    backup_start(job_id, bs, target_bs, speed, sync, NULL, on_source_error,
-                 on_target_error, block_job_cb, bs, txn, &local_err);
+    backup_start(job_id, bs, target_bs, speed, max_workers, buf_size,
+                 sync, NULL, on_source_error, on_target_error,
+                 block_job_cb, bs, txn, &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
     }
@@ -3387,12 +3433,16 @@ void qmp_blockdev_backup(bool has_job_id, const char *job_id,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
+                         bool has_buf_size, int64_t buf_size,
                          Error **errp)
 {
     do_blockdev_backup(has_job_id ? job_id : NULL, device, target,
                        sync, has_speed, speed,
                        has_on_source_error, on_source_error,
                        has_on_target_error, on_target_error,
+                       has_max_workers, max_workers,
+                       has_buf_size, buf_size,
                        NULL, errp);
 }
 
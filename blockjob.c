@@ -160,6 +160,7 @@ void *block_job_create(const char *job_id, const BlockJobDriver *driver,
     job->opaque        = opaque;
     job->busy          = true;
     job->refcnt        = 1;
+    job->throughput_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bs->job = job;
 
     QLIST_INSERT_HEAD(&block_jobs, job, job_list);
@@ -490,9 +491,31 @@ void block_job_yield(BlockJob *job)
     block_job_pause_point(job);
 }
 
+/* Progress is sampled whenever the job is queried, but at most once per
+ * THROUGHPUT_WINDOW_NS, so that the value does not depend on how often
+ * management software polls. */
+#define THROUGHPUT_WINDOW_NS NANOSECONDS_PER_SECOND
+
+static void block_job_update_throughput(BlockJob *job)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - job->throughput_start_ns;
+    int64_t progress = job->offset - job->throughput_start_offset;
+
+    if (elapsed < THROUGHPUT_WINDOW_NS) {
+        return;
+    }
+
+    job->throughput = MAX(progress, 0) * NANOSECONDS_PER_SECOND / elapsed;
+    job->throughput_start_ns = now;
+    job->throughput_start_offset = job->offset;
+}
+
 BlockJobInfo *block_job_query(BlockJob *job)
 {
     BlockJobInfo *info = g_new0(BlockJobInfo, 1);
+
+    block_job_update_throughput(job);
     info->type      = g_strdup(BlockJobType_lookup[job->driver->job_type]);
     info->device    = g_strdup(job->id);
     info->len       = job->len;
@@ -500,6 +523,7 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->paused    = job->pause_count > 0;
     info->offset    = job->offset;
     info->speed     = job->speed;
+    info->throughput = job->throughput;
     info->io_status = job->iostatus;
     info->ready     = job->ready;
     return info;
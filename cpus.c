@@ -554,17 +554,21 @@ static const VMStateDescription vmstate_timers = {
 static void cpu_throttle_thread(void *opaque)
 {
     CPUState *cpu = opaque;
-    double pct;
-    double throttle_ratio;
+    double pct, max_pct;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_get_percentage() ||
+        !atomic_read(&cpu->throttle_percentage)) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    /* The timer period is sized for the most throttled vcpu, which sleeps
+     * max_pct of it; the others sleep their own share of the same period.
+     */
+    pct = (double)atomic_read(&cpu->throttle_percentage) / 100;
+    max_pct = (double)cpu_throttle_get_percentage() / 100;
+    sleeptime_ns = (long)(pct * CPU_THROTTLE_TIMESLICE_NS / (1 - max_pct));
 
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
@@ -582,6 +586,9 @@ static void cpu_throttle_timer_tick(void *opaque)
         return;
     }
     CPU_FOREACH(cpu) {
+        if (!atomic_read(&cpu->throttle_percentage)) {
+            continue;
+        }
         if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
         }
@@ -592,21 +599,57 @@ static void cpu_throttle_timer_tick(void *opaque)
                                    CPU_THROTTLE_TIMESLICE_NS / (1-pct));
 }
 
+static void cpu_throttle_start_timer(void)
+{
+    CPUState *cpu;
+    int max_pct = 0;
+
+    CPU_FOREACH(cpu) {
+        max_pct = MAX(max_pct, atomic_read(&cpu->throttle_percentage));
+    }
+    atomic_set(&throttle_percentage, max_pct);
+
+    if (max_pct) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
 void cpu_throttle_set(int new_throttle_pct)
 {
+    CPUState *cpu;
+
     /* Ensure throttle percentage is within valid range */
     new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
     new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
 
-    atomic_set(&throttle_percentage, new_throttle_pct);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+    }
+    cpu_throttle_start_timer();
+}
 
-    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                       CPU_THROTTLE_TIMESLICE_NS);
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    if (new_throttle_pct > 0) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    } else {
+        new_throttle_pct = 0;
+    }
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+    cpu_throttle_start_timer();
 }
 
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
 }
 
 bool cpu_throttle_active(void)
@@ -619,6 +662,11 @@ int cpu_throttle_get_percentage(void)
     return atomic_read(&throttle_percentage);
 }
 
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return atomic_read(&cpu->throttle_percentage);
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock);
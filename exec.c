@@ -136,10 +136,18 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+/* Number of recently used sections looked up before walking the map */
+#define DISPATCH_MRU_SIZE 4
+
 struct AddressSpaceDispatch {
     struct rcu_head rcu;
 
-    MemoryRegionSection *mru_section;
+    /* Sections recently returned by address_space_lookup_region, after
+     * subpage resolution.  A dispatch is rebuilt whenever the memory map
+     * changes, so they never go stale.
+     */
+    MemoryRegionSection *mru_section[DISPATCH_MRU_SIZE];
+    unsigned mru_next;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -305,13 +313,49 @@ static void phys_page_compact(PhysPageEntry *lp, Node *nodes, unsigned long *com
     }
 }
 
+/* Copy the node @lp points to, and its children, to @nodes in walk order. */
+static void phys_page_repack(PhysPageEntry *lp, Node *old_nodes, Node *nodes,
+                             unsigned *nodes_nb)
+{
+    PhysPageEntry *p;
+    int i;
+
+    if (!lp->skip || lp->ptr == PHYS_MAP_NODE_NIL) {
+        return;
+    }
+
+    p = nodes[*nodes_nb];
+    memcpy(p, old_nodes[lp->ptr], sizeof(Node));
+    lp->ptr = (*nodes_nb)++;
+    for (i = 0; i < P_L2_SIZE; i++) {
+        phys_page_repack(&p[i], old_nodes, nodes, nodes_nb);
+    }
+}
+
 static void phys_page_compact_all(AddressSpaceDispatch *d, int nodes_nb)
 {
     DECLARE_BITMAP(compacted, nodes_nb);
+    Node *old_nodes = d->map.nodes;
 
     if (d->phys_map.skip) {
         phys_page_compact(&d->phys_map, d->map.nodes, compacted);
     }
+
+    /*
+     * Compaction leaves behind the nodes it skipped, and the array was
+     * sized after the largest map built so far.  Keep only the nodes that
+     * can still be reached, each one next to its parent, so that a board
+     * with many small regions has a map small enough to stay in cache.
+     */
+    if (!nodes_nb) {
+        return;
+    }
+    d->map.nodes = g_new(Node, nodes_nb);
+    d->map.nodes_nb = 0;
+    phys_page_repack(&d->phys_map, old_nodes, d->map.nodes, &d->map.nodes_nb);
+    d->map.nodes = g_renew(Node, d->map.nodes, MAX(d->map.nodes_nb, 1));
+    d->map.nodes_nb_alloc = MAX(d->map.nodes_nb, 1);
+    g_free(old_nodes);
 }
 
 static inline bool section_covers_addr(const MemoryRegionSection *section,
@@ -358,24 +402,37 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section = atomic_read(&d->mru_section);
+    MemoryRegionSection *section = NULL;
     subpage_t *subpage;
-    bool update;
+    bool update = true;
+    unsigned i;
 
-    if (section && section != &d->map.sections[PHYS_SECTION_UNASSIGNED] &&
-        section_covers_addr(section, addr)) {
-        update = false;
-    } else {
+    /*
+     * Entries may be replaced concurrently by other threads, but any of
+     * them is a valid section of this dispatch.
+     */
+    for (i = 0; i < DISPATCH_MRU_SIZE; i++) {
+        MemoryRegionSection *mru = atomic_read(&d->mru_section[i]);
+
+        if (mru && section_covers_addr(mru, addr)) {
+            section = mru;
+            update = false;
+            break;
+        }
+    }
+    if (!section) {
         section = phys_page_find(d->phys_map, addr, d->map.nodes,
                                  d->map.sections);
-        update = true;
     }
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
     }
-    if (update) {
-        atomic_set(&d->mru_section, section);
+    /* The unassigned section covers everything, so it is never cached */
+    if (update && section != &d->map.sections[PHYS_SECTION_UNASSIGNED]) {
+        i = atomic_read(&d->mru_next);
+        atomic_set(&d->mru_next, i + 1);
+        atomic_set(&d->mru_section[i % DISPATCH_MRU_SIZE], section);
     }
     return section;
 }
@@ -960,7 +1017,7 @@ found:
     return block;
 }
 
-static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
+void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
 {
     CPUState *cpu;
     ram_addr_t start1;
@@ -1805,6 +1862,28 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+int qemu_ram_remap_file(RAMBlock *block, int fd, off_t file_offset)
+{
+    void *area;
+
+    if ((block->flags & (RAM_PREALLOC | RAM_SHARED)) || block->fd >= 0 ||
+        xen_enabled() || phys_mem_alloc != qemu_anon_ram_alloc) {
+        return -ENOTSUP;
+    }
+
+    area = mmap(block->host, block->used_length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, file_offset);
+    if (area == MAP_FAILED) {
+        return -errno;
+    }
+    assert(area == block->host);
+
+    memory_try_enable_merging(area, block->used_length);
+    qemu_ram_setup_dump(area, block->used_length);
+    qemu_madvise(area, block->used_length, QEMU_MADV_DONTFORK);
+    return 0;
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -1989,6 +2068,13 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
+    /* The migration bits are only ever cleared while dirty logging is on,
+     * so this counts the pages the vcpu dirtied since the last sync.
+     */
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr,
+                                            DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&current_cpu->dirty_pages);
+    }
     /* Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
      */
@@ -2442,8 +2528,7 @@ int cpu_memory_rw_debug(CPUState *cpu, target_ulong addr,
 
 #else
 
-static void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr,
-                                     hwaddr length)
+void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr, hwaddr length)
 {
     uint8_t dirty_log_mask = memory_region_get_dirty_log_mask(mr);
     addr += memory_region_get_ram_addr(mr);
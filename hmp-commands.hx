@@ -356,6 +356,38 @@ STEXI
 @findex loadvm
 Set the whole virtual machine to the snapshot identified by the tag
 @var{tag} or the unique snapshot ID @var{id}.
+ETEXI
+
+    {
+        .name       = "savevm_file",
+        .args_type  = "filename:F",
+        .params     = "filename",
+        .help       = "save the RAM and device state to a snapshot file",
+        .mhandler.cmd = hmp_savevm_file,
+    },
+
+STEXI
+@item savevm_file @var{filename}
+@findex savevm_file
+Save the RAM and device state of the virtual machine to @var{filename}.
+Disks are not included.  @var{filename} is replaced only once the new
+snapshot is complete.
+ETEXI
+
+    {
+        .name       = "loadvm_file",
+        .args_type  = "filename:F",
+        .params     = "filename",
+        .help       = "restore the RAM and device state from a snapshot file",
+        .mhandler.cmd = hmp_loadvm_file,
+    },
+
+STEXI
+@item loadvm_file @var{filename}
+@findex loadvm_file
+Restore the RAM and device state of the virtual machine from
+@var{filename}, written by @code{savevm_file}.  RAM is mapped from the
+file, which must not change while the virtual machine runs.
 ETEXI
 
     {
@@ -961,6 +993,22 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:i",
+        .params     = "second",
+        .help       = "start measuring the guest dirty rate for 'second' "
+                      "seconds (1 to 60)",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second}
+@findex calc_dirty_rate
+Measure how fast the guest dirties its memory over @var{second} seconds.
+The result is shown by @code{info dirty_rate}.
 ETEXI
 
     {
@@ -213,6 +213,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_time);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -245,11 +247,32 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle skipped: %" PRIu64 "\n",
+                       info->xbzrle_cache->skipped);
     }
 
     if (info->has_cpu_throttle_percentage) {
+        MigrationVcpuThrottleList *vcpu;
+
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
+        for (vcpu = info->vcpu_throttle_percentage; vcpu; vcpu = vcpu->next) {
+            monitor_printf(mon, "  vcpu %" PRId64 ": %" PRId64 "%%\n",
+                           vcpu->value->id, vcpu->value->percentage);
+        }
+    }
+
+    if (info->has_device_state_time) {
+        MigrationDeviceStatsList *dev;
+
+        monitor_printf(mon, "device state time: %" PRIu64 " us\n",
+                       info->device_state_time);
+        for (dev = info->device_stats; dev; dev = dev->next) {
+            monitor_printf(mon, "  %s/%" PRId64 ": %" PRId64 " us, %" PRId64
+                           " bytes\n", dev->value->id,
+                           dev->value->instance_id, dev->value->time,
+                           dev->value->size);
+        }
     }
 
     qapi_free_MigrationInfo(info);
@@ -304,6 +327,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: '%s'",
             MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_HOSTNAME],
             params->tls_hostname ? : "");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT],
+            params->x_multifd_page_count);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES],
+            params->postcopy_prefetch_pages);
         monitor_printf(mon, "\n");
     }
 
@@ -316,6 +351,38 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateVcpuList *vcpu;
+    DirtyRateRAMBlockList *block;
+
+    monitor_printf(mon, "Status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    if (info->status == DIRTY_RATE_STATUS_UNSTARTED) {
+        goto out;
+    }
+    monitor_printf(mon, "Start time: %" PRId64 " s\n", info->start_time);
+    monitor_printf(mon, "Sample time: %" PRId64 " s\n", info->calc_time);
+    if (!info->has_dirty_pages_rate) {
+        goto out;
+    }
+    monitor_printf(mon, "Dirty rate: %" PRId64 " pages/s (%" PRId64
+                   " kbytes/s)\n", info->dirty_pages_rate,
+                   (info->dirty_pages_rate * info->page_size) >> 10);
+    for (vcpu = info->vcpu_dirty_rate; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "  vcpu %" PRId64 ": %" PRId64 " pages/s\n",
+                       vcpu->value->id, vcpu->value->dirty_pages_rate);
+    }
+    for (block = info->ramblock_dirty_rate; block; block = block->next) {
+        monitor_printf(mon, "  %s: %" PRId64 " pages/s\n",
+                       block->value->id, block->value->dirty_pages_rate);
+    }
+
+out:
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1127,7 +1194,7 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
     qmp_drive_backup(false, NULL, device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, NULL,
-                     false, 0, false, 0, &err);
+                     false, 0, false, 0, false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1211,6 +1278,36 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, &err);
+    if (err) {
+        error_report_err(err);
+        return;
+    }
+    monitor_printf(mon, "Measuring the dirty rate for %" PRId64 " seconds, "
+                   "use 'info dirty_rate' for the result\n", sec);
+}
+
+void hmp_savevm_file(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_snapshot_save_file(qdict_get_str(qdict, "filename"), &err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_loadvm_file(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_snapshot_load_file(qdict_get_str(qdict, "filename"), &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1260,6 +1357,11 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_cpu_throttle_increment = false;
     bool has_tls_creds = false;
     bool has_tls_hostname = false;
+    bool has_x_multifd_channels = false;
+    bool has_x_multifd_page_count = false;
+    bool has_compress_method = false;
+    int compress_method = 0;
+    bool has_postcopy_prefetch_pages = false;
     bool use_int_value = false;
     int i;
 
@@ -1292,6 +1394,27 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_TLS_HOSTNAME:
                 has_tls_hostname = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT:
+                has_x_multifd_page_count = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                has_compress_method = true;
+                compress_method =
+                    qapi_enum_parse(MigrationCompressMethod_lookup, valuestr,
+                                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                break;
+            case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+                has_postcopy_prefetch_pages = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1309,6 +1432,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                                        has_cpu_throttle_increment, valueint,
                                        has_tls_creds, valuestr,
                                        has_tls_hostname, valuestr,
+                                       has_x_multifd_channels, valueint,
+                                       has_x_multifd_page_count, valueint,
+                                       has_compress_method, compress_method,
+                                       has_postcopy_prefetch_pages, valueint,
                                        &err);
             break;
         }
@@ -26,14 +26,31 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* An IOThread servicing some of the queues */
+typedef struct VirtIOBlockDataPlaneThread {
+    struct VirtIOBlockDataPlane *s;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;                     /* bh for guest notification */
+    QEMUBH *restart_bh;
+    unsigned long *batch_notify_vqs;
+} VirtIOBlockDataPlaneThread;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
 
+    /* Queue n is serviced by threads[n % nthreads] if multiqueue is set,
+     * by threads[0] otherwise.  threads[0] is the "iothread" property, the
+     * others come from "iothreads".
+     */
+    VirtIOBlockDataPlaneThread *threads;
+    unsigned int nthreads;
+    bool multiqueue;
+    Error *blocker;
+
     VirtIOBlkConf *conf;
     VirtIODevice *vdev;
-    QEMUBH *bh;                     /* bh for guest notification */
-    unsigned long *batch_notify_vqs;
 
     /* Note that these EventNotifiers are assigned by value.  This is
      * fine as long as you do not call event_notifier_cleanup on them
@@ -44,25 +61,35 @@ struct VirtIOBlockDataPlane {
     AioContext *ctx;
 };
 
+static VirtIOBlockDataPlaneThread *
+virtio_blk_data_plane_thread(VirtIOBlockDataPlane *s, unsigned queue)
+{
+    return &s->threads[s->multiqueue ? queue % s->nthreads : 0];
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
-    set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
-    qemu_bh_schedule(s->bh);
+    unsigned queue = virtio_get_queue_index(vq);
+    VirtIOBlockDataPlaneThread *t = virtio_blk_data_plane_thread(s, queue);
+
+    set_bit(queue, t->batch_notify_vqs);
+    qemu_bh_schedule(t->bh);
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneThread *t = opaque;
+    VirtIOBlockDataPlane *s = t->s;
     unsigned nvqs = s->conf->num_queues;
     unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+    memcpy(bitmap, t->batch_notify_vqs, sizeof(bitmap));
+    memset(t->batch_notify_vqs, 0, sizeof(bitmap));
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+        unsigned long bits = bitmap[j / BITS_PER_LONG];
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -77,6 +104,64 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+static void restart_requests_bh(void *opaque)
+{
+    VirtIOBlockDataPlaneThread *t = opaque;
+
+    virtio_blk_restart_requests(VIRTIO_BLK(t->s->vdev), t->ctx);
+}
+
+/* Resubmit the failed requests of the queues in the other IOThreads */
+void virtio_blk_data_plane_restart(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->multiqueue) {
+        return;
+    }
+    for (i = 1; i < s->nthreads; i++) {
+        qemu_bh_schedule(s->threads[i].restart_bh);
+    }
+}
+
+/* Whether requests from the queues of threads[n] are in flight */
+static bool virtio_blk_data_plane_busy(VirtIOBlockDataPlane *s, unsigned n)
+{
+    VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    unsigned i;
+
+    for (i = n; i < s->conf->num_queues; i += s->nthreads) {
+        if (vblk->queue_inflight[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Look up the colon-separated IOThread ids in @ids */
+static GPtrArray *virtio_blk_data_plane_iothreads(const char *ids,
+                                                  Error **errp)
+{
+    GPtrArray *iothreads = g_ptr_array_new();
+    char **names = g_strsplit(ids, ":", -1);
+    unsigned i;
+
+    for (i = 0; names[i]; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    names[i]);
+
+        if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+            error_setg(errp, "IOThread '%s' not found", names[i]);
+            g_ptr_array_free(iothreads, true);
+            iothreads = NULL;
+            break;
+        }
+        g_ptr_array_add(iothreads, obj);
+    }
+    g_strfreev(names);
+    return iothreads;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -85,10 +170,15 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    GPtrArray *iothreads = NULL;
+    unsigned i;
 
     *dataplane = NULL;
 
     if (!conf->iothread) {
+        if (conf->iothreads) {
+            error_setg(errp, "iothreads requires the iothread property");
+        }
         return;
     }
 
@@ -108,15 +198,36 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         return;
     }
 
+    if (conf->iothreads) {
+        iothreads = virtio_blk_data_plane_iothreads(conf->iothreads, errp);
+        if (!iothreads) {
+            return;
+        }
+    }
+
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
 
-    s->iothread = conf->iothread;
-    object_ref(OBJECT(s->iothread));
-    s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
-    s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    s->nthreads = 1 + (iothreads ? iothreads->len : 0);
+    s->threads = g_new0(VirtIOBlockDataPlaneThread, s->nthreads);
+    for (i = 0; i < s->nthreads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        t->s = s;
+        t->iothread = i ? g_ptr_array_index(iothreads, i - 1) : conf->iothread;
+        object_ref(OBJECT(t->iothread));
+        t->ctx = iothread_get_aio_context(t->iothread);
+        t->bh = aio_bh_new(t->ctx, notify_guest_bh, t);
+        t->restart_bh = aio_bh_new(t->ctx, restart_requests_bh, t);
+        t->batch_notify_vqs = bitmap_new(conf->num_queues);
+    }
+    if (iothreads) {
+        g_ptr_array_free(iothreads, true);
+    }
+
+    s->iothread = s->threads[0].iothread;
+    s->ctx = s->threads[0].ctx;
 
     *dataplane = s;
 }
@@ -124,14 +235,22 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned i;
+
     if (!s) {
         return;
     }
 
     virtio_blk_data_plane_stop(s);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->nthreads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        g_free(t->batch_notify_vqs);
+        qemu_bh_delete(t->bh);
+        qemu_bh_delete(t->restart_bh);
+        object_unref(OBJECT(t->iothread));
+    }
+    g_free(s->threads);
     g_free(s);
 }
 
@@ -152,6 +271,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    BlockBackend *blk = s->conf->conf.blk;
     unsigned i;
     unsigned nvqs = s->conf->num_queues;
     int r;
@@ -186,7 +306,27 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     vblk->dataplane_started = true;
     trace_virtio_blk_data_plane_start(s);
 
-    blk_set_aio_context(s->conf->conf.blk, s->ctx);
+    blk_set_aio_context(blk, s->ctx);
+
+    /* The other IOThreads submit their requests straight to the node only
+     * if its driver can take them; anything else would have to bounce
+     * through s->ctx.  Jobs and graph changes that do not go through a
+     * drained section would pull the node away from under them.
+     */
+    s->multiqueue = s->nthreads > 1 && blk_mq_supported(blk) &&
+                    !blk_bs(blk)->job;
+    if (s->multiqueue) {
+        error_setg(&s->blocker, "multiqueue dataplane is in use");
+        blk_op_block_all(blk, s->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_BACKUP_SOURCE, s->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_EXTERNAL_SNAPSHOT, s->blocker);
+        blk_op_unblock(blk, BLOCK_OP_TYPE_RESIZE, s->blocker);
+        for (i = 0; i < nvqs; i++) {
+            VirtIOBlockDataPlaneThread *t = virtio_blk_data_plane_thread(s, i);
+
+            vblk->queue_ctx[i] = t->ctx == s->ctx ? NULL : t->ctx;
+        }
+    }
 
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
@@ -196,14 +336,15 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = virtio_blk_data_plane_thread(s, i)->ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return;
 
   fail_guest_notifiers:
@@ -234,6 +375,36 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    /* Stop the queues in the other IOThreads first.  Their requests may
+     * still bounce through s->ctx, so leave that one running meanwhile.
+     */
+    for (i = 0; i < nvqs; i++) {
+        AioContext *ctx = vblk->queue_ctx[i];
+
+        if (ctx) {
+            aio_context_acquire(ctx);
+            virtio_queue_aio_set_host_notifier_handler(
+                    virtio_get_queue(s->vdev, i), ctx, NULL);
+            aio_context_release(ctx);
+        }
+    }
+    for (i = 1; s->multiqueue && i < s->nthreads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        aio_context_acquire(t->ctx);
+        while (virtio_blk_data_plane_busy(s, i)) {
+            aio_poll(t->ctx, true);
+        }
+        aio_context_release(t->ctx);
+    }
+    if (s->multiqueue) {
+        memset(vblk->queue_ctx, 0, nvqs * sizeof(vblk->queue_ctx[0]));
+        blk_op_unblock_all(s->conf->conf.blk, s->blocker);
+        error_free(s->blocker);
+        s->blocker = NULL;
+        s->multiqueue = false;
+    }
+
     aio_context_acquire(s->ctx);
 
     /* Stop notifications for new requests from guest */
@@ -42,24 +42,67 @@ void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
 
 void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    if (req) {
-        g_free(req);
+    virtqueue_element_free(req);
+}
+
+/* The AioContext that requests from @vq are submitted and completed in */
+static AioContext *virtio_blk_vq_ctx(VirtIOBlock *s, VirtQueue *vq)
+{
+    AioContext *ctx = s->queue_ctx[virtio_get_queue_index(vq)];
+
+    return ctx ? ctx : blk_get_aio_context(s->blk);
+}
+
+static void virtio_blk_inflight_inc(VirtIOBlockReq *req)
+{
+    req->dev->queue_inflight[virtio_get_queue_index(req->vq)]++;
+}
+
+static void virtio_blk_inflight_dec(VirtIOBlockReq *req)
+{
+    req->dev->queue_inflight[virtio_get_queue_index(req->vq)]--;
+}
+
+static void virtio_blk_notify(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        virtio_blk_data_plane_notify(s->dataplane, vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(s), vq);
     }
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
-    VirtIOBlock *s = req->dev;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
-
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
     virtqueue_push(req->vq, &req->elem, req->in_len);
-    if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
+    virtio_blk_notify(req->dev, req->vq);
+}
+
+/* Successfully complete @n requests from the same virtqueue, updating the
+ * used ring and notifying the guest once.
+ */
+static void virtio_blk_complete_batch(VirtIOBlockReq **reqs, unsigned int n)
+{
+    VirtIOBlock *s = reqs[0]->dev;
+    VirtQueueElement *elems[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int lens[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        trace_virtio_blk_req_complete(reqs[i], VIRTIO_BLK_S_OK);
+        stb_p(&reqs[i]->in->status, VIRTIO_BLK_S_OK);
+        elems[i] = &reqs[i]->elem;
+        lens[i] = reqs[i]->in_len;
+    }
+    virtqueue_push_batch(reqs[0]->vq, elems, lens, n);
+    virtio_blk_notify(s, reqs[0]->vq);
+
+    for (i = 0; i < n; i++) {
+        block_acct_done(blk_get_stats(s->blk), &reqs[i]->acct);
+        virtio_blk_free_request(reqs[i]);
     }
 }
 
@@ -74,8 +117,10 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         /* Break the link as the next request is going to be parsed from the
          * ring again. Otherwise we may end up doing a double completion! */
         req->mr_next = NULL;
+        qemu_mutex_lock(&s->rq_lock);
         req->next = s->rq;
         s->rq = req;
+        qemu_mutex_unlock(&s->rq_lock);
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         block_acct_failed(blk_get_stats(s->blk), &req->acct);
@@ -89,6 +134,10 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *next = opaque;
+    VirtIOBlockReq *done[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int ndone = 0;
+
+    virtio_blk_inflight_dec(next);
 
     while (next) {
         VirtIOBlockReq *req = next;
@@ -118,9 +167,16 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
             }
         }
 
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-        block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
-        virtio_blk_free_request(req);
+        /* Requests restarted after an error may mix virtqueues */
+        if (ndone == ARRAY_SIZE(done) || (ndone && done[0]->vq != req->vq)) {
+            virtio_blk_complete_batch(done, ndone);
+            ndone = 0;
+        }
+        done[ndone++] = req;
+    }
+
+    if (ndone) {
+        virtio_blk_complete_batch(done, ndone);
     }
 }
 
@@ -128,6 +184,8 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
 
+    virtio_blk_inflight_dec(req);
+
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, 0)) {
             return;
@@ -154,6 +212,7 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     struct virtio_scsi_inhdr *scsi;
     struct sg_io_hdr *hdr;
 
+    virtio_blk_inflight_dec(req);
     scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
 
     if (status) {
@@ -189,15 +248,6 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
-{
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
-    }
-    return req;
-}
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
@@ -210,7 +260,6 @@ static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 #ifdef __linux__
     int i;
     VirtIOBlockIoctlReq *ioctl_req;
-    BlockAIOCB *acb;
 #endif
 
     /*
@@ -288,13 +337,9 @@ static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
     ioctl_req->hdr.sbp = elem->in_sg[elem->in_num - 3].iov_base;
     ioctl_req->hdr.mx_sb_len = elem->in_sg[elem->in_num - 3].iov_len;
 
-    acb = blk_aio_ioctl(blk->blk, SG_IO, &ioctl_req->hdr,
-                        virtio_blk_ioctl_complete, ioctl_req);
-    if (!acb) {
-        g_free(ioctl_req);
-        status = VIRTIO_BLK_S_UNSUPP;
-        goto fail;
-    }
+    virtio_blk_inflight_inc(req);
+    blk_mq_aio_ioctl(blk->blk, virtio_blk_vq_ctx(blk, req->vq), SG_IO,
+                     &ioctl_req->hdr, virtio_blk_ioctl_complete, ioctl_req);
     return -EINPROGRESS;
 #else
     abort();
@@ -322,8 +367,10 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
 static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
                                    int start, int num_reqs, int niov)
 {
-    QEMUIOVector *qiov = &mrb->reqs[start]->qiov;
-    int64_t sector_num = mrb->reqs[start]->sector_num;
+    VirtIOBlockReq *req = mrb->reqs[start];
+    AioContext *ctx = virtio_blk_vq_ctx(req->dev, req->vq);
+    QEMUIOVector *qiov = &req->qiov;
+    int64_t sector_num = req->sector_num;
     bool is_write = mrb->is_write;
 
     if (num_reqs > 1) {
@@ -354,12 +401,13 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
                               num_reqs - 1);
     }
 
+    virtio_blk_inflight_inc(req);
     if (is_write) {
-        blk_aio_pwritev(blk, sector_num << BDRV_SECTOR_BITS, qiov, 0,
-                        virtio_blk_rw_complete, mrb->reqs[start]);
+        blk_mq_aio_pwritev(blk, ctx, sector_num << BDRV_SECTOR_BITS, qiov, 0,
+                           virtio_blk_rw_complete, req);
     } else {
-        blk_aio_preadv(blk, sector_num << BDRV_SECTOR_BITS, qiov, 0,
-                       virtio_blk_rw_complete, mrb->reqs[start]);
+        blk_mq_aio_preadv(blk, ctx, sector_num << BDRV_SECTOR_BITS, qiov, 0,
+                          virtio_blk_rw_complete, req);
     }
 }
 
@@ -443,7 +491,9 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     if (mrb->is_write && mrb->num_reqs > 0) {
         virtio_blk_submit_multireq(req->dev->blk, mrb);
     }
-    blk_aio_flush(req->dev->blk, virtio_blk_flush_complete, req);
+    virtio_blk_inflight_inc(req);
+    blk_mq_aio_flush(req->dev->blk, virtio_blk_vq_ctx(req->dev, req->vq),
+                     virtio_blk_flush_complete, req);
 }
 
 static bool virtio_blk_sect_range_ok(VirtIOBlock *dev,
@@ -580,20 +630,27 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
+    VirtQueueElementPool *pool = &s->req_pools[virtio_get_queue_index(vq)];
+    AioContext *ctx = virtio_blk_vq_ctx(s, vq);
     MultiReqBuffer mrb = {};
+    unsigned int i, n;
 
-    blk_io_plug(s->blk);
+    blk_mq_io_plug(s->blk, ctx);
 
-    while ((req = virtio_blk_get_request(s, vq))) {
-        virtio_blk_handle_request(req, &mrb);
+    while ((n = virtqueue_pop_batch(vq, pool, (void **)reqs,
+                                    ARRAY_SIZE(reqs)))) {
+        for (i = 0; i < n; i++) {
+            virtio_blk_init_request(s, vq, reqs[i]);
+            virtio_blk_handle_request(reqs[i], &mrb);
+        }
     }
 
     if (mrb.num_reqs) {
         virtio_blk_submit_multireq(s->blk, &mrb);
     }
 
-    blk_io_unplug(s->blk);
+    blk_mq_io_unplug(s->blk, ctx);
 }
 
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
@@ -612,21 +669,30 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     virtio_blk_handle_vq(s, vq);
 }
 
-static void virtio_blk_dma_restart_bh(void *opaque)
+/* Resubmit the failed requests of the queues serviced in @ctx */
+void virtio_blk_restart_requests(VirtIOBlock *s, AioContext *ctx)
 {
-    VirtIOBlock *s = opaque;
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockReq *req, **prev, *restart = NULL, **tail = &restart;
     MultiReqBuffer mrb = {};
 
-    qemu_bh_delete(s->bh);
-    s->bh = NULL;
-
-    s->rq = NULL;
+    qemu_mutex_lock(&s->rq_lock);
+    prev = &s->rq;
+    while ((req = *prev)) {
+        if (virtio_blk_vq_ctx(s, req->vq) == ctx) {
+            *prev = req->next;
+            *tail = req;
+            tail = &req->next;
+        } else {
+            prev = &req->next;
+        }
+    }
+    *tail = NULL;
+    qemu_mutex_unlock(&s->rq_lock);
 
-    while (req) {
-        VirtIOBlockReq *next = req->next;
-        virtio_blk_handle_request(req, &mrb);
-        req = next;
+    while (restart) {
+        VirtIOBlockReq *next = restart->next;
+        virtio_blk_handle_request(restart, &mrb);
+        restart = next;
     }
 
     if (mrb.num_reqs) {
@@ -634,6 +700,19 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     }
 }
 
+static void virtio_blk_dma_restart_bh(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    qemu_bh_delete(s->bh);
+    s->bh = NULL;
+
+    virtio_blk_restart_requests(s, blk_get_aio_context(s->blk));
+    if (s->dataplane) {
+        virtio_blk_data_plane_restart(s->dataplane);
+    }
+}
+
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
                                       RunState state)
 {
@@ -656,21 +735,25 @@ static void virtio_blk_reset(VirtIODevice *vdev)
     AioContext *ctx;
     VirtIOBlockReq *req;
 
+    /* The queues in other IOThreads need the BlockBackend's AioContext to
+     * finish their requests, so stop them before taking it */
+    if (s->dataplane) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+
     ctx = blk_get_aio_context(s->blk);
     aio_context_acquire(ctx);
     blk_drain(s->blk);
 
     /* We drop queued requests after blk_drain() because blk_drain() itself can
      * produce them. */
+    qemu_mutex_lock(&s->rq_lock);
     while (s->rq) {
         req = s->rq;
         s->rq = req->next;
         virtio_blk_free_request(req);
     }
-
-    if (s->dataplane) {
-        virtio_blk_data_plane_stop(s->dataplane);
-    }
+    qemu_mutex_unlock(&s->rq_lock);
     aio_context_release(ctx);
 
     blk_set_enable_write_cache(s->blk, s->original_wce);
@@ -813,18 +896,19 @@ static void virtio_blk_save(QEMUFile *f, void *opaque, size_t size)
 static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 {
     VirtIOBlock *s = VIRTIO_BLK(vdev);
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockReq *req;
 
-    while (req) {
+    qemu_mutex_lock(&s->rq_lock);
+    for (req = s->rq; req; req = req->next) {
         qemu_put_sbyte(f, 1);
 
         if (s->conf.num_queues > 1) {
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
-        req = req->next;
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
     }
+    qemu_mutex_unlock(&s->rq_lock);
     qemu_put_sbyte(f, 0);
 }
 
@@ -856,10 +940,12 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
             }
         }
 
-        req = qemu_get_virtqueue_element(f, sizeof(VirtIOBlockReq));
+        req = qemu_get_virtqueue_element(vdev, f, sizeof(VirtIOBlockReq));
         virtio_blk_init_request(s, virtio_get_queue(vdev, vq_idx), req);
+        qemu_mutex_lock(&s->rq_lock);
         req->next = s->rq;
         s->rq = req;
+        qemu_mutex_unlock(&s->rq_lock);
     }
 
     return 0;
@@ -876,6 +962,19 @@ static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
 };
 
+static void virtio_blk_free_queues(VirtIOBlock *s)
+{
+    unsigned i;
+
+    for (i = 0; i < s->conf.num_queues; i++) {
+        virtqueue_element_pool_destroy(&s->req_pools[i]);
+    }
+    g_free(s->req_pools);
+    g_free(s->queue_ctx);
+    g_free(s->queue_inflight);
+    qemu_mutex_destroy(&s->rq_lock);
+}
+
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -896,6 +995,11 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "num-queues property must be larger than 0");
         return;
     }
+    if (conf->num_queues > VIRTIO_QUEUE_MAX) {
+        error_setg(errp, "num-queues property must be at most %d",
+                   VIRTIO_QUEUE_MAX);
+        return;
+    }
 
     blkconf_serial(&conf->conf, &conf->serial);
     blkconf_apply_backend_options(&conf->conf);
@@ -912,6 +1016,13 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
 
     s->blk = conf->conf.blk;
     s->rq = NULL;
+    qemu_mutex_init(&s->rq_lock);
+    s->req_pools = g_new(VirtQueueElementPool, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        virtqueue_element_pool_init(&s->req_pools[i], sizeof(VirtIOBlockReq));
+    }
+    s->queue_ctx = g_new0(AioContext *, conf->num_queues);
+    s->queue_inflight = g_new0(unsigned int, conf->num_queues);
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     for (i = 0; i < conf->num_queues; i++) {
@@ -920,6 +1031,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        virtio_blk_free_queues(s);
         virtio_cleanup(vdev);
         return;
     }
@@ -940,6 +1052,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
+    virtio_blk_free_queues(s);
     virtio_cleanup(vdev);
 }
 
@@ -970,6 +1083,7 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_STRING("iothreads", VirtIOBlock, conf.iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
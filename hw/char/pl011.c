@@ -11,14 +11,22 @@
 #include "hw/sysbus.h"
 #include "sysemu/char.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
 
 #define TYPE_PL011 "pl011"
 #define PL011(obj) OBJECT_CHECK(PL011State, (obj), TYPE_PL011)
 
+/* The registers are accessed without the global lock, and are protected
+ * by @lock instead.  The interrupt line and the character backend still
+ * need the global lock, so UARTDR accesses take it; the lock order is
+ * global lock, then @lock.
+ */
 typedef struct PL011State {
     SysBusDevice parent_obj;
 
     MemoryRegion iomem;
+    QemuMutex lock;
     uint32_t readbuff;
     uint32_t flags;
     uint32_t lcr;
@@ -35,6 +43,8 @@ typedef struct PL011State {
     int read_pos;
     int read_count;
     int read_trigger;
+    /* Level last passed to irq, written with both locks held.  */
+    int irq_level;
     CharDriverState *chr;
     qemu_irq irq;
     const unsigned char *id;
@@ -53,23 +63,47 @@ static const unsigned char pl011_id_arm[8] =
 static const unsigned char pl011_id_luminary[8] =
   { 0x11, 0x00, 0x18, 0x01, 0x0d, 0xf0, 0x05, 0xb1 };
 
+/* UARTDR is the only register that talks to the character backend */
+#define PL011_NEEDS_GLOBAL_LOCK(offset) (((offset) >> 2) == 0)
+
+static int pl011_irq_level(PL011State *s)
+{
+    return (s->int_level & s->int_enabled) != 0;
+}
+
+/* Update interrupts.  Called without s->lock held; the global lock is
+ * only taken if the level changes.
+ */
 static void pl011_update(PL011State *s)
 {
-    uint32_t flags;
+    bool locked = qemu_mutex_iothread_locked();
+    int level;
+
+    qemu_mutex_lock(&s->lock);
+    level = pl011_irq_level(s);
+    qemu_mutex_unlock(&s->lock);
+    if (level == atomic_read(&s->irq_level)) {
+        return;
+    }
 
-    flags = s->int_level & s->int_enabled;
-    qemu_set_irq(s->irq, flags != 0);
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    /* Another thread may have changed the registers in the meanwhile.  */
+    qemu_mutex_lock(&s->lock);
+    level = pl011_irq_level(s);
+    atomic_set(&s->irq_level, level);
+    qemu_mutex_unlock(&s->lock);
+    qemu_set_irq(s->irq, level);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
-static uint64_t pl011_read(void *opaque, hwaddr offset,
-                           unsigned size)
+static uint32_t pl011_do_read(PL011State *s, hwaddr offset)
 {
-    PL011State *s = (PL011State *)opaque;
     uint32_t c;
 
-    if (offset >= 0xfe0 && offset < 0x1000) {
-        return s->id[(offset - 0xfe0) >> 2];
-    }
     switch (offset >> 2) {
     case 0: /* UARTDR */
         s->flags &= ~PL011_FLAG_RXFF;
@@ -85,10 +119,6 @@ static uint64_t pl011_read(void *opaque, hwaddr offset,
         if (s->read_count == s->read_trigger - 1)
             s->int_level &= ~ PL011_INT_RX;
         s->rsr = c >> 8;
-        pl011_update(s);
-        if (s->chr) {
-            qemu_chr_accept_input(s->chr);
-        }
         return c;
     case 1: /* UARTRSR */
         return s->rsr;
@@ -121,6 +151,34 @@ static uint64_t pl011_read(void *opaque, hwaddr offset,
     }
 }
 
+static uint64_t pl011_read(void *opaque, hwaddr offset,
+                           unsigned size)
+{
+    PL011State *s = (PL011State *)opaque;
+    bool take_global = PL011_NEEDS_GLOBAL_LOCK(offset) &&
+                       !qemu_mutex_iothread_locked();
+    uint32_t val;
+
+    if (offset >= 0xfe0 && offset < 0x1000) {
+        return s->id[(offset - 0xfe0) >> 2];
+    }
+
+    if (take_global) {
+        qemu_mutex_lock_iothread();
+    }
+    qemu_mutex_lock(&s->lock);
+    val = pl011_do_read(s, offset);
+    qemu_mutex_unlock(&s->lock);
+    pl011_update(s);
+    if (PL011_NEEDS_GLOBAL_LOCK(offset) && s->chr) {
+        qemu_chr_accept_input(s->chr);
+    }
+    if (take_global) {
+        qemu_mutex_unlock_iothread();
+    }
+    return val;
+}
+
 static void pl011_set_read_trigger(PL011State *s)
 {
 #if 0
@@ -135,20 +193,12 @@ static void pl011_set_read_trigger(PL011State *s)
         s->read_trigger = 1;
 }
 
-static void pl011_write(void *opaque, hwaddr offset,
-                        uint64_t value, unsigned size)
+static void pl011_do_write(PL011State *s, hwaddr offset, uint64_t value)
 {
-    PL011State *s = (PL011State *)opaque;
-    unsigned char ch;
-
     switch (offset >> 2) {
     case 0: /* UARTDR */
-        /* ??? Check if transmitter is enabled.  */
-        ch = value;
-        if (s->chr)
-            qemu_chr_fe_write(s->chr, &ch, 1);
+        /* The character went out in pl011_write.  */
         s->int_level |= PL011_INT_TX;
-        pl011_update(s);
         break;
     case 1: /* UARTRSR/UARTECR */
         s->rsr = 0;
@@ -184,11 +234,9 @@ static void pl011_write(void *opaque, hwaddr offset,
         break;
     case 14: /* UARTIMSC */
         s->int_enabled = value;
-        pl011_update(s);
         break;
     case 17: /* UARTICR */
         s->int_level &= ~value;
-        pl011_update(s);
         break;
     case 18: /* UARTDMACR */
         s->dmacr = value;
@@ -202,21 +250,52 @@ static void pl011_write(void *opaque, hwaddr offset,
     }
 }
 
+static void pl011_write(void *opaque, hwaddr offset,
+                        uint64_t value, unsigned size)
+{
+    PL011State *s = (PL011State *)opaque;
+    bool take_global = PL011_NEEDS_GLOBAL_LOCK(offset) &&
+                       !qemu_mutex_iothread_locked();
+    unsigned char ch;
+
+    if (take_global) {
+        qemu_mutex_lock_iothread();
+    }
+    if (PL011_NEEDS_GLOBAL_LOCK(offset) && s->chr) {
+        /* ??? Check if transmitter is enabled.  */
+        ch = value;
+        qemu_chr_fe_write(s->chr, &ch, 1);
+    }
+    qemu_mutex_lock(&s->lock);
+    pl011_do_write(s, offset, value);
+    qemu_mutex_unlock(&s->lock);
+    pl011_update(s);
+    if (take_global) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static int pl011_can_receive(void *opaque)
 {
     PL011State *s = (PL011State *)opaque;
+    int ret;
 
+    qemu_mutex_lock(&s->lock);
     if (s->lcr & 0x10)
-        return s->read_count < 16;
+        ret = s->read_count < 16;
     else
-        return s->read_count < 1;
+        ret = s->read_count < 1;
+    qemu_mutex_unlock(&s->lock);
+    return ret;
 }
 
+/* Called from the character backend, with the global lock held */
 static void pl011_put_fifo(void *opaque, uint32_t value)
 {
     PL011State *s = (PL011State *)opaque;
     int slot;
 
+    qemu_mutex_lock(&s->lock);
     slot = s->read_pos + s->read_count;
     if (slot >= 16)
         slot -= 16;
@@ -228,8 +307,9 @@ static void pl011_put_fifo(void *opaque, uint32_t value)
     }
     if (s->read_count == s->read_trigger) {
         s->int_level |= PL011_INT_RX;
-        pl011_update(s);
     }
+    qemu_mutex_unlock(&s->lock);
+    pl011_update(s);
 }
 
 static void pl011_receive(void *opaque, const uint8_t *buf, int size)
@@ -249,10 +329,19 @@ static const MemoryRegionOps pl011_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+static int pl011_post_load(void *opaque, int version_id)
+{
+    PL011State *s = (PL011State *)opaque;
+
+    s->irq_level = pl011_irq_level(s);
+    return 0;
+}
+
 static const VMStateDescription vmstate_pl011 = {
     .name = "pl011",
     .version_id = 2,
     .minimum_version_id = 2,
+    .post_load = pl011_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(readbuff, PL011State),
         VMSTATE_UINT32(flags, PL011State),
@@ -284,7 +373,9 @@ static void pl011_init(Object *obj)
     SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
     PL011State *s = PL011(obj);
 
+    qemu_mutex_init(&s->lock);
     memory_region_init_io(&s->iomem, OBJECT(s), &pl011_ops, s, "pl011", 0x1000);
+    memory_region_clear_global_locking(&s->iomem);
     sysbus_init_mmio(sbd, &s->iomem);
     sysbus_init_irq(sbd, &s->irq);
 
@@ -23,6 +23,7 @@ struct ptimer_state
     int64_t next_event;
     QEMUBH *bh;
     QEMUTimer *timer;
+    QemuMutex *lock;
 };
 
 /* Use a bottom-half routine to avoid reentrancy issues.  */
@@ -73,6 +74,10 @@ static void ptimer_reload(ptimer_state *s)
 static void ptimer_tick(void *opaque)
 {
     ptimer_state *s = (ptimer_state *)opaque;
+
+    if (s->lock) {
+        qemu_mutex_lock(s->lock);
+    }
     ptimer_trigger(s);
     s->delta = 0;
     if (s->enabled == 2) {
@@ -80,6 +85,9 @@ static void ptimer_tick(void *opaque)
     } else {
         ptimer_reload(s);
     }
+    if (s->lock) {
+        qemu_mutex_unlock(s->lock);
+    }
 }
 
 uint64_t ptimer_get_count(ptimer_state *s)
@@ -251,3 +259,13 @@ ptimer_state *ptimer_init(QEMUBH *bh)
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, ptimer_tick, s);
     return s;
 }
+
+/* By default the timer is protected by the global lock.  A device that
+ * accesses it from outside the global lock must call every ptimer function
+ * with @lock held; the expiry callback then takes @lock too.  The bottom
+ * half still runs with the global lock held and without @lock.
+ */
+void ptimer_set_lock(ptimer_state *s, QemuMutex *lock)
+{
+    s->lock = lock;
+}
@@ -30,6 +30,9 @@ enum {
     NET_TX_PKT_PL_START_FRAG
 };
 
+/* A TCP header with the largest possible options.  */
+#define NET_TX_PKT_MAX_TCP_HDR_LEN (60)
+
 /* TX packet private context */
 struct NetTxPkt {
     PCIDevice *pci_dev;
@@ -55,6 +58,10 @@ struct NetTxPkt {
     eth_pkt_types_e packet_type;
     uint8_t l4proto;
 
+    /* Segment being built by software TCP segmentation */
+    struct iovec *seg_vec;
+    uint8_t l4_hdr[NET_TX_PKT_MAX_TCP_HDR_LEN];
+
     bool is_loopback;
 };
 
@@ -69,6 +76,8 @@ void net_tx_pkt_init(struct NetTxPkt **pkt, PCIDevice *pci_dev,
 
     p->raw = g_new(struct iovec, max_frags);
 
+    p->seg_vec = g_new(struct iovec, max_frags + NET_TX_PKT_PL_START_FRAG);
+
     p->max_payload_frags = max_frags;
     p->max_raw_frags = max_frags;
     p->has_virt_hdr = has_virt_hdr;
@@ -86,6 +95,7 @@ void net_tx_pkt_uninit(struct NetTxPkt *pkt)
     if (pkt) {
         g_free(pkt->vec);
         g_free(pkt->raw);
+        g_free(pkt->seg_vec);
         g_free(pkt);
     }
 }
@@ -594,15 +604,140 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     return true;
 }
 
-bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
+/*
+ * Split a TCP packet into segments of at most gso_size bytes of payload, as
+ * a TSO capable NIC would.  Each segment is sent with its own copy of the
+ * headers: the L2 and L3 headers of pkt are updated in place between
+ * segments, while the payload is referenced from the guest buffers through
+ * the preallocated seg_vec, so nothing is allocated or copied per segment.
+ */
+static bool net_tx_pkt_do_sw_segmentation(struct NetTxPkt *pkt,
+    NetClientState *nc)
 {
-    assert(pkt);
+    struct iovec *seg = pkt->seg_vec;
+    struct iovec *payload = &pkt->vec[NET_TX_PKT_PL_START_FRAG];
+    void *l3_hdr = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_base;
+    size_t l3_hdr_len = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_len;
+    struct tcp_hdr *tcp = (struct tcp_hdr *)pkt->l4_hdr;
+    bool is_ip4 = (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+                  VIRTIO_NET_HDR_GSO_TCPV4;
+    size_t mss = pkt->virt_hdr.gso_size;
+    size_t l4_hdr_len, data_len, data_off = 0;
+    size_t src_offset;
+    int src_idx = 0;
+    uint16_t ip_id = 0;
+    uint32_t seq;
+    uint8_t flags;
+    unsigned int segs = 0;
+
+    if (!mss ||
+        iov_to_buf(payload, pkt->payload_frags, 0, tcp,
+                   sizeof(struct tcp_hdr)) < sizeof(struct tcp_hdr)) {
+        return false;
+    }
+    l4_hdr_len = tcp->th_off * sizeof(uint32_t);
+    if (l4_hdr_len < sizeof(struct tcp_hdr) ||
+        l4_hdr_len > pkt->payload_len ||
+        iov_to_buf(payload, pkt->payload_frags, 0, tcp,
+                   l4_hdr_len) < l4_hdr_len) {
+        return false;
+    }
 
-    if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
-        net_tx_pkt_do_sw_csum(pkt);
+    seq = be32_to_cpu(tcp->th_seq);
+    flags = tcp->th_flags;
+    if (is_ip4) {
+        ip_id = be16_to_cpu(((struct ip_header *)l3_hdr)->ip_id);
+    }
+    data_len = pkt->payload_len - l4_hdr_len;
+
+    /* Skip the TCP header in the payload fragments.  */
+    src_offset = l4_hdr_len;
+    while (src_idx < pkt->payload_frags &&
+           src_offset >= payload[src_idx].iov_len) {
+        src_offset -= payload[src_idx].iov_len;
+        src_idx++;
+    }
+
+    seg[NET_TX_PKT_FRAGMENT_L2_HDR_POS] = pkt->vec[NET_TX_PKT_L2HDR_FRAG];
+    seg[NET_TX_PKT_FRAGMENT_L3_HDR_POS] = pkt->vec[NET_TX_PKT_L3HDR_FRAG];
+    seg[NET_TX_PKT_FRAGMENT_HEADER_NUM].iov_base = tcp;
+    seg[NET_TX_PKT_FRAGMENT_HEADER_NUM].iov_len = l4_hdr_len;
+
+    if (!pkt->is_loopback) {
+        qemu_net_batch_begin(nc);
+    }
+    do {
+        size_t seg_len = MIN(mss, data_len - data_off);
+        size_t fetched = 0;
+        int seg_cnt = NET_TX_PKT_FRAGMENT_HEADER_NUM + 1;
+        uint32_t csum_cntr, cso;
+
+        while (fetched < seg_len) {
+            size_t len = MIN(payload[src_idx].iov_len - src_offset,
+                             seg_len - fetched);
+
+            seg[seg_cnt].iov_base = payload[src_idx].iov_base + src_offset;
+            seg[seg_cnt].iov_len = len;
+            seg_cnt++;
+            fetched += len;
+            src_offset += len;
+            if (src_offset == payload[src_idx].iov_len) {
+                src_offset = 0;
+                src_idx++;
+            }
+        }
+
+        /* FIN and PSH belong to the last segment, CWR to the first.  */
+        tcp->th_seq = cpu_to_be32(seq + data_off);
+        tcp->th_flags = flags;
+        if (data_off + seg_len < data_len) {
+            tcp->th_flags &= ~(TH_FIN | TH_PUSH);
+        }
+        if (segs) {
+            tcp->th_flags &= ~TH_CWR;
+        }
+        tcp->th_sum = 0;
+
+        if (is_ip4) {
+            struct ip_header *ip = l3_hdr;
+
+            ip->ip_len = cpu_to_be16(l3_hdr_len + l4_hdr_len + seg_len);
+            ip->ip_id = cpu_to_be16(ip_id + segs);
+            eth_fix_ip4_checksum(l3_hdr, l3_hdr_len);
+            csum_cntr = eth_calc_ip4_pseudo_hdr_csum(ip, l4_hdr_len + seg_len,
+                                                     &cso);
+        } else {
+            struct ip6_header *ip6 = l3_hdr;
+
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_plen =
+                cpu_to_be16(l3_hdr_len - sizeof(*ip6) + l4_hdr_len + seg_len);
+            csum_cntr = eth_calc_ip6_pseudo_hdr_csum(ip6, l4_hdr_len + seg_len,
+                                                     IP_PROTO_TCP, &cso);
+        }
+        csum_cntr += net_checksum_add_iov(&seg[NET_TX_PKT_FRAGMENT_HEADER_NUM],
+                                          seg_cnt -
+                                          NET_TX_PKT_FRAGMENT_HEADER_NUM,
+                                          0, l4_hdr_len + seg_len, cso);
+        tcp->th_sum = cpu_to_be16(net_checksum_finish(csum_cntr));
+
+        net_tx_pkt_sendv(pkt, nc, seg, seg_cnt);
+
+        data_off += seg_len;
+        segs++;
+    } while (data_off < data_len);
+    if (!pkt->is_loopback) {
+        qemu_net_batch_end(nc);
     }
 
+    return true;
+}
+
+bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
+{
+    uint8_t gso_type;
+
+    assert(pkt);
+
     /*
      * Since underlying infrastructure does not support IP datagrams longer
      * than 64K we should drop such packets and don't even try to send
@@ -615,8 +750,25 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
         }
     }
 
-    if (pkt->has_virt_hdr ||
-        pkt->virt_hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+    /* The peer takes the virtio header and does the offloads itself.  */
+    if (pkt->has_virt_hdr) {
+        net_tx_pkt_sendv(pkt, nc, pkt->vec,
+            pkt->payload_frags + NET_TX_PKT_PL_START_FRAG);
+        return true;
+    }
+
+    /* Every segment gets its own checksum, skip the one of the whole.  */
+    gso_type = pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+        gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
+        return net_tx_pkt_do_sw_segmentation(pkt, nc);
+    }
+
+    if (pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        net_tx_pkt_do_sw_csum(pkt);
+    }
+
+    if (pkt->virt_hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
         net_tx_pkt_sendv(pkt, nc, pkt->vec,
             pkt->payload_frags + NET_TX_PKT_PL_START_FRAG);
         return true;
@@ -1096,6 +1096,8 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
+    VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
+    unsigned int lens[VIRTQUEUE_MAX_SIZE];
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
 
@@ -1120,8 +1122,8 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
         total = 0;
 
-        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        if (i == ARRAY_SIZE(elems) ||
+            !virtqueue_pop_batch(q->rx_vq, &q->elem_pool, (void **)&elem, 1)) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -1167,13 +1169,12 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_discard(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_element_free(elem);
             return size;
         }
 
-        /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        elems[i] = elem;
+        lens[i++] = total;
     }
 
     if (mhdr_cnt) {
@@ -1183,12 +1184,31 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    /* signal other side */
+    virtqueue_push_batch(q->rx_vq, elems, lens, i);
+    if (qemu_net_in_batch(nc)) {
+        q->rx_notify = true;
+    } else {
+        virtio_notify(vdev, q->rx_vq);
+    }
+    while (i) {
+        virtqueue_element_free(elems[--i]);
+    }
 
     return size;
 }
 
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (q->rx_notify) {
+        q->rx_notify = false;
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1200,7 +1220,7 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -1208,11 +1228,30 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+/* Return the @n transmitted elements at @elems to the guest at once */
+static void virtio_net_tx_done(VirtIONetQueue *q, VirtQueueElement **elems,
+                               unsigned int n)
+{
+    unsigned int lens[VIRTIO_NET_TX_BATCH] = { 0 };
+    unsigned int i;
+
+    if (!n) {
+        return;
+    }
+    virtqueue_push_batch(q->tx_vq, elems, lens, n);
+    virtio_notify(VIRTIO_DEVICE(q->n), q->tx_vq);
+    for (i = 0; i < n; i++) {
+        virtqueue_element_free(elems[i]);
+    }
+}
+
+static int32_t virtio_net_do_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int nelems = 0, ndone = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1230,10 +1269,18 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr_mrg_rxbuf mhdr;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+        if (ndone == nelems) {
+            virtio_net_tx_done(q, elems, ndone);
+            nelems = virtqueue_pop_batch(q->tx_vq, &q->elem_pool,
+                                         (void **)elems,
+                                         MIN(ARRAY_SIZE(elems),
+                                             n->tx_burst - num_packets));
+            ndone = 0;
+            if (!nelems) {
+                break;
+            }
         }
+        elem = elems[ndone];
 
         out_num = elem->out_num;
         out_sg = elem->out_sg;
@@ -1282,23 +1329,40 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
+            virtio_net_tx_done(q, elems, ndone);
+            /* Hand back the rest of the batch, most recent first */
+            while (nelems > ndone + 1) {
+                virtqueue_discard(q->tx_vq, elems[--nelems], 0);
+                virtqueue_element_free(elems[nelems]);
+            }
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             return -EBUSY;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
+        ndone++;
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_done(q, elems, ndone);
     return num_packets;
 }
 
+/* Send the packets as one burst, so that the peer can batch its writes */
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, queue_index);
+    int32_t ret;
+
+    qemu_net_batch_begin(nc);
+    ret = virtio_net_do_flush_tx(q);
+    qemu_net_batch_end(nc);
+    return ret;
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1427,6 +1491,8 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    virtqueue_element_pool_init(&n->vqs[index].elem_pool,
+                                sizeof(VirtQueueElement));
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -1445,6 +1511,7 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
         qemu_bh_delete(q->tx_bh);
     }
     virtio_del_queue(vdev, index * 2 + 1);
+    virtqueue_element_pool_destroy(&q->elem_pool);
 }
 
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
@@ -1662,6 +1729,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch_end = virtio_net_receive_batch_end,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
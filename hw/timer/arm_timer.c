@@ -15,6 +15,7 @@
 #include "hw/ptimer.h"
 #include "qemu/main-loop.h"
 #include "qemu/log.h"
+#include "qemu/thread.h"
 
 /* Common timer implementation.  */
 
@@ -27,31 +28,58 @@
 #define TIMER_CTRL_PERIODIC     (1 << 6)
 #define TIMER_CTRL_ENABLE       (1 << 7)
 
+/* The registers are accessed without the global lock, and are protected
+ * by @lock instead.  The interrupt line still needs the global lock; the
+ * lock order is global lock, then @lock.
+ */
 typedef struct {
     ptimer_state *timer;
+    QemuMutex lock;
     uint32_t control;
     uint32_t limit;
     int freq;
     int int_level;
+    /* Level last passed to irq, written with both locks held.  */
+    int irq_level;
     qemu_irq irq;
 } arm_timer_state;
 
-/* Check all active timers, and schedule the next timer interrupt.  */
+static int arm_timer_irq_level(arm_timer_state *s)
+{
+    return s->int_level && (s->control & TIMER_CTRL_IE);
+}
 
+/* Update interrupts.  Called without s->lock held; the global lock is
+ * only taken if the level changes.
+ */
 static void arm_timer_update(arm_timer_state *s)
 {
-    /* Update interrupts.  */
-    if (s->int_level && (s->control & TIMER_CTRL_IE)) {
-        qemu_irq_raise(s->irq);
-    } else {
-        qemu_irq_lower(s->irq);
+    bool locked = qemu_mutex_iothread_locked();
+    int level;
+
+    qemu_mutex_lock(&s->lock);
+    level = arm_timer_irq_level(s);
+    qemu_mutex_unlock(&s->lock);
+    if (level == atomic_read(&s->irq_level)) {
+        return;
+    }
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    /* Another thread may have changed the registers in the meanwhile.  */
+    qemu_mutex_lock(&s->lock);
+    level = arm_timer_irq_level(s);
+    atomic_set(&s->irq_level, level);
+    qemu_mutex_unlock(&s->lock);
+    qemu_set_irq(s->irq, level);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
     }
 }
 
-static uint32_t arm_timer_read(void *opaque, hwaddr offset)
+static uint32_t arm_timer_do_read(arm_timer_state *s, hwaddr offset)
 {
-    arm_timer_state *s = (arm_timer_state *)opaque;
-
     switch (offset >> 2) {
     case 0: /* TimerLoad */
     case 6: /* TimerBGLoad */
@@ -73,6 +101,17 @@ static uint32_t arm_timer_read(void *opaque, hwaddr offset)
     }
 }
 
+static uint32_t arm_timer_read(void *opaque, hwaddr offset)
+{
+    arm_timer_state *s = (arm_timer_state *)opaque;
+    uint32_t val;
+
+    qemu_mutex_lock(&s->lock);
+    val = arm_timer_do_read(s, offset);
+    qemu_mutex_unlock(&s->lock);
+    return val;
+}
+
 /* Reset the timer limit after settings have changed.  */
 static void arm_timer_recalibrate(arm_timer_state *s, int reload)
 {
@@ -97,6 +136,7 @@ static void arm_timer_write(void *opaque, hwaddr offset,
     arm_timer_state *s = (arm_timer_state *)opaque;
     int freq;
 
+    qemu_mutex_lock(&s->lock);
     switch (offset >> 2) {
     case 0: /* TimerLoad */
         s->limit = value;
@@ -138,20 +178,33 @@ static void arm_timer_write(void *opaque, hwaddr offset,
         qemu_log_mask(LOG_GUEST_ERROR,
                       "%s: Bad offset %x\n", __func__, (int)offset);
     }
+    qemu_mutex_unlock(&s->lock);
     arm_timer_update(s);
 }
 
 static void arm_timer_tick(void *opaque)
 {
     arm_timer_state *s = (arm_timer_state *)opaque;
+
+    qemu_mutex_lock(&s->lock);
     s->int_level = 1;
+    qemu_mutex_unlock(&s->lock);
     arm_timer_update(s);
 }
 
+static int arm_timer_post_load(void *opaque, int version_id)
+{
+    arm_timer_state *s = (arm_timer_state *)opaque;
+
+    s->irq_level = arm_timer_irq_level(s);
+    return 0;
+}
+
 static const VMStateDescription vmstate_arm_timer = {
     .name = "arm_timer",
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = arm_timer_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT32(control, arm_timer_state),
         VMSTATE_UINT32(limit, arm_timer_state),
@@ -169,9 +222,11 @@ static arm_timer_state *arm_timer_init(uint32_t freq)
     s = (arm_timer_state *)g_malloc0(sizeof(arm_timer_state));
     s->freq = freq;
     s->control = TIMER_CTRL_IE;
+    qemu_mutex_init(&s->lock);
 
     bh = qemu_bh_new(arm_timer_tick, s);
     s->timer = ptimer_init(bh);
+    ptimer_set_lock(s->timer, &s->lock);
     vmstate_register(NULL, -1, &vmstate_arm_timer, s);
     return s;
 }
@@ -286,6 +341,7 @@ static void sp804_init(Object *obj)
     sysbus_init_irq(sbd, &s->irq);
     memory_region_init_io(&s->iomem, obj, &sp804_ops, s,
                           "sp804", 0x1000);
+    memory_region_clear_global_locking(&s->iomem);
     sysbus_init_mmio(sbd, &s->iomem);
 }
 
@@ -366,6 +422,7 @@ static void icp_pit_init(Object *obj)
 
     memory_region_init_io(&s->iomem, obj, &icp_pit_ops, s,
                           "icp_pit", 0x1000);
+    memory_region_clear_global_locking(&s->iomem);
     sysbus_init_mmio(dev, &s->iomem);
     /* This device has no state to save/restore.  The component timers will
        save themselves.  */
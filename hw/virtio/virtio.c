@@ -17,12 +17,14 @@
 #include "cpu.h"
 #include "trace.h"
 #include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/xen/xen.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -59,6 +61,26 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+/*
+ * A packed virtqueue has a single ring of these, which the driver makes
+ * available and the device hands back as used in place.  The avail and
+ * used addresses of the VRing then point to the driver and device event
+ * suppression areas.
+ */
+typedef struct VRingPackedDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -69,9 +91,30 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/*
+ * Host pointers to the three ring areas of a queue, so that ring accesses
+ * skip the address space lookup.  A pointer is NULL when its area is not
+ * contiguous guest RAM; accesses then go through address_space_memory.
+ * Rebuilt whenever the rings move or the memory map changes, and freed
+ * through RCU, so readers must hold the RCU read lock.
+ */
+typedef struct VRingMemoryCache {
+    struct rcu_head rcu;
+    void *desc;
+    void *avail;
+    void *used;
+    MemoryRegion *desc_mr;
+    MemoryRegion *avail_mr;
+    MemoryRegion *used_mr;
+    /* Offsets of the rings the device writes, for dirty tracking */
+    hwaddr desc_xlat;
+    hwaddr used_xlat;
+} VRingMemoryCache;
+
 struct VirtQueue
 {
     VRing vring;
+    VRingMemoryCache *cache;
 
     /* Next head to pop */
     uint16_t last_avail_idx;
@@ -81,6 +124,16 @@ struct VirtQueue
 
     uint16_t used_idx;
 
+    /* Packed ring: wrap counters going with last_avail_idx and used_idx */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /* Packed ring: first element of the batch being filled, which
+     * virtqueue_flush() writes last, and the ring slots the batch takes */
+    uint16_t used_head_id;
+    uint32_t used_head_len;
+    unsigned int used_batch_ndescs;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -104,6 +157,101 @@ struct VirtQueue
     QLIST_ENTRY(VirtQueue) node;
 };
 
+/* Map @len bytes of guest memory at @pa, if they are contiguous RAM.
+ * Called from RCU critical section.
+ */
+static void *vring_cache_map(hwaddr pa, hwaddr len, bool is_write,
+                             MemoryRegion **mr, hwaddr *xlat)
+{
+    hwaddr l = len;
+
+    *mr = address_space_translate(&address_space_memory, pa, xlat, &l,
+                                  is_write);
+    if (l < len || !memory_access_is_direct(*mr, is_write)) {
+        *mr = NULL;
+        return NULL;
+    }
+    memory_region_ref(*mr);
+    return qemu_map_ram_ptr((*mr)->ram_block, *xlat);
+}
+
+static void vring_cache_free(VRingMemoryCache *cache)
+{
+    if (cache->desc_mr) {
+        memory_region_unref(cache->desc_mr);
+    }
+    if (cache->avail_mr) {
+        memory_region_unref(cache->avail_mr);
+    }
+    if (cache->used_mr) {
+        memory_region_unref(cache->used_mr);
+    }
+    g_free(cache);
+}
+
+/* Rebuild the host mappings of queue @n's rings; called with the BQL */
+static void virtio_queue_update_cache(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    VRingMemoryCache *old = vq->cache;
+    VRingMemoryCache *new = NULL;
+    unsigned int num = vq->vring.num;
+    bool packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+    hwaddr xlat;
+
+    /* The Xen map cache may drop mappings behind our back */
+    if (vq->vring.desc && vq->vring.avail && vq->vring.used && num &&
+        !xen_enabled()) {
+        new = g_new0(VRingMemoryCache, 1);
+        rcu_read_lock();
+        /* Used descriptors are written back into a packed ring */
+        new->desc = vring_cache_map(vq->vring.desc,
+                                    virtio_queue_get_desc_size(vdev, n),
+                                    packed, &new->desc_mr, &new->desc_xlat);
+        if (packed) {
+            new->avail = vring_cache_map(vq->vring.avail,
+                                         sizeof(VRingPackedDescEvent),
+                                         false, &new->avail_mr, &xlat);
+            new->used = vring_cache_map(vq->vring.used,
+                                        sizeof(VRingPackedDescEvent),
+                                        true, &new->used_mr,
+                                        &new->used_xlat);
+        } else {
+            /* Both rings end with the other side's event index */
+            new->avail = vring_cache_map(vq->vring.avail,
+                                         offsetof(VRingAvail, ring[num + 1]),
+                                         false, &new->avail_mr, &xlat);
+            new->used = vring_cache_map(vq->vring.used,
+                                        offsetof(VRingUsed, ring[num]) +
+                                        sizeof(uint16_t),
+                                        true, &new->used_mr,
+                                        &new->used_xlat);
+        }
+        rcu_read_unlock();
+        if (!new->desc && !new->avail && !new->used) {
+            g_free(new);
+            new = NULL;
+        }
+    }
+
+    atomic_rcu_set(&vq->cache, new);
+    if (old) {
+        call_rcu(old, vring_cache_free, rcu);
+    }
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int n;
+
+    for (n = 0; n < VIRTIO_QUEUE_MAX; n++) {
+        if (vdev->vq[n].vring.desc || vdev->vq[n].cache) {
+            virtio_queue_update_cache(vdev, n);
+        }
+    }
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
@@ -117,39 +265,211 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
     vring->used = vring_align(vring->avail +
                               offsetof(VRingAvail, ring[vring->num]),
                               vring->align);
+    virtio_queue_update_cache(vdev, n);
 }
 
+/* @desc_host is the host mapping of the table at @desc_pa, or NULL */
 static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
-                            hwaddr desc_pa, int i)
+                            void *desc_host, hwaddr desc_pa, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    if (desc_host) {
+        memcpy(desc, desc_host + i * sizeof(VRingDesc), sizeof(VRingDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingDesc));
+    }
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
     virtio_tswap16s(vdev, &desc->next);
 }
 
+/* Host mapping of the descriptor table; called from RCU critical section */
+static inline void *vring_desc_host(VirtQueue *vq)
+{
+    VRingMemoryCache *cache = atomic_rcu_read(&vq->cache);
+
+    return cache ? cache->desc : NULL;
+}
+
+static uint16_t vring_avail_lduw(VirtQueue *vq, hwaddr offset)
+{
+    VRingMemoryCache *cache;
+    uint16_t val;
+
+    rcu_read_lock();
+    cache = atomic_rcu_read(&vq->cache);
+    if (cache && cache->avail) {
+        val = virtio_lduw_p(vq->vdev, cache->avail + offset);
+    } else {
+        val = virtio_lduw_phys(vq->vdev, vq->vring.avail + offset);
+    }
+    rcu_read_unlock();
+    return val;
+}
+
+static uint16_t vring_used_lduw(VirtQueue *vq, hwaddr offset)
+{
+    VRingMemoryCache *cache;
+    uint16_t val;
+
+    rcu_read_lock();
+    cache = atomic_rcu_read(&vq->cache);
+    if (cache && cache->used) {
+        val = virtio_lduw_p(vq->vdev, cache->used + offset);
+    } else {
+        val = virtio_lduw_phys(vq->vdev, vq->vring.used + offset);
+    }
+    rcu_read_unlock();
+    return val;
+}
+
+static void vring_used_stw(VirtQueue *vq, hwaddr offset, uint16_t val)
+{
+    VRingMemoryCache *cache;
+
+    rcu_read_lock();
+    cache = atomic_rcu_read(&vq->cache);
+    if (cache && cache->used) {
+        virtio_stw_p(vq->vdev, cache->used + offset, val);
+        invalidate_and_set_dirty(cache->used_mr, cache->used_xlat + offset,
+                                 sizeof(val));
+    } else {
+        virtio_stw_phys(vq->vdev, vq->vring.used + offset, val);
+    }
+    rcu_read_unlock();
+}
+
+static void vring_desc_write(VirtQueue *vq, hwaddr offset, const void *buf,
+                             hwaddr len)
+{
+    VRingMemoryCache *cache;
+
+    rcu_read_lock();
+    cache = atomic_rcu_read(&vq->cache);
+    if (cache && cache->desc) {
+        memcpy(cache->desc + offset, buf, len);
+        invalidate_and_set_dirty(cache->desc_mr, cache->desc_xlat + offset,
+                                 len);
+    } else {
+        address_space_write(&address_space_memory, vq->vring.desc + offset,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+    rcu_read_unlock();
+}
+
+static inline bool virtio_queue_packed(VirtQueue *vq)
+{
+    return virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+}
+
+static uint16_t vring_packed_desc_flags(VirtQueue *vq, unsigned int i)
+{
+    VRingMemoryCache *cache;
+    hwaddr offset = i * sizeof(VRingPackedDesc) +
+                    offsetof(VRingPackedDesc, flags);
+    uint16_t val;
+
+    rcu_read_lock();
+    cache = atomic_rcu_read(&vq->cache);
+    if (cache && cache->desc) {
+        val = virtio_lduw_p(vq->vdev, cache->desc + offset);
+    } else {
+        val = virtio_lduw_phys(vq->vdev, vq->vring.desc + offset);
+    }
+    rcu_read_unlock();
+    return val;
+}
+
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   void *desc_host, hwaddr desc_pa, int i)
+{
+    if (desc_host) {
+        memcpy(desc, desc_host + i * sizeof(VRingPackedDesc),
+               sizeof(VRingPackedDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingPackedDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingPackedDesc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+static bool vring_packed_desc_is_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    return avail != used && avail == wrap_counter;
+}
+
+/* Hand buffer @id back to the driver in ring slot @i.  The flags make the
+ * slot visible to the driver, so they are written last.
+ */
+static void vring_packed_used_write(VirtQueue *vq, uint16_t id, uint32_t len,
+                                    unsigned int i, bool wrap_counter)
+{
+    VirtIODevice *vdev = vq->vdev;
+    hwaddr offset = i * sizeof(VRingPackedDesc);
+    uint16_t flags = 0;
+
+    if (wrap_counter) {
+        flags = (1 << VRING_PACKED_DESC_F_AVAIL) |
+                (1 << VRING_PACKED_DESC_F_USED);
+    }
+    virtio_tswap16s(vdev, &id);
+    virtio_tswap32s(vdev, &len);
+    virtio_tswap16s(vdev, &flags);
+    vring_desc_write(vq, offset + offsetof(VRingPackedDesc, id),
+                     &id, sizeof(id));
+    vring_desc_write(vq, offset + offsetof(VRingPackedDesc, len),
+                     &len, sizeof(len));
+    smp_wmb();
+    vring_desc_write(vq, offset + offsetof(VRingPackedDesc, flags),
+                     &flags, sizeof(flags));
+}
+
+/* Tell the driver whether and when to kick us, in the device event area */
+static void vring_packed_set_event(VirtQueue *vq, bool enable)
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        off_wrap = vq->last_avail_idx |
+                   vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+        vring_used_stw(vq, offsetof(VRingPackedDescEvent, off_wrap), off_wrap);
+        /* Make sure off_wrap is written before flags */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    vring_used_stw(vq, offsetof(VRingPackedDescEvent, flags), flags);
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_avail_lduw(vq, offsetof(VRingAvail, idx));
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -160,59 +480,64 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
+    VRingMemoryCache *cache;
+    hwaddr offset = offsetof(VRingUsed, ring[i]);
+
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    rcu_read_lock();
+    cache = atomic_rcu_read(&vq->cache);
+    if (cache && cache->used) {
+        memcpy(cache->used + offset, uelem, sizeof(VRingUsedElem));
+        invalidate_and_set_dirty(cache->used_mr, cache->used_xlat + offset,
+                                 sizeof(VRingUsedElem));
+    } else {
+        address_space_write(&address_space_memory, vq->vring.used + offset,
+                            MEMTXATTRS_UNSPECIFIED, (void *)uelem,
+                            sizeof(VRingUsedElem));
+    }
+    rcu_read_unlock();
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
     vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_queue_packed(vq)) {
+        vring_packed_set_event(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -234,6 +559,15 @@ int virtio_queue_ready(VirtQueue *vq)
  * guest has added some buffers. */
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_queue_packed(vq)) {
+        if (unlikely(!vq->vring.desc)) {
+            return 1;
+        }
+        return !vring_packed_desc_is_avail(
+            vring_packed_desc_flags(vq, vq->last_avail_idx),
+            vq->last_avail_wrap_counter);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -267,11 +601,65 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_queue_packed(vq)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+    } else {
+        vq->last_avail_idx--;
+    }
     vq->inuse--;
     virtqueue_unmap_sg(vq, elem, len);
 }
 
+/* Elements of a batch are filled in order, which lets each of them but the
+ * first go straight to its final ring slot.
+ */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    unsigned int i;
+    bool wrap_counter;
+
+    if (idx == 0) {
+        vq->used_head_id = elem->index;
+        vq->used_head_len = len;
+        vq->used_batch_ndescs = elem->ndescs;
+        return;
+    }
+
+    i = vq->used_idx + vq->used_batch_ndescs;
+    wrap_counter = vq->used_wrap_counter;
+    if (i >= vq->vring.num) {
+        i -= vq->vring.num;
+        wrap_counter = !wrap_counter;
+    }
+    vring_packed_used_write(vq, elem->index, len, i, wrap_counter);
+    vq->used_batch_ndescs += elem->ndescs;
+}
+
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    if (!count) {
+        return;
+    }
+
+    /* Make sure the rest of the batch is written before its first slot
+     * hands it to the driver. */
+    smp_wmb();
+    vring_packed_used_write(vq, vq->used_head_id, vq->used_head_len,
+                            vq->used_idx, vq->used_wrap_counter);
+    vq->used_idx += vq->used_batch_ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+    }
+    vq->used_batch_ndescs = 0;
+    vq->inuse -= count;
+}
+
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
 {
@@ -281,6 +669,11 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
     virtqueue_unmap_sg(vq, elem, len);
 
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+        return;
+    }
+
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -291,6 +684,13 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
+
+    if (virtio_queue_packed(vq)) {
+        trace_virtqueue_flush(vq, count);
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -346,7 +746,8 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
 }
 
 static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
-                                         hwaddr desc_pa, unsigned int max)
+                                         void *desc_host, hwaddr desc_pa,
+                                         unsigned int max)
 {
     unsigned int next;
 
@@ -365,10 +766,94 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vdev, desc, desc_host, desc_pa, next);
     return next;
 }
 
+/* Add @desc to the byte counts; returns true once both maxima are reached */
+static bool virtqueue_packed_count_desc(const VRingPackedDesc *desc,
+                                        unsigned int *in_total,
+                                        unsigned int *out_total,
+                                        unsigned max_in_bytes,
+                                        unsigned max_out_bytes)
+{
+    if (desc->flags & VRING_DESC_F_WRITE) {
+        *in_total += desc->len;
+    } else {
+        *out_total += desc->len;
+    }
+    return *in_total >= max_in_bytes && *out_total >= max_out_bytes;
+}
+
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int idx = vq->last_avail_idx;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+    unsigned int in_total = 0, out_total = 0, ndescs = 0;
+    VRingPackedDesc desc;
+    void *desc_host;
+
+    rcu_read_lock();
+    desc_host = vring_desc_host(vq);
+    while (vq->vring.desc &&
+           vring_packed_desc_is_avail(vring_packed_desc_flags(vq, idx),
+                                      wrap_counter)) {
+        /* Read the chain only after its head is known to be available */
+        smp_rmb();
+        do {
+            vring_packed_desc_read(vdev, &desc, desc_host, vq->vring.desc, idx);
+            if (++idx == vq->vring.num) {
+                idx = 0;
+                wrap_counter = !wrap_counter;
+            }
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++ndescs > vq->vring.num) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+
+            if (desc.flags & VRING_DESC_F_INDIRECT) {
+                hwaddr desc_pa = desc.addr;
+                unsigned int i, max;
+
+                if (desc.len % sizeof(VRingPackedDesc)) {
+                    error_report("Invalid size for indirect buffer table");
+                    exit(1);
+                }
+                max = desc.len / sizeof(VRingPackedDesc);
+                for (i = 0; i < max; i++) {
+                    vring_packed_desc_read(vdev, &desc, NULL, desc_pa, i);
+                    if (virtqueue_packed_count_desc(&desc, &in_total,
+                                                    &out_total, max_in_bytes,
+                                                    max_out_bytes)) {
+                        goto done;
+                    }
+                }
+                /* An indirect table is a buffer of its own */
+                break;
+            }
+
+            if (virtqueue_packed_count_desc(&desc, &in_total, &out_total,
+                                            max_in_bytes, max_out_bytes)) {
+                goto done;
+            }
+        } while (desc.flags & VRING_DESC_F_NEXT);
+    }
+done:
+    rcu_read_unlock();
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -376,21 +861,30 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
 
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+        return;
+    }
+
     idx = vq->last_avail_idx;
 
+    rcu_read_lock();
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
         VRingDesc desc;
+        void *desc_host;
         hwaddr desc_pa;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
+        desc_host = vring_desc_host(vq);
         desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vdev, &desc, desc_host, desc_pa, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -407,9 +901,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             /* loop over the indirect descriptor table */
             indirect = 1;
             max = desc.len / sizeof(VRingDesc);
+            desc_host = NULL;
             desc_pa = desc.addr;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vdev, &desc, desc_host, desc_pa, i);
         }
 
         do {
@@ -427,7 +922,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_host,
+                                               desc_pa, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -435,6 +931,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             total_bufs++;
     }
 done:
+    rcu_read_unlock();
     if (in_bytes) {
         *in_bytes = in_total;
     }
@@ -524,44 +1021,236 @@ void virtqueue_map(VirtQueueElement *elem)
                         VIRTQUEUE_MAX_SIZE, 0);
 }
 
-void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+/* Pooled elements have room for this many scatter-gather entries; bigger
+ * requests get an element of their own.
+ */
+#define VIRTQUEUE_POOL_MAX_SG 32
+
+/* The layout below only depends on the total number of entries, which lets
+ * a pooled element take any split between in and out buffers.
+ */
+static size_t virtqueue_element_size(size_t sz, unsigned num_sg)
 {
     VirtQueueElement *elem;
+    size_t addr_end = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0])) +
+                      num_sg * sizeof(elem->in_addr[0]);
+
+    return QEMU_ALIGN_UP(addr_end, __alignof__(elem->in_sg[0])) +
+           num_sg * sizeof(elem->in_sg[0]);
+}
+
+static void virtqueue_init_element(VirtQueueElement *elem, size_t sz,
+                                   unsigned out_num, unsigned in_num)
+{
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
     size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
     size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
     size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
     size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
-    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
-    assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
     elem->out_num = out_num;
     elem->in_num = in_num;
     elem->in_addr = (void *)elem + in_addr_ofs;
     elem->out_addr = (void *)elem + out_addr_ofs;
     elem->in_sg = (void *)elem + in_sg_ofs;
     elem->out_sg = (void *)elem + out_sg_ofs;
+    elem->pool = NULL;
+}
+
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+
+    assert(sz >= sizeof(VirtQueueElement));
+    elem = g_malloc(virtqueue_element_size(sz, out_num + in_num));
+    virtqueue_init_element(elem, sz, out_num, in_num);
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_pool_alloc_element(VirtQueueElementPool *pool,
+                                          size_t sz, unsigned out_num,
+                                          unsigned in_num)
 {
-    unsigned int i, head, max;
+    VirtQueueElement *elem;
+
+    if (!pool || out_num + in_num > VIRTQUEUE_POOL_MAX_SG) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+
+    if (pool->nfree) {
+        elem = pool->free[--pool->nfree];
+    } else {
+        elem = g_malloc(virtqueue_element_size(pool->sz,
+                                               VIRTQUEUE_POOL_MAX_SG));
+    }
+    virtqueue_init_element(elem, pool->sz, out_num, in_num);
+    elem->pool = pool;
+    return elem;
+}
+
+void virtqueue_element_pool_init(VirtQueueElementPool *pool, size_t sz)
+{
+    assert(sz >= sizeof(VirtQueueElement));
+    pool->sz = sz;
+    pool->nfree = 0;
+}
+
+void virtqueue_element_pool_destroy(VirtQueueElementPool *pool)
+{
+    while (pool->nfree) {
+        g_free(pool->free[--pool->nfree]);
+    }
+}
+
+void virtqueue_element_free(void *opaque)
+{
+    VirtQueueElement *elem = opaque;
+    VirtQueueElementPool *pool;
+
+    if (!elem) {
+        return;
+    }
+
+    pool = elem->pool;
+    if (pool && pool->nfree < VIRTQUEUE_POOL_SIZE) {
+        pool->free[pool->nfree++] = elem;
+    } else {
+        g_free(elem);
+    }
+}
+
+/* The caller checks that the ring is not empty */
+static void *virtqueue_packed_pop(VirtQueue *vq, VirtQueueElementPool *pool,
+                                  size_t sz)
+{
+    unsigned int i, max, ndescs = 0;
     hwaddr desc_pa = vq->vring.desc;
+    void *desc_host;
+    bool indirect = false;
     VirtIODevice *vdev = vq->vdev;
     VirtQueueElement *elem;
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
-    VRingDesc desc;
+    VRingPackedDesc desc;
+    uint16_t id;
 
-    if (virtio_queue_empty(vq)) {
-        return NULL;
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = 0;
+
+    if (vq->inuse >= vq->vring.num) {
+        error_report("Virtqueue size exceeded");
+        exit(1);
     }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
+
+    i = vq->last_avail_idx;
+    max = vq->vring.num;
+
+    rcu_read_lock();
+    desc_host = vring_desc_host(vq);
+    vring_packed_desc_read(vdev, &desc, desc_host, desc_pa, i);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table, which takes a single
+         * slot of the ring */
+        indirect = true;
+        ndescs = 1;
+        max = desc.len / sizeof(VRingPackedDesc);
+        desc_host = NULL;
+        desc_pa = desc.addr;
+        i = 0;
+        vring_packed_desc_read(vdev, &desc, desc_host, desc_pa, i);
+    }
+
+    /* Collect all the descriptors */
+    for (;;) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
+                               VIRTQUEUE_MAX_SIZE - out_num, true,
+                               desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
+                exit(1);
+            }
+            virtqueue_map_desc(&out_num, addr, iov,
+                               VIRTQUEUE_MAX_SIZE, false, desc.addr, desc.len);
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if ((in_num + out_num) > max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+
+        if (indirect) {
+            if (++i == max) {
+                break;
+            }
+        } else {
+            ndescs++;
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (ndescs >= vq->vring.num) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+            if (++i == vq->vring.num) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(vdev, &desc, desc_host, desc_pa, i);
+        if (!indirect) {
+            /* The buffer id is in the last descriptor of the chain */
+            id = desc.id;
+        }
+    }
+    rcu_read_unlock();
+
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_pool_alloc_element(pool, sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = ndescs;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem;
+}
+
+/* The caller checks that the ring is not empty */
+static void *virtqueue_split_pop(VirtQueue *vq, VirtQueueElementPool *pool,
+                                 size_t sz)
+{
+    unsigned int i, head, max;
+    hwaddr desc_pa = vq->vring.desc;
+    void *desc_host;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingDesc desc;
 
     /* When we start there are none of either input nor output. */
     out_num = in_num = 0;
@@ -574,11 +1263,10 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
 
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    rcu_read_lock();
+    desc_host = vring_desc_host(vq);
+    vring_desc_read(vdev, &desc, desc_host, desc_pa, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
@@ -587,9 +1275,10 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
 
         /* loop over the indirect descriptor table */
         max = desc.len / sizeof(VRingDesc);
+        desc_host = NULL;
         desc_pa = desc.addr;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vdev, &desc, desc_host, desc_pa, i);
     }
 
     /* Collect all the descriptors */
@@ -611,10 +1300,12 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_host,
+                                           desc_pa, max)) != max);
+    rcu_read_unlock();
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_pool_alloc_element(pool, sz, out_num, in_num);
     elem->index = head;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
@@ -631,6 +1322,92 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     return elem;
 }
 
+/* Tell the driver how far we have consumed the ring */
+static void virtqueue_update_avail_event(VirtQueue *vq)
+{
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return;
+    }
+    if (virtio_queue_packed(vq)) {
+        if (vq->notification) {
+            vring_packed_set_event(vq, true);
+        }
+    } else {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    void *elem;
+
+    if (virtio_queue_empty(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    if (virtio_queue_packed(vq)) {
+        elem = virtqueue_packed_pop(vq, NULL, sz);
+    } else {
+        elem = virtqueue_split_pop(vq, NULL, sz);
+    }
+    virtqueue_update_avail_event(vq);
+    return elem;
+}
+
+/*
+ * Pop up to @max elements from @vq into @elems, taking them from @pool.
+ * The avail index is read at most once and the avail event written once
+ * for the whole batch.  Returns the number of elements popped; free them
+ * with virtqueue_element_free().
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, VirtQueueElementPool *pool,
+                                 void **elems, unsigned int max)
+{
+    unsigned int i, n;
+
+    if (virtio_queue_packed(vq)) {
+        /* Availability is per descriptor in a packed ring */
+        for (n = 0; n < max && !virtio_queue_empty(vq); n++) {
+            smp_rmb();
+            elems[n] = virtqueue_packed_pop(vq, pool, pool->sz);
+        }
+    } else {
+        n = (uint16_t)(vq->shadow_avail_idx - vq->last_avail_idx);
+        if (n) {
+            /* See comment in virtqueue_num_heads(). */
+            smp_rmb();
+        } else {
+            n = virtqueue_num_heads(vq, vq->last_avail_idx);
+        }
+        n = MIN(n, max);
+        for (i = 0; i < n; i++) {
+            elems[i] = virtqueue_split_pop(vq, pool, pool->sz);
+        }
+    }
+
+    if (n) {
+        virtqueue_update_avail_event(vq);
+    }
+    trace_virtqueue_pop_batch(vq, n);
+    return n;
+}
+
+/* Return @count elements to the driver with a single used index update */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    trace_virtqueue_push_batch(vq, count);
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens[i], i);
+    }
+    virtqueue_flush(vq, count);
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -648,7 +1425,7 @@ typedef struct VirtQueueElementOld {
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElementOld;
 
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 {
     VirtQueueElement *elem;
     VirtQueueElementOld data;
@@ -679,11 +1456,17 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
         elem->out_sg[i].iov_len = data.out_sg[i].iov_len;
     }
 
+    /* Host features, as guest features are not loaded yet */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_get_be32s(f, &elem->ndescs);
+    }
+
     virtqueue_map(elem);
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -712,6 +1495,10 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32s(f, &elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -817,12 +1604,16 @@ void virtio_reset(void *opaque)
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
+        vdev->vq[i].used_batch_ndescs = 0;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
+        virtio_queue_update_cache(vdev, i);
     }
 }
 
@@ -1032,6 +1823,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_queue_update_cache(vdev, n);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1192,6 +1984,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    virtio_queue_update_cache(vdev, n);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1201,6 +1994,38 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+/* Has the used index moved past the driver's event offset from @old? */
+static bool vring_packed_need_event(VirtQueue *vq, uint16_t off_wrap,
+                                    uint16_t new, uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (vq->used_wrap_counter != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+    return vring_need_event(off, new, old);
+}
+
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    uint16_t old, new, off_wrap, flags;
+    bool v;
+
+    flags = vring_avail_lduw(vq, offsetof(VRingPackedDescEvent, flags));
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC) {
+        return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    }
+
+    /* Make sure off_wrap is read after flags */
+    smp_rmb();
+    off_wrap = vring_avail_lduw(vq, offsetof(VRingPackedDescEvent, off_wrap));
+    return !v || vring_packed_need_event(vq, off_wrap, new, old);
+}
+
 bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -1213,6 +2038,10 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_queue_packed(vq)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1271,6 +2100,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1317,6 +2153,31 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_INT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1422,6 +2283,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
         &vmstate_virtio_extra_state,
+        &vmstate_virtio_packed_virtqueues,
         NULL
     }
 };
@@ -1635,9 +2497,24 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         }
     }
 
+    /*
+     * The ring addresses and features are final only now: the virtqueues
+     * subsection replaces the avail and used addresses that
+     * virtio_queue_update_rings() derived from the legacy layout.
+     */
+    for (i = 0; i < num; i++) {
+        virtio_queue_update_cache(vdev, i);
+    }
+
     for (i = 0; i < num; i++) {
         if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
+
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+                /* Indexes come from the packed_virtqueues subsection */
+                continue;
+            }
+
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -1673,6 +2550,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vdev->vq[i].vring.desc = 0;
+        virtio_queue_update_cache(vdev, i);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1735,6 +2618,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -1777,12 +2662,18 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -1936,6 +2827,9 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    vdev->listener.commit = virtio_memory_listener_commit;
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1944,6 +2838,7 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
 
+    memory_listener_unregister(&vdev->listener);
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
@@ -177,6 +177,16 @@ struct BlockDriver {
     void (*bdrv_invalidate_cache)(BlockDriverState *bs, Error **errp);
     int (*bdrv_inactivate)(BlockDriverState *bs);
 
+    /*
+     * Returns whether a new persistent dirty bitmap with the given name and
+     * granularity could be stored in the image when it is closed or
+     * inactivated.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     /*
      * Flushes all data for all layers by calling bdrv_co_flush for underlying
      * layers, if needed. This function is needed for deterministic
@@ -206,6 +216,10 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /* Optional; used instead of bdrv_write_compressed() in coroutine
+     * context.  Must be safe to call from several coroutines at once. */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -294,6 +308,23 @@ struct BlockDriver {
     void (*bdrv_io_plug)(BlockDriverState *bs);
     void (*bdrv_io_unplug)(BlockDriverState *bs);
 
+    /*
+     * Multiqueue I/O, see bdrv_mq_begin().  Like bdrv_co_preadv,
+     * bdrv_co_pwritev, bdrv_io_plug and bdrv_io_unplug, but run in
+     * AioContext @ctx instead of the node's own, possibly in several
+     * threads at once; requests must complete in @ctx.  Only drivers that
+     * touch nothing but per-AioContext state, or that pass requests
+     * unchanged to bs->file, may implement these.
+     */
+    int coroutine_fn (*bdrv_co_preadv_mq)(BlockDriverState *bs,
+        AioContext *ctx, uint64_t offset, uint64_t bytes,
+        QEMUIOVector *qiov, int flags);
+    int coroutine_fn (*bdrv_co_pwritev_mq)(BlockDriverState *bs,
+        AioContext *ctx, uint64_t offset, uint64_t bytes,
+        QEMUIOVector *qiov, int flags);
+    void (*bdrv_io_plug_mq)(BlockDriverState *bs, AioContext *ctx);
+    void (*bdrv_io_unplug_mq)(BlockDriverState *bs, AioContext *ctx);
+
     /**
      * Try to get @bs's logical and physical block size.
      * On success, store them in @bsz and return zero.
@@ -528,6 +559,14 @@ struct BlockDriverState {
     unsigned io_plug_disabled;
 
     int quiesce_counter;
+
+    /* multiqueue requests in flight from other AioContexts, and an event
+     * that is set when their number drops to zero; coroutines wait in
+     * mq_waiters instead, and set mq_co_waiting to be woken up */
+    unsigned int mq_in_flight;
+    QemuEvent mq_idle;
+    CoQueue mq_waiters;
+    bool mq_co_waiting;
 };
 
 struct BlockBackendRootState {
@@ -578,6 +617,19 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
 
+bool bdrv_mq_begin(BlockDriverState *bs, int64_t offset, unsigned int bytes,
+                   BdrvRequestFlags flags, bool is_write);
+void bdrv_mq_end(BlockDriverState *bs);
+void bdrv_mq_wait(BlockDriverState *bs);
+int coroutine_fn bdrv_co_preadv_mq(BdrvChild *child, AioContext *ctx,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
+    BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_pwritev_mq(BdrvChild *child, AioContext *ctx,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
+    BdrvRequestFlags flags);
+void bdrv_io_plug_mq(BlockDriverState *bs, AioContext *ctx);
+void bdrv_io_unplug_mq(BlockDriverState *bs, AioContext *ctx);
+
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
                             const char *filename);
@@ -751,6 +803,9 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @bs: Block device to operate on.
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_workers: The maximum number of concurrent copy requests, or 0 for the
+ * default.
+ * @buf_size: The maximum number of bytes in flight, or 0 for the default.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
  * @on_source_error: The action to take upon error reading from the source.
@@ -764,6 +819,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  */
 void backup_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
+                  int64_t max_workers, int64_t buf_size,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
@@ -175,6 +175,13 @@ struct BlockJob {
     /** Speed that was set with @block_job_set_speed.  */
     int64_t speed;
 
+    /** Throughput in bytes per second, published by query-block-jobs */
+    int64_t throughput;
+
+    /** Start time and @offset of the current throughput sampling window */
+    int64_t throughput_start_ns;
+    int64_t throughput_start_offset;
+
     /** The completion function that will be called when the job completes.  */
     BlockCompletionFunc *cb;
 
@@ -250,6 +250,10 @@ struct AddressSpace {
 
     /* Accessed via RCU.  */
     struct FlatView *current_map;
+    /* Run the listeners on the next commit even if current_map does not
+     * change; set for new address spaces.
+     */
+    bool topology_dirty;
 
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
@@ -109,6 +109,16 @@ void qemu_ram_free(RAMBlock *block);
 
 int qemu_ram_resize(RAMBlock *block, ram_addr_t newsize, Error **errp);
 
+#ifndef _WIN32
+/* Replace the memory of @block with a private copy-on-write mapping of @fd
+ * starting at @file_offset, so that its pages are read from the file the
+ * first time they are touched.  Only memory that QEMU allocated itself as
+ * private anonymous memory can be replaced; other blocks get -ENOTSUP.
+ * Returns 0 or -errno.
+ */
+int qemu_ram_remap_file(RAMBlock *block, int fd, off_t file_offset);
+#endif
+
 #define DIRTY_CLIENTS_ALL     ((1 << DIRTY_MEMORY_NUM) - 1)
 #define DIRTY_CLIENTS_NOCODE  (DIRTY_CLIENTS_ALL & ~(1 << DIRTY_MEMORY_CODE))
 
@@ -383,6 +393,17 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+/* Make the TCG TLBs trap the next write to [start, start + length) again,
+ * after its dirty bits were cleared behind their back.  The range must be
+ * within one RAMBlock.
+ */
+void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length);
+
+/* Account for a write of @length bytes at @addr in RAM region @mr done
+ * through a host pointer: invalidate translated code and mark it dirty.
+ */
+void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr, hwaddr length);
+
 static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
                                                          ram_addr_t length)
 {
@@ -392,10 +413,17 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/* Move the migration dirty bits for [start, start + length) into @dest and
+ * return how many of them were not already set there.  The merge into @dest
+ * is atomic, so disjoint ranges may be synced concurrently even when they
+ * share a word of @dest.  If @newly_dirty is not NULL, the bits that were
+ * not already set are also ORed into it.
+ */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
                                                ram_addr_t start,
-                                               ram_addr_t length)
+                                               ram_addr_t length,
+                                               unsigned long *newly_dirty)
 {
     ram_addr_t addr;
     unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
@@ -419,10 +447,12 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
             if (src[idx][offset]) {
                 unsigned long bits = atomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
+                new_dirty = ~atomic_fetch_or(&dest[k], bits);
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
+                if (newly_dirty && new_dirty) {
+                    atomic_or(&newly_dirty[k], new_dirty);
+                }
             }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
@@ -439,8 +469,12 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
                         TARGET_PAGE_SIZE,
                         DIRTY_MEMORY_MIGRATION)) {
                 long k = (start + addr) >> TARGET_PAGE_BITS;
-                if (!test_and_set_bit(k, dest)) {
+                unsigned long mask = BIT_MASK(k);
+                if (!(atomic_fetch_or(&dest[BIT_WORD(k)], mask) & mask)) {
                     num_dirty++;
+                    if (newly_dirty) {
+                        atomic_or(&newly_dirty[BIT_WORD(k)], mask);
+                    }
                 }
             }
         }
@@ -10,6 +10,7 @@
 
 #include "qemu-common.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
 #include "migration/vmstate.h"
 
 /* ptimer.c */
@@ -17,6 +18,7 @@ typedef struct ptimer_state ptimer_state;
 typedef void (*ptimer_cb)(void *opaque);
 
 ptimer_state *ptimer_init(QEMUBH *bh);
+void ptimer_set_lock(ptimer_state *s, QemuMutex *lock);
 void ptimer_set_period(ptimer_state *s, int64_t period);
 void ptimer_set_freq(ptimer_state *s, uint32_t freq);
 uint64_t ptimer_get_limit(ptimer_state *s);
@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;    /* ids of further IOThreads for the queues */
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -47,7 +48,7 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
-    void *rq;
+    struct VirtIOBlockReq *rq;
     QEMUBH *bh;
     VirtIOBlkConf conf;
     unsigned short sector_mask;
@@ -56,6 +57,12 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    VirtQueueElementPool *req_pools;    /* one per queue */
+    /* Per queue, the AioContext its requests are submitted from, if not the
+     * BlockBackend's, and how many of them are in flight */
+    AioContext **queue_ctx;
+    unsigned int *queue_inflight;
+    QemuMutex rq_lock;                  /* protects rq */
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -74,6 +81,9 @@ typedef struct VirtIOBlockReq {
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
 
+/* Requests popped from a virtqueue at a time */
+#define VIRTIO_BLK_POP_BATCH 32
+
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
@@ -90,4 +100,6 @@ void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb);
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
 
+void virtio_blk_restart_requests(VirtIOBlock *s, AioContext *ctx);
+
 #endif
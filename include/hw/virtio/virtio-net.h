@@ -30,6 +30,9 @@
  * and latency. */
 #define TX_BURST 256
 
+/* TX elements popped, and returned to the guest, at a time */
+#define VIRTIO_NET_TX_BATCH 32
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
@@ -49,6 +52,9 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    VirtQueueElementPool elem_pool;
+    /* rx_vq needs a notification at the end of the peer's burst */
+    bool rx_notify;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -41,17 +41,37 @@ typedef struct VirtQueue VirtQueue;
 
 #define VIRTQUEUE_MAX_SIZE 1024
 
+typedef struct VirtQueueElementPool VirtQueueElementPool;
+
 typedef struct VirtQueueElement
 {
     unsigned int index;
+    /* Ring slots taken by the buffer, for packed virtqueues */
+    unsigned int ndescs;
     unsigned int out_num;
     unsigned int in_num;
     hwaddr *in_addr;
     hwaddr *out_addr;
     struct iovec *in_sg;
     struct iovec *out_sg;
+    /* Pool virtqueue_element_free() returns the element to, if any */
+    VirtQueueElementPool *pool;
 } VirtQueueElement;
 
+#define VIRTQUEUE_POOL_SIZE 64
+
+/*
+ * Recycles the elements popped by virtqueue_pop_batch(), each with room for
+ * a device request of @sz bytes.  A pool is not thread-safe: use it from
+ * the context that processes its virtqueues, and free all its elements
+ * before destroying it.
+ */
+struct VirtQueueElementPool {
+    size_t sz;
+    unsigned int nfree;
+    void *free[VIRTQUEUE_POOL_SIZE];
+};
+
 #define VIRTIO_QUEUE_MAX 1024
 
 #define VIRTIO_NO_VECTOR 0xffff
@@ -92,6 +112,8 @@ struct VirtIODevice
     uint8_t device_endian;
     bool use_guest_notifier_mask;
     QLIST_HEAD(, VirtQueue) *vector_queues;
+    /* Refreshes the rings' host mappings when the memory map changes */
+    MemoryListener listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -164,8 +186,16 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
 void virtqueue_map(VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz);
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem);
+unsigned int virtqueue_pop_batch(VirtQueue *vq, VirtQueueElementPool *pool,
+                                 void **elems, unsigned int max);
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int count);
+void virtqueue_element_pool_init(VirtQueueElementPool *pool, size_t sz);
+void virtqueue_element_pool_destroy(VirtQueueElementPool *pool);
+void virtqueue_element_free(void *elem);
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz);
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes);
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
@@ -257,7 +287,9 @@ typedef struct VirtIORNGConf VirtIORNGConf;
     DEFINE_PROP_BIT64("notify_on_empty", _state, _field,  \
                       VIRTIO_F_NOTIFY_ON_EMPTY, true), \
     DEFINE_PROP_BIT64("any_layout", _state, _field, \
-                      VIRTIO_F_ANY_LAYOUT, true)
+                      VIRTIO_F_ANY_LAYOUT, true), \
+    DEFINE_PROP_BIT64("packed", _state, _field, \
+                      VIRTIO_F_RING_PACKED, false)
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_avail_addr(VirtIODevice *vdev, int n);
@@ -48,6 +48,9 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* zero copy writes issued, and completed according to the kernel */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
@@ -0,0 +1,79 @@
+/*
+ * Page compression codecs for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+/* A codec instance holds the per-thread state of one compression method.
+ * Instances must not be shared between threads.
+ */
+typedef struct MigrationCodec MigrationCodec;
+
+/**
+ * migration_codec_available: Checks whether a compression method was
+ * built in
+ */
+bool migration_codec_available(MigrationCompressMethod method);
+
+/**
+ * migration_codec_new: Create a codec instance
+ *
+ * Returns the new instance, or NULL with @errp set if the method is not
+ * built in or its state could not be set up
+ *
+ * @method: compression method
+ * @level: compression level, 0 to 9; not all methods use it
+ */
+MigrationCodec *migration_codec_new(MigrationCompressMethod method, int level,
+                                    Error **errp);
+
+void migration_codec_free(MigrationCodec *codec);
+
+MigrationCompressMethod migration_codec_method(const MigrationCodec *codec);
+
+/**
+ * migration_codec_set_level: Change the level used for the next buffers
+ *
+ * This is cheap when @level is unchanged, so callers may pass the current
+ * compress-level for every page.
+ */
+void migration_codec_set_level(MigrationCodec *codec, int level);
+
+/**
+ * migration_codec_bound: Largest compressed size of @len bytes
+ */
+size_t migration_codec_bound(const MigrationCodec *codec, size_t len);
+
+/**
+ * migration_codec_max_bound: Largest compressed size of @len bytes with
+ * any built in method
+ */
+size_t migration_codec_max_bound(size_t len);
+
+/**
+ * migration_codec_compress: Compress a buffer
+ *
+ * Returns the compressed size, or -1 on error or if the result does not
+ * fit in @dlen bytes
+ */
+ssize_t migration_codec_compress(MigrationCodec *codec,
+                                 uint8_t *dst, size_t dlen,
+                                 const uint8_t *src, size_t slen);
+
+/**
+ * migration_codec_decompress: Decompress a buffer
+ *
+ * Returns the decompressed size, or -1 on error or if the result does not
+ * fit in @dlen bytes
+ */
+ssize_t migration_codec_decompress(MigrationCodec *codec,
+                                   uint8_t *dst, size_t dlen,
+                                   const uint8_t *src, size_t slen);
+
+#endif
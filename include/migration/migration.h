@@ -100,6 +100,9 @@ struct MigrationIncomingState {
     int       userfault_fd;
     /* To tell the fault_thread to quit */
     int       userfault_quit_fd;
+    /* Thread ids of the vCPUs, if the kernel reports who faulted */
+    uint32_t *vcpu_tids;
+    int       nr_vcpu_tids;
     QEMUFile *to_src_file;
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     void     *postcopy_tmp_page;
@@ -160,8 +163,14 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    /* Duration of the last dirty bitmap sync, in microseconds */
+    int64_t dirty_sync_time;
     /* Count of requests incoming from destination */
     int64_t postcopy_requests;
+    /* Time spent saving device state with the guest stopped, in us */
+    int64_t device_state_time;
+    /* The devices that took longest to save, slowest first */
+    MigrationDeviceStatsList *device_stats;
 
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
@@ -174,6 +183,10 @@ struct MigrationState
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
+    /* Pages worth sending ahead of the background scan, served once
+     * src_page_requests is empty; same lock.
+     */
+    struct src_page_requests src_page_prefetch;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
 
@@ -217,6 +230,10 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+/* Additional connections to the address of the current socket migration */
+QIOChannel *socket_send_channel_create(Error **errp);
+void socket_send_channel_reset(void);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
@@ -243,6 +260,8 @@ bool migration_in_postcopy(MigrationState *);
 /* ...and after the device transmission */
 bool migration_in_postcopy_after_devices(MigrationState *);
 MigrationState *migrate_get_current(void);
+/* True once the destination has accepted every connection it expects */
+bool migration_has_all_channels(void);
 
 void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
@@ -253,6 +272,19 @@ uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 void free_xbzrle_decoded_buf(void);
 
+/* Upper bound for the x-multifd-page-count parameter */
+#define MULTIFD_MAX_PAGE_COUNT 4096
+/* Upper bound for the postcopy-prefetch-pages parameter */
+#define POSTCOPY_MAX_PREFETCH_PAGES 4096
+/* Number of devices listed in MigrationInfo's device-stats */
+#define MIGRATION_DEVICE_STATS_MAX 10
+
+int multifd_load_setup(void);
+void multifd_load_cleanup(void);
+void multifd_recv_new_channel(QIOChannel *ioc);
+bool multifd_recv_all_channels_created(void);
+uint64_t multifd_mig_bytes_transferred(void);
+
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
 uint64_t dup_mig_bytes_transferred(void);
@@ -264,13 +296,20 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_pages_skipped(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
 
+bool dirty_rate_measuring(void);
+
+int64_t ram_file_save(int fd, const char *filename, off_t start, Error **errp);
+int ram_file_load(int fd, off_t start, Error **errp);
+
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
 /* For outgoing discard bitmap */
 int ram_postcopy_send_discard_bitmap(MigrationState *ms);
+void ram_postcopy_queue_hot_pages(MigrationState *ms);
 /* For incoming postcopy discard */
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
@@ -298,6 +337,8 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+bool test_xbzrle_encode_next_accel(void);
+const char *test_xbzrle_encode_accel_name(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -306,10 +347,17 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
+int migrate_postcopy_prefetch_pages(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 
+bool migrate_use_multifd(void);
+bool migrate_use_zero_copy_send(void);
+int migrate_multifd_channels(void);
+int migrate_multifd_page_count(void);
+
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
                              enum mig_rp_message_type message_type,
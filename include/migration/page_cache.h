@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -72,6 +72,29 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_update_delta: record whether the last delta against the cached
+ * copy of a page was worth sending.  Pages with good deltas are kept in
+ * preference to others; after a poor one the page is sent whole for a few
+ * rounds, see cache_skip_delta.
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page address
+ * @good: %true if the delta was small enough to be worth sending
+ */
+void cache_update_delta(PageCache *cache, uint64_t addr, bool good);
+
+/**
+ * cache_skip_delta: Checks whether a cached page should be sent whole
+ * instead of as a delta, because its recent deltas were poor
+ *
+ * Returns %true if the delta should be skipped this time
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page address
+ */
+bool cache_skip_delta(PageCache *cache, uint64_t addr);
+
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
  * pages will be freed
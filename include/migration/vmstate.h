@@ -86,6 +86,11 @@ struct VMStateInfo {
     const char *name;
     int (*get)(QEMUFile *f, void *pv, size_t size);
     void (*put)(QEMUFile *f, void *pv, size_t size);
+    /* Non-zero if get/put transfer a plain integer of this many bytes,
+     * big endian and unchecked, so that arrays of them can be copied in
+     * one go.
+     */
+    size_t bulk_size;
 };
 
 enum VMStateFlags {
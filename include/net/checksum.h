@@ -21,6 +21,17 @@
 #include "qemu/bswap.h"
 struct iovec;
 
+/**
+ * net_checksum_add_cont: partial Internet checksum of a buffer
+ *
+ * @len: number of bytes to sum
+ * @buf: data to sum, with no alignment requirement
+ * @seq: offset of @buf within the checksummed area; only its parity matters
+ *
+ * Returns a partial sum that may be added to other partial sums before
+ * being passed to net_checksum_finish().  The value is only meaningful
+ * modulo 0xffff.
+ */
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
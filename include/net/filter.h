@@ -37,6 +37,13 @@ typedef ssize_t (FilterReceiveIOV)(NetFilterState *nc,
 
 typedef void (FilterStatusChanged) (NetFilterState *nf, Error **errp);
 
+/*
+ * Called after the last packet of a burst (see qemu_net_batch_begin()) has
+ * gone through the filter, so that work deferred while the burst lasted
+ * can be done once.
+ */
+typedef void (FilterReceiveBatchEnd) (NetFilterState *nf);
+
 typedef struct NetFilterClass {
     ObjectClass parent_class;
 
@@ -44,6 +51,7 @@ typedef struct NetFilterClass {
     FilterSetup *setup;
     FilterCleanup *cleanup;
     FilterStatusChanged *status_changed;
+    FilterReceiveBatchEnd *receive_batch_end;
     /* mandatory */
     FilterReceiveIOV *receive_iov;
 } NetFilterClass;
@@ -69,6 +77,8 @@ ssize_t qemu_netfilter_receive(NetFilterState *nf,
                                int iovcnt,
                                NetPacketSent *sent_cb);
 
+void qemu_netfilter_batch_end(NetFilterState *nf);
+
 /* pass the packet to the next filter */
 ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
                                     unsigned flags,
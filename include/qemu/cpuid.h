@@ -0,0 +1,71 @@
+/*
+ * x86 cpuid helpers for runtime selection of vector code paths
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUID_H
+#define QEMU_CPUID_H
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+
+/* Older compilers' cpuid.h lack some of these */
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+
+/* XCR0 bits for the register state an instruction set needs the OS to
+ * save on context switch */
+#define XCR0_AVX_STATE      0x6     /* SSE and AVX */
+#define XCR0_AVX512_STATE   0xe6    /* SSE, AVX, opmask and ZMM */
+
+/* Return the XCR0 bits enabled by the OS, or 0 without OSXSAVE */
+static inline uint64_t cpuid_xgetbv_xcr0(void)
+{
+    unsigned a, b, c, d;
+    uint32_t lo, hi;
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return 0;
+    }
+
+    asm("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Return the structured extended feature flags (leaf 7, EBX) */
+static inline unsigned cpuid_leaf7_ebx(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return b;
+}
+
+static inline bool cpuid_has_avx2(void)
+{
+    return (cpuid_xgetbv_xcr0() & XCR0_AVX_STATE) == XCR0_AVX_STATE &&
+           (cpuid_leaf7_ebx() & bit_AVX2);
+}
+
+static inline bool cpuid_has_avx512f(void)
+{
+    return (cpuid_xgetbv_xcr0() & XCR0_AVX512_STATE) == XCR0_AVX512_STATE &&
+           (cpuid_leaf7_ebx() & bit_AVX512F);
+}
+#endif
+
+#endif
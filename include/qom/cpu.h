@@ -283,6 +283,10 @@ struct qemu_work_item {
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate: Dynamic tracing state of events for this vCPU (bitmask).
+ * @throttle_percentage: Share of time this vCPU is made to sleep, 0 if it
+ *                       is not throttled.  See cpu_throttle_set_vcpu.
+ * @dirty_pages: Guest pages this vCPU took from clean to dirty while dirty
+ *               logging is enabled.  Only maintained by TCG.
  *
  * State of one CPU core or thread.
  */
@@ -367,6 +371,8 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    int throttle_percentage;
+    unsigned long dirty_pages;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -669,10 +675,23 @@ bool cpu_exists(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time, 1 to 99, or 0 to leave @cpu
+ * running at full speed.
+ *
+ * Like cpu_throttle_set, but only for @cpu; other vcpus keep their current
+ * percentage.  This lets callers that know which vcpus are responsible for
+ * a load throttle just those.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set or
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -687,11 +706,20 @@ bool cpu_throttle_active(void);
  * cpu_throttle_get_percentage:
  *
  * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ * When vcpus are throttled individually, this is the highest percentage.
  *
  * Returns: The throttle percentage in range 1 to 99.
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vCPU to query.
+ *
+ * Returns: The throttle percentage of @cpu, 0 if it is not throttled.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
@@ -192,6 +192,20 @@ void blk_add_remove_bs_notifier(BlockBackend *blk, Notifier *notify);
 void blk_add_insert_bs_notifier(BlockBackend *blk, Notifier *notify);
 void blk_io_plug(BlockBackend *blk);
 void blk_io_unplug(BlockBackend *blk);
+bool blk_mq_supported(BlockBackend *blk);
+void blk_mq_aio_preadv(BlockBackend *blk, AioContext *ctx, int64_t offset,
+                       QEMUIOVector *qiov, BdrvRequestFlags flags,
+                       BlockCompletionFunc *cb, void *opaque);
+void blk_mq_aio_pwritev(BlockBackend *blk, AioContext *ctx, int64_t offset,
+                        QEMUIOVector *qiov, BdrvRequestFlags flags,
+                        BlockCompletionFunc *cb, void *opaque);
+void blk_mq_aio_flush(BlockBackend *blk, AioContext *ctx,
+                      BlockCompletionFunc *cb, void *opaque);
+void blk_mq_aio_ioctl(BlockBackend *blk, AioContext *ctx,
+                      unsigned long int req, void *buf,
+                      BlockCompletionFunc *cb, void *opaque);
+void blk_mq_io_plug(BlockBackend *blk, AioContext *ctx);
+void blk_mq_io_unplug(BlockBackend *blk, AioContext *ctx);
 BlockAcctStats *blk_get_stats(BlockBackend *blk);
 BlockBackendRootState *blk_get_root_state(BlockBackend *blk);
 void blk_update_root_state(BlockBackend *blk);
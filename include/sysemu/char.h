@@ -62,6 +62,8 @@ struct CharDriverState {
     QemuMutex chr_write_lock;
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     int (*chr_sync_read)(struct CharDriverState *s,
                          const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
@@ -280,6 +282,22 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
  */
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev_all:
+ *
+ * Like @qemu_chr_fe_write_all, but gathers the data from an I/O vector.
+ * Back ends that support it send the whole vector with as few system calls
+ * as possible and without copying it; the others get one write per
+ * element.  This function is thread-safe.
+ *
+ * @iov the data, which is left unchanged
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed
+ */
+int qemu_chr_fe_writev_all(CharDriverState *s, const struct iovec *iov,
+                           int iovcnt);
+
 /**
  * @qemu_chr_fe_read_all:
  *
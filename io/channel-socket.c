@@ -27,6 +27,11 @@
 
 #define SOCKET_MAX_FDS 16
 
+#if defined(CONFIG_LINUX) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define QEMU_MSG_ZEROCOPY
+#endif
+
 SocketAddress *
 qio_channel_socket_get_local_address(QIOChannelSocket *ioc,
                                      Error **errp)
@@ -159,6 +164,18 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
+#ifdef QEMU_MSG_ZEROCOPY
+    {
+        int v = 1;
+
+        /* Only TCP sockets support it, so failure is not an error */
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) == 0) {
+            QIO_CHANNEL(ioc)->features |=
+                (1 << QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        }
+    }
+#endif
+
     return 0;
 }
 
@@ -568,6 +585,98 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     }
     return ret;
 }
+#ifdef QEMU_MSG_ZEROCOPY
+static ssize_t qio_channel_socket_writev_zero_copy(QIOChannel *ioc,
+                                                   const struct iovec *iov,
+                                                   size_t niov,
+                                                   Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    struct msghdr msg = { NULL, };
+    ssize_t ret;
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = niov;
+
+ retry:
+    ret = sendmsg(sioc->fd, &msg, MSG_ZEROCOPY);
+    if (ret <= 0) {
+        switch (errno) {
+        case EAGAIN:
+            return QIO_CHANNEL_ERR_BLOCK;
+        case EINTR:
+            goto retry;
+        case ENOBUFS:
+            error_setg_errno(errp, errno,
+                             "Unable to pin memory for a zero copy write "
+                             "to socket, check the locked memory limit");
+            return -1;
+        default:
+            error_setg_errno(errp, errno,
+                             "Unable to write to socket");
+            return -1;
+        }
+    }
+    /* Each successful call gets its own completion notification */
+    sioc->zero_copy_queued++;
+    return ret;
+}
+
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct msghdr msg = { NULL, };
+    struct cmsghdr *cm;
+    int ret = 0;
+
+    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        memset(control, 0, sizeof(control));
+
+        if (recvmsg(sioc->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN) {
+                /* The error queue is signalled as G_IO_ERR */
+                qio_channel_wait(ioc, G_IO_ERR);
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to read socket error queue");
+            return -1;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm ||
+            !((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+            error_setg_errno(errp, EPROTO,
+                             "Unexpected message in socket error queue");
+            return -1;
+        }
+
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            error_setg_errno(errp, serr->ee_errno ? serr->ee_errno : EPROTO,
+                             "Error on socket");
+            return -1;
+        }
+
+        /* ee_info..ee_data is the range of completed sendmsg() calls */
+        sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+        if (serr->ee_code == SO_EE_CODE_ZEROCOPY_COPIED) {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+#endif /* QEMU_MSG_ZEROCOPY */
+
 #else /* WIN32 */
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
@@ -771,6 +880,10 @@ static void qio_channel_socket_class_init(ObjectClass *klass,
     ioc_klass->io_set_cork = qio_channel_socket_set_cork;
     ioc_klass->io_set_delay = qio_channel_socket_set_delay;
     ioc_klass->io_create_watch = qio_channel_socket_create_watch;
+#ifdef QEMU_MSG_ZEROCOPY
+    ioc_klass->io_writev_zero_copy = qio_channel_socket_writev_zero_copy;
+    ioc_klass->io_flush = qio_channel_socket_flush;
+#endif
 }
 
 static const TypeInfo qio_channel_socket_info = {
@@ -23,6 +23,7 @@
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -254,6 +255,28 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+/* Unlike flatrange_equal, this also compares the dirty logging state, so
+ * that equal views need no listener callback at all.
+ */
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a == b) {
+        return true;
+    }
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ref = 1;
@@ -876,13 +899,79 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* Call the begin or commit hook of the listeners filtered on @as, or of
+ * the unfiltered listeners if @as is NULL.
+ */
+static void memory_listener_call_filtered(AddressSpace *as, bool commit)
+{
+    MemoryListener *listener;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->address_space_filter != as) {
+            continue;
+        }
+        if (commit) {
+            if (listener->commit) {
+                listener->commit(listener);
+            }
+        } else if (listener->begin) {
+            listener->begin(listener);
+        }
+    }
+}
+
+/* Statistics for "info mtree".  */
+static uint64_t topology_commits;
+static uint64_t topology_commit_ns;
+static uint64_t topology_last_commit_ns;
+static uint64_t topology_views_rendered;
+static uint64_t topology_views_shared;
+static uint64_t topology_views_unchanged;
+
+/* Bring @as up to date.  @views maps the root of every address space
+ * updated so far in this transaction to its new FlatView, so that address
+ * spaces with the same root render it only once and share the result.  If
+ * the view did not change, the listeners filtered on @as are not called at
+ * all, which saves them from rebuilding their state (for example the
+ * dispatch tree and the TLBs) from scratch.
+ */
+static void address_space_update_topology(AddressSpace *as, GHashTable *views)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = g_hash_table_lookup(views, as->root);
+    bool changed;
+
+    if (new_view) {
+        flatview_ref(new_view);
+        topology_views_shared++;
+    } else {
+        new_view = generate_memory_topology(as->root);
+        topology_views_rendered++;
+        if (flatview_equal(old_view, new_view)) {
+            flatview_unref(new_view);
+            new_view = old_view;
+            flatview_ref(new_view);
+        }
+        g_hash_table_insert(views, as->root, new_view);
+    }
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
-    address_space_update_topology_pass(as, old_view, new_view, true);
+    changed = as->topology_dirty || !flatview_equal(old_view, new_view);
+    as->topology_dirty = false;
+    if (changed) {
+        memory_listener_call_filtered(as, false);
+        address_space_update_topology_pass(as, old_view, new_view, false);
+        address_space_update_topology_pass(as, old_view, new_view, true);
+        memory_listener_call_filtered(as, true);
+    } else {
+        topology_views_unchanged++;
+    }
+
+    if (new_view == old_view) {
+        flatview_unref(new_view);
+        flatview_unref(old_view);
+        address_space_update_ioeventfds(as);
+        return;
+    }
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
@@ -919,13 +1008,22 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
+            int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            GHashTable *views = g_hash_table_new(NULL, NULL);
+
+            memory_listener_call_filtered(NULL, false);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, views);
             }
 
-            MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            memory_listener_call_filtered(NULL, true);
+            g_hash_table_destroy(views);
+
+            topology_last_commit_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME)
+                                      - start;
+            topology_commit_ns += topology_last_commit_ns;
+            topology_commits++;
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -2320,10 +2418,12 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     flatview_init(as->current_map);
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    as->topology_dirty = true;
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
-    memory_region_update_pending |= root->enabled;
+    /* Even an empty address space needs its listeners to run once.  */
+    memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
 
@@ -2519,6 +2619,14 @@ void mtree_info(fprintf_function mon_printf, void *f)
     QTAILQ_FOREACH_SAFE(ml, &ml_head, queue, ml2) {
         g_free(ml);
     }
+
+    mon_printf(f, "topology rebuilds: %" PRIu64 ", total %" PRIu64
+               " us, last %" PRIu64 " us\n",
+               topology_commits, topology_commit_ns / SCALE_US,
+               topology_last_commit_ns / SCALE_US);
+    mon_printf(f, "flat views: %" PRIu64 " rendered, %" PRIu64 " shared, %"
+               PRIu64 " unchanged\n", topology_views_rendered,
+               topology_views_shared, topology_views_unchanged);
 }
 
 static const TypeInfo memory_region_info = {
@@ -0,0 +1,350 @@
+/*
+ * Page compression codecs for migration
+ *
+ * zlib is always available and produces the stream format used by older
+ * QEMU versions; LZ4 and Zstandard are optional and trade some ratio for
+ * much higher throughput.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "migration/compress.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+typedef struct MigrationCodecOps {
+    /* Set up codec->state; return -1 on failure */
+    int (*init)(MigrationCodec *codec);
+    void (*cleanup)(MigrationCodec *codec);
+    /* Optional; called after codec->level changed */
+    void (*level_changed)(MigrationCodec *codec);
+    size_t (*bound)(size_t len);
+    ssize_t (*compress)(MigrationCodec *codec, uint8_t *dst, size_t dlen,
+                        const uint8_t *src, size_t slen);
+    ssize_t (*decompress)(MigrationCodec *codec, uint8_t *dst, size_t dlen,
+                          const uint8_t *src, size_t slen);
+} MigrationCodecOps;
+
+struct MigrationCodec {
+    MigrationCompressMethod method;
+    const MigrationCodecOps *ops;
+    int level;
+    void *state;
+};
+
+/* zlib keeps one deflate and one inflate stream per instance and resets
+ * them for each buffer, instead of paying for their setup every time as
+ * compress2()/uncompress() do.  The output is the same. */
+
+typedef struct ZlibState {
+    bool deflate_ready;
+    bool inflate_ready;
+    z_stream deflate;
+    z_stream inflate;
+} ZlibState;
+
+static int zlib_init(MigrationCodec *codec)
+{
+    codec->state = g_new0(ZlibState, 1);
+    return 0;
+}
+
+static void zlib_cleanup(MigrationCodec *codec)
+{
+    ZlibState *z = codec->state;
+
+    if (z->deflate_ready) {
+        deflateEnd(&z->deflate);
+    }
+    if (z->inflate_ready) {
+        inflateEnd(&z->inflate);
+    }
+    g_free(z);
+}
+
+/* The level is fixed by deflateInit(), so start over with the next buffer */
+static void zlib_level_changed(MigrationCodec *codec)
+{
+    ZlibState *z = codec->state;
+
+    if (z->deflate_ready) {
+        deflateEnd(&z->deflate);
+        z->deflate_ready = false;
+    }
+}
+
+static size_t zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static ssize_t zlib_compress(MigrationCodec *codec, uint8_t *dst, size_t dlen,
+                             const uint8_t *src, size_t slen)
+{
+    ZlibState *z = codec->state;
+    z_stream *zs = &z->deflate;
+
+    if (!z->deflate_ready) {
+        if (deflateInit(zs, codec->level) != Z_OK) {
+            return -1;
+        }
+        z->deflate_ready = true;
+    } else if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = slen;
+    zs->next_out = dst;
+    zs->avail_out = dlen;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dlen - zs->avail_out;
+}
+
+static ssize_t zlib_decompress(MigrationCodec *codec,
+                               uint8_t *dst, size_t dlen,
+                               const uint8_t *src, size_t slen)
+{
+    ZlibState *z = codec->state;
+    z_stream *zs = &z->inflate;
+
+    if (!z->inflate_ready) {
+        if (inflateInit(zs) != Z_OK) {
+            return -1;
+        }
+        z->inflate_ready = true;
+    } else if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = slen;
+    zs->next_out = dst;
+    zs->avail_out = dlen;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dlen - zs->avail_out;
+}
+
+static const MigrationCodecOps zlib_ops = {
+    .init = zlib_init,
+    .cleanup = zlib_cleanup,
+    .level_changed = zlib_level_changed,
+    .bound = zlib_bound,
+    .compress = zlib_compress,
+    .decompress = zlib_decompress,
+};
+
+#ifdef CONFIG_LZ4
+/* LZ4 has no levels; its state lives in the instance rather than on the
+ * stack of every call. */
+
+static int lz4_init(MigrationCodec *codec)
+{
+    codec->state = g_malloc(LZ4_sizeofState());
+    return 0;
+}
+
+static void lz4_cleanup(MigrationCodec *codec)
+{
+    g_free(codec->state);
+}
+
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+static ssize_t lz4_compress(MigrationCodec *codec, uint8_t *dst, size_t dlen,
+                            const uint8_t *src, size_t slen)
+{
+    int ret = LZ4_compress_fast_extState(codec->state, (const char *)src,
+                                         (char *)dst, slen, dlen, 1);
+
+    return ret > 0 ? ret : -1;
+}
+
+static ssize_t lz4_decompress(MigrationCodec *codec, uint8_t *dst, size_t dlen,
+                              const uint8_t *src, size_t slen)
+{
+    int ret = LZ4_decompress_safe((const char *)src, (char *)dst, slen, dlen);
+
+    return ret >= 0 ? ret : -1;
+}
+
+static const MigrationCodecOps lz4_ops = {
+    .init = lz4_init,
+    .cleanup = lz4_cleanup,
+    .bound = lz4_bound,
+    .compress = lz4_compress,
+    .decompress = lz4_decompress,
+};
+#endif
+
+#ifdef CONFIG_ZSTD
+/* Level 0 picks the Zstandard default level. */
+
+typedef struct ZstdState {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+} ZstdState;
+
+static int zstd_init(MigrationCodec *codec)
+{
+    ZstdState *z = g_new0(ZstdState, 1);
+
+    codec->state = z;
+    z->cctx = ZSTD_createCCtx();
+    z->dctx = ZSTD_createDCtx();
+    return z->cctx && z->dctx ? 0 : -1;
+}
+
+static void zstd_cleanup(MigrationCodec *codec)
+{
+    ZstdState *z = codec->state;
+
+    ZSTD_freeCCtx(z->cctx);
+    ZSTD_freeDCtx(z->dctx);
+    g_free(z);
+}
+
+static size_t zstd_bound(size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+static ssize_t zstd_compress(MigrationCodec *codec, uint8_t *dst, size_t dlen,
+                             const uint8_t *src, size_t slen)
+{
+    ZstdState *z = codec->state;
+    size_t ret = ZSTD_compressCCtx(z->cctx, dst, dlen, src, slen,
+                                   codec->level);
+
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static ssize_t zstd_decompress(MigrationCodec *codec,
+                               uint8_t *dst, size_t dlen,
+                               const uint8_t *src, size_t slen)
+{
+    ZstdState *z = codec->state;
+    size_t ret = ZSTD_decompressDCtx(z->dctx, dst, dlen, src, slen);
+
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static const MigrationCodecOps zstd_ops = {
+    .init = zstd_init,
+    .cleanup = zstd_cleanup,
+    .bound = zstd_bound,
+    .compress = zstd_compress,
+    .decompress = zstd_decompress,
+};
+#endif
+
+static const MigrationCodecOps *
+migration_codecs[MIGRATION_COMPRESS_METHOD__MAX] = {
+    [MIGRATION_COMPRESS_METHOD_ZLIB] = &zlib_ops,
+#ifdef CONFIG_LZ4
+    [MIGRATION_COMPRESS_METHOD_LZ4] = &lz4_ops,
+#endif
+#ifdef CONFIG_ZSTD
+    [MIGRATION_COMPRESS_METHOD_ZSTD] = &zstd_ops,
+#endif
+};
+
+bool migration_codec_available(MigrationCompressMethod method)
+{
+    return method < MIGRATION_COMPRESS_METHOD__MAX && migration_codecs[method];
+}
+
+MigrationCodec *migration_codec_new(MigrationCompressMethod method, int level,
+                                    Error **errp)
+{
+    MigrationCodec *codec;
+
+    if (!migration_codec_available(method)) {
+        error_setg(errp, "Compression method '%s' is not supported by this "
+                   "QEMU build", MigrationCompressMethod_lookup[method]);
+        return NULL;
+    }
+
+    codec = g_new0(MigrationCodec, 1);
+    codec->method = method;
+    codec->ops = migration_codecs[method];
+    codec->level = level;
+    if (codec->ops->init(codec) < 0) {
+        error_setg(errp, "Failed to set up compression method '%s'",
+                   MigrationCompressMethod_lookup[method]);
+        migration_codec_free(codec);
+        return NULL;
+    }
+    return codec;
+}
+
+void migration_codec_free(MigrationCodec *codec)
+{
+    if (codec) {
+        codec->ops->cleanup(codec);
+        g_free(codec);
+    }
+}
+
+MigrationCompressMethod migration_codec_method(const MigrationCodec *codec)
+{
+    return codec->method;
+}
+
+void migration_codec_set_level(MigrationCodec *codec, int level)
+{
+    if (codec->level == level) {
+        return;
+    }
+    codec->level = level;
+    if (codec->ops->level_changed) {
+        codec->ops->level_changed(codec);
+    }
+}
+
+size_t migration_codec_bound(const MigrationCodec *codec, size_t len)
+{
+    return codec->ops->bound(len);
+}
+
+size_t migration_codec_max_bound(size_t len)
+{
+    size_t bound = 0;
+    int i;
+
+    for (i = 0; i < MIGRATION_COMPRESS_METHOD__MAX; i++) {
+        if (migration_codecs[i]) {
+            bound = MAX(bound, migration_codecs[i]->bound(len));
+        }
+    }
+    return bound;
+}
+
+ssize_t migration_codec_compress(MigrationCodec *codec,
+                                 uint8_t *dst, size_t dlen,
+                                 const uint8_t *src, size_t slen)
+{
+    return codec->ops->compress(codec, dst, dlen, src, slen);
+}
+
+ssize_t migration_codec_decompress(MigrationCodec *codec,
+                                   uint8_t *dst, size_t dlen,
+                                   const uint8_t *src, size_t slen)
+{
+    return codec->ops->decompress(codec, dst, dlen, src, slen);
+}
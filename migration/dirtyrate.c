@@ -0,0 +1,188 @@
+/*
+ * Guest memory dirty rate measurement
+ *
+ * Samples how fast the guest dirties its memory without migrating it, so
+ * that management can tell beforehand whether a migration will converge
+ * and how much throttling it may need.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi-visit.h"
+#include "qmp-commands.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+#define DIRTY_RATE_MIN_CALC_TIME 1
+#define DIRTY_RATE_MAX_CALC_TIME 60
+
+/* Owned by the big QEMU lock: written by the measurement thread, read by
+ * the monitor.  The status is also read without the lock by
+ * dirty_rate_measuring().
+ */
+static DirtyRateInfo *dirty_rate_info;
+static QemuThread dirty_rate_thread;
+
+/* Clear the migration dirty bits of every RAMBlock, prepending the rate
+ * over @calc_time of each block to @block_list if it is non-NULL.  Called
+ * with the iothread lock held.  Returns the number of dirty pages.
+ */
+static uint64_t dirty_rate_sync(DirtyRateRAMBlockList **block_list,
+                                int64_t calc_time)
+{
+    unsigned long *bitmap;
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    bitmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        uint64_t pages;
+
+        pages = cpu_physical_memory_sync_dirty_bitmap(bitmap, block->offset,
+                                                      block->used_length,
+                                                      NULL);
+        if (tcg_enabled()) {
+            tlb_reset_dirty_range_all(block->offset, block->used_length);
+        }
+        total += pages;
+
+        if (block_list) {
+            DirtyRateRAMBlockList *entry = g_new0(DirtyRateRAMBlockList, 1);
+
+            entry->value = g_new0(DirtyRateRAMBlock, 1);
+            entry->value->id = g_strdup(block->idstr);
+            entry->value->dirty_pages_rate = pages / calc_time;
+            entry->next = *block_list;
+            *block_list = entry;
+        }
+    }
+    rcu_read_unlock();
+
+    g_free(bitmap);
+    return total;
+}
+
+static void *dirty_rate_thread_fn(void *opaque)
+{
+    DirtyRateInfo *info = opaque;
+    DirtyRateRAMBlockList *block_list = NULL;
+    DirtyRateVcpuList *vcpu_list = NULL;
+    CPUState *cpu;
+    uint64_t pages;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    /* Everything is dirty to begin with; start from a clean slate. */
+    dirty_rate_sync(NULL, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->dirty_pages, 0);
+    }
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(info->calc_time * G_USEC_PER_SEC);
+
+    qemu_mutex_lock_iothread();
+    pages = dirty_rate_sync(&block_list, info->calc_time);
+    if (tcg_enabled()) {
+        CPU_FOREACH(cpu) {
+            DirtyRateVcpuList *entry = g_new0(DirtyRateVcpuList, 1);
+
+            entry->value = g_new0(DirtyRateVcpu, 1);
+            entry->value->id = cpu->cpu_index;
+            entry->value->dirty_pages_rate =
+                atomic_xchg(&cpu->dirty_pages, 0) / info->calc_time;
+            entry->next = vcpu_list;
+            vcpu_list = entry;
+        }
+    }
+    memory_global_dirty_log_stop();
+
+    info->has_dirty_pages_rate = true;
+    info->dirty_pages_rate = pages / info->calc_time;
+    info->has_ramblock_dirty_rate = true;
+    info->ramblock_dirty_rate = block_list;
+    info->has_vcpu_dirty_rate = vcpu_list != NULL;
+    info->vcpu_dirty_rate = vcpu_list;
+    trace_dirty_rate_calc_end(pages, info->calc_time);
+    atomic_set(&info->status, DIRTY_RATE_STATUS_MEASURED);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+bool dirty_rate_measuring(void)
+{
+    DirtyRateInfo *info = atomic_read(&dirty_rate_info);
+
+    return info && atomic_read(&info->status) == DIRTY_RATE_STATUS_MEASURING;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    DirtyRateInfo *info;
+
+    if (calc_time < DIRTY_RATE_MIN_CALC_TIME ||
+        calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be between %d and %d seconds",
+                   DIRTY_RATE_MIN_CALC_TIME, DIRTY_RATE_MAX_CALC_TIME);
+        return;
+    }
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "A dirty rate measurement is already running");
+        return;
+    }
+    /* Migration consumes the same dirty bits; wait for it to end. */
+    if (s->state != MIGRATION_STATUS_NONE &&
+        !migration_has_finished(s) && !migration_has_failed(s)) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    info = g_new0(DirtyRateInfo, 1);
+    info->status = DIRTY_RATE_STATUS_MEASURING;
+    info->start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    info->calc_time = calc_time;
+    info->page_size = TARGET_PAGE_SIZE;
+
+    qapi_free_DirtyRateInfo(dirty_rate_info);
+    atomic_set(&dirty_rate_info, info);
+
+    trace_dirty_rate_calc_start(calc_time);
+    qemu_thread_create(&dirty_rate_thread, "dirtyrate", dirty_rate_thread_fn,
+                       info, QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info;
+
+    if (dirty_rate_info) {
+        return QAPI_CLONE(DirtyRateInfo, dirty_rate_info);
+    }
+
+    info = g_new0(DirtyRateInfo, 1);
+    info->status = DIRTY_RATE_STATUS_UNSTARTED;
+    info->page_size = TARGET_PAGE_SIZE;
+    return info;
+}
@@ -18,11 +18,14 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "migration/compress.h"
 #include "migration/qemu-file.h"
 #include "sysemu/sysemu.h"
 #include "block/block.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/util.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
 #include "qemu/sockets.h"
 #include "qemu/rcu.h"
 #include "migration/block.h"
@@ -54,6 +57,11 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+/* Default number of multifd sockets and pages per multifd packet */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 128
+/* Pages sent after each page faulted on by a postcopy destination */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES 32
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -89,6 +97,10 @@ MigrationState *migrate_get_current(void)
             .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
             .cpu_throttle_initial = DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
             .cpu_throttle_increment = DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .x_multifd_page_count = DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT,
+            .compress_method = MIGRATION_COMPRESS_METHOD_ZLIB,
+            .postcopy_prefetch_pages = DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES,
         },
     };
 
@@ -409,16 +421,26 @@ static void process_incoming_migration_co(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report("load of migration failed: %s", strerror(-ret));
         migrate_decompress_threads_join();
+        multifd_load_cleanup();
         exit(EXIT_FAILURE);
     }
 
+    /* All RAM has been received once the last sync point was passed */
+    multifd_load_cleanup();
+
     mis->bh = qemu_bh_new(process_incoming_migration_bh, mis);
     qemu_bh_schedule(mis->bh);
 }
 
 void migration_fd_process_incoming(QEMUFile *f)
 {
-    Coroutine *co = qemu_coroutine_create(process_incoming_migration_co, f);
+    Coroutine *co;
+
+    if (multifd_load_setup() < 0) {
+        qemu_fclose(f);
+        return;
+    }
+    co = qemu_coroutine_create(process_incoming_migration_co, f);
 
     migrate_decompress_threads_create();
     qemu_file_set_blocking(f, false);
@@ -426,6 +448,15 @@ void migration_fd_process_incoming(QEMUFile *f)
 }
 
 
+bool migration_has_all_channels(void)
+{
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+    return migration_incoming_get_current() &&
+           multifd_recv_all_channels_created();
+}
+
 void migration_channel_process_incoming(MigrationState *s,
                                         QIOChannel *ioc)
 {
@@ -566,6 +597,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->tls_hostname = g_strdup(s->parameters.tls_hostname);
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->x_multifd_page_count = s->parameters.x_multifd_page_count;
+    params->compress_method = s->parameters.compress_method;
+    params->postcopy_prefetch_pages = s->parameters.postcopy_prefetch_pages;
 
     return params;
 }
@@ -599,6 +634,24 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->skipped = xbzrle_mig_pages_skipped();
+    }
+}
+
+static void populate_vcpu_throttle(MigrationInfo *info)
+{
+    MigrationVcpuThrottleList **tail = &info->vcpu_throttle_percentage;
+    CPUState *cpu;
+
+    info->has_vcpu_throttle_percentage = true;
+    CPU_FOREACH(cpu) {
+        MigrationVcpuThrottleList *entry = g_new0(MigrationVcpuThrottleList, 1);
+
+        entry->value = g_new0(MigrationVcpuThrottle, 1);
+        entry->value->id = cpu->cpu_index;
+        entry->value->percentage = cpu_throttle_get_vcpu_percentage(cpu);
+        *tail = entry;
+        tail = &entry->next;
     }
 }
 
@@ -614,6 +667,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->normal_bytes = norm_mig_bytes_transferred();
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = s->dirty_sync_count;
+    info->ram->dirty_sync_time = s->dirty_sync_time;
     info->ram->postcopy_requests = s->postcopy_requests;
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
@@ -659,6 +713,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         if (cpu_throttle_active()) {
             info->has_cpu_throttle_percentage = true;
             info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+            populate_vcpu_throttle(info);
         }
 
         get_xbzrle_cache_stats(info);
@@ -696,6 +751,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->downtime = s->downtime;
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
+        if (s->device_stats) {
+            info->has_device_state_time = true;
+            info->device_state_time = s->device_state_time;
+            info->has_device_stats = true;
+            info->device_stats = QAPI_CLONE(MigrationDeviceStatsList,
+                                            s->device_stats);
+        }
 
         populate_ram_info(info, s);
         break;
@@ -743,6 +805,15 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
             s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM] =
                 false;
         }
+        if (migrate_use_multifd()) {
+            /* Same as above, the multifd threads write pages straight
+             * into guest RAM.
+             */
+            error_report("Postcopy is not currently compatible with "
+                         "multifd");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM] =
+                false;
+        }
         /* This check is reasonably expensive, so only when it's being
          * set the first time, also it's only the destination that needs
          * special support.
@@ -773,6 +844,14 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 const char *tls_creds,
                                 bool has_tls_hostname,
                                 const char *tls_hostname,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_multifd_page_count,
+                                int64_t x_multifd_page_count,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                bool has_postcopy_prefetch_pages,
+                                int64_t postcopy_prefetch_pages,
                                 Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -808,6 +887,36 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_multifd_page_count &&
+            (x_multifd_page_count < 1 ||
+             x_multifd_page_count > MULTIFD_MAX_PAGE_COUNT)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_page_count",
+                   "is invalid, it should be in the range of 1 to "
+                   stringify(MULTIFD_MAX_PAGE_COUNT));
+        return;
+    }
+    if (has_compress_method && !migration_codec_available(compress_method)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_method",
+                   "a compression method supported by this build");
+        return;
+    }
+    if (has_postcopy_prefetch_pages &&
+            (postcopy_prefetch_pages < 0 ||
+             postcopy_prefetch_pages > POSTCOPY_MAX_PREFETCH_PAGES)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_pages",
+                   "is invalid, it should be in the range of 0 to "
+                   stringify(POSTCOPY_MAX_PREFETCH_PAGES));
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters.compress_level = compress_level;
@@ -832,6 +941,18 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         g_free(s->parameters.tls_hostname);
         s->parameters.tls_hostname = g_strdup(tls_hostname);
     }
+    if (has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = x_multifd_channels;
+    }
+    if (has_x_multifd_page_count) {
+        s->parameters.x_multifd_page_count = x_multifd_page_count;
+    }
+    if (has_compress_method) {
+        s->parameters.compress_method = compress_method;
+    }
+    if (has_postcopy_prefetch_pages) {
+        s->parameters.postcopy_prefetch_pages = postcopy_prefetch_pages;
+    }
 }
 
 
@@ -992,6 +1113,7 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->bytes_xfer = 0;
     s->xfer_limit = 0;
     s->cleanup_bh = 0;
+    socket_send_channel_reset();
     s->to_dst_file = NULL;
     s->state = MIGRATION_STATUS_NONE;
     s->params = *params;
@@ -1003,7 +1125,11 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->dirty_pages_rate = 0;
     s->dirty_bytes_rate = 0;
     s->setup_time = 0;
+    s->device_state_time = 0;
+    qapi_free_MigrationDeviceStatsList(s->device_stats);
+    s->device_stats = NULL;
     s->dirty_sync_count = 0;
+    s->dirty_sync_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->postcopy_requests = 0;
@@ -1015,6 +1141,7 @@ MigrationState *migrate_init(const MigrationParams *params)
     migrate_set_state(&s->state, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
     QSIMPLEQ_INIT(&s->src_page_requests);
+    QSIMPLEQ_INIT(&s->src_page_prefetch);
 
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     return s;
@@ -1090,6 +1217,10 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
     }
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "Cannot migrate while the dirty rate is measured");
+        return;
+    }
 
     if (migration_is_blocked(errp)) {
         return;
@@ -1234,6 +1365,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1270,6 +1410,51 @@ int migrate_use_xbzrle(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+int migrate_multifd_page_count(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_page_count;
+}
+
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_pages;
+}
+
 int64_t migrate_xbzrle_cache_size(void)
 {
     MigrationState *s;
@@ -1529,6 +1714,7 @@ static int postcopy_start(MigrationState *ms, bool *old_vm_running)
         error_report("postcopy send discard bitmap failed");
         goto fail;
     }
+    ram_postcopy_queue_hot_pages(ms);
 
     /*
      * send rest of state - note things that are doing postcopy
@@ -1696,6 +1882,12 @@ fail:
                       MIGRATION_STATUS_FAILED);
 }
 
+/* Bytes sent so far, including RAM sent over the multifd channels */
+static uint64_t migration_transferred_bytes(MigrationState *s)
+{
+    return qemu_ftell(s->to_dst_file) + multifd_mig_bytes_transferred();
+}
+
 /*
  * Master migration thread on the source VM.
  * It drives the migration and pumps the data down the outgoing channel.
@@ -1789,7 +1981,7 @@ static void *migration_thread(void *opaque)
         }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         if (current_time >= initial_time + BUFFER_DELAY) {
-            uint64_t transferred_bytes = qemu_ftell(s->to_dst_file) -
+            uint64_t transferred_bytes = migration_transferred_bytes(s) -
                                          initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = (double)transferred_bytes / time_spent;
@@ -1808,7 +2000,7 @@ static void *migration_thread(void *opaque)
 
             qemu_file_reset_rate_limit(s->to_dst_file);
             initial_time = current_time;
-            initial_bytes = qemu_ftell(s->to_dst_file);
+            initial_bytes = migration_transferred_bytes(s);
         }
         if (qemu_file_rate_limit(s->to_dst_file)) {
             /* usleep expects microseconds */
@@ -1824,7 +2016,7 @@ static void *migration_thread(void *opaque)
     qemu_mutex_lock_iothread();
     qemu_savevm_state_cleanup();
     if (s->state == MIGRATION_STATUS_COMPLETED) {
-        uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
+        uint64_t transferred_bytes = migration_transferred_bytes(s);
         s->total_time = end_time - s->total_time;
         if (!entered_postcopy) {
             s->downtime = end_time - start_time;
@@ -23,6 +23,7 @@
 #include "migration/postcopy-ram.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
+#include "qom/cpu.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 
@@ -60,13 +61,21 @@ struct PostcopyDiscardState {
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
-static bool ufd_version_check(int ufd)
+/* Not in older headers; reports the faulting thread in each message */
+#ifndef UFFD_FEATURE_THREAD_ID
+#define UFFD_FEATURE_THREAD_ID (1 << 8)
+#endif
+
+/* Most faults picked up in one wakeup of the fault thread */
+#define POSTCOPY_FAULT_BATCH 64
+
+static bool ufd_version_check(int ufd, uint64_t features)
 {
     struct uffdio_api api_struct;
     uint64_t ioctl_mask;
 
     api_struct.api = UFFD_API;
-    api_struct.features = 0;
+    api_struct.features = features;
     if (ioctl(ufd, UFFDIO_API, &api_struct)) {
         error_report("postcopy_ram_supported_by_host: UFFDIO_API failed: %s",
                      strerror(errno));
@@ -84,6 +93,43 @@ static bool ufd_version_check(int ufd)
     return true;
 }
 
+/*
+ * The optional features the kernel supports; it only reports them on an
+ * fd whose API has not been set yet, so use a throwaway one.
+ */
+static uint64_t ufd_available_features(void)
+{
+    struct uffdio_api api_struct;
+    uint64_t features = 0;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        return 0;
+    }
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (!ioctl(ufd, UFFDIO_API, &api_struct)) {
+        features = api_struct.features;
+    }
+    close(ufd);
+
+    return features;
+}
+
+/*
+ * Thread id of the task that faulted, with UFFD_FEATURE_THREAD_ID; older
+ * headers don't name the field that follows the fault address.
+ */
+static uint32_t ufd_msg_ptid(const struct uffd_msg *msg)
+{
+    uint32_t ptid;
+
+    memcpy(&ptid, (const char *)&msg->arg.pagefault + 2 * sizeof(__u64),
+           sizeof(ptid));
+    return ptid;
+}
+
 /*
  * Note: This has the side effect of munlock'ing all of RAM, that's
  * normally fine since if the postcopy succeeds it gets turned back on at the
@@ -112,7 +158,7 @@ bool postcopy_ram_supported_by_host(void)
     }
 
     /* Version and features check */
-    if (!ufd_version_check(ufd)) {
+    if (!ufd_version_check(ufd, 0)) {
         goto out;
     }
 
@@ -301,6 +347,9 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         close(mis->userfault_quit_fd);
         mis->have_fault_thread = false;
     }
+    g_free(mis->vcpu_tids);
+    mis->vcpu_tids = NULL;
+    mis->nr_vcpu_tids = 0;
 
     qemu_balloon_inhibit(false);
 
@@ -389,23 +438,90 @@ static int ram_block_enable_notify(const char *block_name, void *host_addr,
 }
 
 /*
- * Handle faults detected by the USERFAULT markings
+ * Whether a fault came from a vCPU; without thread ids every fault is
+ * assumed to.
+ */
+static bool postcopy_fault_from_vcpu(MigrationIncomingState *mis,
+                                     const struct uffd_msg *msg)
+{
+    uint32_t ptid;
+    int i;
+
+    if (!mis->vcpu_tids) {
+        return true;
+    }
+    ptid = ufd_msg_ptid(msg);
+    for (i = 0; i < mis->nr_vcpu_tids; i++) {
+        if (mis->vcpu_tids[i] == ptid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Ask the source for the host page containing the fault in @msg.
+ * Returns false if the fault is outside guest RAM.
+ */
+static bool postcopy_request_fault(MigrationIncomingState *mis,
+                                   const struct uffd_msg *msg,
+                                   RAMBlock **last_rb)
+{
+    size_t hostpagesize = getpagesize();
+    ram_addr_t rb_offset;
+    RAMBlock *rb;
+
+    rb = qemu_ram_block_from_host(
+             (void *)(uintptr_t)msg->arg.pagefault.address,
+             true, &rb_offset);
+    if (!rb) {
+        error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                     PRIx64, (uint64_t)msg->arg.pagefault.address);
+        return false;
+    }
+
+    rb_offset &= ~(hostpagesize - 1);
+    trace_postcopy_ram_fault_thread_request(msg->arg.pagefault.address,
+                                            qemu_ram_get_idstr(rb),
+                                            rb_offset);
+
+    /*
+     * Send the request to the source - we want to request one
+     * of our host page sizes (which is >= TPS)
+     */
+    if (rb != *last_rb) {
+        *last_rb = rb;
+        migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
+                                 rb_offset, hostpagesize);
+    } else {
+        /* Save some space */
+        migrate_send_rp_req_pages(mis, NULL,
+                                 rb_offset, hostpagesize);
+    }
+    return true;
+}
+
+/*
+ * Handle faults detected by the USERFAULT markings.  All the faults
+ * pending at a wakeup are read at once and those of vCPUs are requested
+ * first: a stalled vCPU stalls the guest, while a device model or the
+ * migration thread touching guest RAM can wait a little longer.
  */
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
-    struct uffd_msg msg;
+    struct uffd_msg msg[POSTCOPY_FAULT_BATCH];
+    bool from_vcpu[POSTCOPY_FAULT_BATCH];
     int ret;
-    size_t hostpagesize = getpagesize();
-    RAMBlock *rb = NULL;
     RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
 
     trace_postcopy_ram_fault_thread_entry();
     qemu_sem_post(&mis->fault_thread_sem);
 
     while (true) {
-        ram_addr_t rb_offset;
         struct pollfd pfd[2];
+        int i, nmsg, nvcpu;
+        bool fatal = false;
 
         /*
          * We're mainly waiting for the kernel to give us a faulting HVA,
@@ -429,9 +545,10 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        ret = read(mis->userfault_fd, &msg, sizeof(msg));
-        if (ret != sizeof(msg)) {
-            if (errno == EAGAIN) {
+        /* The fd is non-blocking: this returns whatever is pending */
+        ret = read(mis->userfault_fd, msg, sizeof(msg));
+        if (ret <= 0 || ret % sizeof(msg[0])) {
+            if (ret < 0 && errno == EAGAIN) {
                 /*
                  * if a wake up happens on the other thread just after
                  * the poll, there is nothing to read.
@@ -443,43 +560,40 @@ static void *postcopy_ram_fault_thread(void *opaque)
                              __func__, strerror(errno));
                 break;
             } else {
-                error_report("%s: Read %d bytes from userfaultfd expected %zd",
-                             __func__, ret, sizeof(msg));
+                error_report("%s: Read %d bytes from userfaultfd expected "
+                             "a multiple of %zd", __func__, ret,
+                             sizeof(msg[0]));
                 break; /* Lost alignment, don't know what we'd read next */
             }
         }
-        if (msg.event != UFFD_EVENT_PAGEFAULT) {
-            error_report("%s: Read unexpected event %ud from userfaultfd",
-                         __func__, msg.event);
-            continue; /* It's not a page fault, shouldn't happen */
+        nmsg = ret / sizeof(msg[0]);
+
+        nvcpu = 0;
+        for (i = 0; i < nmsg; i++) {
+            if (msg[i].event != UFFD_EVENT_PAGEFAULT) {
+                error_report("%s: Read unexpected event %ud from userfaultfd",
+                             __func__, msg[i].event);
+                /* It's not a page fault, shouldn't happen */
+                from_vcpu[i] = false;
+                continue;
+            }
+            from_vcpu[i] = postcopy_fault_from_vcpu(mis, &msg[i]);
+            nvcpu += from_vcpu[i];
         }
+        trace_postcopy_ram_fault_thread_batch(nmsg, nvcpu);
 
-        rb = qemu_ram_block_from_host(
-                 (void *)(uintptr_t)msg.arg.pagefault.address,
-                 true, &rb_offset);
-        if (!rb) {
-            error_report("postcopy_ram_fault_thread: Fault outside guest: %"
-                         PRIx64, (uint64_t)msg.arg.pagefault.address);
-            break;
+        for (i = 0; i < nmsg && !fatal; i++) {
+            if (from_vcpu[i]) {
+                fatal = !postcopy_request_fault(mis, &msg[i], &last_rb);
+            }
         }
-
-        rb_offset &= ~(hostpagesize - 1);
-        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset);
-
-        /*
-         * Send the request to the source - we want to request one
-         * of our host page sizes (which is >= TPS)
-         */
-        if (rb != last_rb) {
-            last_rb = rb;
-            migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, hostpagesize);
-        } else {
-            /* Save some space */
-            migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, hostpagesize);
+        for (i = 0; i < nmsg && !fatal; i++) {
+            if (!from_vcpu[i] && msg[i].event == UFFD_EVENT_PAGEFAULT) {
+                fatal = !postcopy_request_fault(mis, &msg[i], &last_rb);
+            }
+        }
+        if (fatal) {
+            break;
         }
     }
     trace_postcopy_ram_fault_thread_exit();
@@ -488,6 +602,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
 
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
+    uint64_t features = ufd_available_features() & UFFD_FEATURE_THREAD_ID;
+    CPUState *cpu;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -500,10 +617,22 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
      * Although the host check already tested the API, we need to
      * do the check again as an ABI handshake on the new fd.
      */
-    if (!ufd_version_check(mis->userfault_fd)) {
+    if (!ufd_version_check(mis->userfault_fd, features)) {
         return -1;
     }
 
+    /* Let the fault thread tell the vCPUs' faults from the others */
+    if (features & UFFD_FEATURE_THREAD_ID) {
+        CPU_FOREACH(cpu) {
+            mis->nr_vcpu_tids++;
+        }
+        mis->vcpu_tids = g_new(uint32_t, mis->nr_vcpu_tids);
+        mis->nr_vcpu_tids = 0;
+        CPU_FOREACH(cpu) {
+            mis->vcpu_tids[mis->nr_vcpu_tids++] = cpu->thread_id;
+        }
+    }
+
     /* Now an eventfd we use to tell the fault-thread to quit */
     mis->userfault_quit_fd = eventfd(0, EFD_CLOEXEC);
     if (mis->userfault_quit_fd == -1) {
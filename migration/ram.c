@@ -28,7 +28,6 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "cpu.h"
-#include <zlib.h>
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
@@ -39,10 +38,16 @@
 #include "migration/postcopy-ram.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
+#include "migration/compress.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
+#include "exec/exec-all.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/coroutine.h"
+#include "io/channel.h"
+#include "sysemu/sysemu.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -56,10 +61,14 @@ static int dirty_rate_high_cnt;
 
 static uint64_t bitmap_sync_count;
 
+/* set by migration_bitmap_sync once pages of a new round may be sent */
+static bool multifd_sync_needed;
+
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* 0x01 was RAM_SAVE_FLAG_FULL, obsolete since long before it was reused */
+#define RAM_SAVE_FLAG_COMPRESS_METHOD 0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -68,12 +77,13 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
-    return buffer_find_nonzero_offset(p, size) == size;
+    return buffer_is_zero(p, size);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -154,6 +164,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t xbzrle_skipped;
+    uint64_t multifd_bytes;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -218,6 +230,11 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t xbzrle_mig_pages_skipped(void)
+{
+    return acct_info.xbzrle_skipped;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -229,6 +246,23 @@ static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
+/* Postcopy page ordering: a decaying count of the pages newly found dirty
+ * in each RAM_HOT_CHUNK_SIZE chunk of ram_addr space at every bitmap sync.
+ * ram_hot_delta collects the bits each sync adds to the migration bitmap;
+ * pages that were dirty already and are still waiting to be sent say
+ * nothing about what the guest is writing now.
+ * At switchover the busiest chunks are queued ahead of the background
+ * scan, since the guest is likely to touch them first.  Only allocated
+ * when postcopy is enabled.
+ */
+#define RAM_HOT_CHUNK_BITS 21
+#define RAM_HOT_CHUNK_SIZE (1ULL << RAM_HOT_CHUNK_BITS)
+#define RAM_HOT_MAX_CHUNKS 1024
+static uint32_t *ram_hot_score;
+static unsigned long *ram_hot_delta;
+static unsigned long ram_hot_chunks;
+static unsigned long ram_hot_words;
+
 /* used by the search for pages to send */
 struct PageSearchStatus {
     /* Current block being searched */
@@ -256,6 +290,7 @@ struct CompressParam {
     bool done;
     bool quit;
     QEMUFile *file;
+    MigrationCodec *codec;
     QemuMutex mutex;
     QemuCond cond;
     RAMBlock *block;
@@ -266,6 +301,7 @@ typedef struct CompressParam CompressParam;
 struct DecompressParam {
     bool done;
     bool quit;
+    MigrationCodec *codec;
     QemuMutex mutex;
     QemuCond cond;
     void *des;
@@ -276,6 +312,8 @@ typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
+/* used by the migration thread for the first page of each block */
+static MigrationCodec *comp_codec;
 /* comp_done_cond is used to wake up the migration thread when
  * one of the compression threads has finished the compression.
  * comp_done_lock is used to co-work with comp_done_cond.
@@ -291,8 +329,8 @@ static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static int do_compress_ram_page(QEMUFile *f, MigrationCodec *codec,
+                                RAMBlock *block, ram_addr_t offset);
 
 static void *do_data_compress(void *opaque)
 {
@@ -308,7 +346,7 @@ static void *do_data_compress(void *opaque)
             param->block = NULL;
             qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+            do_compress_ram_page(param->file, param->codec, block, offset);
 
             qemu_mutex_lock(&comp_done_lock);
             param->done = true;
@@ -350,6 +388,7 @@ void migrate_compress_threads_join(void)
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
         qemu_fclose(comp_param[i].file);
+        migration_codec_free(comp_param[i].codec);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
@@ -357,8 +396,10 @@ void migrate_compress_threads_join(void)
     qemu_cond_destroy(&comp_done_cond);
     g_free(compress_threads);
     g_free(comp_param);
+    migration_codec_free(comp_codec);
     compress_threads = NULL;
     comp_param = NULL;
+    comp_codec = NULL;
 }
 
 void migrate_compress_threads_create(void)
@@ -372,6 +413,9 @@ void migrate_compress_threads_create(void)
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
+    /* the method was checked when it was set */
+    comp_codec = migration_codec_new(migrate_compress_method(),
+                                     migrate_compress_level(), &error_abort);
     qemu_cond_init(&comp_done_cond);
     qemu_mutex_init(&comp_done_lock);
     for (i = 0; i < thread_count; i++) {
@@ -379,6 +423,9 @@ void migrate_compress_threads_create(void)
          * set its ops to empty.
          */
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].codec = migration_codec_new(migrate_compress_method(),
+                                                  migrate_compress_level(),
+                                                  &error_abort);
         comp_param[i].done = true;
         comp_param[i].quit = false;
         qemu_mutex_init(&comp_param[i].mutex);
@@ -423,18 +470,25 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
  * migration. Some workloads dirty memory way too fast and will not effectively
  * converge, even with auto-converge.
  */
+static bool mig_throttle_vcpus(int pct);
+
 static void mig_throttle_guest_down(void)
 {
     MigrationState *s = migrate_get_current();
     uint64_t pct_initial = s->parameters.cpu_throttle_initial;
     uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
+    int pct;
 
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
-        cpu_throttle_set(pct_initial);
+        pct = pct_initial;
     } else {
         /* Throttling already on, just increase the rate */
-        cpu_throttle_set(cpu_throttle_get_percentage() + pct_icrement);
+        pct = cpu_throttle_get_percentage() + pct_icrement;
+    }
+
+    if (!mig_throttle_vcpus(pct)) {
+        cpu_throttle_set(pct);
     }
 }
 
@@ -458,6 +512,10 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
 #define ENCODING_FLAG_XBZRLE 0x1
 
+/* A delta longer than this is not worth its CPU time; the page is sent
+ * whole for the next few rounds instead, see cache_skip_delta() */
+#define XBZRLE_POOR_DELTA_LEN (TARGET_PAGE_SIZE / 2)
+
 /**
  * save_xbzrle_page: compress and send current page
  *
@@ -498,6 +556,16 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
+    if (cache_skip_delta(XBZRLE.cache, current_addr)) {
+        acct_info.xbzrle_skipped++;
+        /* update data in the cache */
+        if (!last_stage) {
+            memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
+            *current_data = prev_cached_page;
+        }
+        return -1;
+    }
+
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
 
@@ -511,6 +579,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     } else if (encoded_len == -1) {
         DPRINTF("Overflow\n");
         acct_info.xbzrle_overflows++;
+        cache_update_delta(XBZRLE.cache, current_addr, false);
         /* update data in the cache */
         if (!last_stage) {
             memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
@@ -519,6 +588,9 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         return -1;
     }
 
+    cache_update_delta(XBZRLE.cache, current_addr,
+                       encoded_len <= XBZRLE_POOR_DELTA_LEN);
+
     /* we need to update the data in the cache, in order to get the same data */
     if (!last_stage) {
         memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
@@ -583,12 +655,179 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     return ret;
 }
 
+/* Where to record the pages a sync of [start, start + length) adds; RAM
+ * hotplugged after the scores were set up is not scored.
+ */
+static unsigned long *ram_hot_delta_for(ram_addr_t start, ram_addr_t length)
+{
+    if (!ram_hot_delta ||
+        BITS_TO_LONGS((start + length) >> TARGET_PAGE_BITS) > ram_hot_words) {
+        return NULL;
+    }
+    return ram_hot_delta;
+}
+
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
     unsigned long *bitmap;
     bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
     migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length,
+                                              ram_hot_delta_for(start,
+                                                                length));
+}
+
+/*
+ * On large guests the bitmap sync is split into shards of at most
+ * BITMAP_SYNC_SHARD_SIZE bytes of a RAMBlock.  The migration thread and a
+ * few helper threads pull shards off a shared index until none are left;
+ * cpu_physical_memory_sync_dirty_bitmap() merges atomically, so shards that
+ * meet inside a bitmap word do not race.
+ */
+#define BITMAP_SYNC_SHARD_SIZE      (1ULL << 30)
+#define BITMAP_SYNC_MAX_THREADS     8
+
+typedef struct BitmapSyncShard {
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncShard;
+
+static struct {
+    QemuThread *threads;
+    int thread_count;
+    bool quit;
+    /* posted once per helper to start a round, and by helpers when done */
+    QemuSemaphore sem;
+    QemuSemaphore done_sem;
+    BitmapSyncShard *shards;
+    int nr_shards;
+    int next_shard;
+    uint64_t num_dirty;
+} bitmap_sync;
+
+/* Called with rcu_read_lock() held */
+static uint64_t bitmap_sync_do_shards(void)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    uint64_t num_dirty = 0;
+    int i;
+
+    while ((i = atomic_fetch_inc(&bitmap_sync.next_shard)) <
+           bitmap_sync.nr_shards) {
+        ram_addr_t start = bitmap_sync.shards[i].start;
+        ram_addr_t length = bitmap_sync.shards[i].length;
+
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(bitmap, start,
+                                        length,
+                                        ram_hot_delta_for(start, length));
+    }
+
+    return num_dirty;
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    for (;;) {
+        qemu_sem_wait(&bitmap_sync.sem);
+        if (atomic_read(&bitmap_sync.quit)) {
+            break;
+        }
+        rcu_read_lock();
+        atomic_add(&bitmap_sync.num_dirty, bitmap_sync_do_shards());
+        rcu_read_unlock();
+        qemu_sem_post(&bitmap_sync.done_sem);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void bitmap_sync_threads_create(void)
+{
+    uint64_t nr_shards = ram_bytes_total() / BITMAP_SYNC_SHARD_SIZE;
+    long host_cpus = 1;
+    int i, count;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    /* The migration thread does its share of the work too */
+    count = MIN(nr_shards, MIN(host_cpus, BITMAP_SYNC_MAX_THREADS)) - 1;
+    if (count <= 0) {
+        return;
+    }
+
+    bitmap_sync.quit = false;
+    bitmap_sync.thread_count = count;
+    bitmap_sync.threads = g_new0(QemuThread, count);
+    qemu_sem_init(&bitmap_sync.sem, 0);
+    qemu_sem_init(&bitmap_sync.done_sem, 0);
+    for (i = 0; i < count; i++) {
+        qemu_thread_create(bitmap_sync.threads + i, "bitmapsync",
+                           bitmap_sync_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+    trace_bitmap_sync_threads_create(count);
+}
+
+static void bitmap_sync_threads_join(void)
+{
+    int i;
+
+    if (!bitmap_sync.threads) {
+        return;
+    }
+    atomic_set(&bitmap_sync.quit, true);
+    for (i = 0; i < bitmap_sync.thread_count; i++) {
+        qemu_sem_post(&bitmap_sync.sem);
+    }
+    for (i = 0; i < bitmap_sync.thread_count; i++) {
+        qemu_thread_join(bitmap_sync.threads + i);
+    }
+    qemu_sem_destroy(&bitmap_sync.sem);
+    qemu_sem_destroy(&bitmap_sync.done_sem);
+    g_free(bitmap_sync.threads);
+    g_free(bitmap_sync.shards);
+    bitmap_sync.threads = NULL;
+    bitmap_sync.shards = NULL;
+    bitmap_sync.thread_count = 0;
+}
+
+/* Called with migration_bitmap_mutex and rcu_read_lock() held */
+static void migration_bitmap_sync_parallel(void)
+{
+    RAMBlock *block;
+    ram_addr_t offset, len;
+    int n = 0, i;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        n += DIV_ROUND_UP(block->used_length, BITMAP_SYNC_SHARD_SIZE);
+    }
+    bitmap_sync.shards = g_renew(BitmapSyncShard, bitmap_sync.shards, n);
+
+    n = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        for (offset = 0; offset < block->used_length; offset += len) {
+            len = MIN(block->used_length - offset, BITMAP_SYNC_SHARD_SIZE);
+            bitmap_sync.shards[n].start = block->offset + offset;
+            bitmap_sync.shards[n].length = len;
+            n++;
+        }
+    }
+    bitmap_sync.nr_shards = n;
+    bitmap_sync.next_shard = 0;
+    bitmap_sync.num_dirty = 0;
+
+    for (i = 0; i < bitmap_sync.thread_count; i++) {
+        qemu_sem_post(&bitmap_sync.sem);
+    }
+    atomic_add(&bitmap_sync.num_dirty, bitmap_sync_do_shards());
+    for (i = 0; i < bitmap_sync.thread_count; i++) {
+        qemu_sem_wait(&bitmap_sync.done_sem);
+    }
+
+    migration_dirty_pages += atomic_read(&bitmap_sync.num_dirty);
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -597,14 +836,88 @@ static int64_t bytes_xfer_prev;
 static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
 static uint64_t iterations_prev;
+/* Pages each vcpu dirtied during the last period, indexed by cpu_index */
+static unsigned long *vcpu_dirty_period;
 
 static void migration_bitmap_sync_init(void)
 {
+    CPUState *cpu;
+
     start_time = 0;
     bytes_xfer_prev = 0;
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
     iterations_prev = 0;
+
+    if (tcg_enabled()) {
+        vcpu_dirty_period = g_new0(unsigned long, max_cpus);
+        CPU_FOREACH(cpu) {
+            atomic_set(&cpu->dirty_pages, 0);
+        }
+    }
+}
+
+static void migration_vcpu_dirty_period_end(void)
+{
+    CPUState *cpu;
+
+    if (!vcpu_dirty_period) {
+        return;
+    }
+    CPU_FOREACH(cpu) {
+        vcpu_dirty_period[cpu->cpu_index] = atomic_xchg(&cpu->dirty_pages, 0);
+    }
+}
+
+/* Throttle each vcpu in proportion to the pages it dirtied during the last
+ * period, the worst offender getting @pct and a vcpu that dirtied nothing
+ * none at all.  Only TCG knows which vcpu dirtied a page, so this returns
+ * false, leaving the caller to throttle everyone, when there is nothing to
+ * go by.
+ */
+static bool mig_throttle_vcpus(int pct)
+{
+    CPUState *cpu;
+    unsigned long max_dirty = 0;
+
+    if (!vcpu_dirty_period) {
+        return false;
+    }
+    CPU_FOREACH(cpu) {
+        max_dirty = MAX(max_dirty, vcpu_dirty_period[cpu->cpu_index]);
+    }
+    if (!max_dirty) {
+        return false;
+    }
+
+    CPU_FOREACH(cpu) {
+        unsigned long dirty = vcpu_dirty_period[cpu->cpu_index];
+        int vcpu_pct = DIV_ROUND_UP((uint64_t)pct * dirty, max_dirty);
+
+        trace_migration_throttle_vcpu(cpu->cpu_index, dirty, vcpu_pct);
+        cpu_throttle_set_vcpu(cpu, vcpu_pct);
+    }
+    return true;
+}
+
+/* Called with migration_bitmap_mutex held, once the sync is complete */
+static void ram_hot_score_update(void)
+{
+    unsigned long words_per_chunk =
+        (RAM_HOT_CHUNK_SIZE >> TARGET_PAGE_BITS) / BITS_PER_LONG;
+    unsigned long chunk;
+
+    for (chunk = 0; chunk < ram_hot_chunks; chunk++) {
+        unsigned long word = chunk * words_per_chunk;
+        unsigned long end = MIN(word + words_per_chunk, ram_hot_words);
+        uint32_t dirty = 0;
+
+        for (; word < end; word++) {
+            dirty += ctpopl(ram_hot_delta[word]);
+            ram_hot_delta[word] = 0;
+        }
+        ram_hot_score[chunk] = ram_hot_score[chunk] / 2 + dirty;
+    }
 }
 
 static void migration_bitmap_sync(void)
@@ -614,6 +927,7 @@ static void migration_bitmap_sync(void)
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     bitmap_sync_count++;
 
@@ -630,19 +944,37 @@ static void migration_bitmap_sync(void)
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+    if (bitmap_sync.threads) {
+        migration_bitmap_sync_parallel();
+    } else {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            migration_bitmap_sync_range(block->offset, block->used_length);
+        }
+    }
+    if (tcg_enabled()) {
+        /* The bits were cleared without telling the TLBs; make them trap
+         * the next write to each page again so that it gets logged.
+         */
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            tlb_reset_dirty_range_all(block->offset, block->used_length);
+        }
+    }
+    if (ram_hot_score) {
+        ram_hot_score_update();
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
+    s->dirty_sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - sync_start;
     trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
+                                    - num_dirty_pages_init,
+                                    s->dirty_sync_time);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
+        migration_vcpu_dirty_period_end();
         if (migrate_auto_converge()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
@@ -679,6 +1011,7 @@ static void migration_bitmap_sync(void)
         num_dirty_pages_period = 0;
     }
     s->dirty_sync_count = bitmap_sync_count;
+    multifd_sync_needed = true;
     if (migrate_use_events()) {
         qapi_event_send_migration_pass(bitmap_sync_count, NULL);
     }
@@ -802,16 +1135,17 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+static int do_compress_ram_page(QEMUFile *f, MigrationCodec *codec,
+                                RAMBlock *block, ram_addr_t offset)
 {
     int bytes_sent, blen;
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
 
     bytes_sent = save_page_header(f, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+    /* compress-level may be changed while migration is running */
+    migration_codec_set_level(codec, migrate_compress_level());
+    blen = qemu_put_compression_data(f, codec, p, TARGET_PAGE_SIZE);
     if (blen < 0) {
         bytes_sent = 0;
         qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
@@ -945,8 +1279,10 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
                 /* Make sure the first page is sent out before other pages */
                 bytes_xmit = save_page_header(f, block, offset |
                                               RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
+                migration_codec_set_level(comp_codec,
+                                          migrate_compress_level());
+                blen = qemu_put_compression_data(f, comp_codec, p,
+                                                 TARGET_PAGE_SIZE);
                 if (blen > 0) {
                     *bytes_transferred += bytes_xmit + blen;
                     acct_info.norm_pages++;
@@ -1025,7 +1361,38 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
 }
 
 /*
- * Helper for 'get_queued_page' - gets a page off the queue
+ * Take the first page off @queue; called with src_page_req_mutex held.
+ */
+static RAMBlock *unqueue_page_locked(struct src_page_requests *queue,
+                                     ram_addr_t *offset,
+                                     ram_addr_t *ram_addr_abs)
+{
+    struct MigrationSrcPageRequest *entry = QSIMPLEQ_FIRST(queue);
+    RAMBlock *block;
+
+    if (!entry) {
+        return NULL;
+    }
+
+    block = entry->rb;
+    *offset = entry->offset;
+    *ram_addr_abs = (entry->offset + entry->rb->offset) & TARGET_PAGE_MASK;
+
+    if (entry->len > TARGET_PAGE_SIZE) {
+        entry->len -= TARGET_PAGE_SIZE;
+        entry->offset += TARGET_PAGE_SIZE;
+    } else {
+        memory_region_unref(block->mr);
+        QSIMPLEQ_REMOVE_HEAD(queue, next_req);
+        g_free(entry);
+    }
+
+    return block;
+}
+
+/*
+ * Helper for 'get_queued_page' - gets a page off the queue.  Pages the
+ * destination is blocked on come first, prefetched pages after them.
  *      ms:      MigrationState in
  * *offset:      Used to return the offset within the RAMBlock
  * ram_addr_abs: global offset in the dirty/sent bitmaps
@@ -1035,25 +1402,13 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
 static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
                               ram_addr_t *ram_addr_abs)
 {
-    RAMBlock *block = NULL;
+    RAMBlock *block;
 
     qemu_mutex_lock(&ms->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
-        struct MigrationSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&ms->src_page_requests);
-        block = entry->rb;
-        *offset = entry->offset;
-        *ram_addr_abs = (entry->offset + entry->rb->offset) &
-                        TARGET_PAGE_MASK;
-
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
-            entry->offset += TARGET_PAGE_SIZE;
-        } else {
-            memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
-            g_free(entry);
-        }
+    block = unqueue_page_locked(&ms->src_page_requests, offset, ram_addr_abs);
+    if (!block) {
+        block = unqueue_page_locked(&ms->src_page_prefetch, offset,
+                                    ram_addr_abs);
     }
     qemu_mutex_unlock(&ms->src_page_req_mutex);
 
@@ -1132,21 +1487,50 @@ static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
  *
  * ms: MigrationState
  */
-void flush_page_queue(MigrationState *ms)
+static void flush_one_page_queue(struct src_page_requests *queue)
 {
     struct MigrationSrcPageRequest *mspr, *next_mspr;
+
+    QSIMPLEQ_FOREACH_SAFE(mspr, queue, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(queue, next_req);
+        g_free(mspr);
+    }
+}
+
+void flush_page_queue(MigrationState *ms)
+{
     /* This queue generally should be empty - but in the case of a failed
      * migration might have some droppings in.
      */
     rcu_read_lock();
-    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_requests, next_req, next_mspr) {
-        memory_region_unref(mspr->rb->mr);
-        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
-        g_free(mspr);
-    }
+    flush_one_page_queue(&ms->src_page_requests);
+    flush_one_page_queue(&ms->src_page_prefetch);
     rcu_read_unlock();
 }
 
+/*
+ * Add [offset, offset + len) of @rb to the prefetch queue, at its head
+ * if @urgent; called with src_page_req_mutex held.
+ */
+static void ram_queue_prefetch_locked(MigrationState *ms, RAMBlock *rb,
+                                      ram_addr_t offset, ram_addr_t len,
+                                      bool urgent)
+{
+    struct MigrationSrcPageRequest *entry =
+        g_new0(struct MigrationSrcPageRequest, 1);
+
+    entry->rb = rb;
+    entry->offset = offset;
+    entry->len = len;
+    memory_region_ref(rb->mr);
+    if (urgent) {
+        QSIMPLEQ_INSERT_HEAD(&ms->src_page_prefetch, entry, next_req);
+    } else {
+        QSIMPLEQ_INSERT_TAIL(&ms->src_page_prefetch, entry, next_req);
+    }
+}
+
 /**
  * Queue the pages for transmission, e.g. a request from postcopy destination
  *   ms: MigrationStatus in which the queue is held
@@ -1159,6 +1543,7 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
                          ram_addr_t start, ram_addr_t len)
 {
     RAMBlock *ramblock;
+    ram_addr_t prefetch;
 
     ms->postcopy_requests++;
     rcu_read_lock();
@@ -1166,49 +1551,938 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
         /* Reuse last RAMBlock */
         ramblock = ms->last_req_rb;
 
-        if (!ramblock) {
-            /*
-             * Shouldn't happen, we can't reuse the last RAMBlock if
-             * it's the 1st request.
-             */
-            error_report("ram_save_queue_pages no previous block");
-            goto err;
-        }
-    } else {
-        ramblock = qemu_ram_block_by_name(rbname);
+        if (!ramblock) {
+            /*
+             * Shouldn't happen, we can't reuse the last RAMBlock if
+             * it's the 1st request.
+             */
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        ramblock = qemu_ram_block_by_name(rbname);
+
+        if (!ramblock) {
+            /* We shouldn't be asked for a non-existent RAMBlock */
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        ms->last_req_rb = ramblock;
+    }
+    trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (start+len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    struct MigrationSrcPageRequest *new_entry =
+        g_malloc0(sizeof(struct MigrationSrcPageRequest));
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    /*
+     * Guests tend to walk memory upwards, so follow the faulted range with
+     * the pages right after it; they go ahead of anything prefetched for
+     * older faults, but behind every page the destination is waiting on.
+     */
+    prefetch = (ram_addr_t)migrate_postcopy_prefetch_pages() *
+               TARGET_PAGE_SIZE;
+    prefetch = MIN(prefetch, ramblock->used_length - (start + len));
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    if (prefetch) {
+        trace_ram_save_queue_prefetch(ramblock->idstr, start + len, prefetch);
+        ram_queue_prefetch_locked(ms, ramblock, start + len, prefetch, true);
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
+/* Multiple fd's */
+
+/*
+ * With the x-multifd capability, normal pages are not put on the main
+ * migration stream but collected into batches of up to
+ * x-multifd-page-count pages from a single RAMBlock.  Each batch is handed
+ * to one of x-multifd-channels threads, which sends it over its own socket
+ * as a MultiFDPacket_t header followed by the page data.  Zero pages and
+ * everything else still go over the main stream.
+ *
+ * A page may be dirtied again and resent over a different channel in the
+ * next round, so the rounds must not overlap on the destination.  After
+ * every bitmap sync the source puts a SYNC packet on every channel and
+ * RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream; the destination does not
+ * let either side get past that point until all of them have reached it.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;
+    uint32_t channels;
+} QEMU_PACKED MultiFDInit_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    /* number of pages in this packet */
+    uint32_t used;
+    uint64_t packet_num;
+    char ramblock[256];
+    uint64_t offset[];
+} QEMU_PACKED MultiFDPacket_t;
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    RAMBlock *block;
+    /* offset of each page inside block */
+    ram_addr_t *offset;
+} MultiFDPages_t;
+
+typedef struct {
+    /* these fields are not changed once the thread is created */
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted by the migration thread when there is a job or on quit */
+    QemuSemaphore sem;
+    /* protects the fields below */
+    QemuMutex mutex;
+    bool running;
+    bool quit;
+    /* a packet is queued for this channel */
+    bool pending_job;
+    /* the thread has picked up the pending job in its RCU critical section */
+    bool job_started;
+    QemuCond job_started_cond;
+    /* pages to send; owned by the thread while pending_job is set */
+    MultiFDPages_t *pages;
+    uint32_t flags;
+    uint64_t packet_num;
+    /* thread local variables */
+    MultiFDPacket_t *packet;
+    struct iovec *iov;
+    uint64_t num_packets;
+    uint64_t num_pages;
+} MultiFDSendParams;
+
+typedef struct {
+    /* these fields are not changed once the thread is created */
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    bool running;
+    bool quit;
+    /* posted by the main thread to release the channel after a sync */
+    QemuSemaphore sem_sync;
+    /* thread local variables */
+    MultiFDPacket_t *packet;
+    struct iovec *iov;
+    uint64_t num_packets;
+    uint64_t num_pages;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* batch being filled by the migration thread */
+    MultiFDPages_t *pages;
+    /* one post for every channel that is idle */
+    QemuSemaphore channels_ready;
+    uint64_t packet_num;
+    bool failed;
+    /* send the pages with MSG_ZEROCOPY-style writes */
+    bool zero_copy;
+} *multifd_send_state;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    /* number of channels that have connected */
+    int created;
+    /* posted by each channel when it reaches a sync point or fails */
+    QemuSemaphore sem_sync;
+    /* ram_load waiting for the remaining channels to connect */
+    Coroutine *waiting_co;
+    bool failed;
+} *multifd_recv_state;
+
+uint64_t multifd_mig_bytes_transferred(void)
+{
+    return acct_info.multifd_bytes;
+}
+
+static MultiFDPages_t *multifd_pages_init(size_t size)
+{
+    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
+
+    pages->allocated = size;
+    pages->offset = g_new0(ram_addr_t, size);
+
+    return pages;
+}
+
+static void multifd_pages_clear(MultiFDPages_t *pages)
+{
+    g_free(pages->offset);
+    g_free(pages);
+}
+
+static size_t multifd_packet_size(uint32_t used)
+{
+    return sizeof(MultiFDPacket_t) + used * sizeof(uint64_t);
+}
+
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDInit_t msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = cpu_to_be32(p->id);
+    msg.channels = cpu_to_be32(multifd_send_state->count);
+
+    return qio_channel_writev_all(p->c, &iov, 1, errp);
+}
+
+/* Called with p->mutex held; returns the number of iovec entries to send */
+static int multifd_send_fill_packet(MultiFDSendParams *p)
+{
+    MultiFDPacket_t *packet = p->packet;
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i;
+
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(p->flags);
+    packet->used = cpu_to_be32(pages->used);
+    packet->packet_num = cpu_to_be64(p->packet_num);
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    if (pages->block) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    }
+
+    p->iov[0].iov_base = packet;
+    p->iov[0].iov_len = multifd_packet_size(pages->used);
+    for (i = 0; i < pages->used; i++) {
+        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+        p->iov[i + 1].iov_base = pages->block->host + pages->offset[i];
+        p->iov[i + 1].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    return pages->used + 1;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+
+    rcu_register_thread();
+    trace_multifd_send_thread_start(p->id);
+
+    if (multifd_send_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+    /* ready for the first job */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+
+        if (p->pending_job) {
+            uint32_t used = p->pages->used;
+            uint32_t flags = p->flags;
+            bool ok = true;
+            int niov;
+
+            /* The RAMBlock must outlive the write, even once the migration
+             * thread has left the critical section it queued the pages in */
+            rcu_read_lock();
+            niov = multifd_send_fill_packet(p);
+            p->flags = 0;
+            p->job_started = true;
+            qemu_cond_signal(&p->job_started_cond);
+            qemu_mutex_unlock(&p->mutex);
+
+            if (multifd_send_state->zero_copy) {
+                /* The header lives in p->packet, which is rewritten for
+                 * the next packet, so only the guest pages go zero copy. */
+                ok = qio_channel_writev_all(p->c, p->iov, 1,
+                                            &local_err) >= 0 &&
+                     qio_channel_writev_zero_copy_all(p->c, p->iov + 1,
+                                                      niov - 1,
+                                                      &local_err) >= 0;
+                /* Reap the completions once per round so that the pinned
+                 * memory and the socket error queue stay bounded. */
+                if (ok && (flags & MULTIFD_FLAG_SYNC)) {
+                    int ret = qio_channel_flush(p->c, &local_err);
+
+                    ok = ret >= 0;
+                    if (ok) {
+                        trace_multifd_send_zero_copy_flush(p->id, ret);
+                    }
+                }
+            } else {
+                ok = qio_channel_writev_all(p->c, p->iov, niov,
+                                            &local_err) >= 0;
+            }
+            rcu_read_unlock();
+            if (!ok) {
+                break;
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pending_job = false;
+            p->job_started = false;
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->num_packets++;
+            p->num_pages += used;
+            qemu_mutex_unlock(&p->mutex);
+
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+            /* sometimes there are spurious wakeups */
+        }
+    }
+
+out:
+    if (local_err) {
+        if (!atomic_read(&p->quit)) {
+            error_report_err(local_err);
+        } else {
+            error_free(local_err);
+        }
+        atomic_set(&multifd_send_state->failed, true);
+        /* wake up the migration thread if it waits for a channel */
+        qemu_sem_post(&multifd_send_state->channels_ready);
+        qemu_mutex_lock(&p->mutex);
+        qemu_cond_broadcast(&p->job_started_cond);
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (p->running) {
+            qemu_mutex_lock(&p->mutex);
+            atomic_set(&p->quit, true);
+            qemu_mutex_unlock(&p->mutex);
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            qemu_sem_post(&p->sem);
+            qemu_thread_join(&p->thread);
+        }
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->job_started_cond);
+        qemu_sem_destroy(&p->sem);
+        multifd_pages_clear(p->pages);
+        g_free(p->packet);
+        g_free(p->iov);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    multifd_pages_clear(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+static int multifd_save_setup(void)
+{
+    MigrationState *s = migrate_get_current();
+    int thread_count = migrate_multifd_channels();
+    uint32_t page_count = migrate_multifd_page_count();
+    Error *local_err = NULL;
+    int i;
+
+    acct_info.multifd_bytes = 0;
+    multifd_sync_needed = false;
+    if (!migrate_use_multifd()) {
+        if (migrate_use_zero_copy_send()) {
+            error_report("x-zero-copy-send requires x-multifd");
+            return -1;
+        }
+        return 0;
+    }
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_report("multifd is not supported with TLS migration");
+        return -1;
+    }
+
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->count = thread_count;
+    multifd_send_state->pages = multifd_pages_init(page_count);
+    multifd_send_state->zero_copy = migrate_use_zero_copy_send();
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->job_started_cond);
+        qemu_sem_init(&p->sem, 0);
+        p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet = g_malloc0(multifd_packet_size(page_count));
+        p->iov = g_new0(struct iovec, page_count + 1);
+        p->name = g_strdup_printf("multifdsend_%d", i);
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        p->c = socket_send_channel_create(&local_err);
+        if (!p->c) {
+            error_report_err(local_err);
+            multifd_save_cleanup();
+            return -1;
+        }
+        if (multifd_send_state->zero_copy &&
+            !qio_channel_has_feature(p->c,
+                                     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+            error_report("x-zero-copy-send is not supported by this "
+                         "host or migration URI");
+            multifd_save_cleanup();
+            return -1;
+        }
+        p->running = true;
+        qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+}
+
+/*
+ * Hand the current batch to an idle channel.  Called from the migration
+ * thread; waits for a channel to become idle if all of them are busy.
+ */
+static int multifd_send_pages(void)
+{
+    static int next_channel;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+    int i;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->failed)) {
+        qemu_sem_post(&multifd_send_state->channels_ready);
+        return -1;
+    }
+
+    for (i = next_channel;; i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            next_channel = (i + 1) % multifd_send_state->count;
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    p->pending_job = true;
+    p->packet_num = multifd_send_state->packet_num++;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    if (pages->used && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+
+    if (pages->used == pages->allocated) {
+        return multifd_send_pages();
+    }
+    return 0;
+}
+
+/* Wait until every channel is idle, returning with all of them reserved */
+static int multifd_send_wait_idle(void)
+{
+    int i;
+
+    if (multifd_send_state->pages->used && multifd_send_pages() < 0) {
+        return -1;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+        if (atomic_read(&multifd_send_state->failed)) {
+            qemu_sem_post(&multifd_send_state->channels_ready);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Send all queued pages and wait until every channel has picked up its job.
+ * The channels then hold their own RCU read lock until the pages are on the
+ * wire, so the caller may leave its critical section without waiting for
+ * the writes to complete.
+ */
+static int multifd_send_handoff(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return 0;
+    }
+    if (multifd_send_state->pages->used && multifd_send_pages() < 0) {
+        return -1;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        while (p->pending_job && !p->job_started &&
+               !atomic_read(&multifd_send_state->failed)) {
+            qemu_cond_wait(&p->job_started_cond, &p->mutex);
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    return atomic_read(&multifd_send_state->failed) ? -1 : 0;
+}
+
+/*
+ * Flush the pages of the current round and put a sync point on every
+ * channel and on the main stream.
+ */
+static int multifd_send_sync_main(QEMUFile *f)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return 0;
+    }
+    if (multifd_send_wait_idle() < 0) {
+        return -1;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending_job = true;
+        p->flags |= MULTIFD_FLAG_SYNC;
+        p->packet_num = multifd_send_state->packet_num++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    trace_multifd_send_sync_main(multifd_send_state->packet_num);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    bytes_transferred += 8;
+    return 0;
+}
+
+/* Returns the channel id, or -1 on error */
+static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+{
+    MultiFDInit_t msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    uint32_t id;
+
+    if (qio_channel_readv_all(c, &iov, 1, errp) < 0) {
+        return -1;
+    }
+
+    if (be32_to_cpu(msg.magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x expected %x",
+                   be32_to_cpu(msg.magic), MULTIFD_MAGIC);
+        return -1;
+    }
+    if (be32_to_cpu(msg.version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d expected %d",
+                   be32_to_cpu(msg.version), MULTIFD_VERSION);
+        return -1;
+    }
+    if (be32_to_cpu(msg.channels) != multifd_recv_state->count) {
+        error_setg(errp, "multifd: source uses %d channels, "
+                   "x-multifd-channels is %d here",
+                   be32_to_cpu(msg.channels), multifd_recv_state->count);
+        return -1;
+    }
+    id = be32_to_cpu(msg.id);
+    if (id >= multifd_recv_state->count) {
+        error_setg(errp, "multifd: received channel id %d is too big", id);
+        return -1;
+    }
+    if (multifd_recv_state->params[id].c) {
+        error_setg(errp, "multifd: received channel id %d twice", id);
+        return -1;
+    }
+
+    return id;
+}
+
+/*
+ * Read the rest of the packet whose fixed header is in p->packet and set
+ * up p->iov to receive its pages.  Called with the RCU read lock held.
+ */
+static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    struct iovec iov;
+    RAMBlock *block;
+    uint32_t used;
+    uint32_t i;
+
+    packet->magic = be32_to_cpu(packet->magic);
+    if (packet->magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x expected %x",
+                   packet->magic, MULTIFD_MAGIC);
+        return -1;
+    }
+    packet->version = be32_to_cpu(packet->version);
+    if (packet->version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d expected %d",
+                   packet->version, MULTIFD_VERSION);
+        return -1;
+    }
+    packet->flags = be32_to_cpu(packet->flags);
+    used = packet->used = be32_to_cpu(packet->used);
+    if (used > MULTIFD_MAX_PAGE_COUNT) {
+        error_setg(errp, "multifd: received packet with %d pages, "
+                   "maximum is %d", used, MULTIFD_MAX_PAGE_COUNT);
+        return -1;
+    }
+    packet->packet_num = be64_to_cpu(packet->packet_num);
+    if (!used) {
+        return 0;
+    }
+
+    iov.iov_base = packet->offset;
+    iov.iov_len = used * sizeof(uint64_t);
+    if (qio_channel_readv_all(p->c, &iov, 1, errp) < 0) {
+        return -1;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_setg(errp, "multifd: unknown ramblock \"%s\"",
+                   packet->ramblock);
+        return -1;
+    }
+
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+
+        if (offset & ~TARGET_PAGE_MASK ||
+            offset + TARGET_PAGE_SIZE > block->used_length) {
+            error_setg(errp, "multifd: illegal offset " RAM_ADDR_FMT
+                       " for ramblock \"%s\"", offset, block->idstr);
+            return -1;
+        }
+        p->iov[i].iov_base = block->host + offset;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    struct iovec hdr = {
+        .iov_base = p->packet,
+        .iov_len = sizeof(MultiFDPacket_t),
+    };
+    Error *local_err = NULL;
+    int ret;
+
+    rcu_register_thread();
+    trace_multifd_recv_thread_start(p->id);
+
+    while (true) {
+        uint32_t used, flags;
+
+        ret = qio_channel_readv_all_eof(p->c, &hdr, 1, &local_err);
+        if (ret <= 0) {
+            /* 0 is end of stream: the source has finished or went away */
+            break;
+        }
+
+        rcu_read_lock();
+        ret = multifd_recv_unfill_packet(p, &local_err);
+        used = p->packet->used;
+        flags = p->packet->flags;
+        if (!ret && used) {
+            ret = qio_channel_readv_all(p->c, p->iov, used, &local_err);
+        }
+        rcu_read_unlock();
+        if (ret) {
+            break;
+        }
+
+        p->num_packets++;
+        p->num_pages += used;
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+            if (atomic_read(&p->quit)) {
+                break;
+            }
+        }
+    }
+
+    if (!atomic_read(&p->quit)) {
+        if (local_err) {
+            error_report_err(local_err);
+            local_err = NULL;
+        }
+        atomic_set(&multifd_recv_state->failed, true);
+        /* wake up ram_load if it waits for this channel */
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+    error_free(local_err);
+
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+int multifd_load_setup(void)
+{
+    int thread_count;
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (migrate_get_current()->parameters.tls_creds &&
+        *migrate_get_current()->parameters.tls_creds) {
+        error_report("multifd is not supported with TLS migration");
+        return -1;
+    }
+
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->count = thread_count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_sem_init(&p->sem_sync, 0);
+        p->id = i;
+        p->packet = g_malloc0(multifd_packet_size(MULTIFD_MAX_PAGE_COUNT));
+        p->iov = g_new0(struct iovec, MULTIFD_MAX_PAGE_COUNT);
+        p->name = g_strdup_printf("multifdrecv_%d", i);
+    }
+
+    return 0;
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->running) {
+            atomic_set(&p->quit, true);
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            qemu_sem_post(&p->sem_sync);
+            qemu_thread_join(&p->thread);
+        }
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+        }
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->packet);
+        g_free(p->iov);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    if (!multifd_recv_state) {
+        return true;
+    }
+    return multifd_recv_state->created == multifd_recv_state->count ||
+           atomic_read(&multifd_recv_state->failed);
+}
+
+/* Called from the main loop for each additional incoming connection */
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParams *p;
+    Error *local_err = NULL;
+    int id;
+
+    if (!multifd_recv_state) {
+        error_report("unexpected additional migration connection, "
+                     "x-multifd is not enabled");
+        return;
+    }
+
+    id = multifd_recv_initial_packet(ioc, &local_err);
+    if (id < 0) {
+        error_report_err(local_err);
+        atomic_set(&multifd_recv_state->failed, true);
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    } else {
+        p = &multifd_recv_state->params[id];
+        p->c = ioc;
+        object_ref(OBJECT(ioc));
+        p->running = true;
+        qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        multifd_recv_state->created++;
+    }
+
+    if (multifd_recv_all_channels_created() && multifd_recv_state->waiting_co) {
+        qemu_coroutine_enter(multifd_recv_state->waiting_co);
+    }
+}
+
+/*
+ * Called by ram_load when it finds RAM_SAVE_FLAG_MULTIFD_SYNC: wait until
+ * every channel has received all pages sent before the sync point, then
+ * let them continue with the next round.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state || !qemu_in_coroutine()) {
+        error_report("Received a multifd sync point but x-multifd is not "
+                     "enabled");
+        return -EINVAL;
+    }
+
+    if (!multifd_recv_all_channels_created()) {
+        multifd_recv_state->waiting_co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+        multifd_recv_state->waiting_co = NULL;
+    }
 
-        if (!ramblock) {
-            /* We shouldn't be asked for a non-existent RAMBlock */
-            error_report("ram_save_queue_pages no block '%s'", rbname);
-            goto err;
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+        if (atomic_read(&multifd_recv_state->failed)) {
+            error_report("multifd: receiving channel failed");
+            return -EIO;
         }
-        ms->last_req_rb = ramblock;
     }
-    trace_ram_save_queue_pages(ramblock->idstr, start, len);
-    if (start+len > ramblock->used_length) {
-        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
-                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
-                     __func__, start, len, ramblock->used_length);
-        goto err;
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
     }
+    trace_multifd_recv_sync_main();
 
-    struct MigrationSrcPageRequest *new_entry =
-        g_malloc0(sizeof(struct MigrationSrcPageRequest));
-    new_entry->rb = ramblock;
-    new_entry->offset = start;
-    new_entry->len = len;
+    return 0;
+}
 
-    memory_region_ref(ramblock->mr);
-    qemu_mutex_lock(&ms->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
-    qemu_mutex_unlock(&ms->src_page_req_mutex);
-    rcu_read_unlock();
+/**
+ * ram_save_multifd_page: Queue a page for one of the multifd channels
+ *
+ * Zero pages are still sent on the main stream.
+ *
+ * Returns: Number of pages written, < 0 on error.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page we want to send
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+
+    pages = save_zero_page(f, block,
+                           block == last_sent_block ?
+                           offset | RAM_SAVE_FLAG_CONTINUE : offset,
+                           block->host + offset, bytes_transferred);
+    if (pages > 0) {
+        last_sent_block = block;
+        return pages;
+    }
 
-    return 0;
+    if (multifd_queue_page(block, offset) < 0) {
+        qemu_file_set_error(f, -EIO);
+        return -EIO;
+    }
+    acct_info.norm_pages++;
+    acct_info.multifd_bytes += TARGET_PAGE_SIZE;
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
 
-err:
-    rcu_read_unlock();
-    return -1;
+    return 1;
 }
 
 /**
@@ -1235,7 +2509,9 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     /* Check the pages is dirty and if it is send it */
     if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
         unsigned long *unsentmap;
-        if (compression_switch && migrate_use_compression()) {
+        if (multifd_send_state) {
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
+        } else if (compression_switch && migrate_use_compression()) {
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
@@ -1253,9 +2529,9 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  multifd pages do not go to the stream at all.
          */
-        if (res > 0) {
+        if (res > 0 && !multifd_send_state) {
             last_sent_block = pss->block;
         }
     }
@@ -1418,6 +2694,16 @@ static void ram_migration_cleanup(void *opaque)
      * no writing race against this migration_bitmap
      */
     struct BitmapRcu *bitmap = migration_bitmap_rcu;
+
+    multifd_save_cleanup();
+    bitmap_sync_threads_join();
+    g_free(vcpu_dirty_period);
+    vcpu_dirty_period = NULL;
+    g_free(ram_hot_score);
+    ram_hot_score = NULL;
+    g_free(ram_hot_delta);
+    ram_hot_delta = NULL;
+
     atomic_rcu_set(&migration_bitmap_rcu, NULL);
     if (bitmap) {
         memory_global_dirty_log_stop();
@@ -1817,6 +3103,72 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
     return ret;
 }
 
+typedef struct RAMHotChunk {
+    uint32_t score;
+    unsigned long chunk;
+} RAMHotChunk;
+
+static int ram_hot_chunk_cmp(const void *a, const void *b)
+{
+    const RAMHotChunk *ca = a, *cb = b;
+
+    /* Busiest first */
+    return ca->score < cb->score ? 1 : ca->score > cb->score ? -1 : 0;
+}
+
+/*
+ * Queue the chunks of RAM the guest dirtied most during precopy, busiest
+ * first, so that the source sends them before falling back to its linear
+ * scan; the guest is likely to fault on them soon after it resumes.
+ * Called at the postcopy switchover, after the discard bitmap was sent.
+ */
+void ram_postcopy_queue_hot_pages(MigrationState *ms)
+{
+    RAMHotChunk *hot;
+    RAMBlock *block;
+    unsigned long i, n = 0;
+    uint64_t queued = 0;
+
+    if (!ram_hot_score || !migrate_postcopy_prefetch_pages()) {
+        return;
+    }
+
+    hot = g_new(RAMHotChunk, ram_hot_chunks);
+    for (i = 0; i < ram_hot_chunks; i++) {
+        if (ram_hot_score[i]) {
+            hot[n].score = ram_hot_score[i];
+            hot[n].chunk = i;
+            n++;
+        }
+    }
+    qsort(hot, n, sizeof(*hot), ram_hot_chunk_cmp);
+    n = MIN(n, RAM_HOT_MAX_CHUNKS);
+
+    rcu_read_lock();
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    for (i = 0; i < n; i++) {
+        ram_addr_t chunk_start = (ram_addr_t)hot[i].chunk << RAM_HOT_CHUNK_BITS;
+        ram_addr_t chunk_end = chunk_start + RAM_HOT_CHUNK_SIZE;
+
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            ram_addr_t start = MAX(chunk_start, block->offset);
+            ram_addr_t end = MIN(chunk_end,
+                                 block->offset + block->used_length);
+
+            if (start < end) {
+                ram_queue_prefetch_locked(ms, block, start - block->offset,
+                                          end - start, false);
+                queued += end - start;
+            }
+        }
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+    rcu_read_unlock();
+
+    trace_ram_postcopy_queue_hot_pages(n, queued);
+    g_free(hot);
+}
+
 /*
  * At the start of the postcopy phase of migration, any now-dirty
  * precopied pages are discarded.
@@ -1885,6 +3237,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
 
+    if (multifd_save_setup() < 0) {
+        return -1;
+    }
+
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -1931,6 +3287,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     if (migrate_postcopy_ram()) {
         migration_bitmap_rcu->unsentmap = bitmap_new(ram_bitmap_pages);
         bitmap_set(migration_bitmap_rcu->unsentmap, 0, ram_bitmap_pages);
+
+        ram_hot_words = BITS_TO_LONGS(ram_bitmap_pages);
+        ram_hot_chunks = DIV_ROUND_UP(ram_bitmap_pages,
+                                      RAM_HOT_CHUNK_SIZE >> TARGET_PAGE_BITS);
+        ram_hot_score = g_new0(uint32_t, ram_hot_chunks);
+        ram_hot_delta = bitmap_new(ram_bitmap_pages);
     }
 
     /*
@@ -1939,8 +3301,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
+    bitmap_sync_threads_create();
     memory_global_dirty_log_start();
     migration_bitmap_sync();
+    /* nothing has been sent yet */
+    multifd_sync_needed = false;
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
@@ -1954,6 +3319,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     rcu_read_unlock();
 
+    /* zlib streams stay readable by destinations that predate the
+     * method record */
+    if (migrate_use_compression() &&
+        migrate_compress_method() != MIGRATION_COMPRESS_METHOD_ZLIB) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_COMPRESS_METHOD);
+        qemu_put_byte(f, migrate_compress_method());
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
@@ -1979,6 +3352,13 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    if (multifd_sync_needed) {
+        multifd_sync_needed = false;
+        if (multifd_send_sync_main(f) < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+    }
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -2008,6 +3388,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    /* The channels must hold the RAMBlocks before we leave the RCU critical
+     * section; they are drained only at the sync points. */
+    if (multifd_send_handoff() < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
     rcu_read_unlock();
 
     /*
@@ -2038,6 +3423,13 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    if (multifd_sync_needed) {
+        multifd_sync_needed = false;
+        if (multifd_send_sync_main(f) < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -2052,6 +3444,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    /* The destination must have all of RAM before the device state */
+    if (multifd_send_sync_main(f) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2181,7 +3577,6 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
     uint8_t *des;
     int len;
 
@@ -2193,14 +3588,14 @@ static void *do_data_decompress(void *opaque)
             param->des = 0;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
-             * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
+            /* Decompression will fail in some cases, especially when
+             * the page was dirtied while it was being compressed.  That
+             * is not a problem because the dirty page will be
+             * retransferred, and the failure won't break the data in
+             * other pages.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+            migration_codec_decompress(param->codec, des, TARGET_PAGE_SIZE,
+                                       param->compbuf, len);
 
             qemu_mutex_lock(&decomp_done_lock);
             param->done = true;
@@ -2247,7 +3642,11 @@ void migrate_decompress_threads_create(void)
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf =
+            g_malloc0(migration_codec_max_bound(TARGET_PAGE_SIZE));
+        /* until the stream says otherwise */
+        decomp_param[i].codec = migration_codec_new(
+            MIGRATION_COMPRESS_METHOD_ZLIB, 0, &error_abort);
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
@@ -2272,6 +3671,7 @@ void migrate_decompress_threads_join(void)
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
+        migration_codec_free(decomp_param[i].codec);
     }
     g_free(decompress_threads);
     g_free(decomp_param);
@@ -2279,6 +3679,37 @@ void migrate_decompress_threads_join(void)
     decomp_param = NULL;
 }
 
+/* Switch the decompression threads to the method announced by the source */
+static int decompress_set_method(int method)
+{
+    Error *local_err = NULL;
+    int i, thread_count;
+
+    if (method >= MIGRATION_COMPRESS_METHOD__MAX ||
+        !migration_codec_available(method)) {
+        error_report("Compression method %d of the migration stream is not "
+                     "supported", method);
+        return -EINVAL;
+    }
+
+    wait_for_decompress_done();
+    thread_count = migrate_decompress_threads();
+    for (i = 0; i < thread_count; i++) {
+        MigrationCodec *codec = migration_codec_new(method, 0, &local_err);
+
+        if (!codec) {
+            error_report_err(local_err);
+            return -EINVAL;
+        }
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        migration_codec_free(decomp_param[i].codec);
+        decomp_param[i].codec = codec;
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+    }
+    trace_decompress_set_method(MigrationCompressMethod_lookup[method]);
+    return 0;
+}
+
 static void decompress_data_with_multi_threads(QEMUFile *f,
                                                void *host, int len)
 {
@@ -2536,9 +3967,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
 
+        case RAM_SAVE_FLAG_COMPRESS_METHOD:
+            ret = decompress_set_method(qemu_get_byte(f));
+            break;
+
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 ||
+                len > migration_codec_max_bound(TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2554,6 +3990,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2578,6 +4017,392 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     return ret;
 }
 
+/*
+ * RAM snapshot files
+ *
+ * ram_file_save() lays every RAMBlock out at a fixed offset of a file,
+ * behind a table that names the blocks:
+ *
+ *   RAMFileHeader, then one RAMFileBlock per block, all big endian;
+ *   the data of each block, starting at a RAM_FILE_ALIGN boundary.
+ *
+ * Host pages that are all zero are left as holes.  Since every page has a
+ * known place in the file, ram_file_load() can map the file in place of
+ * guest RAM and let the guest fault pages in as it uses them.
+ */
+#ifndef _WIN32
+
+#define RAM_FILE_MAGIC          0x5152414d      /* "QRAM" */
+#define RAM_FILE_ALIGN          (2 * 1024 * 1024)
+#define RAM_FILE_CHUNK_SIZE     (2 * 1024 * 1024)
+#define RAM_FILE_MAX_THREADS    8
+
+typedef struct QEMU_PACKED RAMFileHeader {
+    uint32_t magic;
+    uint32_t page_size;
+    uint32_t nr_blocks;
+} RAMFileHeader;
+
+typedef struct QEMU_PACKED RAMFileBlock {
+    char idstr[256];
+    uint64_t length;
+    uint64_t offset;
+} RAMFileBlock;
+
+typedef struct RAMFileChunk {
+    uint8_t *host;
+    size_t len;
+    off_t offset;
+} RAMFileChunk;
+
+typedef struct RAMFileWriter {
+    /* possibly O_DIRECT */
+    int fd;
+    /* for what is not host page sized */
+    int cached_fd;
+    RAMFileChunk *chunks;
+    unsigned nr_chunks;
+    unsigned next_chunk;
+    int error;
+} RAMFileWriter;
+
+static int ram_file_pwrite(int fd, const uint8_t *buf, size_t len,
+                           off_t offset)
+{
+    while (len) {
+        ssize_t ret = pwrite(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int ram_file_pread(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    while (len) {
+        ssize_t ret = pread(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EINVAL;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/*
+ * Write the runs of non-zero host pages of @chunk.  The last one may be cut
+ * short by the end of the RAMBlock, which need not be host page aligned
+ * when the target pages are smaller.
+ */
+static int ram_file_write_chunk(RAMFileWriter *w, RAMFileChunk *chunk)
+{
+    size_t page_size = qemu_real_host_page_size;
+    size_t start, end, aligned;
+    int ret;
+
+    for (start = 0; start < chunk->len; start = end) {
+        end = MIN(start + page_size, chunk->len);
+        if (buffer_is_zero(chunk->host + start, end - start)) {
+            continue;
+        }
+        while (end < chunk->len &&
+               !buffer_is_zero(chunk->host + end,
+                               MIN(page_size, chunk->len - end))) {
+            end = MIN(end + page_size, chunk->len);
+        }
+        aligned = QEMU_ALIGN_DOWN(end - start, page_size);
+        ret = ram_file_pwrite(w->fd, chunk->host + start, aligned,
+                              chunk->offset + start);
+        if (!ret && aligned < end - start) {
+            ret = ram_file_pwrite(w->cached_fd, chunk->host + start + aligned,
+                                  end - start - aligned,
+                                  chunk->offset + start + aligned);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void *ram_file_write_thread(void *opaque)
+{
+    RAMFileWriter *w = opaque;
+    unsigned i;
+
+    while (!atomic_read(&w->error) &&
+           (i = atomic_fetch_inc(&w->next_chunk)) < w->nr_chunks) {
+        int ret = ram_file_write_chunk(w, &w->chunks[i]);
+
+        if (ret < 0) {
+            atomic_cmpxchg(&w->error, 0, ret);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * ram_file_save: write guest RAM to a snapshot file
+ *
+ * Returns the offset at which the RAM area ends, RAM_FILE_ALIGN aligned,
+ * or -errno with @errp set.  The guest must be stopped.
+ *
+ * @fd: the file, open for writing
+ * @filename: name of the file, opened again for the bulk data
+ * @start: offset at which the RAM area starts
+ * @errp: pointer to error object
+ */
+int64_t ram_file_save(int fd, const char *filename, off_t start, Error **errp)
+{
+    RAMFileWriter w = { .fd = -1, .cached_fd = fd };
+    RAMFileHeader hdr;
+    RAMFileBlock *table;
+    RAMBlock *block;
+    QemuThread *threads;
+    unsigned nr_blocks = 0, nr_threads, i, j;
+    long host_cpus = 1;
+    off_t offset;
+    int64_t ret;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        nr_blocks++;
+        w.nr_chunks += DIV_ROUND_UP(block->used_length, RAM_FILE_CHUNK_SIZE);
+    }
+
+    table = g_new0(RAMFileBlock, nr_blocks);
+    w.chunks = g_new(RAMFileChunk, w.nr_chunks);
+    offset = ROUND_UP(start + sizeof(hdr) + nr_blocks * sizeof(*table),
+                      RAM_FILE_ALIGN);
+    i = j = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t done;
+
+        pstrcpy(table[i].idstr, sizeof(table[i].idstr), block->idstr);
+        table[i].length = cpu_to_be64(block->used_length);
+        table[i].offset = cpu_to_be64(offset);
+        for (done = 0; done < block->used_length;
+             done += RAM_FILE_CHUNK_SIZE) {
+            w.chunks[j].host = block->host + done;
+            w.chunks[j].len = MIN(RAM_FILE_CHUNK_SIZE,
+                                  block->used_length - done);
+            w.chunks[j].offset = offset + done;
+            j++;
+        }
+        offset = ROUND_UP(offset + block->used_length, RAM_FILE_ALIGN);
+        i++;
+    }
+
+    hdr.magic = cpu_to_be32(RAM_FILE_MAGIC);
+    hdr.page_size = cpu_to_be32(qemu_real_host_page_size);
+    hdr.nr_blocks = cpu_to_be32(nr_blocks);
+    ret = ram_file_pwrite(fd, (uint8_t *)&hdr, sizeof(hdr), start);
+    if (!ret) {
+        ret = ram_file_pwrite(fd, (uint8_t *)table,
+                              nr_blocks * sizeof(*table),
+                              start + sizeof(hdr));
+    }
+    if (!ret && ftruncate(fd, offset) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write RAM block table");
+        goto out;
+    }
+
+    /* The bulk of the data goes through a second descriptor, uncached if
+     * the file system allows it; guest RAM is page aligned and so are the
+     * chunks, which is all O_DIRECT asks for.
+     */
+    w.fd = qemu_open(filename, O_WRONLY | O_BINARY);
+    if (w.fd < 0) {
+        ret = -errno;
+        error_setg_file_open(errp, errno, filename);
+        goto out;
+    }
+#ifdef O_DIRECT
+    fcntl(w.fd, F_SETFL, fcntl(w.fd, F_GETFL) | O_DIRECT);
+#endif
+
+#ifdef _SC_NPROCESSORS_ONLN
+    host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    /* This thread writes too */
+    nr_threads = MAX(MIN(w.nr_chunks, MIN(host_cpus, RAM_FILE_MAX_THREADS)),
+                     1) - 1;
+    threads = g_new0(QemuThread, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(threads + i, "ramfile", ram_file_write_thread, &w,
+                           QEMU_THREAD_JOINABLE);
+    }
+    ram_file_write_thread(&w);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(threads + i);
+    }
+    g_free(threads);
+    trace_ram_file_save(w.nr_chunks, nr_threads + 1, w.error);
+
+    ret = w.error;
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write guest RAM");
+    } else {
+        ret = offset;
+    }
+
+out:
+    rcu_read_unlock();
+    if (w.fd >= 0) {
+        qemu_close(w.fd);
+    }
+    g_free(w.chunks);
+    g_free(table);
+    return ret;
+}
+
+/**
+ * ram_file_load: restore guest RAM from a snapshot file
+ *
+ * RAM that QEMU allocated itself is replaced by a private mapping of the
+ * file, which must therefore not change for as long as the guest runs;
+ * other blocks are read in.  The RAMBlocks must be the same as when the
+ * file was written.
+ *
+ * Returns 0 for success or -errno with @errp set.
+ *
+ * @fd: the file, open for reading
+ * @start: offset at which the RAM area starts
+ * @errp: pointer to error object
+ */
+int ram_file_load(int fd, off_t start, Error **errp)
+{
+    RAMFileHeader hdr;
+    RAMFileBlock *table = NULL;
+    RAMBlock *block;
+    unsigned nr_blocks = 0, nr_mapped = 0, i;
+    int ret;
+
+    ret = ram_file_pread(fd, (uint8_t *)&hdr, sizeof(hdr), start);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read RAM block table");
+        return ret;
+    }
+    if (be32_to_cpu(hdr.magic) != RAM_FILE_MAGIC) {
+        error_setg(errp, "No RAM block table found");
+        return -EINVAL;
+    }
+    if (be32_to_cpu(hdr.page_size) != qemu_real_host_page_size) {
+        error_setg(errp, "File was written with %u byte pages, this host "
+                   "uses %lu", be32_to_cpu(hdr.page_size),
+                   (unsigned long)qemu_real_host_page_size);
+        return -EINVAL;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        nr_blocks++;
+    }
+    if (be32_to_cpu(hdr.nr_blocks) != nr_blocks) {
+        error_setg(errp, "File has %u RAM blocks, the guest has %u",
+                   be32_to_cpu(hdr.nr_blocks), nr_blocks);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    table = g_new(RAMFileBlock, nr_blocks);
+    ret = ram_file_pread(fd, (uint8_t *)table, nr_blocks * sizeof(*table),
+                         start + sizeof(hdr));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read RAM block table");
+        goto out;
+    }
+
+    /* Check everything before touching guest memory */
+    for (i = 0; i < nr_blocks; i++) {
+        table[i].idstr[sizeof(table[i].idstr) - 1] = '\0';
+        block = qemu_ram_block_by_name(table[i].idstr);
+        if (!block) {
+            error_setg(errp, "Unknown RAM block '%s'", table[i].idstr);
+            ret = -EINVAL;
+            goto out;
+        }
+        if (be64_to_cpu(table[i].length) != block->used_length) {
+            error_setg(errp, "Length mismatch for RAM block '%s': 0x%"
+                       PRIx64 " in file, 0x" RAM_ADDR_FMT " in guest",
+                       block->idstr, be64_to_cpu(table[i].length),
+                       block->used_length);
+            ret = -EINVAL;
+            goto out;
+        }
+        if (be64_to_cpu(table[i].offset) % qemu_real_host_page_size) {
+            error_setg(errp, "RAM block '%s' is misaligned in the file",
+                       block->idstr);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nr_blocks; i++) {
+        off_t offset = be64_to_cpu(table[i].offset);
+
+        block = qemu_ram_block_by_name(table[i].idstr);
+        ret = qemu_ram_remap_file(block, fd, offset);
+        if (ret == -ENOTSUP) {
+            ret = ram_file_pread(fd, block->host, block->used_length, offset);
+        } else if (!ret) {
+            nr_mapped++;
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not restore RAM block '%s'",
+                             block->idstr);
+            goto out;
+        }
+        cpu_physical_memory_set_dirty_range(block->offset, block->used_length,
+                                            DIRTY_CLIENTS_ALL);
+    }
+    trace_ram_file_load(nr_blocks, nr_mapped);
+
+    /* Guest code may have changed behind the translator's back */
+    tb_flush(first_cpu);
+
+out:
+    rcu_read_unlock();
+    g_free(table);
+    return ret;
+}
+
+#else /* _WIN32 */
+
+int64_t ram_file_save(int fd, const char *filename, off_t start, Error **errp)
+{
+    error_setg(errp, "RAM snapshot files are not supported on this host");
+    return -ENOTSUP;
+}
+
+int ram_file_load(int fd, off_t start, Error **errp)
+{
+    error_setg(errp, "RAM snapshot files are not supported on this host");
+    return -ENOTSUP;
+}
+
+#endif /* _WIN32 */
+
 static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
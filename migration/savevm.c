@@ -1014,13 +1014,60 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+typedef struct SaveStateTime {
+    SaveStateEntry *se;
+    int64_t time;
+    int64_t size;
+} SaveStateTime;
+
+static int save_state_time_cmp(const void *a, const void *b)
+{
+    const SaveStateTime *ta = a, *tb = b;
+
+    /* Slowest first */
+    return ta->time < tb->time ? 1 : ta->time > tb->time ? -1 : 0;
+}
+
+/*
+ * Record how long saving the state of each device took for query-migrate,
+ * keeping the MIGRATION_DEVICE_STATS_MAX slowest ones.
+ */
+static void savevm_record_device_times(MigrationState *ms,
+                                       SaveStateTime *times, int n,
+                                       int64_t total)
+{
+    MigrationDeviceStatsList **tail;
+    int i;
+
+    qsort(times, n, sizeof(*times), save_state_time_cmp);
+
+    qapi_free_MigrationDeviceStatsList(ms->device_stats);
+    ms->device_stats = NULL;
+    ms->device_state_time = total;
+    tail = &ms->device_stats;
+    for (i = 0; i < MIN(n, MIGRATION_DEVICE_STATS_MAX); i++) {
+        MigrationDeviceStatsList *entry = g_new0(MigrationDeviceStatsList, 1);
+
+        entry->value = g_new0(MigrationDeviceStats, 1);
+        entry->value->id = g_strdup(times[i].se->idstr);
+        entry->value->instance_id = times[i].se->instance_id;
+        entry->value->time = times[i].time;
+        entry->value->size = times[i].size;
+        *tail = entry;
+        tail = &entry->next;
+    }
+}
+
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 {
-    QJSON *vmdesc;
+    QJSON *vmdesc = NULL;
     int vmdesc_len;
     SaveStateEntry *se;
-    int ret;
-    bool in_postcopy = migration_in_postcopy(migrate_get_current());
+    SaveStateTime *times = NULL;
+    int ret, ntimes = 0, nhandlers = 0;
+    int64_t devices_start, start, offset;
+    MigrationState *ms = migrate_get_current();
+    bool in_postcopy = migration_in_postcopy(ms);
 
     trace_savevm_state_complete_precopy();
 
@@ -1056,9 +1103,22 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         return;
     }
 
-    vmdesc = qjson_new();
-    json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
-    json_start_array(vmdesc, "devices");
+    /* The guest is stopped: don't spend time describing the device
+     * state if the description is not going to be sent.
+     */
+    if (should_send_vmdesc()) {
+        vmdesc = qjson_new();
+        json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
+        json_start_array(vmdesc, "devices");
+    }
+    /* Only migration reports the times, not savevm */
+    if (ms->state == MIGRATION_STATUS_ACTIVE || in_postcopy) {
+        QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+            nhandlers++;
+        }
+        times = g_new(SaveStateTime, nhandlers);
+    }
+    devices_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
@@ -1070,17 +1130,39 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         }
 
         trace_savevm_section_start(se->idstr, se->section_id);
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        offset = qemu_ftell_fast(f);
 
-        json_start_object(vmdesc, NULL);
-        json_prop_str(vmdesc, "name", se->idstr);
-        json_prop_int(vmdesc, "instance_id", se->instance_id);
+        if (vmdesc) {
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", se->idstr);
+            json_prop_int(vmdesc, "instance_id", se->instance_id);
+        }
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         vmstate_save(f, se, vmdesc);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
 
-        json_end_object(vmdesc);
+        if (vmdesc) {
+            json_end_object(vmdesc);
+        }
+
+        if (times) {
+            times[ntimes].se = se;
+            times[ntimes].time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+            times[ntimes].size = qemu_ftell_fast(f) - offset;
+            trace_savevm_section_time(se->idstr, se->instance_id,
+                                      times[ntimes].time, times[ntimes].size);
+            ntimes++;
+        }
+    }
+
+    if (times) {
+        savevm_record_device_times(ms, times, ntimes,
+                                   qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   devices_start);
+        g_free(times);
     }
 
     if (!in_postcopy) {
@@ -1088,16 +1170,16 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         qemu_put_byte(f, QEMU_VM_EOF);
     }
 
-    json_end_array(vmdesc);
-    qjson_finish(vmdesc);
-    vmdesc_len = strlen(qjson_get_str(vmdesc));
+    if (vmdesc) {
+        json_end_array(vmdesc);
+        qjson_finish(vmdesc);
+        vmdesc_len = strlen(qjson_get_str(vmdesc));
 
-    if (should_send_vmdesc()) {
         qemu_put_byte(f, QEMU_VM_VMDESCRIPTION);
         qemu_put_be32(f, vmdesc_len);
         qemu_put_buffer(f, (uint8_t *)qjson_get_str(vmdesc), vmdesc_len);
+        qjson_destroy(vmdesc);
     }
-    qjson_destroy(vmdesc);
 
     qemu_fflush(f);
 }
@@ -1158,6 +1240,12 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
         goto done;
     }
 
+    if (migrate_use_multifd()) {
+        error_setg(errp, "x-multifd is not supported for snapshots");
+        ret = -EINVAL;
+        goto done;
+    }
+
     qemu_mutex_unlock_iothread();
     qemu_savevm_state_header(f);
     qemu_savevm_state_begin(f, &params);
@@ -1737,6 +1825,7 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     LoadStateEntry *le;
     char idstr[256];
     int ret;
+    int64_t start;
 
     /* Read section start */
     section_id = qemu_get_be32(f);
@@ -1779,12 +1868,16 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     le->version_id = version_id;
     QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
 
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = vmstate_load(f, le->se, le->version_id);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%x of"
                      " device '%s'", instance_id, idstr);
         return ret;
     }
+    trace_qemu_loadvm_section_time(idstr, instance_id,
+                                   qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   start);
     if (!check_section_footer(f, le)) {
         return -EINVAL;
     }
@@ -2111,6 +2204,165 @@ void qmp_xen_load_devices_state(const char *filename, Error **errp)
     migration_incoming_state_destroy();
 }
 
+/*
+ * Snapshot files hold the whole VM state outside of any disk image: a
+ * SnapshotFileHeader, the RAM area written by ram_file_save() at
+ * SNAPSHOT_FILE_RAM_OFFSET, and the state of the devices, in the format of
+ * xen-save-devices-state, at device_offset.  The header is written last so
+ * that an interrupted save leaves no usable file.  Disks are not included.
+ *
+ * The file is written under a temporary name and renamed over @filename
+ * once it is complete: guest RAM may be a private mapping of the previous
+ * file of that name, which must not be truncated under the guest's feet.
+ */
+#define SNAPSHOT_FILE_MAGIC         0x51534e50      /* "QSNP" */
+#define SNAPSHOT_FILE_VERSION       1
+#define SNAPSHOT_FILE_RAM_OFFSET    4096
+
+typedef struct QEMU_PACKED SnapshotFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ram_offset;
+    uint64_t device_offset;
+} SnapshotFileHeader;
+
+void qmp_snapshot_save_file(const char *filename, Error **errp)
+{
+    SnapshotFileHeader hdr;
+    QIOChannelFile *ioc;
+    QEMUFile *f;
+    Error *local_err = NULL;
+    char *tmpname;
+    int64_t device_offset;
+    int saved_vm_running;
+    int fd, ret;
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    tmpname = g_strdup_printf("%s.XXXXXX", filename);
+    fd = g_mkstemp(tmpname);
+    if (fd < 0) {
+        error_setg_file_open(&local_err, errno, tmpname);
+        goto the_end;
+    }
+
+    device_offset = ram_file_save(fd, tmpname, SNAPSHOT_FILE_RAM_OFFSET,
+                                  &local_err);
+    if (device_offset < 0) {
+        goto out;
+    }
+
+    if (lseek(fd, device_offset, SEEK_SET) < 0) {
+        error_setg_errno(&local_err, errno, "Could not write device state");
+        goto out;
+    }
+    ioc = qio_channel_file_new_fd(dup(fd));
+    f = qemu_fopen_channel_output(QIO_CHANNEL(ioc));
+    object_unref(OBJECT(ioc));
+    ret = qemu_save_device_state(f);
+    if (!ret) {
+        ret = qemu_fclose(f);
+    } else {
+        qemu_fclose(f);
+    }
+    if (ret < 0) {
+        error_setg_errno(&local_err, -ret, "Could not write device state");
+        goto out;
+    }
+
+    /* The header must not reach the disk before what it describes */
+    if (qemu_fdatasync(fd) < 0) {
+        error_setg_errno(&local_err, errno, "Could not write snapshot file");
+        goto out;
+    }
+    hdr.magic = cpu_to_be32(SNAPSHOT_FILE_MAGIC);
+    hdr.version = cpu_to_be32(SNAPSHOT_FILE_VERSION);
+    hdr.ram_offset = cpu_to_be64(SNAPSHOT_FILE_RAM_OFFSET);
+    hdr.device_offset = cpu_to_be64(device_offset);
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        qemu_fdatasync(fd) < 0) {
+        error_setg_errno(&local_err, errno, "Could not write snapshot header");
+        goto out;
+    }
+    if (rename(tmpname, filename) < 0) {
+        error_setg_errno(&local_err, errno, "Could not rename '%s' to '%s'",
+                         tmpname, filename);
+    }
+
+ out:
+    qemu_close(fd);
+    if (local_err) {
+        unlink(tmpname);
+    }
+ the_end:
+    g_free(tmpname);
+    error_propagate(errp, local_err);
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+void qmp_snapshot_load_file(const char *filename, Error **errp)
+{
+    SnapshotFileHeader hdr;
+    QIOChannelFile *ioc;
+    QEMUFile *f;
+    int saved_vm_running;
+    int fd, ret;
+
+    fd = qemu_open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        error_setg_file_open(errp, errno, filename);
+        return;
+    }
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        be32_to_cpu(hdr.magic) != SNAPSHOT_FILE_MAGIC) {
+        error_setg(errp, "'%s' is not a snapshot file", filename);
+        goto out;
+    }
+    if (be32_to_cpu(hdr.version) != SNAPSHOT_FILE_VERSION) {
+        error_setg(errp, "Unsupported snapshot file version %u",
+                   be32_to_cpu(hdr.version));
+        goto out;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    /* Flush all IO requests so they don't interfere with the new state.  */
+    bdrv_drain_all();
+    /* Reset first: it may write ROM contents to RAM */
+    qemu_system_reset(VMRESET_SILENT);
+
+    if (ram_file_load(fd, be64_to_cpu(hdr.ram_offset), errp) < 0) {
+        goto out;
+    }
+
+    if (lseek(fd, be64_to_cpu(hdr.device_offset), SEEK_SET) < 0) {
+        error_setg_errno(errp, errno, "Could not read device state");
+        goto out;
+    }
+    ioc = qio_channel_file_new_fd(dup(fd));
+    f = qemu_fopen_channel_input(QIO_CHANNEL(ioc));
+    object_unref(OBJECT(ioc));
+    migration_incoming_state_new(f);
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    migration_incoming_state_destroy();
+    if (ret < 0) {
+        error_setg(errp, "Error %d while loading device state", ret);
+        goto out;
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+
+ out:
+    qemu_close(fd);
+}
+
 int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
@@ -22,9 +22,39 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "io/channel-socket.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
 #include "trace.h"
 
 
+/* Address of the current outgoing socket migration, used to open the
+ * additional multifd connections. */
+static SocketAddress *outgoing_saddr;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "multifd requires a tcp: or unix: migration URI");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+void socket_send_channel_reset(void)
+{
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = NULL;
+}
+
+
 static SocketAddress *tcp_build_address(const char *host_port, Error **errp)
 {
     InetSocketAddress *iaddr = inet_parse(host_port, errp);
@@ -105,6 +135,10 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
+    if (migrate_use_multifd()) {
+        socket_send_channel_reset();
+        outgoing_saddr = QAPI_CLONE(SocketAddress, saddr);
+    }
     qapi_free_SocketAddress(saddr);
 }
 
@@ -142,10 +176,20 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
-    migration_channel_process_incoming(migrate_get_current(),
-                                       QIO_CHANNEL(sioc));
+    /* The first connection carries the main migration stream, any further
+     * ones are multifd channels. */
+    if (!migration_incoming_get_current()) {
+        migration_channel_process_incoming(migrate_get_current(),
+                                           QIO_CHANNEL(sioc));
+    } else {
+        multifd_recv_new_channel(QIO_CHANNEL(sioc));
+    }
     object_unref(OBJECT(sioc));
 
+    if (!migration_has_all_channels()) {
+        return TRUE; /* keep listening */
+    }
+
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
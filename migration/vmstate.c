@@ -4,6 +4,7 @@
 #include "migration/qemu-file.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 
@@ -75,6 +76,84 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
     return base_addr;
 }
 
+/*
+ * Arrays of plain integers are transferred with a single buffer copy
+ * rather than one get/put call per element.  The stream is unchanged:
+ * every element is still stored big endian.
+ */
+static bool vmstate_field_is_bulk(VMStateField *field, int n_elems, int size)
+{
+    return n_elems > 1 &&
+           !(field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER)) &&
+           field->info->bulk_size && field->info->bulk_size == size;
+}
+
+/* Bounce buffer size used to byteswap bulk arrays on save */
+#define VMSTATE_BULK_CHUNK 512
+
+static void vmstate_put_bulk(QEMUFile *f, void *base_addr, int n_elems,
+                             int size)
+{
+    size_t len = (size_t)n_elems * size;
+#ifndef HOST_WORDS_BIGENDIAN
+    uint8_t buf[VMSTATE_BULK_CHUNK];
+    size_t done, i, chunk;
+
+    if (size > 1) {
+        for (done = 0; done < len; done += chunk) {
+            chunk = MIN(len - done, sizeof(buf));
+            for (i = 0; i < chunk; i += size) {
+                void *src = base_addr + done + i;
+
+                switch (size) {
+                case 2:
+                    stw_be_p(buf + i, *(uint16_t *)src);
+                    break;
+                case 4:
+                    stl_be_p(buf + i, *(uint32_t *)src);
+                    break;
+                default:
+                    stq_be_p(buf + i, *(uint64_t *)src);
+                    break;
+                }
+            }
+            qemu_put_buffer(f, buf, chunk);
+        }
+        return;
+    }
+#endif
+    qemu_put_buffer(f, base_addr, len);
+}
+
+static void vmstate_get_bulk(QEMUFile *f, void *base_addr, int n_elems,
+                             int size)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    int i;
+#endif
+
+    qemu_get_buffer(f, base_addr, (size_t)n_elems * size);
+#ifndef HOST_WORDS_BIGENDIAN
+    switch (size) {
+    case 2:
+        for (i = 0; i < n_elems; i++) {
+            be16_to_cpus((uint16_t *)base_addr + i);
+        }
+        break;
+    case 4:
+        for (i = 0; i < n_elems; i++) {
+            be32_to_cpus((uint32_t *)base_addr + i);
+        }
+        break;
+    case 8:
+        for (i = 0; i < n_elems; i++) {
+            be64_to_cpus((uint64_t *)base_addr + i);
+        }
+        break;
+    }
+#endif
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
@@ -112,6 +191,16 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
 
+            if (vmstate_field_is_bulk(field, n_elems, size)) {
+                vmstate_get_bulk(f, base_addr, n_elems, size);
+                ret = qemu_file_get_error(f);
+                if (ret < 0) {
+                    trace_vmstate_load_field_error(field->name, ret);
+                    return ret;
+                }
+                n_elems = 0;
+            }
+
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -316,6 +405,18 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
             int64_t old_offset, written_bytes;
             QJSON *vmdesc_loop = vmdesc;
 
+            /* The description only lists the first element of arrays
+             * that can be compressed, which bulk arrays are once it is
+             * written.
+             */
+            if (vmstate_field_is_bulk(field, n_elems, size) &&
+                (!vmdesc || vmsd_can_compress(field))) {
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmstate_put_bulk(f, base_addr, n_elems, size);
+                vmsd_desc_field_end(vmsd, vmdesc, field, size, 0);
+                n_elems = 0;
+            }
+
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -499,6 +600,7 @@ const VMStateInfo vmstate_info_int8 = {
     .name = "int8",
     .get  = get_int8,
     .put  = put_int8,
+    .bulk_size = 1,
 };
 
 /* 16 bit int */
@@ -520,6 +622,7 @@ const VMStateInfo vmstate_info_int16 = {
     .name = "int16",
     .get  = get_int16,
     .put  = put_int16,
+    .bulk_size = 2,
 };
 
 /* 32 bit int */
@@ -541,6 +644,7 @@ const VMStateInfo vmstate_info_int32 = {
     .name = "int32",
     .get  = get_int32,
     .put  = put_int32,
+    .bulk_size = 4,
 };
 
 /* 32 bit int. See that the received value is the same than the one
@@ -606,6 +710,7 @@ const VMStateInfo vmstate_info_int64 = {
     .name = "int64",
     .get  = get_int64,
     .put  = put_int64,
+    .bulk_size = 8,
 };
 
 /* 8 bit unsigned int */
@@ -627,6 +732,7 @@ const VMStateInfo vmstate_info_uint8 = {
     .name = "uint8",
     .get  = get_uint8,
     .put  = put_uint8,
+    .bulk_size = 1,
 };
 
 /* 16 bit unsigned int */
@@ -648,6 +754,7 @@ const VMStateInfo vmstate_info_uint16 = {
     .name = "uint16",
     .get  = get_uint16,
     .put  = put_uint16,
+    .bulk_size = 2,
 };
 
 /* 32 bit unsigned int */
@@ -669,6 +776,7 @@ const VMStateInfo vmstate_info_uint32 = {
     .name = "uint32",
     .get  = get_uint32,
     .put  = put_uint32,
+    .bulk_size = 4,
 };
 
 /* 32 bit uint. See that the received value is the same than the one
@@ -711,6 +819,7 @@ const VMStateInfo vmstate_info_uint64 = {
     .name = "uint64",
     .get  = get_uint64,
     .put  = put_uint64,
+    .bulk_size = 8,
 };
 
 /* 64 bit unsigned int. See that the received value is the same than the one
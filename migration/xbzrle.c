@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,13 +25,212 @@
 
   length = uleb128 encoded integer
  */
+
+/*
+ * The encoder splits the page into maximal runs of unchanged (zrun) and
+ * changed (nzrun) bytes.  Finding where each run ends is where the time
+ * goes, so that part has vector implementations, picked at startup.  All
+ * of them produce the same output.
+ *
+ * Each run finder returns the length of the run starting at @old and @new,
+ * at most @len.  @old and @new are equally aligned.
+ */
+static int zrun_len_int(const uint8_t *old, const uint8_t *new, int len)
+{
+    int i = 0;
+
+    /* not aligned to sizeof(long) */
+    while (i < len && ((uintptr_t)(old + i) % sizeof(long))) {
+        if (old[i] != new[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time for speed */
+    while (i + sizeof(long) <= len &&
+           *(long *)(old + i) == *(long *)(new + i)) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < len && old[i] == new[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_len_int(const uint8_t *old, const uint8_t *new, int len)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+    int i = 0;
+
+    while (i < len && ((uintptr_t)(old + i) % sizeof(long))) {
+        if (old[i] == new[i]) {
+            return i;
+        }
+        i++;
+    }
+
+    /* word at a time, until a word has an unchanged byte */
+    while (i + sizeof(long) <= len) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old + i) ^ *(unsigned long *)(new + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            break;
+        }
+        i += sizeof(long);
+    }
+
+    while (i < len && old[i] != new[i]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#include <immintrin.h>
+#include "qemu/cpuid.h"
+
+/* The vector run finders compare a vector at a time, turn the result into
+ * a mask with one bit per equal byte and look for the first bit that ends
+ * the run.  The remainder is left to the integer version.  */
+
+static int zrun_len_sse2(const uint8_t *old, const uint8_t *new, int len)
+{
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        uint32_t eq = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(old + i)),
+                           _mm_loadu_si128((__m128i *)(new + i))));
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return i + zrun_len_int(old + i, new + i, len - i);
+}
+
+static int nzrun_len_sse2(const uint8_t *old, const uint8_t *new, int len)
+{
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        uint32_t eq = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(old + i)),
+                           _mm_loadu_si128((__m128i *)(new + i))));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return i + nzrun_len_int(old + i, new + i, len - i);
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static int zrun_len_avx2(const uint8_t *old, const uint8_t *new, int len)
+{
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        uint32_t eq = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(old + i)),
+                              _mm256_loadu_si256((__m256i *)(new + i))));
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return i + zrun_len_sse2(old + i, new + i, len - i);
+}
+
+static int nzrun_len_avx2(const uint8_t *old, const uint8_t *new, int len)
+{
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        uint32_t eq = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(old + i)),
+                              _mm256_loadu_si256((__m256i *)(new + i))));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return i + nzrun_len_sse2(old + i, new + i, len - i);
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+#endif
+
+/*
+ * The implementations usable on this host, best first.  xbzrle_accel is
+ * picked at startup; test_xbzrle_encode_next_accel() steps down the list so
+ * that the tests can exercise every implementation.
+ */
+typedef struct XbzrleAccel {
+    const char *name;
+    int (*zrun_len)(const uint8_t *, const uint8_t *, int);
+    int (*nzrun_len)(const uint8_t *, const uint8_t *, int);
+    bool (*available)(void);
+} XbzrleAccel;
+
+static const XbzrleAccel xbzrle_accels[] = {
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", zrun_len_avx2, nzrun_len_avx2, cpuid_has_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", zrun_len_sse2, nzrun_len_sse2, NULL },
+#endif
+    { "int", zrun_len_int, nzrun_len_int, NULL },
+};
+
+static unsigned xbzrle_accel_index;
+static const XbzrleAccel *xbzrle_accel = &xbzrle_accels[0];
+
+static void xbzrle_select_accel(unsigned first)
+{
+    unsigned i;
+
+    for (i = first; i < ARRAY_SIZE(xbzrle_accels); i++) {
+        const XbzrleAccel *a = &xbzrle_accels[i];
+
+        if (!a->available || a->available()) {
+            xbzrle_accel_index = i;
+            xbzrle_accel = a;
+            return;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void __attribute__((constructor)) xbzrle_init_accel(void)
+{
+    xbzrle_select_accel(0);
+}
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    if (xbzrle_accel_index + 1 >= ARRAY_SIZE(xbzrle_accels)) {
+        return false;
+    }
+    xbzrle_select_accel(xbzrle_accel_index + 1);
+    return true;
+}
+
+const char *test_xbzrle_encode_accel_name(void)
+{
+    return xbzrle_accels[xbzrle_accel_index].name;
+}
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
+    const XbzrleAccel *accel = xbzrle_accel;
+    int zrun_len, nzrun_len;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +241,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = accel->zrun_len(old_buf + i, new_buf + i, slen - i);
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,51 +256,21 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = accel->nzrun_len(old_buf + i, new_buf + i, slen - i);
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i += nzrun_len;
     }
 
     return d;
@@ -0,0 +1,405 @@
+/*
+ * AF_PACKET memory-mapped ring network backend
+ *
+ * Exchanges packets with a host network interface through the receive and
+ * transmit rings of an AF_PACKET socket (PACKET_MMAP, TPACKET_V2), so that
+ * whole bursts go in and out without a syscall per packet.
+ *
+ * Every frame of a ring has the same size.  A received packet that does not
+ * fit is truncated by the kernel and dropped here, so the frames must be
+ * large enough for what the interface delivers: with GRO, GSO or TSO on,
+ * that can be up to 64 KiB.  Drops are counted in "info network".
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "trace.h"
+
+/* Large enough for a 1500 byte MTU frame with a VLAN tag.  */
+#define AF_PACKET_DEFAULT_FRAME_SIZE 2048
+/* Large enough for a 64 KiB GSO or GRO frame and the frame header.  */
+#define AF_PACKET_MAX_FRAME_SIZE (128 * 1024)
+#define AF_PACKET_DEFAULT_FRAMES 256
+#define AF_PACKET_MAX_FRAMES 65536
+
+/* Where the kernel expects the packet data of a transmit frame.  */
+#define AF_PACKET_TX_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+typedef struct AFPacketState {
+    NetClientState nc;
+    int fd;
+    char *ifname;
+    uint8_t *map;
+    size_t map_size;
+    uint8_t *rx_ring;
+    uint8_t *tx_ring;
+    unsigned int frames;
+    unsigned int frame_size;
+    /* Packets that did not fit in a frame.  */
+    uint64_t rx_dropped;
+    uint64_t tx_dropped;
+    unsigned int rx_head;
+    unsigned int tx_head;
+    /* Frames were queued on the transmit ring since the last kick.  */
+    bool tx_pending;
+    bool read_poll;
+    bool write_poll;
+} AFPacketState;
+
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static struct tpacket2_hdr *af_packet_frame(AFPacketState *s, uint8_t *ring,
+                                            unsigned int i)
+{
+    return (struct tpacket2_hdr *)(ring + (size_t)i * s->frame_size);
+}
+
+static void af_packet_update_info_str(AFPacketState *s)
+{
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "ifname=%s,frames=%u,frame-size=%u,"
+             "rx-dropped=%" PRIu64 ",tx-dropped=%" PRIu64,
+             s->ifname, s->frames, s->frame_size,
+             s->rx_dropped, s->tx_dropped);
+}
+
+/* Count a packet that did not fit in a frame, and say why on the first one */
+static void af_packet_drop(AFPacketState *s, bool rx, size_t len)
+{
+    if (!s->rx_dropped && !s->tx_dropped) {
+        error_report("af-packet: dropping %zu byte packet, frames hold %u "
+                     "bytes; raise frame-size or turn off GRO, GSO and "
+                     "TSO on %s", len, s->frame_size, s->ifname);
+    }
+    if (rx) {
+        s->rx_dropped++;
+    } else {
+        s->tx_dropped++;
+    }
+    trace_af_packet_drop(s->ifname, rx, len, s->frame_size);
+    af_packet_update_info_str(s);
+}
+
+static void af_packet_update_fd_handler(AFPacketState *s)
+{
+    qemu_set_fd_handler(s->fd,
+                        s->read_poll ? af_packet_send : NULL,
+                        s->write_poll ? af_packet_writable : NULL,
+                        s);
+}
+
+static void af_packet_read_poll(AFPacketState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_write_poll(AFPacketState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+static void af_packet_poll(NetClientState *nc, bool enable)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_packet_update_fd_handler(s);
+    }
+}
+
+/* Ask the kernel to transmit every frame queued on the ring.  */
+static void af_packet_flush_tx(AFPacketState *s)
+{
+    ssize_t ret;
+
+    if (!s->tx_pending) {
+        return;
+    }
+    do {
+        ret = send(s->fd, NULL, 0, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && (errno == EAGAIN || errno == ENOBUFS)) {
+        af_packet_write_poll(s, true);
+        return;
+    }
+    s->tx_pending = false;
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AFPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+    af_packet_flush_tx(s);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+    struct tpacket2_hdr *hdr = af_packet_frame(s, s->tx_ring, s->tx_head);
+    size_t size = iov_size(iov, iovcnt);
+
+    if (size > s->frame_size - AF_PACKET_TX_OFFSET) {
+        af_packet_drop(s, false, size);
+        return size;
+    }
+
+    if (atomic_read(&hdr->tp_status) != TP_STATUS_AVAILABLE) {
+        /* The ring is full; kick it and wait until a frame is free.  */
+        af_packet_flush_tx(s);
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+
+    iov_to_buf(iov, iovcnt, 0, (uint8_t *)hdr + AF_PACKET_TX_OFFSET, size);
+    hdr->tp_len = size;
+    smp_wmb();
+    atomic_set(&hdr->tp_status, TP_STATUS_SEND_REQUEST);
+    s->tx_head = (s->tx_head + 1) % s->frames;
+    s->tx_pending = true;
+
+    /* Inside a burst, a single kick at the end sends everything.  */
+    if (!qemu_net_in_batch(nc)) {
+        af_packet_flush_tx(s);
+    }
+    return size;
+}
+
+static ssize_t af_packet_receive(NetClientState *nc,
+                                 const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+static void af_packet_receive_batch_end(NetClientState *nc)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    af_packet_flush_tx(s);
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+/* Deliver the frames the kernel has filled in as a single burst.  */
+static void af_packet_send(void *opaque)
+{
+    AFPacketState *s = opaque;
+    unsigned int packets;
+
+    qemu_net_batch_begin(&s->nc);
+    for (packets = 0; packets < s->frames; packets++) {
+        struct tpacket2_hdr *hdr = af_packet_frame(s, s->rx_ring,
+                                                   s->rx_head);
+        struct sockaddr_ll *sll;
+        ssize_t size = -1;
+
+        if (!(atomic_read(&hdr->tp_status) & TP_STATUS_USER)) {
+            break;
+        }
+        smp_rmb();
+
+        /* Skip our own transmissions and frames that did not fit.  */
+        sll = (struct sockaddr_ll *)((uint8_t *)hdr +
+                                     TPACKET_ALIGN(sizeof(*hdr)));
+        if (sll->sll_pkttype == PACKET_OUTGOING) {
+            /* nothing */
+        } else if (hdr->tp_snaplen != hdr->tp_len) {
+            af_packet_drop(s, true, hdr->tp_len);
+        } else {
+            size = qemu_send_packet_async(&s->nc, (uint8_t *)hdr + hdr->tp_mac,
+                                          hdr->tp_snaplen,
+                                          af_packet_send_completed);
+        }
+
+        /* The peer has consumed the frame or queued a copy of it.  */
+        smp_mb();
+        atomic_set(&hdr->tp_status, TP_STATUS_KERNEL);
+        s->rx_head = (s->rx_head + 1) % s->frames;
+
+        if (size == 0) {
+            af_packet_read_poll(s, false);
+            break;
+        }
+    }
+    qemu_net_batch_end(&s->nc);
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AFPacketState *s = DO_UPCAST(AFPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+    af_packet_poll(nc, false);
+    munmap(s->map, s->map_size);
+    close(s->fd);
+    g_free(s->ifname);
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_DRIVER_AF_PACKET,
+    .size = sizeof(AFPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .receive_batch_end = af_packet_receive_batch_end,
+    .poll = af_packet_poll,
+    .cleanup = af_packet_cleanup,
+};
+
+int net_init_af_packet(const Netdev *netdev, const char *name,
+                       NetClientState *peer, Error **errp)
+{
+    const NetdevAFPacketOptions *opts = &netdev->u.af_packet;
+    unsigned int frames = AF_PACKET_DEFAULT_FRAMES;
+    unsigned int frame_size = AF_PACKET_DEFAULT_FRAME_SIZE;
+    unsigned int block_size, block_frames;
+    int version = TPACKET_V2;
+    int one = 1;
+    struct tpacket_req req;
+    struct packet_mreq mreq;
+    struct sockaddr_ll sll;
+    unsigned int ifindex;
+    NetClientState *nc;
+    AFPacketState *s;
+    size_t ring_size;
+    uint8_t *map;
+    int fd;
+
+    if (opts->has_frames) {
+        if (opts->frames == 0 || opts->frames > AF_PACKET_MAX_FRAMES) {
+            error_setg(errp, "af-packet: frames must be between 1 and %d",
+                       AF_PACKET_MAX_FRAMES);
+            return -1;
+        }
+        frames = opts->frames;
+    }
+    if (opts->has_frame_size) {
+        if (opts->frame_size < AF_PACKET_DEFAULT_FRAME_SIZE ||
+            opts->frame_size > AF_PACKET_MAX_FRAME_SIZE ||
+            !is_power_of_2(opts->frame_size)) {
+            error_setg(errp, "af-packet: frame-size must be a power of 2 "
+                       "between %d and %d", AF_PACKET_DEFAULT_FRAME_SIZE,
+                       AF_PACKET_MAX_FRAME_SIZE);
+            return -1;
+        }
+        frame_size = opts->frame_size;
+    }
+    /* Each ring block is at least a page and holds a whole number of
+     * frames.  */
+    block_size = MAX(getpagesize(), frame_size);
+    block_frames = block_size / frame_size;
+    frames = ROUND_UP(frames, block_frames);
+
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "af-packet: unknown interface %s",
+                         opts->ifname);
+        return -1;
+    }
+
+    fd = qemu_socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't create socket");
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = block_size;
+    req.tp_block_nr = frames / block_frames;
+    req.tp_frame_size = frame_size;
+    req.tp_frame_nr = frames;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0 ||
+        setsockopt(fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) < 0 ||
+        setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0 ||
+        setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't set up packet rings");
+        goto fail;
+    }
+
+    /* The receive ring comes first, then the transmit ring.  */
+    ring_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    map = mmap(NULL, 2 * ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "af-packet: can't map packet rings");
+        goto fail;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't bind to %s",
+                         opts->ifname);
+        munmap(map, 2 * ring_size);
+        goto fail;
+    }
+
+    /* The guest has its own MAC address.  */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_setg_errno(errp, errno, "af-packet: can't make %s promiscuous",
+                         opts->ifname);
+        munmap(map, 2 * ring_size);
+        goto fail;
+    }
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet", name);
+
+    s = DO_UPCAST(AFPacketState, nc, nc);
+    s->fd = fd;
+    s->ifname = g_strdup(opts->ifname);
+    s->map = map;
+    s->map_size = 2 * ring_size;
+    s->rx_ring = map;
+    s->tx_ring = map + ring_size;
+    s->frames = frames;
+    s->frame_size = frame_size;
+    af_packet_update_info_str(s);
+    af_packet_read_poll(s, true);
+    return 0;
+
+fail:
+    closesocket(fd);
+    return -1;
+}
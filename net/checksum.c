@@ -19,20 +19,88 @@
 #include "qemu-common.h"
 #include "net/checksum.h"
 #include "net/eth.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline uint32_t net_checksum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+/*
+ * Ones' complement sum of @len bytes taken as host-endian 32-bit words,
+ * @len being a multiple of 4.  Since the ones' complement sum does not
+ * depend on byte order (RFC 1071), the folded result only needs a byte
+ * swap on little-endian hosts to match a sum of big-endian 16-bit words.
+ */
+static uint32_t net_checksum_add_words(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+
+#ifdef __SSE2__
+    if (len >= 64) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+        uint64_t lanes[2];
+
+        /* Widen each 32-bit word into a 64-bit lane, so that carries
+         * are kept in the upper half and no fold is needed in the loop.  */
+        for (; len >= 16; buf += 16, len -= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+
+            acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+            acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum = net_checksum_fold(lanes[0]) + net_checksum_fold(lanes[1]);
+    }
+#endif
+
+    for (; len >= 16; buf += 16, len -= 16) {
+        sum += (uint64_t)(uint32_t)ldl_he_p(buf) +
+               (uint32_t)ldl_he_p(buf + 4) +
+               (uint32_t)ldl_he_p(buf + 8) +
+               (uint32_t)ldl_he_p(buf + 12);
+    }
+    for (; len >= 4; buf += 4, len -= 4) {
+        sum += (uint32_t)ldl_he_p(buf);
+    }
+
+#ifdef HOST_WORDS_BIGENDIAN
+    return net_checksum_fold(sum);
+#else
+    return bswap16(net_checksum_fold(sum));
+#endif
+}
 
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum = 0;
-    int i;
+    uint32_t sum;
+    int words, i;
+
+    if (len <= 0) {
+        return 0;
+    }
 
-    for (i = seq; i < seq + len; i++) {
+    words = len & ~3;
+    sum = net_checksum_add_words(buf, words);
+    for (i = words; i < len; i++) {
         if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
+            sum += (uint32_t)buf[i];
         } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+            sum += (uint32_t)buf[i] << 8;
         }
     }
-    return sum;
+    sum = net_checksum_fold(sum);
+
+    /* Data that starts at an odd offset of the checksummed area has its
+     * bytes in the other halves of the 16-bit words.  */
+    return seq & 1 ? bswap16(sum) : sum;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -32,11 +32,16 @@
 #include "qemu/timer.h"
 #include "qapi/visitor.h"
 #include "net/filter.h"
+#include "net/net.h"
 
 typedef struct DumpState {
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+    /* Records staged for one large write, if buf is not NULL */
+    uint8_t *buf;
+    size_t buf_size;
+    size_t buf_used;
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -60,7 +65,30 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
-static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt)
+static void dump_write_error(DumpState *s)
+{
+    error_report("network dump write error - stopping dump");
+    close(s->fd);
+    s->fd = -1;
+}
+
+/* Write out the staged records.  */
+static void dump_flush(DumpState *s)
+{
+    if (s->fd >= 0 && s->buf_used &&
+        qemu_write_full(s->fd, s->buf, s->buf_used) != s->buf_used) {
+        dump_write_error(s);
+    }
+    s->buf_used = 0;
+}
+
+/*
+ * Add a packet to the dump.  If @defer is true more packets are on their
+ * way, so the record may stay in the staging buffer until it fills up or
+ * dump_flush() is called.
+ */
+static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt,
+                                bool defer)
 {
     struct pcap_sf_pkthdr hdr;
     int64_t ts;
@@ -81,14 +109,31 @@ static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt)
     hdr.caplen = caplen;
     hdr.len = size;
 
+    if (s->buf && sizeof(hdr) + caplen <= s->buf_size) {
+        if (s->buf_used + sizeof(hdr) + caplen > s->buf_size) {
+            dump_flush(s);
+        }
+        memcpy(s->buf + s->buf_used, &hdr, sizeof(hdr));
+        iov_to_buf(iov, cnt, 0, s->buf + s->buf_used + sizeof(hdr), caplen);
+        s->buf_used += sizeof(hdr) + caplen;
+        if (!defer) {
+            dump_flush(s);
+        }
+        return size;
+    }
+
+    /* Too big to stage; keep the records in order.  */
+    dump_flush(s);
+    if (s->fd < 0) {
+        return size;
+    }
+
     dumpiov[0].iov_base = &hdr;
     dumpiov[0].iov_len = sizeof(hdr);
     cnt = iov_copy(&dumpiov[1], cnt, iov, cnt, 0, caplen);
 
     if (writev(s->fd, dumpiov, cnt + 1) != sizeof(hdr) + caplen) {
-        error_report("network dump write error - stopping dump");
-        close(s->fd);
-        s->fd = -1;
+        dump_write_error(s);
     }
 
     return size;
@@ -96,8 +141,11 @@ static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt)
 
 static void dump_cleanup(DumpState *s)
 {
+    dump_flush(s);
     close(s->fd);
     s->fd = -1;
+    g_free(s->buf);
+    s->buf = NULL;
 }
 
 static int net_dump_state_init(DumpState *s, const char *filename,
@@ -153,7 +201,7 @@ static ssize_t dumpclient_receive(NetClientState *nc, const uint8_t *buf,
         .iov_len = size
     };
 
-    return dump_receive_iov(&dc->ds, &iov, 1);
+    return dump_receive_iov(&dc->ds, &iov, 1, false);
 }
 
 static ssize_t dumpclient_receive_iov(NetClientState *nc,
@@ -161,7 +209,7 @@ static ssize_t dumpclient_receive_iov(NetClientState *nc,
 {
     DumpNetClient *dc = DO_UPCAST(DumpNetClient, nc, nc);
 
-    return dump_receive_iov(&dc->ds, iov, cnt);
+    return dump_receive_iov(&dc->ds, iov, cnt, false);
 }
 
 static void dumpclient_cleanup(NetClientState *nc)
@@ -233,6 +281,9 @@ int net_init_dump(const Netdev *netdev, const char *name,
 
 #define TYPE_FILTER_DUMP "filter-dump"
 
+/* Records of a burst are staged in a buffer of this size by default.  */
+#define FILTER_DUMP_DEFAULT_BUFSIZE (256 * 1024)
+
 #define FILTER_DUMP(obj) \
     OBJECT_CHECK(NetFilterDumpState, (obj), TYPE_FILTER_DUMP)
 
@@ -241,6 +292,7 @@ struct NetFilterDumpState {
     DumpState ds;
     char *filename;
     uint32_t maxlen;
+    uint32_t bufsize;
 };
 typedef struct NetFilterDumpState NetFilterDumpState;
 
@@ -250,10 +302,27 @@ static ssize_t filter_dump_receive_iov(NetFilterState *nf, NetClientState *sndr,
 {
     NetFilterDumpState *nfds = FILTER_DUMP(nf);
 
-    dump_receive_iov(&nfds->ds, iov, iovcnt);
+    /* Within a burst, the records are written when it ends.  */
+    dump_receive_iov(&nfds->ds, iov, iovcnt, qemu_net_sending_batch(sndr));
     return 0;
 }
 
+static void filter_dump_receive_batch_end(NetFilterState *nf)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(nf);
+
+    dump_flush(&nfds->ds);
+}
+
+static void filter_dump_status_changed(NetFilterState *nf, Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(nf);
+
+    if (!nf->on) {
+        dump_flush(&nfds->ds);
+    }
+}
+
 static void filter_dump_cleanup(NetFilterState *nf)
 {
     NetFilterDumpState *nfds = FILTER_DUMP(nf);
@@ -270,7 +339,14 @@ static void filter_dump_setup(NetFilterState *nf, Error **errp)
         return;
     }
 
-    net_dump_state_init(&nfds->ds, nfds->filename, nfds->maxlen, errp);
+    if (net_dump_state_init(&nfds->ds, nfds->filename, nfds->maxlen,
+                            errp) < 0) {
+        return;
+    }
+    if (nfds->bufsize) {
+        nfds->ds.buf = g_malloc(nfds->bufsize);
+        nfds->ds.buf_size = nfds->bufsize;
+    }
 }
 
 static void filter_dump_get_maxlen(Object *obj, Visitor *v, const char *name,
@@ -304,6 +380,37 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void filter_dump_get_bufsize(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+    uint32_t value = nfds->bufsize;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void filter_dump_set_bufsize(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (nfds->ds.buf) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once the "
+                   "dump has started", object_get_typename(obj), name);
+        goto out;
+    }
+    nfds->bufsize = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static char *file_dump_get_filename(Object *obj, Error **errp)
 {
     NetFilterDumpState *nfds = FILTER_DUMP(obj);
@@ -324,9 +431,12 @@ static void filter_dump_instance_init(Object *obj)
     NetFilterDumpState *nfds = FILTER_DUMP(obj);
 
     nfds->maxlen = 65536;
+    nfds->bufsize = FILTER_DUMP_DEFAULT_BUFSIZE;
 
     object_property_add(obj, "maxlen", "int", filter_dump_get_maxlen,
                         filter_dump_set_maxlen, NULL, NULL, NULL);
+    object_property_add(obj, "bufsize", "int", filter_dump_get_bufsize,
+                        filter_dump_set_bufsize, NULL, NULL, NULL);
     object_property_add_str(obj, "file", file_dump_get_filename,
                             file_dump_set_filename, NULL);
 }
@@ -345,6 +455,8 @@ static void filter_dump_class_init(ObjectClass *oc, void *data)
     nfc->setup = filter_dump_setup;
     nfc->cleanup = filter_dump_cleanup;
     nfc->receive_iov = filter_dump_receive_iov;
+    nfc->receive_batch_end = filter_dump_receive_batch_end;
+    nfc->status_changed = filter_dump_status_changed;
 }
 
 static const TypeInfo filter_dump_info = {
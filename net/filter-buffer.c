@@ -8,6 +8,7 @@
 
 #include "qemu/osdep.h"
 #include "net/filter.h"
+#include "net/net.h"
 #include "net/queue.h"
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -33,11 +34,21 @@ typedef struct FilterBufferState {
 static void filter_buffer_flush(NetFilterState *nf)
 {
     FilterBufferState *s = FILTER_BUFFER(nf);
+    NetClientState *peer = nf->netdev->peer;
 
+    /* Release the held packets as one burst in each direction.  */
+    qemu_net_batch_begin(nf->netdev);
+    if (peer) {
+        qemu_net_batch_begin(peer);
+    }
     if (!qemu_net_queue_flush(s->incoming_queue)) {
         /* Unable to empty the queue, purge remaining packets */
         qemu_net_queue_purge(s->incoming_queue, nf->netdev);
     }
+    if (peer) {
+        qemu_net_batch_end(peer);
+    }
+    qemu_net_batch_end(nf->netdev);
 }
 
 static void filter_buffer_release_timer(void *opaque)
@@ -34,6 +34,9 @@
 #define TYPE_FILTER_REDIRECTOR "filter-redirector"
 #define REDIRECTOR_MAX_LEN NET_BUFSIZE
 
+/* Packets with up to this many fragments are sent without allocating */
+#define MIRROR_IOV_LOCAL 16
+
 typedef struct MirrorState {
     NetFilterState parent_obj;
     char *indev;
@@ -50,24 +53,30 @@ static int filter_mirror_send(CharDriverState *chr_out,
     int ret = 0;
     ssize_t size = 0;
     uint32_t len =  0;
-    char *buf;
+    struct iovec local[MIRROR_IOV_LOCAL + 1];
+    struct iovec *out;
 
     size = iov_size(iov, iovcnt);
     if (!size) {
         return 0;
     }
 
+    /* Send the length and the packet with a single vectored write,
+     * straight from the buffers of the packet. */
     len = htonl(size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
+    if (iovcnt <= MIRROR_IOV_LOCAL) {
+        out = local;
+    } else {
+        out = g_new(struct iovec, iovcnt + 1);
     }
-
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)buf, size);
-    g_free(buf);
-    if (ret != size) {
+    out[0].iov_base = &len;
+    out[0].iov_len = sizeof(len);
+    memcpy(&out[1], iov, iovcnt * sizeof(*iov));
+    ret = qemu_chr_fe_writev_all(chr_out, out, iovcnt + 1);
+    if (out != local) {
+        g_free(out);
+    }
+    if (ret != sizeof(len) + size) {
         goto err;
     }
 
@@ -43,6 +43,15 @@ ssize_t qemu_netfilter_receive(NetFilterState *nf,
     return 0;
 }
 
+void qemu_netfilter_batch_end(NetFilterState *nf)
+{
+    NetFilterClass *nfc = NETFILTER_GET_CLASS(OBJECT(nf));
+
+    if (!qemu_can_skip_netfilter(nf) && nfc->receive_batch_end) {
+        nfc->receive_batch_end(nf);
+    }
+}
+
 static NetFilterState *netfilter_next(NetFilterState *nf,
                                       NetFilterDirection dir)
 {
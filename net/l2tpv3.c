@@ -75,6 +75,15 @@ typedef struct NetL2TPV3State {
 
     struct mmsghdr *msgvec;
 
+    /*
+     * these are used for xmit while the peer sends a burst - packets
+     * are copied and go out with a single sendmmsg when it ends
+     */
+
+    struct mmsghdr *tx_msgvec;
+    int tx_head;
+    int tx_count;
+
     /*
      * peer address
      */
@@ -159,10 +168,39 @@ static void l2tpv3_write_poll(NetL2TPV3State *s, bool enable)
     }
 }
 
+/* Send the packets staged during a burst.  Returns false if the socket
+ * is full; the remaining packets are then sent when it becomes writable.
+ */
+static bool l2tpv3_flush_tx(NetL2TPV3State *s)
+{
+    int count;
+
+    while (s->tx_count) {
+        do {
+            count = sendmmsg(s->fd, s->tx_msgvec + s->tx_head, s->tx_count, 0);
+        } while ((count == -1) && (errno == EINTR));
+        if (count < 0) {
+            if (errno == EAGAIN || errno == ENOBUFS) {
+                l2tpv3_write_poll(s, true);
+                return false;
+            }
+            /* drop the packet, as a failing sendmsg would */
+            count = 1;
+        }
+        s->tx_head += count;
+        s->tx_count -= count;
+    }
+    s->tx_head = 0;
+    return true;
+}
+
 static void l2tpv3_writable(void *opaque)
 {
     NetL2TPV3State *s = opaque;
     l2tpv3_write_poll(s, false);
+    if (!l2tpv3_flush_tx(s)) {
+        return;
+    }
     qemu_flush_queued_packets(&s->nc);
 }
 
@@ -213,6 +251,39 @@ static void l2tpv3_form_header(NetL2TPV3State *s)
     }
 }
 
+/* Copy a packet into the burst vector.  Returns -1 if it does not fit
+ * in a buffer and must be sent on its own.
+ */
+static ssize_t l2tpv3_stage_tx(NetL2TPV3State *s,
+                    const struct iovec *iov,
+                    int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    struct iovec *vec;
+
+    if (size > BUFFER_SIZE) {
+        return -1;
+    }
+    if (s->tx_head + s->tx_count == MAX_L2TPV3_MSGCNT &&
+        !l2tpv3_flush_tx(s)) {
+        return 0;
+    }
+    l2tpv3_form_header(s);
+    vec = s->tx_msgvec[s->tx_head + s->tx_count].msg_hdr.msg_iov;
+    memcpy(vec->iov_base, s->header_buf, s->offset);
+    vec->iov_len = s->offset;
+    vec++;
+    vec->iov_len = iov_to_buf(iov, iovcnt, 0, vec->iov_base, size);
+    s->tx_count++;
+    return size;
+}
+
+static void l2tpv3_receive_batch_end(NetClientState *nc)
+{
+    NetL2TPV3State *s = DO_UPCAST(NetL2TPV3State, nc, nc);
+    l2tpv3_flush_tx(s);
+}
+
 static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
                     const struct iovec *iov,
                     int iovcnt)
@@ -222,6 +293,16 @@ static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
     struct msghdr message;
     int ret;
 
+    if (qemu_net_in_batch(nc)) {
+        ret = l2tpv3_stage_tx(s, iov, iovcnt);
+        if (ret >= 0) {
+            return ret;
+        }
+    }
+    /* keep ordering with the packets of an earlier burst */
+    if (!l2tpv3_flush_tx(s)) {
+        return 0;
+    }
     if (iovcnt > MAX_L2TPV3_IOVCNT - 1) {
         error_report(
             "iovec too long %d > %d, change l2tpv3.h",
@@ -271,6 +352,11 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     struct msghdr message;
     ssize_t ret = 0;
 
+    if (qemu_net_in_batch(nc) || s->tx_count) {
+        struct iovec iov = { .iov_base = (void *) buf, .iov_len = size };
+        return net_l2tpv3_receive_dgram_iov(nc, &iov, 1);
+    }
+
     l2tpv3_form_header(s);
     vec = s->vec;
     vec->iov_base = s->header_buf;
@@ -354,6 +440,7 @@ static void net_l2tpv3_process_queue(NetL2TPV3State *s)
 
     /* go into ring mode only if there is a "pending" tail */
     if (s->queue_depth > 0) {
+        qemu_net_batch_begin(&s->nc);
         do {
             msgvec = s->msgvec + s->queue_tail;
             if (msgvec->msg_len > 0) {
@@ -394,6 +481,7 @@ static void net_l2tpv3_process_queue(NetL2TPV3State *s)
                  qemu_can_send_packet(&s->nc) &&
                 ((size > 0) || bad_read)
             );
+        qemu_net_batch_end(&s->nc);
     }
 }
 
@@ -510,6 +598,7 @@ static void net_l2tpv3_cleanup(NetClientState *nc)
         close(s->fd);
     }
     destroy_vector(s->msgvec, MAX_L2TPV3_MSGCNT, IOVSIZE);
+    destroy_vector(s->tx_msgvec, MAX_L2TPV3_MSGCNT, IOVSIZE);
     g_free(s->vec);
     g_free(s->header_buf);
     g_free(s->dgram_dst);
@@ -520,6 +609,7 @@ static NetClientInfo net_l2tpv3_info = {
     .size = sizeof(NetL2TPV3State),
     .receive = net_l2tpv3_receive_dgram,
     .receive_iov = net_l2tpv3_receive_dgram_iov,
+    .receive_batch_end = l2tpv3_receive_batch_end,
     .poll = l2tpv3_poll,
     .cleanup = net_l2tpv3_cleanup,
 };
@@ -532,7 +622,7 @@ int net_init_l2tpv3(const Netdev *netdev,
     const NetdevL2TPv3Options *l2tpv3;
     NetL2TPV3State *s;
     NetClientState *nc;
-    int fd = -1, gairet;
+    int fd = -1, gairet, i;
     struct addrinfo hints;
     struct addrinfo *result = NULL;
     char *srcport, *dstport;
@@ -718,6 +808,11 @@ int net_init_l2tpv3(const Netdev *netdev,
     }
 
     s->msgvec = build_l2tpv3_vector(s, MAX_L2TPV3_MSGCNT);
+    s->tx_msgvec = build_l2tpv3_vector(s, MAX_L2TPV3_MSGCNT);
+    for (i = 0; i < MAX_L2TPV3_MSGCNT; i++) {
+        s->tx_msgvec[i].msg_hdr.msg_name = s->dgram_dst;
+        s->tx_msgvec[i].msg_hdr.msg_namelen = s->dst_size;
+    }
     s->vec = g_new(struct iovec, MAX_L2TPV3_IOVCNT);
     s->header_buf = g_malloc(s->header_size);
 
@@ -66,6 +66,9 @@ const char *host_net_devices[] = {
 #ifdef CONFIG_NETMAP
     "netmap",
 #endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet",
+#endif
 #ifdef CONFIG_SLIRP
     "user",
 #endif
@@ -766,6 +769,64 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+static void qemu_netfilters_batch_end(NetClientState *nc)
+{
+    NetFilterState *nf;
+
+    QTAILQ_FOREACH(nf, &nc->filters, next) {
+        qemu_netfilter_batch_end(nf);
+    }
+}
+
+/* Bracket a burst of packets sent by @nc.  While the burst lasts, a peer
+ * that implements receive_batch_end may defer per-packet work, such as
+ * notifying the guest or issuing one syscall per packet, and do it once
+ * in receive_batch_end.  The filters of @nc and of its peer are told
+ * about the end of the burst in the same way.  Bursts nest.
+ */
+void qemu_net_batch_begin(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    nc->send_batch++;
+    if (peer && peer->info->receive_batch_end) {
+        peer->receive_batch++;
+    }
+}
+
+void qemu_net_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    assert(nc->send_batch);
+    if (--nc->send_batch == 0) {
+        /* Filters may still hand packets to the peer, so they go first.  */
+        qemu_netfilters_batch_end(nc);
+        if (peer) {
+            qemu_netfilters_batch_end(peer);
+        }
+    }
+
+    if (peer && peer->info->receive_batch_end) {
+        assert(peer->receive_batch);
+        if (--peer->receive_batch == 0) {
+            peer->info->receive_batch_end(peer);
+        }
+    }
+}
+
+/* Whether the packet @nc is receiving is part of a burst.  */
+bool qemu_net_in_batch(NetClientState *nc)
+{
+    return nc->receive_batch > 0;
+}
+
+/* Whether the packet @nc is sending is part of a burst.  */
+bool qemu_net_sending_batch(NetClientState *nc)
+{
+    return nc->send_batch > 0;
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -957,6 +1018,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_L2TPV3
         [NET_CLIENT_DRIVER_L2TPV3]    = net_init_l2tpv3,
 #endif
+#ifdef CONFIG_AF_PACKET
+        [NET_CLIENT_DRIVER_AF_PACKET] = net_init_af_packet,
+#endif
 };
 
 
@@ -1030,6 +1094,10 @@ static int net_client_init1(const void *object, bool is_netdev, Error **errp)
             legacy.type = NET_CLIENT_DRIVER_VHOST_USER;
             legacy.u.vhost_user = *opts->u.vhost_user.data;
             break;
+        case NET_LEGACY_OPTIONS_KIND_AF_PACKET:
+            legacy.type = NET_CLIENT_DRIVER_AF_PACKET;
+            legacy.u.af_packet = *opts->u.af_packet.data;
+            break;
         default:
             abort();
         }
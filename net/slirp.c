@@ -111,15 +111,40 @@ void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
     qemu_send_packet(&s->nc, pkt, pkt_len);
 }
 
+void slirp_output_batch_begin(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    qemu_net_batch_begin(&s->nc);
+}
+
+void slirp_output_batch_end(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    qemu_net_batch_end(&s->nc);
+}
+
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
-    slirp_input(s->slirp, buf, size);
+    if (qemu_net_in_batch(nc)) {
+        slirp_input_deferred(s->slirp, buf, size);
+    } else {
+        slirp_input(s->slirp, buf, size);
+    }
 
     return size;
 }
 
+static void net_slirp_receive_batch_end(NetClientState *nc)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    slirp_input_flush(s->slirp);
+}
+
 static void slirp_smb_exit(Notifier *n, void *data)
 {
     SlirpState *s = container_of(n, SlirpState, exit_notifier);
@@ -142,6 +167,7 @@ static NetClientInfo net_slirp_info = {
     .type = NET_CLIENT_DRIVER_USER,
     .size = sizeof(SlirpState),
     .receive = net_slirp_receive,
+    .receive_batch_end = net_slirp_receive_batch_end,
     .cleanup = net_slirp_cleanup,
 };
 
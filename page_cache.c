@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,12 +29,29 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* Pages are placed in sets of CACHE_WAYS items by address; within a set
+ * the item with the lowest score is replaced.  The score is the number of
+ * useful deltas the page produced, halved for every bitmap generation in
+ * which it was not looked up.
+ */
+#define CACHE_WAYS 4
+#define CACHE_MAX_HITS 255
+
+/* After a poor delta the page is sent whole for this many times, doubling
+ * up to CACHE_MAX_SKIP while its deltas stay poor.
+ */
+#define CACHE_MIN_SKIP 1
+#define CACHE_MAX_SKIP 32
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    uint8_t it_hits;
+    uint8_t it_skip;
+    uint8_t it_backoff;
 };
 
 struct PageCache {
@@ -43,8 +60,19 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int num_ways;
 };
 
+static void cache_item_reset(CacheItem *it)
+{
+    it->it_data = NULL;
+    it->it_age = 0;
+    it->it_addr = -1;
+    it->it_hits = 0;
+    it->it_skip = 0;
+    it->it_backoff = 0;
+}
+
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 {
     int64_t i;
@@ -71,6 +99,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
@@ -84,9 +113,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+        cache_item_reset(&cache->page_cache[i]);
     }
 
     return cache;
@@ -108,28 +135,100 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Return the first item of the set @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
+    size_t num_sets = cache->max_num_items / cache->num_ways;
+    size_t set;
+
     g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    set = (address / cache->page_size) & (num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+static unsigned int cache_item_score(const CacheItem *it, uint64_t current_age)
+{
+    uint64_t idle = current_age - MIN(it->it_age, current_age);
+
+    return idle >= 8 ? 0 : it->it_hits >> idle;
+}
 
-    return &cache->page_cache[pos];
+/* Pick the item of the set to hold @addr: the one already holding it, an
+ * empty one, or the lowest scoring page that is no longer fresh.  Returns
+ * NULL if every page of the set is fresh.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (it->it_addr == addr || !it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        if (!victim ||
+            cache_item_score(it, current_age) <
+            cache_item_score(victim, current_age) ||
+            (cache_item_score(it, current_age) ==
+             cache_item_score(victim, current_age) &&
+             it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+    return victim;
+}
+
+/* Like cache_get_victim() but ignoring freshness, for cache_resize() */
+static CacheItem *cache_get_resize_slot(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = &set[0];
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_hits < victim->it_hits ||
+            (it->it_hits == victim->it_hits && it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -139,7 +238,7 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
         return true;
@@ -154,13 +253,11 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     CacheItem *it;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
+    it = cache_get_victim(cache, addr, current_age);
+    if (!it) {
         return -1;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -173,12 +270,51 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     memcpy(it->it_data, pdata, cache->page_size);
 
+    if (it->it_addr != addr) {
+        it->it_hits = 0;
+        it->it_skip = 0;
+        it->it_backoff = 0;
+    }
     it->it_age = current_age;
     it->it_addr = addr;
 
     return 0;
 }
 
+void cache_update_delta(PageCache *cache, uint64_t addr, bool good)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return;
+    }
+
+    if (good) {
+        if (it->it_hits < CACHE_MAX_HITS) {
+            it->it_hits++;
+        }
+        it->it_backoff = 0;
+    } else {
+        /* make the page the first candidate for replacement */
+        it->it_hits = 0;
+        it->it_backoff = it->it_backoff ?
+                         MIN(it->it_backoff * 2, CACHE_MAX_SKIP) :
+                         CACHE_MIN_SKIP;
+        it->it_skip = it->it_backoff;
+    }
+}
+
+bool cache_skip_delta(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it || !it->it_skip) {
+        return false;
+    }
+    it->it_skip--;
+    return true;
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
@@ -208,19 +344,22 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
+            /* check for collision, if there is, keep the better page */
             new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
+            if (!new_it) {
+                new_it = cache_get_resize_slot(new_cache, old_it->it_addr);
+            }
+            if (new_it->it_data &&
+                (new_it->it_hits > old_it->it_hits ||
+                 (new_it->it_hits == old_it->it_hits &&
+                  new_it->it_age >= old_it->it_age))) {
                 g_free(old_it->it_data);
             } else {
                 if (!new_it->it_data) {
                     new_cache->num_items++;
                 }
                 g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+                *new_it = *old_it;
             }
         }
     }
@@ -229,6 +368,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_ways = new_cache->num_ways;
 
     g_free(new_cache);
 
@@ -35,6 +35,7 @@
 #include "qapi/clone-visitor.h"
 #include "qapi-visit.h"
 #include "qemu/base64.h"
+#include "qemu/iov.h"
 #include "io/channel-socket.h"
 #include "io/channel-file.h"
 #include "io/channel-tls.h"
@@ -317,6 +318,56 @@ int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
     return offset;
 }
 
+int qemu_chr_fe_writev_all(CharDriverState *s, const struct iovec *iov,
+                           int iovcnt)
+{
+    struct iovec *local, *cur;
+    unsigned int cnt = iovcnt;
+    size_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
+    int res = 0;
+    int i;
+
+    /* The log and record/replay work on flat buffers.  */
+    if (!s->chr_writev || s->replay || s->logfd >= 0) {
+        for (i = 0; i < iovcnt; i++) {
+            res = qemu_chr_fe_write_all(s, iov[i].iov_base, iov[i].iov_len);
+            if (res < 0) {
+                return res;
+            }
+            done += res;
+            if (res < iov[i].iov_len) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    local = cur = g_memdup(iov, iovcnt * sizeof(*iov));
+    qemu_mutex_lock(&s->chr_write_lock);
+    while (done < size) {
+        res = s->chr_writev(s, cur, cnt);
+        if (res < 0 && errno == EAGAIN) {
+            g_usleep(100);
+            continue;
+        }
+
+        if (res <= 0) {
+            break;
+        }
+
+        done += res;
+        iov_discard_front(&cur, &cnt, res);
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+    g_free(local);
+
+    if (res < 0) {
+        return res;
+    }
+    return done;
+}
+
 int qemu_chr_fe_read_all(CharDriverState *s, uint8_t *buf, int len)
 {
     int offset = 0, counter = 10;
@@ -991,6 +1042,25 @@ static int io_channel_send_full(QIOChannel *ioc,
 }
 
 
+/* Send as much of @iov as the channel takes without blocking.  */
+static int io_channel_sendv_full(QIOChannel *ioc,
+                                 const struct iovec *iov, int iovcnt,
+                                 int *fds, size_t nfds)
+{
+    ssize_t ret = qio_channel_writev_full(ioc, iov, iovcnt, fds, nfds, NULL);
+
+    if (ret == QIO_CHANNEL_ERR_BLOCK) {
+        errno = EAGAIN;
+        return -1;
+    } else if (ret < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ret;
+}
+
+
 #ifndef _WIN32
 static int io_channel_send(QIOChannel *ioc, const void *buf, size_t len)
 {
@@ -1012,6 +1082,15 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->ioc_out, buf, len);
 }
 
+/* Called with chr_write_lock held.  */
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+
+    return io_channel_sendv_full(s->ioc_out, iov, iovcnt, NULL, 0);
+}
+
 static gboolean fd_chr_read(QIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -1104,6 +1183,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out,
     chr->opaque = s;
     chr->chr_add_watch = fd_chr_add_watch;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -2685,6 +2765,30 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+/* Called with chr_write_lock held.  */
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    int ret;
+
+    if (!s->connected) {
+        return iov_size(iov, iovcnt);
+    }
+
+    ret = io_channel_sendv_full(s->ioc, iov, iovcnt,
+                                s->write_msgfds, s->write_msgfds_num);
+
+    /* free the written msgfds, no matter what */
+    if (s->write_msgfds_num) {
+        g_free(s->write_msgfds);
+        s->write_msgfds = 0;
+        s->write_msgfds_num = 0;
+    }
+
+    return ret;
+}
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -4471,6 +4575,7 @@ static CharDriverState *qmp_chardev_open_socket(const char *id,
     chr->opaque = s;
     chr->chr_wait_connected = tcp_chr_wait_connected;
     chr->chr_write = tcp_chr_write;
+    chr->chr_writev = tcp_chr_writev;
     chr->chr_sync_read = tcp_chr_sync_read;
     chr->chr_close = tcp_chr_close;
     chr->chr_disconnect = tcp_chr_disconnect;
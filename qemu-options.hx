@@ -1671,6 +1671,12 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "-netdev af-packet,id=str,ifname=name[,frames=n][,frame-size=n]\n"
+    "                attach to the existing host network interface 'name' through\n"
+    "                the memory-mapped rings of an AF_PACKET socket, with 'n' frames\n"
+    "                in each ring (default 256) of 'frame-size' bytes (default 2048)\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -1695,6 +1701,9 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet|"
 #endif
     "socket][,vlan=n][,option][,option][,...]\n"
     "                old way to initialize a host network interface\n"
@@ -2105,6 +2114,30 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,frames=@var{n}][,frame-size=@var{size}]
+@itemx -net af-packet[,vlan=@var{n}][,name=@var{name}],ifname=@var{name}[,frames=@var{n}][,frame-size=@var{size}]
+Connect to the existing host network interface @var{name} through an
+AF_PACKET socket.  Packets are exchanged through memory-mapped receive and
+transmit rings of @var{n} frames each (256 by default), so bursts of packets
+need no system call per packet.  The interface is put in promiscuous mode.
+This requires the CAP_NET_RAW capability.
+
+Each frame holds @var{size} bytes (2048 by default, at most 131072),
+including a header of about 80 bytes.  Larger packets are dropped, and the
+drops are counted in @code{info network}.  The default is enough for a
+1500 byte MTU, but with GRO, GSO or TSO the host hands out packets of up to
+64 KiB; either turn these off or use @code{frame-size=131072}.
+
+Example, using one end of a veth pair:
+@example
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+ip link set veth1 up
+ethtool -K veth0 gso off gro off tso off
+qemu-system-i386 linux.img -netdev af-packet,id=n0,ifname=veth0 \
+                 -device virtio-net-pci,netdev=n0
+@end example
+
 @item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
@@ -3880,13 +3913,17 @@ Create a filter-redirector we need to differ outdev id from indev id, id can not
 be the same. we can just use indev or outdev, but at least one of indev or outdev
 need to be specified.
 
-@item -object filter-dump,id=@var{id},netdev=@var{dev},file=@var{filename}][,maxlen=@var{len}]
+@item -object filter-dump,id=@var{id},netdev=@var{dev},file=@var{filename}][,maxlen=@var{len}][,bufsize=@var{size}]
 
 Dump the network traffic on netdev @var{dev} to the file specified by
 @var{filename}. At most @var{len} bytes (64k by default) per packet are stored.
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
+The packets of a burst are collected in a buffer of @var{size} bytes (256k by
+default) and written with a single large write when the burst ends or the
+buffer is full.  A @var{size} of 0 writes every packet as it arrives.
+
 @item -object secret,id=@var{id},data=@var{string},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 @item -object secret,id=@var{id},file=@var{filename},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 
@@ -611,6 +611,59 @@ Example:
      "arguments": { "filename": "/tmp/resume" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "snapshot-save-file",
+        .args_type  = "filename:F",
+        .mhandler.cmd_new = qmp_marshal_snapshot_save_file,
+    },
+
+SQMP
+snapshot-save-file
+------------------
+
+Save the RAM and device state of the VM to a file, with each RAM page at a
+fixed offset.  The block devices are not saved.
+
+Arguments:
+
+- "filename": the file to create; it is replaced only once the new
+              snapshot is complete (json-string)
+
+Example:
+
+-> { "execute": "snapshot-save-file",
+     "arguments": { "filename": "/var/tmp/clean.snap" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "snapshot-load-file",
+        .args_type  = "filename:F",
+        .mhandler.cmd_new = qmp_marshal_snapshot_load_file,
+    },
+
+SQMP
+snapshot-load-file
+------------------
+
+Restore the RAM and device state of the VM from a file written by
+snapshot-save-file.  RAM is mapped from the file, which must not be modified
+in place while the VM runs; snapshot-save-file may replace it.  The block
+devices are not restored.
+
+Arguments:
+
+- "filename": the file to load (json-string)
+
+Example:
+
+-> { "execute": "snapshot-load-file",
+     "arguments": { "filename": "/var/tmp/clean.snap" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -781,6 +834,71 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Measure how fast the guest dirties its memory, in the background.  Cannot
+be used while an outgoing migration is running.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the result of the last calc-dirty-rate.
+
+returns a json-object with the following information:
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": start of the measurement, seconds since the epoch (json-int)
+- "calc-time": length of the measurement in seconds (json-int)
+- "page-size": size of a page in bytes (json-int)
+- "dirty-pages-rate": pages dirtied per second (json-int, optional)
+- "vcpu-dirty-rate": pages dirtied per second by each vCPU, TCG only
+  (json-array of json-objects with "id" and "dirty-pages-rate", optional)
+- "ramblock-dirty-rate": pages dirtied per second in each RAMBlock
+  (json-array of json-objects with "id" and "dirty-pages-rate", optional)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "start-time": 1476787200,
+        "calc-time": 1,
+        "page-size": 4096,
+        "dirty-pages-rate": 12288,
+        "vcpu-dirty-rate": [
+           { "id": 0, "dirty-pages-rate": 12000 },
+           { "id": 1, "dirty-pages-rate": 288 } ],
+        "ramblock-dirty-rate": [
+           { "id": "pc.ram", "dirty-pages-rate": 12280 },
+           { "id": "vga.vram", "dirty-pages-rate": 8 } ] } }
+
 EQMP
 
     {
@@ -1217,7 +1335,8 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "job-id:s?,sync:s,device:B,target:s,speed:i?,mode:s?,"
-                      "format:s?,bitmap:s?,on-source-error:s?,on-target-error:s?",
+                      "format:s?,bitmap:s?,on-source-error:s?,on-target-error:s?,"
+                      "max-workers:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_drive_backup,
     },
 
@@ -1261,6 +1380,10 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": maximum number of concurrent copy requests, 1 to 256;
+                 0 selects the default of 16 (json-int, optional)
+- "buf-size": maximum number of bytes in flight; 0 selects the default of
+              16 MiB (json-int, optional)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
@@ -1273,7 +1396,8 @@ EQMP
     {
         .name       = "blockdev-backup",
         .args_type  = "job-id:s?,sync:s,device:B,target:B,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,"
+                      "max-workers:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_blockdev_backup,
     },
 
@@ -1304,6 +1428,10 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": maximum number of concurrent copy requests, 1 to 256;
+                 0 selects the default of 16 (json-int, optional)
+- "buf-size": maximum number of bytes in flight; 0 selects the default of
+              16 MiB (json-int, optional)
 
 Example:
 -> { "execute": "blockdev-backup", "arguments": { "device": "src-id",
@@ -1435,7 +1563,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1452,6 +1580,8 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": bitmap will be saved to the corresponding block device image
+                file on its close (json-bool, optional, default false)
 
 Example:
 
@@ -3560,6 +3690,16 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
                 the last bitmap round (json-int)
+- "device-state-time": only present when migration has finished correctly
+                time in us spent saving device state once the guest was
+                stopped (json-int)
+- "device-stats": only present when migration has finished correctly,
+                  a json-array of the devices whose state took longest
+                  to save, slowest first, each a json-object with:
+         - "id": state section name (json-string)
+         - "instance-id": section instance (json-int)
+         - "time": time taken in us (json-int)
+         - "size": bytes written (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3576,6 +3716,8 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-time": time spent in the last dirty ram
+            synchronization in microseconds (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3592,6 +3734,9 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "skipped": number of cached pages sent as normal pages
+           without trying XBZRLE, because their recent XBZRLE encodings
+           were too large
 
 Examples:
 
@@ -3697,7 +3842,8 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "skipped":120
          }
       }
    }
@@ -3723,6 +3869,8 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over several sockets in parallel
+- "x-zero-copy-send": send multifd pages without copying them
 
 Arguments:
 
@@ -3753,6 +3901,8 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multifd migration state (json-bool)
+         - "x-zero-copy-send": zero copy send state (json-bool)
 
 Arguments:
 
@@ -3766,7 +3916,9 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-zero-copy-send"}
    ]}
 
 EQMP
@@ -3790,6 +3942,13 @@ Set migration parameters
                           throttled for auto-converge (json-int)
 - "cpu-throttle-increment": set throttle increasing percentage for
                             auto-converge (json-int)
+- "x-multifd-channels": set the number of multifd sockets (json-int)
+- "x-multifd-page-count": set the number of pages per multifd packet
+                          (json-int)
+- "compress-method": set the compression method: "zlib", "lz4" or "zstd"
+                     (json-string)
+- "postcopy-prefetch-pages": set the number of pages sent after each page
+                             faulted on in postcopy (json-int)
 
 Arguments:
 
@@ -3803,7 +3962,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?,x-multifd-channels:i?,x-multifd-page-count:i?,compress-method:s?,postcopy-prefetch-pages:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3820,6 +3979,11 @@ Query current migration parameters
                                     throttled (json-int)
          - "cpu-throttle-increment" : throttle increasing percentage for
                                       auto-converge (json-int)
+         - "x-multifd-channels" : number of multifd sockets (json-int)
+         - "x-multifd-page-count" : pages per multifd packet (json-int)
+         - "compress-method" : compression method (json-string)
+         - "postcopy-prefetch-pages" : pages prefetched after each postcopy
+                                       fault (json-int)
 
 Arguments:
 
@@ -3832,7 +3996,11 @@ Example:
          "cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "cpu-throttle-initial": 20
+         "cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "x-multifd-page-count": 128,
+         "compress-method": "zlib",
+         "postcopy-prefetch-pages": 32
       }
    }
 
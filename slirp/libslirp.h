@@ -25,9 +25,17 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout);
 void slirp_pollfds_poll(GArray *pollfds, int select_error);
 
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+/* Like slirp_input(), but TCP data for host sockets may be held back until
+ * slirp_input_flush(), so that a burst of packets from the guest is written
+ * to each socket at once. */
+void slirp_input_deferred(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+void slirp_input_flush(Slirp *slirp);
 
 /* you must provide the following functions: */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+/* Bracket the packets output while handling host sockets and timers */
+void slirp_output_batch_begin(void *opaque);
+void slirp_output_batch_end(void *opaque);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
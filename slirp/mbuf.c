@@ -18,14 +18,27 @@
 #include "qemu/osdep.h"
 #include "slirp.h"
 
-#define MBUF_THRESH 30
-
 /*
  * Find a nice value for msize
  */
 #define SLIRP_MSIZE\
     (offsetof(struct mbuf, m_dat) + IF_MAXLINKHDR + TCPIPHDR_DELTA + IF_MTU)
 
+/*
+ * mbufs are carved out of slabs of MBUF_POOL_CHUNK, and never given back
+ * to malloc until slirp_cleanup().  Once MBUF_POOL_MAX of them are in use,
+ * further mbufs are malloc()ed one at a time and freed as soon as they are
+ * released, so that a burst does not pin memory forever.
+ */
+#define MBUF_POOL_CHUNK 64
+#define MBUF_POOL_MAX 1024
+#define MBUF_POOL_STRIDE QEMU_ALIGN_UP(SLIRP_MSIZE, 16)
+#define MBUF_SLAB_HDR QEMU_ALIGN_UP(sizeof(struct mbuf_slab), 16)
+
+struct mbuf_slab {
+    struct mbuf_slab *next;
+};
+
 void
 m_init(Slirp *slirp)
 {
@@ -36,30 +49,61 @@ m_init(Slirp *slirp)
 void m_cleanup(Slirp *slirp)
 {
     struct mbuf *m, *next;
+    struct mbuf_slab *slab;
 
+    /* Only mbufs outside the pool are M_DOFREE; the rest go with the slabs */
     m = (struct mbuf *) slirp->m_usedlist.qh_link;
     while ((struct quehead *) m != &slirp->m_usedlist) {
         next = m->m_next;
         if (m->m_flags & M_EXT) {
             free(m->m_ext);
         }
-        free(m);
+        if (m->m_flags & M_DOFREE) {
+            free(m);
+        }
         m = next;
     }
-    m = (struct mbuf *) slirp->m_freelist.qh_link;
-    while ((struct quehead *) m != &slirp->m_freelist) {
-        next = m->m_next;
-        free(m);
-        m = next;
+    while (slirp->m_slabs) {
+        slab = slirp->m_slabs;
+        slirp->m_slabs = slab->next;
+        free(slab);
+    }
+}
+
+/*
+ * Put a new slab of mbufs on the free list
+ */
+static void m_pool_grow(Slirp *slirp)
+{
+    struct mbuf_slab *slab;
+    struct mbuf *m;
+    int i;
+
+    slab = malloc(MBUF_SLAB_HDR + MBUF_POOL_CHUNK * MBUF_POOL_STRIDE);
+    if (slab == NULL) {
+        return;
+    }
+    slab->next = slirp->m_slabs;
+    slirp->m_slabs = slab;
+
+    /* Backwards, so that m_get() hands them out in address order */
+    for (i = MBUF_POOL_CHUNK - 1; i >= 0; i--) {
+        m = (struct mbuf *)((char *)slab + MBUF_SLAB_HDR +
+                            i * MBUF_POOL_STRIDE);
+        m->slirp = slirp;
+        m->m_flags = M_FREELIST;
+        insque(m, &slirp->m_freelist);
     }
+    slirp->mbuf_pooled += MBUF_POOL_CHUNK;
+    slirp->mbuf_alloced += MBUF_POOL_CHUNK;
 }
 
 /*
- * Get an mbuf from the free list, if there are none
- * malloc one
+ * Get an mbuf from the free list, growing the pool if it is empty;
+ * past MBUF_POOL_MAX, malloc one
  *
  * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
+ * free old mbufs, mbufs outside the pool are marked M_DOFREE,
  * which tells m_free to actually free() it
  */
 struct mbuf *
@@ -70,12 +114,16 @@ m_get(Slirp *slirp)
 
 	DEBUG_CALL("m_get");
 
+	if (slirp->m_freelist.qh_link == &slirp->m_freelist &&
+	    slirp->mbuf_pooled < MBUF_POOL_MAX) {
+		m_pool_grow(slirp);
+	}
+
 	if (slirp->m_freelist.qh_link == &slirp->m_freelist) {
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
 		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
+		flags = M_DOFREE;
 		m->slirp = slirp;
 	} else {
 		m = (struct mbuf *) slirp->m_freelist.qh_link;
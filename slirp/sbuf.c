@@ -97,9 +97,11 @@ sbappend(struct socket *so, struct mbuf *m)
 
 	/*
 	 * We only write if there's nothing in the buffer,
-	 * ottherwise it'll arrive out of order, and hence corrupt
+	 * ottherwise it'll arrive out of order, and hence corrupt.
+	 * Within a burst from the guest, slirp_input_flush() writes
+	 * everything at once.
 	 */
-	if (!so->so_rcv.sb_cc)
+	if (!so->so_rcv.sb_cc && !(so->slirp->defer_sowrite && so->s != -1))
 	   ret = slirp_send(so, m->m_data, m->m_len, 0);
 
 	if (ret <= 0) {
@@ -562,6 +562,8 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
     curtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        slirp_output_batch_begin(slirp->opaque);
+
         /*
          * See if anything has timed out
          */
@@ -768,6 +770,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
         }
 
         if_start(slirp);
+        slirp_output_batch_end(slirp->opaque);
     }
 }
 
@@ -875,6 +878,41 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
+void slirp_input_deferred(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    slirp->defer_sowrite = true;
+    slirp_input(slirp, pkt, pkt_len);
+    slirp->defer_sowrite = false;
+}
+
+/*
+ * Write out what slirp_input_deferred() left in the socket buffers, and
+ * acknowledge the burst
+ */
+void slirp_input_flush(Slirp *slirp)
+{
+    struct socket *so, *so_next;
+    struct tcpcb *tp;
+
+    for (so = slirp->tcb.so_next; so != &slirp->tcb; so = so_next) {
+        so_next = so->so_next;
+
+        if (so->s != -1 && !(so->so_state & SS_NOFDREF) &&
+            CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+            if (sowrite(so) < 0) {
+                /* The socket may be gone */
+                continue;
+            }
+        }
+
+        tp = sototcpcb(so);
+        if (tp && (tp->t_flags & TF_DELACK)) {
+            tp->t_flags |= TF_ACKNOW;
+            tcp_output(tp);
+        }
+    }
+}
+
 /* Prepare the IPv4 packet to be sent to the ethernet device. Returns 1 if no
  * packet should be sent, 0 if the packet must be re-queued, 2 if the packet
  * is ready to go.
@@ -178,7 +178,12 @@ struct Slirp {
     /* mbuf states */
     struct quehead m_freelist;
     struct quehead m_usedlist;
+    struct mbuf_slab *m_slabs;
     int mbuf_alloced;
+    int mbuf_pooled;
+
+    /* Data for host sockets waits for slirp_input_flush() */
+    bool defer_sowrite;
 
     /* if states */
     struct quehead if_fastq;   /* fast queue (for interactive data) */
@@ -475,7 +475,14 @@ findso:
 	if (tp->t_state == TCPS_CLOSED)
 		goto drop;
 
-	tiwin = ti->ti_win;
+	/*
+	 * The window is only scaled once the connection is synchronized,
+	 * never in a SYN.
+	 */
+	if ((tiflags & TH_SYN) == 0)
+		tiwin = ti->ti_win << tp->snd_scale;
+	else
+		tiwin = ti->ti_win;
 
 	/*
 	 * Segment received on connection.
@@ -579,8 +586,14 @@ findso:
 			 *	he gets an ACK.
 			 *
 			 * It is better to not delay acks at all to maximize
-			 * TCP throughput.  See RFC 2581.
+			 * TCP throughput.  See RFC 2581.  Within a burst
+			 * from the guest, slirp_input_flush() acks the
+			 * whole burst at once.
 			 */
+			if (slirp->defer_sowrite) {
+				tp->t_flags |= TF_DELACK;
+				return;
+			}
 			tp->t_flags |= TF_ACKNOW;
 			tcp_output(tp);
 			return;
@@ -623,6 +636,13 @@ findso:
 	  if ((tiflags & TH_SYN) == 0)
 	    goto drop;
 
+	  /*
+	   * Process the options now: once the connection to the host
+	   * completes asynchronously, only the header is left.
+	   */
+	  if (optp)
+	    tcp_dooptions(tp, (u_char *)optp, optlen, ti);
+
 	  /*
 	   * This has way too many gotos...
 	   * But a bit of spaghetti code never hurt anybody :)
@@ -804,6 +824,12 @@ findso:
 		if (tiflags & TH_ACK && SEQ_GT(tp->snd_una, tp->iss)) {
 			soisfconnected(so);
 			tp->t_state = TCPS_ESTABLISHED;
+			/* Do window scaling on this connection? */
+			if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+				(TF_RCVD_SCALE|TF_REQ_SCALE)) {
+				tp->snd_scale = tp->requested_s_scale;
+				tp->rcv_scale = tp->request_r_scale;
+			}
 
 			(void) tcp_reass(tp, (struct tcpiphdr *)0,
 				(struct mbuf *)0);
@@ -984,6 +1010,14 @@ trimthenstep6:
 		    SEQ_GT(ti->ti_ack, tp->snd_max))
 			goto dropwithreset;
 		tp->t_state = TCPS_ESTABLISHED;
+		/* Do window scaling? */
+		if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+			(TF_RCVD_SCALE|TF_REQ_SCALE)) {
+			tp->snd_scale = tp->requested_s_scale;
+			tp->rcv_scale = tp->request_r_scale;
+			/* This ACK already carries a scaled window */
+			tiwin = ti->ti_win << tp->snd_scale;
+		}
 		/*
 		 * The sent SYN is ack'ed with our sequence number +1
 		 * The first data byte already in the buffer will get
@@ -1439,6 +1473,15 @@ tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 			NTOHS(mss);
 			(void) tcp_mss(tp, mss);	/* sets t_maxseg */
 			break;
+
+		case TCPOPT_WINDOW:
+			if (optlen != TCPOLEN_WINDOW)
+				continue;
+			if (!(ti->ti_flags & TH_SYN))
+				continue;
+			tp->t_flags |= TF_RCVD_SCALE;
+			tp->requested_s_scale = min(cp[2], TCP_MAX_WINSHIFT);
+			break;
 		}
 	}
 }
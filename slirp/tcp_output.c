@@ -274,6 +274,25 @@ send:
 			mss = htons((uint16_t) tcp_mss(tp, 0));
 			memcpy((caddr_t)(opt + 2), (caddr_t)&mss, sizeof(mss));
 			optlen = 4;
+
+			/*
+			 * Ask for the smallest window scale that lets the
+			 * whole receive buffer be advertised; in a SYN-ACK,
+			 * only if the other side asked for scaling too.
+			 */
+			if ((tp->t_flags & TF_REQ_SCALE) &&
+			    ((flags & TH_ACK) == 0 ||
+			     (tp->t_flags & TF_RCVD_SCALE))) {
+				tp->request_r_scale = 0;
+				while (tp->request_r_scale < TCP_MAX_WINSHIFT &&
+				       ((long)TCP_MAXWIN << tp->request_r_scale) <
+				       so->so_rcv.sb_datalen)
+					tp->request_r_scale++;
+				opt[optlen++] = TCPOPT_NOP;
+				opt[optlen++] = TCPOPT_WINDOW;
+				opt[optlen++] = TCPOLEN_WINDOW;
+				opt[optlen++] = tp->request_r_scale;
+			}
 		}
  	}
 
@@ -0,0 +1,206 @@
+#!/usr/bin/env python
+#
+# Test the af-packet network backend over a veth pair
+#
+# QEMU is attached to one end of the pair with af-packet and bridged to a
+# UDP socket with "-net socket"; the test talks raw Ethernet on the other
+# end and UDP on the loopback.  Creating the pair and opening AF_PACKET
+# sockets needs CAP_NET_ADMIN and CAP_NET_RAW; without them the test is
+# skipped.
+#
+# Usage: QEMU_PROG=x86_64-softmmu/qemu-system-x86_64 tests/af-packet-veth.py
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import os
+import re
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', 'scripts'))
+from qmp import qmp
+
+ETH_P_TEST = 0x88b5         # IEEE local experimental EtherType
+TIMEOUT = 5
+BIG_MTU = 9000
+BIG_LEN = 4000              # more than a 2048 byte frame holds
+
+qemu_prog = os.environ.get('QEMU_PROG', 'x86_64-softmmu/qemu-system-x86_64')
+veth0 = 'qafp%d' % (os.getpid() % 100000)
+veth1 = veth0 + 'p'
+
+
+def skip(why):
+    print('SKIP: %s' % why)
+    sys.exit(0)
+
+
+def ip(*args):
+    with open(os.devnull, 'w') as null:
+        return subprocess.call(('ip',) + args, stdout=null, stderr=null)
+
+
+def free_udp_port():
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def frame(payload):
+    # Broadcast, from a locally administered address
+    return (b'\xff' * 6 + b'\x02\x00\x00\x00\x00\x01' +
+            struct.pack('!H', ETH_P_TEST) + payload)
+
+
+def marked(n, tag):
+    head = ('%s-%d-' % (tag, os.getpid())).encode()
+    return head + b'x' * (n - len(head))
+
+
+def recv_matching(sock, want):
+    '''Wait for @want on @sock, ignoring any other traffic'''
+    deadline = time.time() + TIMEOUT
+    while time.time() < deadline:
+        sock.settimeout(max(deadline - time.time(), 0.01))
+        try:
+            data = sock.recv(65536)
+        except socket.timeout:
+            break
+        if data == want:
+            return True
+    return False
+
+
+class Guestless(object):
+    '''A QEMU with no guest, forwarding between af-packet and UDP'''
+
+    def __init__(self, frame_size=None):
+        self.udp_out = free_udp_port()
+        self.udp_in = free_udp_port()
+        self.qmp_path = tempfile.mktemp(prefix='qemu-af-packet-')
+        self.mon = qmp.QEMUMonitorProtocol(self.qmp_path, server=True)
+
+        afp = 'af-packet,vlan=0,ifname=%s' % veth0
+        if frame_size:
+            afp += ',frame-size=%d' % frame_size
+        args = [qemu_prog, '-machine', 'none', '-nodefaults',
+                '-display', 'none', '-qmp', 'unix:%s' % self.qmp_path,
+                '-net', afp,
+                '-net', 'socket,vlan=0,udp=127.0.0.1:%d,'
+                        'localaddr=127.0.0.1:%d' % (self.udp_out, self.udp_in)]
+
+        # Listen first, so that nothing QEMU forwards is lost
+        self.udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.udp.bind(('127.0.0.1', self.udp_out))
+        self.proc = subprocess.Popen(args)
+        self.mon.accept()
+        # Commands run from the main loop, once the rings are set up
+        self.info_network()
+
+    def info_network(self):
+        return self.mon.command('human-monitor-command',
+                                **{'command-line': 'info network'})
+
+    def dropped(self, which):
+        m = re.search(r'%s-dropped=(\d+)' % which, self.info_network())
+        assert m, 'no drop count in "info network"'
+        return int(m.group(1))
+
+    def close(self):
+        self.mon.cmd('quit')
+        self.mon.close()
+        self.proc.wait()
+        self.udp.close()
+        if os.path.exists(self.qmp_path):
+            os.unlink(self.qmp_path)
+
+
+def check(cond, what):
+    if not cond:
+        raise AssertionError(what)
+    print('ok: %s' % what)
+
+
+def test_small(raw):
+    q = Guestless()
+    try:
+        # host to QEMU
+        payload = frame(marked(100, 'rx'))
+        raw.send(payload)
+        check(recv_matching(q.udp, payload), 'small frame received')
+
+        # QEMU to host
+        payload = frame(marked(100, 'tx'))
+        q.udp.sendto(payload, ('127.0.0.1', q.udp_in))
+        check(recv_matching(raw, payload), 'small frame sent')
+        check(q.dropped('rx') == 0 and q.dropped('tx') == 0, 'no drops')
+    finally:
+        q.close()
+
+
+def test_big(raw, frame_size):
+    q = Guestless(frame_size)
+    fits = frame_size is not None
+    try:
+        payload = frame(marked(BIG_LEN, 'rx'))
+        raw.send(payload)
+        check(recv_matching(q.udp, payload) == fits,
+              'big frame %s with frame-size %s' %
+              ('received' if fits else 'dropped', frame_size or 'default'))
+        check(q.dropped('rx') == (0 if fits else 1),
+              'big frame rx drop counted')
+
+        payload = frame(marked(BIG_LEN, 'tx'))
+        q.udp.sendto(payload, ('127.0.0.1', q.udp_in))
+        check(recv_matching(raw, payload) == fits,
+              'big frame %s with frame-size %s' %
+              ('sent' if fits else 'dropped', frame_size or 'default'))
+        check(q.dropped('tx') == (0 if fits else 1),
+              'big frame tx drop counted')
+    finally:
+        q.close()
+
+
+def main():
+    if not sys.platform.startswith('linux'):
+        skip('AF_PACKET is Linux only')
+    if not os.access(qemu_prog, os.X_OK):
+        print('%s not found; set QEMU_PROG' % qemu_prog)
+        sys.exit(1)
+    try:
+        socket.socket(socket.AF_PACKET, socket.SOCK_RAW).close()
+    except (socket.error, AttributeError):
+        skip('cannot open AF_PACKET sockets (needs CAP_NET_RAW)')
+    if ip('link', 'add', veth0, 'type', 'veth', 'peer', 'name', veth1):
+        skip('cannot create a veth pair (needs CAP_NET_ADMIN)')
+
+    try:
+        for dev in (veth0, veth1):
+            # Jumbo frames for the drop tests; no offloads, so each frame
+            # crosses the pair as it was sent
+            ip('link', 'set', dev, 'mtu', str(BIG_MTU), 'up')
+            with open(os.devnull, 'w') as null:
+                subprocess.call(['ethtool', '-K', dev, 'gso', 'off',
+                                 'gro', 'off', 'tso', 'off'],
+                                stdout=null, stderr=null)
+        raw = socket.socket(socket.AF_PACKET, socket.SOCK_RAW,
+                            socket.htons(ETH_P_TEST))
+        raw.bind((veth1, ETH_P_TEST))
+
+        test_small(raw)
+        test_big(raw, None)
+        test_big(raw, 8192)
+        raw.close()
+    finally:
+        ip('link', 'del', veth0)
+
+
+if __name__ == '__main__':
+    main()
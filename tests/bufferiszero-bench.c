@@ -0,0 +1,109 @@
+/*
+ * buffer_is_zero micro-benchmark
+ *
+ * Reports the throughput of every buffer_is_zero implementation usable on
+ * this host, for a range of buffer sizes.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+
+static size_t sizes[] = { 64, 512, 4096, 65536, 1 << 20 };
+static unsigned int duration_ms = 200;
+static bool nonzero_mid;
+
+static const char commands_string[] =
+    " -d = duration per measurement, in milliseconds. Default: 200\n"
+    " -n = put a non-zero byte in the middle of the buffer\n"
+    " -h = show this help message.\n";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:nh");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 'n':
+            nonzero_mid = true;
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        default:
+            exit(1);
+        }
+    }
+}
+
+static double bench_one(const uint8_t *buf, size_t len)
+{
+    int64_t start, end, deadline;
+    uint64_t iters = 0;
+    unsigned i;
+    bool r = false;
+
+    start = get_clock();
+    deadline = start + duration_ms * SCALE_MS;
+    do {
+        for (i = 0; i < 64; i++) {
+            r |= buffer_is_zero(buf, len);
+        }
+        iters += i;
+        end = get_clock();
+    } while (end < deadline);
+
+    /* Keep the calls from being optimized away.  */
+    g_assert(r == !nonzero_mid);
+
+    return (double)iters * len / (end - start);  /* bytes per ns == GB/s */
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max = sizes[ARRAY_SIZE(sizes) - 1];
+    uint8_t *buf;
+    unsigned i;
+
+    parse_args(argc, argv);
+
+    buf = qemu_memalign(64, max);
+
+    printf("%-8s", "accel");
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        printf(" %9zu", sizes[i]);
+    }
+    printf("   (GB/s)\n");
+
+    do {
+        printf("%-8s", test_buffer_is_zero_accel_name());
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            memset(buf, 0, sizes[i]);
+            if (nonzero_mid) {
+                buf[sizes[i] / 2] = 1;
+            }
+            printf(" %9.2f", bench_one(buf, sizes[i]));
+            fflush(stdout);
+        }
+        printf("\n");
+    } while (test_buffer_is_zero_next_accel());
+
+    qemu_vfree(buf);
+    return 0;
+}
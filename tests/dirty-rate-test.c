@@ -0,0 +1,222 @@
+/*
+ * QTest testcase for the per-vCPU dirty rate and targeted auto-converge
+ *
+ * Copyright (c) 2016 Red Hat, Inc. and/or its affiliates
+ *   based on postcopy-test.c
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+
+/* Seconds to wait for auto-converge to start throttling */
+#define THROTTLE_TIMEOUT 60
+
+static const char *tmpfs;
+
+/* The PC boot sector of postcopy-test.c: it modifies memory (1-100MB)
+ * quickly, outputing a 'B' every so often if it's still running.  Only
+ * the boot processor runs it, the other vCPU stays halted.
+ */
+static const unsigned char bootsect[512] = {
+    0xfa, 0x0f, 0x01, 0x16, 0x74, 0x7c, 0x66, 0xb8, 0x01, 0x00, 0x00, 0x00,
+    0x0f, 0x22, 0xc0, 0x66, 0xea, 0x20, 0x7c, 0x00, 0x00, 0x08, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe4, 0x92, 0x0c, 0x02,
+    0xe6, 0x92, 0xb8, 0x10, 0x00, 0x00, 0x00, 0x8e, 0xd8, 0x66, 0xb8, 0x41,
+    0x00, 0x66, 0xba, 0xf8, 0x03, 0xee, 0xb3, 0x00, 0xb8, 0x00, 0x00, 0x10,
+    0x00, 0xfe, 0x00, 0x05, 0x00, 0x10, 0x00, 0x00, 0x3d, 0x00, 0x00, 0x40,
+    0x06, 0x7c, 0xf2, 0xfe, 0xc3, 0x75, 0xe9, 0x66, 0xb8, 0x42, 0x00, 0x66,
+    0xba, 0xf8, 0x03, 0xee, 0xeb, 0xde, 0x66, 0x90, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x00, 0x9a, 0xcf, 0x00,
+    0xff, 0xff, 0x00, 0x00, 0x00, 0x92, 0xcf, 0x00, 0x27, 0x00, 0x5c, 0x7c,
+    [510] = 0x55, [511] = 0xaa
+};
+
+static void init_bootfile(const char *bootpath)
+{
+    FILE *bootfile = fopen(bootpath, "wb");
+
+    g_assert_cmpint(fwrite(bootsect, 512, 1, bootfile), ==, 1);
+    fclose(bootfile);
+}
+
+/* Wait for the boot sector to print its first 'B' */
+static void wait_for_serial(const char *serialpath)
+{
+    FILE *serialfile = fopen(serialpath, "r");
+
+    g_assert(serialfile);
+    do {
+        int readvalue = fgetc(serialfile);
+
+        switch (readvalue) {
+        case 'A':
+            break;
+
+        case 'B':
+            fclose(serialfile);
+            return;
+
+        case EOF:
+            fseek(serialfile, 0, SEEK_SET);
+            usleep(1000);
+            break;
+
+        default:
+            fprintf(stderr, "Unexpected %d on serial\n", readvalue);
+            g_assert_not_reached();
+        }
+    } while (true);
+}
+
+/* Skip over any event that comes before the response */
+static QDict *return_or_event(QDict *response)
+{
+    while (qdict_haskey(response, "event")) {
+        QDECREF(response);
+        response = qtest_qmp_receive(global_qtest);
+    }
+    g_assert(qdict_haskey(response, "return"));
+    return response;
+}
+
+/* Look up the entry for vCPU @id in a list of { 'id': int, @key: int } */
+static int64_t vcpu_entry(QList *list, int64_t id, const char *key)
+{
+    const QListEntry *entry;
+
+    g_assert(list);
+    for (entry = qlist_first(list); entry; entry = qlist_next(entry)) {
+        QDict *vcpu = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (qdict_get_int(vcpu, "id") == id) {
+            return qdict_get_int(vcpu, key);
+        }
+    }
+    g_assert_not_reached();
+}
+
+/* The vCPU running the boot sector gets all of the dirtied pages */
+static void test_vcpu_dirty_rate(void)
+{
+    QDict *rsp, *info;
+    QList *vcpus;
+    const char *status;
+
+    rsp = return_or_event(qmp("{ 'execute': 'calc-dirty-rate',"
+                              "  'arguments': { 'calc-time': 1 } }"));
+    QDECREF(rsp);
+
+    for (;;) {
+        usleep(100 * 1000);
+        rsp = return_or_event(qmp("{ 'execute': 'query-dirty-rate' }"));
+        info = qdict_get_qdict(rsp, "return");
+        status = qdict_get_str(info, "status");
+        if (!strcmp(status, "measured")) {
+            break;
+        }
+        g_assert_cmpstr(status, ==, "measuring");
+        QDECREF(rsp);
+    }
+
+    g_assert_cmpint(qdict_get_int(info, "dirty-pages-rate"), >, 0);
+    vcpus = qdict_get_qlist(info, "vcpu-dirty-rate");
+    g_assert_cmpint(vcpu_entry(vcpus, 0, "dirty-pages-rate"), >, 0);
+    g_assert_cmpint(vcpu_entry(vcpus, 1, "dirty-pages-rate"), ==, 0);
+    QDECREF(rsp);
+}
+
+/* Auto-converge throttles the vCPU that dirties memory, not the idle one */
+static void test_vcpu_throttle(void)
+{
+    QDict *rsp, *info;
+    QList *vcpus = NULL;
+    int i;
+
+    rsp = return_or_event(qmp("{ 'execute': 'migrate-set-capabilities',"
+                              "  'arguments': { 'capabilities': [ {"
+                              "    'capability': 'auto-converge',"
+                              "    'state': true } ] } }"));
+    QDECREF(rsp);
+
+    /* Fast enough for the first pass to be quick, but the guest dirties
+     * memory much faster, and with 1ms downtime it never converges.
+     */
+    rsp = return_or_event(qmp("{ 'execute': 'migrate_set_speed',"
+                              "  'arguments': { 'value': 50000000 } }"));
+    QDECREF(rsp);
+    rsp = return_or_event(qmp("{ 'execute': 'migrate_set_downtime',"
+                              "  'arguments': { 'value': 0.001 } }"));
+    QDECREF(rsp);
+
+    rsp = return_or_event(qmp("{ 'execute': 'migrate',"
+                              "  'arguments': { 'uri': 'exec:cat >/dev/null' }"
+                              "}"));
+    QDECREF(rsp);
+
+    for (i = 0; i < THROTTLE_TIMEOUT * 10; i++) {
+        usleep(100 * 1000);
+        rsp = return_or_event(qmp("{ 'execute': 'query-migrate' }"));
+        info = qdict_get_qdict(rsp, "return");
+        g_assert_cmpstr(qdict_get_str(info, "status"), ==, "active");
+        if (qdict_haskey(info, "cpu-throttle-percentage")) {
+            vcpus = qdict_get_qlist(info, "vcpu-throttle-percentage");
+            break;
+        }
+        QDECREF(rsp);
+    }
+    g_assert(vcpus);
+
+    g_assert_cmpint(qdict_get_int(info, "cpu-throttle-percentage"), >, 0);
+    g_assert_cmpint(vcpu_entry(vcpus, 0, "percentage"), ==,
+                    qdict_get_int(info, "cpu-throttle-percentage"));
+    g_assert_cmpint(vcpu_entry(vcpus, 1, "percentage"), ==, 0);
+    QDECREF(rsp);
+
+    rsp = return_or_event(qmp("{ 'execute': 'migrate_cancel' }"));
+    QDECREF(rsp);
+}
+
+int main(int argc, char **argv)
+{
+    char template[] = "/tmp/dirty-rate-test-XXXXXX";
+    char *bootpath, *serialpath, *cmd;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    tmpfs = mkdtemp(template);
+    g_assert(tmpfs);
+    bootpath = g_strdup_printf("%s/bootsect", tmpfs);
+    serialpath = g_strdup_printf("%s/serial", tmpfs);
+    init_bootfile(bootpath);
+
+    /* Only TCG can tell which vCPU dirtied a page */
+    cmd = g_strdup_printf("-machine accel=tcg -smp 2 -m 150M"
+                          " -serial file:%s"
+                          " -drive file=%s,format=raw",
+                          serialpath, bootpath);
+    qtest_start(cmd);
+    g_free(cmd);
+    wait_for_serial(serialpath);
+
+    qtest_add_func("/dirty-rate/vcpu", test_vcpu_dirty_rate);
+    qtest_add_func("/dirty-rate/vcpu-throttle", test_vcpu_throttle);
+
+    ret = g_test_run();
+
+    qtest_quit(global_qtest);
+    unlink(bootpath);
+    unlink(serialpath);
+    rmdir(tmpfs);
+    g_free(bootpath);
+    g_free(serialpath);
+
+    return ret;
+}
@@ -0,0 +1,173 @@
+/*
+ * Migration page compression benchmark
+ *
+ * Compresses the pages of guest memory dumps with every compression
+ * method built into QEMU and reports the ratio and throughput of each.
+ * Zero pages are skipped, as migration sends them without compression.
+ *
+ * A dump can be taken with "dump-guest-memory" (with paging off the ELF
+ * headers are a negligible part of it) or by backing guest RAM with
+ * memory-backend-file.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "migration/compress.h"
+
+static size_t page_size = 4096;
+static size_t max_mb = 1024;
+static int level = 1;
+
+static const char commands_string[] =
+    " -l = compression level, 0 to 9. Default: 1\n"
+    " -p = page size in bytes. Default: 4096\n"
+    " -s = maximum MiB read from each file. Default: 1024\n"
+    " -h = show this help message.\n";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options] DUMP...\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "l:p:s:h");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'l':
+            level = atoi(optarg);
+            break;
+        case 'p':
+            page_size = atoi(optarg);
+            break;
+        case 's':
+            max_mb = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        default:
+            exit(1);
+        }
+    }
+    if (optind == argc || !page_size || level < 0 || level > 9) {
+        usage_complete(argc, argv);
+    }
+}
+
+/* Append the non-zero pages of @path to @pages */
+static void load_dump(const char *path, GByteArray *pages,
+                      uint64_t *zero_pages)
+{
+    uint8_t *buf = g_malloc(page_size);
+    uint64_t limit = (uint64_t)max_mb << 20;
+    uint64_t done = 0;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while (done < limit && fread(buf, page_size, 1, f) == 1) {
+        if (buffer_is_zero(buf, page_size)) {
+            (*zero_pages)++;
+        } else {
+            g_byte_array_append(pages, buf, page_size);
+        }
+        done += page_size;
+    }
+    fclose(f);
+    g_free(buf);
+}
+
+static void bench_method(MigrationCompressMethod method,
+                         const uint8_t *pages, size_t nr_pages)
+{
+    MigrationCodec *codec = migration_codec_new(method, level, &error_abort);
+    size_t bound = migration_codec_bound(codec, page_size);
+    uint8_t *out = g_malloc(bound * nr_pages);
+    size_t *out_len = g_new(size_t, nr_pages);
+    uint8_t *check = g_malloc(page_size);
+    uint64_t total = 0;
+    int64_t start, comp_ns, decomp_ns;
+    size_t i;
+
+    start = get_clock();
+    for (i = 0; i < nr_pages; i++) {
+        ssize_t len = migration_codec_compress(codec, out + i * bound, bound,
+                                               pages + i * page_size,
+                                               page_size);
+        g_assert(len > 0);
+        out_len[i] = len;
+        total += len;
+    }
+    comp_ns = get_clock() - start;
+
+    start = get_clock();
+    for (i = 0; i < nr_pages; i++) {
+        ssize_t len = migration_codec_decompress(codec, check, page_size,
+                                                 out + i * bound, out_len[i]);
+        g_assert(len == page_size);
+    }
+    decomp_ns = get_clock() - start;
+
+    /* check outside the timed loop */
+    for (i = 0; i < nr_pages; i++) {
+        migration_codec_decompress(codec, check, page_size,
+                                   out + i * bound, out_len[i]);
+        g_assert(memcmp(check, pages + i * page_size, page_size) == 0);
+    }
+
+    printf("%-6s %6.3f %12.1f %12.1f\n",
+           MigrationCompressMethod_lookup[method],
+           (double)total / (nr_pages * page_size),
+           (double)nr_pages * page_size * 1000 / comp_ns,
+           (double)nr_pages * page_size * 1000 / decomp_ns);
+
+    g_free(check);
+    g_free(out_len);
+    g_free(out);
+    migration_codec_free(codec);
+}
+
+int main(int argc, char *argv[])
+{
+    GByteArray *pages = g_byte_array_new();
+    uint64_t zero_pages = 0;
+    size_t nr_pages;
+    int i;
+
+    parse_args(argc, argv);
+
+    for (i = optind; i < argc; i++) {
+        load_dump(argv[i], pages, &zero_pages);
+    }
+    nr_pages = pages->len / page_size;
+    printf("%zu non-zero pages, %" PRIu64 " zero pages skipped, level %d\n",
+           nr_pages, zero_pages, level);
+    if (!nr_pages) {
+        return 0;
+    }
+
+    printf("%-6s %6s %12s %12s\n", "method", "ratio", "comp MB/s",
+           "decomp MB/s");
+    for (i = 0; i < MIGRATION_COMPRESS_METHOD__MAX; i++) {
+        if (migration_codec_available(i)) {
+            bench_method(i, pages->data, nr_pages);
+        }
+    }
+
+    g_byte_array_free(pages, true);
+    return 0;
+}
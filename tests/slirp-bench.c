@@ -0,0 +1,474 @@
+/*
+ * Slirp TCP throughput benchmark
+ *
+ * Streams data over TCP between the host and the "user" network backend,
+ * in the manner of iperf.  QEMU runs with a user backend and a socket
+ * backend on the same hub; the benchmark stands in for the guest at the
+ * other end of the socket with just enough of a TCP stack for one
+ * connection, which the host reaches through a hostfwd rule.
+ *
+ * QTEST_QEMU_BINARY must point to a system emulator.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/error.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "net/eth.h"
+#include "net/checksum.h"
+
+#define GUEST_PORT 5001
+#define GUEST_MSS 1460
+#define GUEST_WSCALE 7
+#define GUEST_ISS 1
+#define ARP_HLEN 28
+#define MAX_FRAME (ETH_HLEN + sizeof(struct ip_header) + 60 + GUEST_MSS)
+#define STALL_TIMEOUT_MS 10000
+
+#define SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_MAXSEG 2
+#define TCPOPT_WINDOW 3
+#define TCPOLEN_MAXSEG 4
+#define TCPOLEN_WINDOW 3
+
+static const uint8_t guest_mac[ETH_ALEN] = {
+    0x52, 0x54, 0x00, 0x12, 0x34, 0x56
+};
+static const uint32_t guest_ip = 0x0a00020f; /* 10.0.2.15 */
+
+static size_t total_mb = 256;
+static bool guest_sends;
+static bool no_wscale;
+
+static const char commands_string[] =
+    " -s = MiB to transfer. Default: 256\n"
+    " -r = the guest sends and the host receives. Default: the reverse\n"
+    " -n = do not offer TCP window scaling\n"
+    " -h = show this help message.\n";
+
+/* The guest end of the socket backend and its single TCP connection */
+static int guest_fd;
+static uint8_t rbuf[256 * 1024];
+static size_t rlen;
+static GByteArray *wbuf;
+
+static uint8_t peer_mac[ETH_ALEN];
+static uint32_t peer_ip;        /* network byte order */
+static uint16_t peer_port;      /* network byte order */
+static bool syn_received;
+static bool established;
+static int peer_wscale = -1;     /* -1 if slirp did not offer scaling */
+static unsigned int snd_scale;
+static unsigned int snd_mss = GUEST_MSS;
+static uint32_t snd_nxt, snd_una, snd_wnd;
+static uint32_t rcv_nxt;
+static bool ack_pending;
+static uint16_t ip_id;
+
+static uint64_t guest_bytes;
+static uint8_t payload[GUEST_MSS];
+static uint8_t host_buf[64 * 1024];
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "s:rnh");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 's':
+            total_mb = atoi(optarg);
+            break;
+        case 'r':
+            guest_sends = true;
+            break;
+        case 'n':
+            no_wscale = true;
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        default:
+            exit(1);
+        }
+    }
+    if (!total_mb) {
+        usage_complete(argc, argv);
+    }
+}
+
+/* Queue a frame for the socket backend, which expects a length prefix */
+static void guest_queue_frame(const uint8_t *frame, uint32_t len)
+{
+    uint32_t be_len = cpu_to_be32(len);
+
+    g_byte_array_append(wbuf, (uint8_t *)&be_len, sizeof(be_len));
+    g_byte_array_append(wbuf, frame, len);
+}
+
+static void guest_flush(void)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < wbuf->len) {
+        ret = write(guest_fd, wbuf->data + done, wbuf->len - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            fprintf(stderr, "write to QEMU: %s\n", strerror(errno));
+            exit(1);
+        }
+        done += ret;
+    }
+    g_byte_array_set_size(wbuf, 0);
+}
+
+static void guest_send_tcp(uint8_t flags, const uint8_t *opts, int optlen,
+                           int len)
+{
+    /* Two bytes of padding keep the IP header aligned */
+    uint64_t buf[(2 + MAX_FRAME + 7) / 8];
+    uint8_t *frame = (uint8_t *)buf + 2;
+    struct eth_header *eth = (struct eth_header *)frame;
+    struct ip_header *ip = (struct ip_header *)(frame + ETH_HLEN);
+    tcp_header *tcp = (tcp_header *)(ip + 1);
+    int tcp_len = sizeof(*tcp) + optlen + len;
+
+    memcpy(eth->h_dest, peer_mac, ETH_ALEN);
+    memcpy(eth->h_source, guest_mac, ETH_ALEN);
+    eth->h_proto = cpu_to_be16(ETH_P_IP);
+
+    ip->ip_ver_len = (IP_HEADER_VERSION_4 << 4) | (sizeof(*ip) / 4);
+    ip->ip_tos = 0;
+    ip->ip_len = cpu_to_be16(sizeof(*ip) + tcp_len);
+    ip->ip_id = cpu_to_be16(ip_id++);
+    ip->ip_off = 0;
+    ip->ip_ttl = 64;
+    ip->ip_p = IP_PROTO_TCP;
+    ip->ip_sum = 0;
+    ip->ip_src = cpu_to_be32(guest_ip);
+    ip->ip_dst = peer_ip;
+    ip->ip_sum = cpu_to_be16(net_raw_checksum((uint8_t *)ip, sizeof(*ip)));
+
+    tcp->th_sport = cpu_to_be16(GUEST_PORT);
+    tcp->th_dport = peer_port;
+    tcp->th_seq = cpu_to_be32(snd_nxt);
+    tcp->th_ack = cpu_to_be32(rcv_nxt);
+    tcp->th_offset_flags = cpu_to_be16((((sizeof(*tcp) + optlen) / 4) << 12) |
+                                       flags);
+    tcp->th_win = cpu_to_be16(0xffff);
+    tcp->th_sum = 0;
+    tcp->th_urp = 0;
+    memcpy(tcp + 1, opts, optlen);
+    memcpy((uint8_t *)(tcp + 1) + optlen, payload, len);
+    tcp->th_sum = cpu_to_be16(net_checksum_tcpudp(tcp_len, IP_PROTO_TCP,
+                                                  (uint8_t *)&ip->ip_src,
+                                                  (uint8_t *)tcp));
+
+    guest_queue_frame(frame, ETH_HLEN + sizeof(*ip) + tcp_len);
+    snd_nxt += len;
+    if (flags & (TH_SYN | TH_FIN)) {
+        snd_nxt++;
+    }
+    ack_pending = false;
+}
+
+/* Answer the ARP requests of slirp for the guest address */
+static void guest_arp_input(const uint8_t *frame, uint32_t len)
+{
+    const uint8_t *arp = frame + ETH_HLEN;
+    uint8_t reply[ETH_HLEN + ARP_HLEN];
+
+    if (len < ETH_HLEN + ARP_HLEN || lduw_be_p(arp + 6) != 1 ||
+        ldl_be_p(arp + 24) != guest_ip) {
+        return;
+    }
+
+    memcpy(reply, frame + ETH_ALEN, ETH_ALEN);
+    memcpy(reply + ETH_ALEN, guest_mac, ETH_ALEN);
+    stw_be_p(reply + 12, ETH_P_ARP);
+    memcpy(reply + ETH_HLEN, arp, 6);           /* htype, ptype, hlen, plen */
+    stw_be_p(reply + ETH_HLEN + 6, 2);          /* reply */
+    memcpy(reply + ETH_HLEN + 8, guest_mac, ETH_ALEN);
+    stl_be_p(reply + ETH_HLEN + 14, guest_ip);
+    memcpy(reply + ETH_HLEN + 18, arp + 8, 10); /* sender hw and IP */
+    guest_queue_frame(reply, sizeof(reply));
+}
+
+static void guest_parse_options(const uint8_t *opt, int optlen)
+{
+    while (optlen > 0) {
+        int len;
+
+        if (opt[0] == TCPOPT_EOL) {
+            break;
+        }
+        len = opt[0] == TCPOPT_NOP ? 1 : (optlen > 1 ? opt[1] : 0);
+        if (len <= 0 || len > optlen) {
+            break;
+        }
+        if (opt[0] == TCPOPT_MAXSEG && len == TCPOLEN_MAXSEG) {
+            snd_mss = MIN(lduw_be_p(opt + 2), GUEST_MSS);
+        } else if (opt[0] == TCPOPT_WINDOW && len == TCPOLEN_WINDOW) {
+            peer_wscale = MIN(opt[2], 14);
+        }
+        opt += len;
+        optlen -= len;
+    }
+}
+
+static void guest_tcp_input(const uint8_t *frame, uint32_t len)
+{
+    uint64_t buf[(2 + MAX_FRAME + 7) / 8];
+    uint8_t *copy = (uint8_t *)buf + 2;
+    struct ip_header *ip = (struct ip_header *)(copy + ETH_HLEN);
+    tcp_header *tcp;
+    int ihl, doff, data_len;
+    uint16_t flags;
+    uint32_t seq, ack;
+
+    if (len > MAX_FRAME || len < ETH_HLEN + sizeof(*ip)) {
+        return;
+    }
+    memcpy(copy, frame, len);
+    ihl = (ip->ip_ver_len & 0xf) * 4;
+    if (ip->ip_p != IP_PROTO_TCP ||
+        ETH_HLEN + ihl + sizeof(*tcp) > len) {
+        return;
+    }
+    tcp = (tcp_header *)((uint8_t *)ip + ihl);
+    if (tcp->th_dport != cpu_to_be16(GUEST_PORT)) {
+        return;
+    }
+
+    flags = be16_to_cpu(tcp->th_offset_flags);
+    doff = (flags >> 12) * 4;
+    flags &= 0x3f;
+    data_len = be16_to_cpu(ip->ip_len) - ihl - doff;
+    seq = be32_to_cpu(tcp->th_seq);
+    ack = be32_to_cpu(tcp->th_ack);
+
+    if (flags & TH_RST) {
+        fprintf(stderr, "connection reset by slirp\n");
+        exit(1);
+    }
+
+    if (flags & TH_SYN) {
+        uint8_t opts[8] = {
+            TCPOPT_MAXSEG, TCPOLEN_MAXSEG, GUEST_MSS >> 8, GUEST_MSS & 0xff,
+            TCPOPT_NOP, TCPOPT_WINDOW, TCPOLEN_WINDOW, GUEST_WSCALE,
+        };
+
+        if (syn_received) {
+            /* A retransmission; the SYN-ACK below is sent again */
+            snd_nxt = GUEST_ISS;
+        }
+        memcpy(peer_mac, copy + ETH_ALEN, ETH_ALEN);
+        peer_ip = ip->ip_src;
+        peer_port = tcp->th_sport;
+        guest_parse_options((uint8_t *)(tcp + 1), doff - sizeof(*tcp));
+        if (no_wscale) {
+            peer_wscale = -1;
+        }
+        rcv_nxt = seq + 1;
+        snd_nxt = snd_una = GUEST_ISS;
+        syn_received = true;
+        guest_send_tcp(TH_SYN | TH_ACK, opts, peer_wscale >= 0 ? 8 : 4, 0);
+        return;
+    }
+    if (!syn_received || !(flags & TH_ACK)) {
+        return;
+    }
+
+    if (!established && ack == snd_nxt) {
+        established = true;
+        snd_scale = MAX(peer_wscale, 0);
+    }
+    if (SEQ_GT(ack, snd_una)) {
+        snd_una = ack;
+    }
+    snd_wnd = be16_to_cpu(tcp->th_win) << snd_scale;
+
+    if (data_len > 0 || (flags & TH_FIN)) {
+        if (seq == rcv_nxt) {
+            rcv_nxt += data_len;
+            guest_bytes += data_len;
+            if (flags & TH_FIN) {
+                rcv_nxt++;
+            }
+        }
+        ack_pending = true;
+    }
+}
+
+/* Handle every complete frame read so far */
+static void guest_input(void)
+{
+    size_t off = 0;
+
+    while (rlen - off >= 4) {
+        uint32_t len = ldl_be_p(rbuf + off);
+        const uint8_t *frame = rbuf + off + 4;
+
+        if (rlen - off - 4 < len) {
+            break;
+        }
+        if (len >= ETH_HLEN) {
+            switch (lduw_be_p(frame + 12)) {
+            case ETH_P_ARP:
+                guest_arp_input(frame, len);
+                break;
+            case ETH_P_IP:
+                guest_tcp_input(frame, len);
+                break;
+            }
+        }
+        off += 4 + len;
+    }
+    memmove(rbuf, rbuf + off, rlen - off);
+    rlen -= off;
+}
+
+/* Fill the window offered by slirp */
+static void guest_output(uint64_t total)
+{
+    while (established && guest_bytes < total &&
+           snd_nxt - snd_una + snd_mss <= snd_wnd) {
+        guest_send_tcp(TH_ACK, NULL, 0, MIN(snd_mss, total - guest_bytes));
+        guest_bytes += MIN(snd_mss, total - guest_bytes);
+    }
+}
+
+static int pick_port(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd = qemu_socket(AF_INET, SOCK_STREAM, 0);
+
+    g_assert(fd >= 0);
+    g_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    closesocket(fd);
+    return ntohs(addr.sin_port);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t total, host_bytes = 0;
+    int64_t start = 0, ns;
+    int sv[2], port, host_fd;
+    char *cmdline, *addr;
+    GPollFD pfd[2];
+    ssize_t ret;
+
+    parse_args(argc, argv);
+    total = (uint64_t)total_mb << 20;
+    wbuf = g_byte_array_new();
+
+    if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return 1;
+    }
+    guest_fd = sv[0];
+
+    port = pick_port();
+    cmdline = g_strdup_printf("-net socket,vlan=0,fd=%d "
+                              "-net user,vlan=0,"
+                              "hostfwd=tcp:127.0.0.1:%d-10.0.2.15:%d",
+                              sv[1], port, GUEST_PORT);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    close(sv[1]);
+
+    addr = g_strdup_printf("127.0.0.1:%d", port);
+    host_fd = inet_connect(addr, &error_abort);
+    g_free(addr);
+    qemu_set_nonblock(host_fd);
+
+    pfd[0].fd = guest_fd;
+    pfd[0].events = G_IO_IN;
+    pfd[1].fd = host_fd;
+
+    while ((guest_sends ? host_bytes : guest_bytes) < total) {
+        if (guest_sends) {
+            pfd[1].events = G_IO_IN;
+        } else {
+            pfd[1].events = established && host_bytes < total ? G_IO_OUT : 0;
+        }
+
+        ret = g_poll(pfd, 2, STALL_TIMEOUT_MS);
+        if (ret == 0) {
+            fprintf(stderr, "stalled after %" PRIu64 " bytes\n",
+                    guest_sends ? host_bytes : guest_bytes);
+            return 1;
+        }
+        if (ret < 0) {
+            continue;
+        }
+
+        if (pfd[0].revents & G_IO_IN) {
+            ret = read(guest_fd, rbuf + rlen, sizeof(rbuf) - rlen);
+            if (ret <= 0) {
+                fprintf(stderr, "QEMU closed the socket backend\n");
+                return 1;
+            }
+            rlen += ret;
+            guest_input();
+            if (established && !start) {
+                start = get_clock();
+            }
+            if (guest_sends) {
+                guest_output(total);
+            }
+            if (ack_pending) {
+                guest_send_tcp(TH_ACK, NULL, 0, 0);
+            }
+            guest_flush();
+        }
+
+        if (pfd[1].revents & G_IO_IN) {
+            ret = read(host_fd, host_buf, sizeof(host_buf));
+            if (ret > 0) {
+                host_bytes += ret;
+            }
+        } else if (pfd[1].revents & G_IO_OUT) {
+            ret = write(host_fd, host_buf,
+                        MIN(sizeof(host_buf), total - host_bytes));
+            if (ret > 0) {
+                host_bytes += ret;
+            }
+        }
+    }
+    ns = get_clock() - start;
+
+    printf("%s: %" PRIu64 " MiB in %.3f s, %.2f MiB/s\n",
+           guest_sends ? "guest to host" : "host to guest", total >> 20,
+           ns / 1e9, (double)(total >> 20) * 1e9 / ns);
+
+    closesocket(host_fd);
+    qtest_end();
+    close(guest_fd);
+    g_byte_array_free(wbuf, true);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * QTest testcase for snapshot-save-file and snapshot-load-file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+/* Two pages of guest RAM above the ISA hole */
+#define ADDR_A 0x100000
+#define ADDR_B 0x200000
+#define PATTERN_LEN 4096
+
+static char snapshot_path[] = "/tmp/qtest-snapshot.XXXXXX";
+
+static void snapshot_cmd(const char *cmd)
+{
+    QDict *rsp;
+
+    rsp = qmp("{ 'execute': %s, 'arguments': { 'filename': %s } }",
+              cmd, snapshot_path);
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+}
+
+static void fill_pattern(uint64_t addr, uint8_t seed)
+{
+    uint8_t buf[PATTERN_LEN];
+    int i;
+
+    for (i = 0; i < PATTERN_LEN; i++) {
+        buf[i] = seed + i;
+    }
+    memwrite(addr, buf, sizeof(buf));
+}
+
+static void check_pattern(uint64_t addr, uint8_t seed)
+{
+    uint8_t buf[PATTERN_LEN];
+    int i;
+
+    memread(addr, buf, sizeof(buf));
+    for (i = 0; i < PATTERN_LEN; i++) {
+        g_assert_cmphex(buf[i], ==, (uint8_t)(seed + i));
+    }
+}
+
+/*
+ * Save, load, then save again over the file that guest RAM is now mapped
+ * from.  The pages the guest did not touch since the load still come from
+ * the old file and must survive the new save.
+ */
+static void test_round_trip(void)
+{
+    fill_pattern(ADDR_A, 1);
+    fill_pattern(ADDR_B, 2);
+    snapshot_cmd("snapshot-save-file");
+
+    fill_pattern(ADDR_A, 3);
+    fill_pattern(ADDR_B, 3);
+    snapshot_cmd("snapshot-load-file");
+    check_pattern(ADDR_A, 1);
+    check_pattern(ADDR_B, 2);
+
+    fill_pattern(ADDR_A, 4);
+    snapshot_cmd("snapshot-save-file");
+
+    fill_pattern(ADDR_A, 5);
+    fill_pattern(ADDR_B, 5);
+    snapshot_cmd("snapshot-load-file");
+    check_pattern(ADDR_A, 4);
+    check_pattern(ADDR_B, 2);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(snapshot_path);
+    g_assert(fd >= 0);
+    close(fd);
+
+    qtest_add_func("/snapshot-file/round-trip", test_round_trip);
+
+    qtest_start("-m 16");
+    ret = g_test_run();
+    qtest_end();
+
+    unlink(snapshot_path);
+
+    return ret;
+}
@@ -0,0 +1,347 @@
+/*
+ * Multiqueue block requests test
+ *
+ * Several threads, each running its own AioContext like an IOThread,
+ * read and write a raw image through blk_mq_aio_preadv/pwritev while the
+ * BlockBackend stays in the main loop.  Draining the node, adding a dirty
+ * bitmap and a coroutine in bdrv_mq_wait() must all wait for the requests
+ * that bypass the node's AioContext.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+
+#define NUM_THREADS 4
+#define NUM_REQS    32
+#define REQ_SIZE    (64 * 1024)
+#define BATCH_SIZE  ((int64_t)NUM_THREADS * NUM_REQS * REQ_SIZE)
+#define NUM_BATCHES 5
+#define IMG_SIZE    (NUM_BATCHES * BATCH_SIZE)
+
+typedef struct TestThread {
+    int id;
+    AioContext *ctx;
+    QemuThread thread;
+    bool stopping;
+
+    /* What submit_bh() does next */
+    int batch;
+    bool is_write;
+    QEMUBH *submit_bh;
+    QemuEvent submitted;
+} TestThread;
+
+typedef struct TestReq {
+    TestThread *t;
+    int64_t offset;
+    bool is_write;
+    QEMUIOVector qiov;
+    struct iovec iov;
+} TestReq;
+
+static BlockBackend *blk;
+static TestThread threads[NUM_THREADS];
+static __thread TestThread *current_thread;
+static int completed;
+static QEMUBH *wake_bh;
+
+static void *test_thread_run(void *opaque)
+{
+    TestThread *t = opaque;
+
+    rcu_register_thread();
+    current_thread = t;
+
+    while (!atomic_read(&t->stopping)) {
+        aio_context_acquire(t->ctx);
+        while (!atomic_read(&t->stopping) && aio_poll(t->ctx, true)) {
+            /* Progress was made, keep going */
+        }
+        aio_context_release(t->ctx);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Each 32-bit word of the image holds its own offset */
+static void fill_buf(uint8_t *buf, int64_t offset)
+{
+    int i;
+
+    for (i = 0; i < REQ_SIZE; i += 4) {
+        stl_le_p(buf + i, offset + i);
+    }
+}
+
+static void check_buf(const uint8_t *buf, int64_t offset)
+{
+    int i;
+
+    for (i = 0; i < REQ_SIZE; i += 4) {
+        g_assert_cmphex(ldl_le_p(buf + i), ==, (uint32_t)(offset + i));
+    }
+}
+
+/* Where request @i of thread @id goes in @batch */
+static int64_t req_offset(int batch, int id, int i)
+{
+    return batch * BATCH_SIZE + ((int64_t)id * NUM_REQS + i) * REQ_SIZE;
+}
+
+static void wake_bh_cb(void *opaque)
+{
+}
+
+/* Called in the AioContext of the thread that submitted the request */
+static void req_cb(void *opaque, int ret)
+{
+    TestReq *req = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    g_assert(current_thread == req->t);
+    if (!req->is_write) {
+        check_buf(req->iov.iov_base, req->offset);
+    }
+    g_free(req->iov.iov_base);
+    g_free(req);
+
+    atomic_inc(&completed);
+    qemu_bh_schedule(wake_bh);
+}
+
+/*
+ * Writes go to the thread's own part of the batch, reads come from the
+ * part that the next thread wrote.
+ */
+static void submit_bh(void *opaque)
+{
+    TestThread *t = opaque;
+    int id = t->is_write ? t->id : (t->id + 1) % NUM_THREADS;
+    TestReq *req;
+    int i;
+
+    for (i = 0; i < NUM_REQS; i++) {
+        req = g_new0(TestReq, 1);
+        req->t = t;
+        req->is_write = t->is_write;
+        req->offset = req_offset(t->batch, id, i);
+        req->iov.iov_base = g_malloc(REQ_SIZE);
+        req->iov.iov_len = REQ_SIZE;
+        qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+
+        if (t->is_write) {
+            fill_buf(req->iov.iov_base, req->offset);
+            blk_mq_aio_pwritev(blk, t->ctx, req->offset, &req->qiov, 0,
+                               req_cb, req);
+        } else {
+            blk_mq_aio_preadv(blk, t->ctx, req->offset, &req->qiov, 0,
+                              req_cb, req);
+        }
+    }
+    qemu_event_set(&t->submitted);
+}
+
+/*
+ * Have every thread submit its requests for @batch, and return once they
+ * are all submitted; returns the number of completions to wait for.
+ */
+static int submit_batch(int batch, bool is_write)
+{
+    int i;
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        threads[i].batch = batch;
+        threads[i].is_write = is_write;
+        qemu_event_reset(&threads[i].submitted);
+        qemu_bh_schedule(threads[i].submit_bh);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        qemu_event_wait(&threads[i].submitted);
+    }
+    return NUM_THREADS * NUM_REQS;
+}
+
+static void wait_completed(int n)
+{
+    while (atomic_read(&completed) < n) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(atomic_read(&completed), ==, n);
+}
+
+static void run_batch(int batch, bool is_write)
+{
+    int n = atomic_read(&completed) + submit_batch(batch, is_write);
+
+    wait_completed(n);
+}
+
+static void assert_mq_idle(void)
+{
+    BlockDriverState *bs;
+
+    for (bs = blk_bs(blk); bs; bs = bs->file ? bs->file->bs : NULL) {
+        g_assert_cmpint(atomic_read(&bs->mq_in_flight), ==, 0);
+    }
+}
+
+static void test_rw(void)
+{
+    g_assert(blk_mq_supported(blk));
+
+    run_batch(0, true);
+    run_batch(0, false);
+    assert_mq_idle();
+}
+
+/*
+ * A drained section waits for the requests that are in flight, and holds
+ * those submitted during it until it ends.
+ */
+static void test_drain(void)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    int n;
+
+    n = atomic_read(&completed) + submit_batch(1, true);
+    bdrv_drained_begin(bs);
+    assert_mq_idle();
+    wait_completed(n);
+
+    n += submit_batch(2, true);
+    /* Run the bottom halves that bounce the requests, and then some */
+    aio_poll(qemu_get_aio_context(), false);
+    g_usleep(100 * 1000);
+    while (aio_poll(qemu_get_aio_context(), false)) {
+        /* Keep going */
+    }
+    g_assert_cmpint(atomic_read(&completed), ==,
+                    n - NUM_THREADS * NUM_REQS);
+    assert_mq_idle();
+
+    bdrv_drained_end(bs);
+    wait_completed(n);
+
+    run_batch(1, false);
+    run_batch(2, false);
+}
+
+/*
+ * Adding a dirty bitmap waits for the requests that cannot know about it,
+ * and every write after that is recorded in it.
+ */
+static void test_dirty_bitmap(void)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    BdrvDirtyBitmap *bitmap;
+    int64_t offset;
+    int n, id, i;
+
+    n = atomic_read(&completed) + submit_batch(3, true);
+    bitmap = bdrv_create_dirty_bitmap(bs, REQ_SIZE, NULL, &error_abort);
+    assert_mq_idle();
+    wait_completed(n);
+
+    run_batch(4, true);
+    for (id = 0; id < NUM_THREADS; id++) {
+        for (i = 0; i < NUM_REQS; i++) {
+            offset = req_offset(4, id, i);
+            g_assert(bdrv_get_dirty(bs, bitmap, offset >> BDRV_SECTOR_BITS));
+            offset = req_offset(0, id, i);
+            g_assert(!bdrv_get_dirty(bs, bitmap, offset >> BDRV_SECTOR_BITS));
+        }
+    }
+    bdrv_release_dirty_bitmap(bs, bitmap);
+
+    run_batch(3, false);
+    run_batch(4, false);
+}
+
+static void coroutine_fn co_mq_wait(void *opaque)
+{
+    bool *done = opaque;
+
+    bdrv_mq_wait(blk_bs(blk));
+    assert_mq_idle();
+    *done = true;
+}
+
+/* A coroutine in bdrv_mq_wait() is woken up by the last request */
+static void test_co_wait(void)
+{
+    Coroutine *co;
+    bool done = false;
+    int n;
+
+    n = atomic_read(&completed) + submit_batch(0, true);
+    co = qemu_coroutine_create(co_mq_wait, &done);
+    qemu_coroutine_enter(co);
+    while (!done) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    wait_completed(n);
+    run_batch(0, false);
+}
+
+int main(int argc, char **argv)
+{
+    char img[] = "/tmp/qtest-block-mq.XXXXXX";
+    QDict *opts;
+    int fd, ret, i;
+
+    qemu_init_main_loop(&error_abort);
+    bdrv_init();
+
+    fd = mkstemp(img);
+    g_assert(fd >= 0);
+    g_assert(ftruncate(fd, IMG_SIZE) == 0);
+    close(fd);
+
+    opts = qdict_new();
+    qdict_put(opts, "driver", qstring_from_str("raw"));
+    blk = blk_new_open(img, NULL, opts, BDRV_O_RDWR, &error_abort);
+
+    wake_bh = qemu_bh_new(wake_bh_cb, NULL);
+    for (i = 0; i < NUM_THREADS; i++) {
+        threads[i].id = i;
+        threads[i].ctx = aio_context_new(&error_abort);
+        threads[i].submit_bh = aio_bh_new(threads[i].ctx, submit_bh,
+                                          &threads[i]);
+        qemu_event_init(&threads[i].submitted, false);
+        qemu_thread_create(&threads[i].thread, "test-block-mq",
+                           test_thread_run, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/block-mq/rw", test_rw);
+    g_test_add_func("/block-mq/drain", test_drain);
+    g_test_add_func("/block-mq/dirty-bitmap", test_dirty_bitmap);
+    g_test_add_func("/block-mq/co-wait", test_co_wait);
+    ret = g_test_run();
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        atomic_set(&threads[i].stopping, true);
+        aio_notify(threads[i].ctx);
+        qemu_thread_join(&threads[i].thread);
+        qemu_bh_delete(threads[i].submit_bh);
+        qemu_event_destroy(&threads[i].submitted);
+        aio_context_unref(threads[i].ctx);
+    }
+    qemu_bh_delete(wake_bh);
+    blk_unref(blk);
+    unlink(img);
+
+    return ret;
+}
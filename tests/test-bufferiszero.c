@@ -0,0 +1,77 @@
+/*
+ * QEMU buffer_is_zero test
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+
+#define BUF_SIZE 1024
+
+static uint8_t buffer[BUF_SIZE + 128] QEMU_ALIGNED(64);
+
+/* Check every (offset, length) pair of a window of the buffer.  */
+static void test_1(void)
+{
+    size_t s, a, o;
+
+    for (a = 0; a < 64; a++) {
+        for (s = 0; s <= BUF_SIZE; s = s < 192 ? s + 1 : s + 61) {
+            memset(buffer, 0, sizeof(buffer));
+            g_assert(buffer_is_zero(buffer + a, s));
+
+            /* Set a non-zero byte at each position and check it is seen,
+             * then clear it again.  */
+            for (o = 0; o < s; o++) {
+                buffer[a + o] = 1;
+                g_assert(!buffer_is_zero(buffer + a, s));
+                buffer[a + o] = 0;
+            }
+
+            /* Data just outside the range must not matter.  */
+            if (a > 0) {
+                buffer[a - 1] = 1;
+            }
+            buffer[a + s] = 1;
+            g_assert(buffer_is_zero(buffer + a, s));
+        }
+    }
+}
+
+/* The vector implementation that every host of this architecture has */
+#if defined(__SSE2__)
+#define BASE_ACCEL "sse2"
+#elif defined(__aarch64__)
+#define BASE_ACCEL "neon"
+#elif defined(__ALTIVEC__)
+#define BASE_ACCEL "altivec"
+#else
+#define BASE_ACCEL "int"
+#endif
+
+static void test_2(void)
+{
+    bool seen_base = false, seen_int = false;
+    const char *name;
+
+    do {
+        name = test_buffer_is_zero_accel_name();
+        if (g_test_verbose()) {
+            g_test_message("accel %s", name);
+        }
+        seen_base |= !strcmp(name, BASE_ACCEL);
+        seen_int |= !strcmp(name, "int");
+        test_1();
+    } while (test_buffer_is_zero_next_accel());
+
+    g_assert(seen_base);
+    g_assert(seen_int);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/bufferiszero", test_2);
+    return g_test_run();
+}
@@ -0,0 +1,238 @@
+/*
+ * qemu_chr_fe_writev_all() unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/iov.h"
+#include "sysemu/char.h"
+
+/* Steps of a script: a positive number is the most a write takes */
+#define STEP_EAGAIN -1
+#define STEP_EIO    -2
+#define STEP_ZERO   0
+
+typedef struct FakeChar {
+    const int *steps;
+    int nsteps;
+    int calls;
+    uint8_t out[256];
+    size_t len;
+} FakeChar;
+
+/* A packet-like vector: a length word and two fragments */
+static uint8_t hdr[4] = { 0, 0, 0, 30 };
+static uint8_t frag1[10];
+static uint8_t frag2[20];
+
+static struct iovec iov[] = {
+    { .iov_base = hdr, .iov_len = sizeof(hdr) },
+    { .iov_base = frag1, .iov_len = sizeof(frag1) },
+    { .iov_base = frag2, .iov_len = sizeof(frag2) },
+};
+
+#define IOV_SIZE (sizeof(hdr) + sizeof(frag1) + sizeof(frag2))
+
+static int fake_step(FakeChar *f, size_t size)
+{
+    int step;
+
+    if (f->calls >= f->nsteps) {
+        f->calls++;
+        return size;
+    }
+
+    step = f->steps[f->calls++];
+    switch (step) {
+    case STEP_EAGAIN:
+        errno = EAGAIN;
+        return -1;
+    case STEP_EIO:
+        errno = EIO;
+        return -1;
+    default:
+        return MIN(step, size);
+    }
+}
+
+static int fake_writev(CharDriverState *s, const struct iovec *v, int cnt)
+{
+    FakeChar *f = s->opaque;
+    int res = fake_step(f, iov_size(v, cnt));
+
+    if (res > 0) {
+        g_assert_cmpint(f->len + res, <=, sizeof(f->out));
+        iov_to_buf(v, cnt, 0, f->out + f->len, res);
+        f->len += res;
+    }
+    return res;
+}
+
+static int fake_write(CharDriverState *s, const uint8_t *buf, int len)
+{
+    FakeChar *f = s->opaque;
+    int res = fake_step(f, len);
+
+    if (res > 0) {
+        g_assert_cmpint(f->len + res, <=, sizeof(f->out));
+        memcpy(f->out + f->len, buf, res);
+        f->len += res;
+    }
+    return res;
+}
+
+static CharDriverState *fake_chr_new(FakeChar *f, const int *steps,
+                                     int nsteps, const char *logfile)
+{
+    ChardevCommon common = {
+        .has_logfile = logfile != NULL,
+        .logfile = (char *)logfile,
+    };
+    CharDriverState *chr = qemu_chr_alloc(&common, &error_abort);
+
+    memset(f, 0, sizeof(*f));
+    f->steps = steps;
+    f->nsteps = nsteps;
+    chr->opaque = f;
+    chr->chr_write = fake_write;
+    chr->chr_writev = fake_writev;
+    return chr;
+}
+
+static void init_data(void)
+{
+    int i;
+
+    for (i = 0; i < sizeof(frag1); i++) {
+        frag1[i] = i + 1;
+    }
+    for (i = 0; i < sizeof(frag2); i++) {
+        frag2[i] = 0x80 + i;
+    }
+}
+
+static void assert_data(const uint8_t *buf, size_t len)
+{
+    g_assert_cmpint(len, ==, IOV_SIZE);
+    g_assert(!memcmp(buf, hdr, sizeof(hdr)));
+    g_assert(!memcmp(buf + sizeof(hdr), frag1, sizeof(frag1)));
+    g_assert(!memcmp(buf + sizeof(hdr) + sizeof(frag1), frag2,
+                     sizeof(frag2)));
+}
+
+/* Short writes resume where they stopped, also within a fragment */
+static void test_partial(void)
+{
+    static const int steps[] = { 3, 5, 1, 16 };
+    CharDriverState *chr;
+    FakeChar f;
+
+    chr = fake_chr_new(&f, steps, ARRAY_SIZE(steps), NULL);
+    g_assert_cmpint(qemu_chr_fe_writev_all(chr, iov, ARRAY_SIZE(iov)), ==,
+                    IOV_SIZE);
+    g_assert_cmpint(f.calls, ==, ARRAY_SIZE(steps) + 1);
+    assert_data(f.out, f.len);
+
+    /* The caller's vector is left alone */
+    g_assert(iov[0].iov_base == hdr && iov[0].iov_len == sizeof(hdr));
+    g_assert(iov[2].iov_base == frag2 && iov[2].iov_len == sizeof(frag2));
+    qemu_chr_free(chr);
+}
+
+/* EAGAIN is retried, before and after a short write */
+static void test_eagain(void)
+{
+    static const int steps[] = {
+        STEP_EAGAIN, 7, STEP_EAGAIN, STEP_EAGAIN, 20
+    };
+    CharDriverState *chr;
+    FakeChar f;
+
+    chr = fake_chr_new(&f, steps, ARRAY_SIZE(steps), NULL);
+    g_assert_cmpint(qemu_chr_fe_writev_all(chr, iov, ARRAY_SIZE(iov)), ==,
+                    IOV_SIZE);
+    g_assert_cmpint(f.calls, ==, ARRAY_SIZE(steps) + 1);
+    assert_data(f.out, f.len);
+    qemu_chr_free(chr);
+}
+
+/* Other errors end the write; a closed backend returns what got out */
+static void test_error(void)
+{
+    static const int eio[] = { 12, STEP_EIO };
+    static const int zero[] = { 12, STEP_ZERO };
+    CharDriverState *chr;
+    FakeChar f;
+
+    chr = fake_chr_new(&f, eio, ARRAY_SIZE(eio), NULL);
+    g_assert_cmpint(qemu_chr_fe_writev_all(chr, iov, ARRAY_SIZE(iov)), ==,
+                    -1);
+    g_assert_cmpint(f.calls, ==, 2);
+    qemu_chr_free(chr);
+
+    chr = fake_chr_new(&f, zero, ARRAY_SIZE(zero), NULL);
+    g_assert_cmpint(qemu_chr_fe_writev_all(chr, iov, ARRAY_SIZE(iov)), ==,
+                    12);
+    g_assert_cmpint(f.calls, ==, 2);
+    qemu_chr_free(chr);
+}
+
+/* Without chr_writev, each element goes through chr_write */
+static void test_no_writev(void)
+{
+    static const int steps[] = { 2, STEP_EAGAIN, 9, 3, STEP_EAGAIN };
+    CharDriverState *chr;
+    FakeChar f;
+
+    chr = fake_chr_new(&f, steps, ARRAY_SIZE(steps), NULL);
+    chr->chr_writev = NULL;
+    g_assert_cmpint(qemu_chr_fe_writev_all(chr, iov, ARRAY_SIZE(iov)), ==,
+                    IOV_SIZE);
+    assert_data(f.out, f.len);
+    qemu_chr_free(chr);
+}
+
+/* With a log, the data goes through chr_write and into the log */
+static void test_log(void)
+{
+    static const int steps[] = { 5, STEP_EAGAIN, 6, 13 };
+    char logfile[] = "/tmp/test-char.XXXXXX";
+    CharDriverState *chr;
+    FakeChar f;
+    gchar *log;
+    gsize len;
+    int fd;
+
+    fd = mkstemp(logfile);
+    g_assert_cmpint(fd, !=, -1);
+    close(fd);
+
+    chr = fake_chr_new(&f, steps, ARRAY_SIZE(steps), logfile);
+    g_assert_cmpint(qemu_chr_fe_writev_all(chr, iov, ARRAY_SIZE(iov)), ==,
+                    IOV_SIZE);
+    assert_data(f.out, f.len);
+    qemu_chr_free(chr);
+
+    g_assert(g_file_get_contents(logfile, &log, &len, NULL));
+    assert_data((uint8_t *)log, len);
+    g_free(log);
+    unlink(logfile);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    init_data();
+
+    g_test_add_func("/char/writev-all/partial", test_partial);
+    g_test_add_func("/char/writev-all/eagain", test_eagain);
+    g_test_add_func("/char/writev-all/error", test_error);
+    g_test_add_func("/char/writev-all/no-writev", test_no_writev);
+    g_test_add_func("/char/writev-all/log", test_log);
+
+    return g_test_run();
+}
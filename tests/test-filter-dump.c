@@ -0,0 +1,246 @@
+/*
+ * QTest testcase for filter-dump
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+/* filter-buffer releases what it holds as one burst every interval */
+#define BUFFER_INTERVAL_US 1000
+#define BURST 8
+
+#define PCAP_FILE_HDR_SIZE 24
+#define PCAP_PKT_HDR_SIZE 16
+
+static int send_sock[2];
+static char staged_path[] = "/tmp/filter-dump-staged.XXXXXX";
+static char direct_path[] = "/tmp/filter-dump-direct.XXXXXX";
+
+/*
+ * Both dump filters sit behind a filter-buffer, so they see each packet
+ * at the same virtual time; one stages records, the other writes them
+ * one at a time.
+ */
+static void test_start(void)
+{
+    char *cmdline;
+    int fd;
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, send_sock), !=, -1);
+
+    fd = mkstemp(staged_path);
+    g_assert_cmpint(fd, !=, -1);
+    close(fd);
+    fd = mkstemp(direct_path);
+    g_assert_cmpint(fd, !=, -1);
+    close(fd);
+
+    cmdline = g_strdup_printf("-netdev socket,id=qtest-bn0,fd=%d "
+                 "-device e1000,netdev=qtest-bn0,id=qtest-e0 "
+                 "-object filter-buffer,id=qtest-buffer,netdev=qtest-bn0,"
+                 "queue=tx,interval=%d "
+                 "-object filter-dump,id=qtest-staged,netdev=qtest-bn0,"
+                 "queue=tx,file=%s "
+                 "-object filter-dump,id=qtest-direct,netdev=qtest-bn0,"
+                 "queue=tx,file=%s,bufsize=0 ",
+                 send_sock[1], BUFFER_INTERVAL_US, staged_path, direct_path);
+    qtest_start(cmdline);
+    g_free(cmdline);
+}
+
+static void test_end(void)
+{
+    qtest_end();
+    close(send_sock[0]);
+    close(send_sock[1]);
+    unlink(staged_path);
+    unlink(direct_path);
+    strcpy(staged_path + strlen(staged_path) - 6, "XXXXXX");
+    strcpy(direct_path + strlen(direct_path) - 6, "XXXXXX");
+}
+
+static void send_packets(int count)
+{
+    static int seq;
+    uint8_t buf[256];
+    uint32_t len;
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = buf,
+        },
+    };
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < count; i++, seq++) {
+        iov[1].iov_len = 60 + (seq * 13) % (sizeof(buf) - 60);
+        memset(buf, seq, iov[1].iov_len);
+        len = htonl(iov[1].iov_len);
+        ret = iov_send(send_sock[0], iov, 2, 0,
+                       sizeof(len) + iov[1].iov_len);
+        g_assert_cmpint(ret, ==, sizeof(len) + iov[1].iov_len);
+    }
+
+    /* QEMU has read the packets once it answers */
+    qmp_discard_response("{ 'execute' : 'query-status'}");
+}
+
+static void release_burst(void)
+{
+    clock_step(BUFFER_INTERVAL_US * 1000);
+}
+
+static void set_status(const char *id, const char *status)
+{
+    QDict *response;
+    char *path = g_strdup_printf("/objects/%s", id);
+
+    response = qmp("{'execute': 'qom-set',"
+                   " 'arguments': {"
+                   "   'path': %s,"
+                   "   'property': 'status',"
+                   "   'value': %s"
+                   "}}", path, status);
+    g_free(path);
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+}
+
+static void del_filter(const char *id)
+{
+    QDict *response;
+
+    response = qmp("{'execute': 'object-del',"
+                   " 'arguments': {"
+                   "   'id': %s"
+                   "}}", id);
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+}
+
+/* Check that the file at @path holds @count records, and return it */
+static gchar *read_dump(const char *path, int count, gsize *size)
+{
+    gchar *data;
+    gsize offset;
+    uint32_t caplen;
+    int n = 0;
+
+    g_assert(g_file_get_contents(path, &data, size, NULL));
+    g_assert_cmpint(*size, >=, PCAP_FILE_HDR_SIZE);
+
+    for (offset = PCAP_FILE_HDR_SIZE; offset < *size;
+         offset += PCAP_PKT_HDR_SIZE + caplen) {
+        g_assert_cmpint(offset + PCAP_PKT_HDR_SIZE, <=, *size);
+        memcpy(&caplen, data + offset + 8, sizeof(caplen));
+        n++;
+    }
+    g_assert_cmpint(offset, ==, *size);
+    g_assert_cmpint(n, ==, count);
+
+    return data;
+}
+
+/* Both files hold @count records, and staging changed nothing in them */
+static void assert_dumps(int count)
+{
+    gchar *staged, *direct;
+    gsize staged_size, direct_size;
+
+    staged = read_dump(staged_path, count, &staged_size);
+    direct = read_dump(direct_path, count, &direct_size);
+    g_assert_cmpint(staged_size, ==, direct_size);
+    g_assert(!memcmp(staged, direct, staged_size));
+    g_free(staged);
+    g_free(direct);
+}
+
+/* The records of a burst are on disk as soon as the burst ends */
+static void test_burst(void)
+{
+    test_start();
+
+    send_packets(BURST);
+    assert_dumps(0);
+    release_burst();
+    assert_dumps(BURST);
+
+    send_packets(BURST);
+    send_packets(BURST);
+    release_burst();
+    assert_dumps(3 * BURST);
+
+    /* Without the buffer, packets come one at a time */
+    del_filter("qtest-buffer");
+    send_packets(BURST);
+    assert_dumps(4 * BURST);
+
+    test_end();
+}
+
+/* Turning the filter off writes out what it has */
+static void test_status(void)
+{
+    test_start();
+
+    send_packets(BURST);
+    release_burst();
+    set_status("qtest-staged", "off");
+    set_status("qtest-direct", "off");
+    assert_dumps(BURST);
+
+    /* Nothing is recorded while the filters are off */
+    send_packets(BURST);
+    release_burst();
+    assert_dumps(BURST);
+
+    set_status("qtest-staged", "on");
+    set_status("qtest-direct", "on");
+    send_packets(BURST);
+    release_burst();
+    set_status("qtest-staged", "off");
+    assert_dumps(2 * BURST);
+
+    test_end();
+}
+
+/* Deleting the filter writes out what it has */
+static void test_delete(void)
+{
+    test_start();
+
+    send_packets(BURST);
+    release_burst();
+    del_filter("qtest-staged");
+    del_filter("qtest-direct");
+    assert_dumps(BURST);
+
+    test_end();
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+#ifndef _WIN32
+    /* socketpair(PF_UNIX) which does not exist on windows */
+    qtest_add_func("/netfilter/dump/burst", test_burst);
+    qtest_add_func("/netfilter/dump/status", test_status);
+    qtest_add_func("/netfilter/dump/delete", test_delete);
+#endif
+    ret = g_test_run();
+
+    return ret;
+}
@@ -634,6 +634,56 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void hbitmap_test_serialize_range(TestHBitmapData *data,
+                                         uint64_t pos, uint64_t count)
+{
+    uint64_t gran = hbitmap_serialization_granularity(data->hb);
+    uint64_t start, chunk;
+    size_t buf_size;
+    uint8_t *buf;
+    HBitmap *old = data->hb;
+
+    hbitmap_test_set(data, pos, count);
+
+    /* Round trip the whole bitmap through a fresh HBitmap, two
+     * serialization chunks at a time.
+     */
+    data->hb = hbitmap_alloc(data->size, data->granularity);
+    for (start = 0; start < data->size; start += chunk) {
+        chunk = MIN(gran * 2, data->size - start);
+        buf_size = hbitmap_serialization_size(old, start, chunk);
+        g_assert_cmpint(buf_size, <=, 2 * sizeof(unsigned long));
+
+        buf = g_malloc0(buf_size);
+        hbitmap_serialize_part(old, buf, start, chunk);
+        hbitmap_deserialize_part(data->hb, buf, start, chunk, false);
+        g_free(buf);
+    }
+    hbitmap_deserialize_finish(data->hb);
+    hbitmap_free(old);
+
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check_get(data);
+}
+
+static void test_hbitmap_serialize_basic(TestHBitmapData *data,
+                                         const void *unused)
+{
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_serialize_range(data, 0, 1);
+    hbitmap_test_serialize_range(data, L1 - 1, 2);
+    hbitmap_test_serialize_range(data, L2 + 5, L1 * 3);
+    hbitmap_test_serialize_range(data, L3 + 22, 1);
+}
+
+static void test_hbitmap_serialize_empty(TestHBitmapData *data,
+                                         const void *unused)
+{
+    hbitmap_test_init(data, L2 + 3, 0);
+    hbitmap_test_serialize_range(data, 0, 0);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 0);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -683,6 +733,11 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/basic",
+                     test_hbitmap_serialize_basic);
+    hbitmap_test_add("/hbitmap/serialize/empty",
+                     test_hbitmap_serialize_empty);
     g_test_run();
 
     return 0;
@@ -23,6 +23,7 @@
 #include "io/channel-util.h"
 #include "io-channel-helpers.h"
 #include "qapi/error.h"
+#include "qemu/thread.h"
 
 #ifndef AI_ADDRCONFIG
 # define AI_ADDRCONFIG 0
@@ -491,6 +492,147 @@ static void test_io_channel_unix_fd_pass(void)
     }
     g_free(fdrecv);
 }
+
+
+#define TEST_ALL_NIOV (IOV_MAX * 2 + 3)
+#define TEST_ALL_IOVLEN 7
+
+typedef struct {
+    QIOChannel *src;
+    bool zero_copy;
+} TestIOChannelAllWriter;
+
+static void *test_io_channel_all_writer(void *opaque)
+{
+    TestIOChannelAllWriter *w = opaque;
+    QIOChannel *src = w->src;
+    struct iovec *iov = g_new(struct iovec, TEST_ALL_NIOV);
+    uint8_t *buf = g_malloc(TEST_ALL_NIOV * TEST_ALL_IOVLEN);
+    size_t i;
+
+    for (i = 0; i < TEST_ALL_NIOV * TEST_ALL_IOVLEN; i++) {
+        buf[i] = i & 0xff;
+    }
+    for (i = 0; i < TEST_ALL_NIOV; i++) {
+        iov[i].iov_base = buf + i * TEST_ALL_IOVLEN;
+        iov[i].iov_len = TEST_ALL_IOVLEN;
+    }
+
+    if (w->zero_copy) {
+        g_assert_cmpint(qio_channel_writev_zero_copy_all(src, iov,
+                                                         TEST_ALL_NIOV,
+                                                         &error_abort), ==, 0);
+        /* The buffer must not be freed before the kernel is done with it */
+        g_assert_cmpint(qio_channel_flush(src, &error_abort), >=, 0);
+    } else {
+        g_assert_cmpint(qio_channel_writev_all(src, iov, TEST_ALL_NIOV,
+                                               &error_abort), ==, 0);
+    }
+    qio_channel_shutdown(src, QIO_CHANNEL_SHUTDOWN_WRITE, &error_abort);
+
+    g_free(iov);
+    g_free(buf);
+    return NULL;
+}
+
+static void test_io_channel_all(SocketAddress *listen_addr,
+                                SocketAddress *connect_addr,
+                                bool zero_copy)
+{
+    QIOChannel *src, *dst;
+    QemuThread writer;
+    TestIOChannelAllWriter w;
+    size_t len = TEST_ALL_NIOV * TEST_ALL_IOVLEN;
+    uint8_t *buf;
+    struct iovec iov[2];
+    uint8_t extra;
+    size_t i;
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+
+    if (zero_copy &&
+        !qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        g_test_message("zero copy writes not supported, skipping");
+        object_unref(OBJECT(src));
+        object_unref(OBJECT(dst));
+        return;
+    }
+
+    /* More iovecs than the kernel takes at once, and read back with a
+     * different layout than they were written with. */
+    w.src = src;
+    w.zero_copy = zero_copy;
+    qemu_thread_create(&writer, "writer", test_io_channel_all_writer, &w,
+                       QEMU_THREAD_JOINABLE);
+
+    buf = g_malloc0(len);
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = buf + 1;
+    iov[1].iov_len = len - 1;
+    g_assert_cmpint(qio_channel_readv_all(dst, iov, 2, &error_abort), ==, 0);
+    for (i = 0; i < len; i++) {
+        g_assert_cmpint(buf[i], ==, i & 0xff);
+    }
+
+    /* End of file at the start of a read is not an error */
+    iov[0].iov_base = &extra;
+    iov[0].iov_len = 1;
+    g_assert_cmpint(qio_channel_readv_all_eof(dst, iov, 1, &error_abort),
+                    ==, 0);
+
+    qemu_thread_join(&writer);
+
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    g_free(buf);
+}
+
+static void test_io_channel_unix_all(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+
+    listen_addr->type = SOCKET_ADDRESS_KIND_UNIX;
+    listen_addr->u.q_unix.data = g_new0(UnixSocketAddress, 1);
+    listen_addr->u.q_unix.data->path = g_strdup(TEST_SOCKET);
+
+    connect_addr->type = SOCKET_ADDRESS_KIND_UNIX;
+    connect_addr->u.q_unix.data = g_new0(UnixSocketAddress, 1);
+    connect_addr->u.q_unix.data->path = g_strdup(TEST_SOCKET);
+
+    test_io_channel_all(listen_addr, connect_addr, false);
+
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+    unlink(TEST_SOCKET);
+}
+
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+
+    listen_addr->type = SOCKET_ADDRESS_KIND_INET;
+    listen_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *listen_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_KIND_INET;
+    connect_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *connect_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_all(listen_addr, connect_addr, true);
+
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
 #endif /* _WIN32 */
 
 
@@ -547,6 +689,10 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+#ifndef _WIN32
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
+#endif
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
@@ -562,6 +708,8 @@ int main(int argc, char **argv)
                     test_io_channel_unix_async);
     g_test_add_func("/io/channel/socket/unix-fd-pass",
                     test_io_channel_unix_fd_pass);
+    g_test_add_func("/io/channel/socket/unix-all",
+                    test_io_channel_unix_all);
 #endif /* _WIN32 */
 
     return g_test_run();
@@ -0,0 +1,459 @@
+/*
+ * Packet burst tests
+ *
+ * A sender brackets a burst with qemu_net_batch_begin()/end(); a peer
+ * that implements receive_batch_end sees qemu_net_in_batch() for every
+ * packet of the burst and is called once when the outermost burst ends.
+ * l2tpv3 uses that to send the packets of a burst with one sendmmsg, and
+ * must not lose or reorder them when the socket is full.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/syscall.h>
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "net/net.h"
+#include "net/clients.h"
+#include "net/slirp.h"
+#include "net/vhost_net.h"
+#include "sysemu/sysemu.h"
+
+#define PKT_SIZE    64
+#define TX_SESSION  0x1234
+
+/* What the net layer needs from the rest of QEMU */
+
+NICInfo nd_table[MAX_NICS];
+int nb_nics;
+
+int runstate_is_running(void)
+{
+    return 1;
+}
+
+VMChangeStateEntry *qemu_add_vm_change_state_handler(VMChangeStateHandler *cb,
+                                                     void *opaque)
+{
+    return NULL;
+}
+
+void qemu_del_vm_change_state_handler(VMChangeStateEntry *e)
+{
+}
+
+VHostNetState *get_vhost_net(NetClientState *nc)
+{
+    return NULL;
+}
+
+int net_init_dump(const Netdev *netdev, const char *name,
+                  NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+int net_init_socket(const Netdev *netdev, const char *name,
+                    NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+int net_init_tap(const Netdev *netdev, const char *name,
+                 NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+int net_init_bridge(const Netdev *netdev, const char *name,
+                    NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+int net_init_vhost_user(const Netdev *netdev, const char *name,
+                        NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+#ifdef CONFIG_SLIRP
+int net_init_slirp(const Netdev *netdev, const char *name,
+                   NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+int net_slirp_parse_legacy(QemuOptsList *opts_list, const char *optarg,
+                           int *ret)
+{
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_VDE
+int net_init_vde(const Netdev *netdev, const char *name,
+                 NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+#endif
+
+#ifdef CONFIG_NETMAP
+int net_init_netmap(const Netdev *netdev, const char *name,
+                    NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+#endif
+
+#ifdef CONFIG_AF_PACKET
+int net_init_af_packet(const Netdev *netdev, const char *name,
+                       NetClientState *peer, Error **errp)
+{
+    g_assert_not_reached();
+}
+#endif
+
+/* The guest side, which sends the bursts */
+typedef struct TestClient {
+    NetClientState nc;
+    int packets;
+    int packets_in_batch;
+    int batch_ends;
+} TestClient;
+
+static TestClient *tx, *rx;
+
+static ssize_t test_receive(NetClientState *nc, const uint8_t *buf,
+                            size_t size)
+{
+    TestClient *t = DO_UPCAST(TestClient, nc, nc);
+
+    t->packets++;
+    if (qemu_net_in_batch(nc)) {
+        t->packets_in_batch++;
+    }
+    return size;
+}
+
+static void test_receive_batch_end(NetClientState *nc)
+{
+    TestClient *t = DO_UPCAST(TestClient, nc, nc);
+
+    g_assert(!qemu_net_in_batch(nc));
+    t->batch_ends++;
+}
+
+static NetClientInfo test_info = {
+    .type = NET_CLIENT_DRIVER_NONE,
+    .size = sizeof(TestClient),
+    .receive = test_receive,
+};
+
+static NetClientInfo test_batch_info = {
+    .type = NET_CLIENT_DRIVER_NONE,
+    .size = sizeof(TestClient),
+    .receive = test_receive,
+    .receive_batch_end = test_receive_batch_end,
+};
+
+static void clients_init(NetClientInfo *rx_info)
+{
+    tx = DO_UPCAST(TestClient, nc,
+                   qemu_new_net_client(&test_info, NULL, "test", "tx"));
+    rx = DO_UPCAST(TestClient, nc,
+                   qemu_new_net_client(rx_info, &tx->nc, "test", "rx"));
+}
+
+static void clients_cleanup(void)
+{
+    qemu_del_net_client(&rx->nc);
+    qemu_del_net_client(&tx->nc);
+}
+
+static void send_one(void)
+{
+    static const uint8_t pkt[PKT_SIZE];
+
+    g_assert_cmpint(qemu_send_packet_async(&tx->nc, pkt, sizeof(pkt), NULL),
+                    ==, sizeof(pkt));
+}
+
+static void test_nesting(void)
+{
+    clients_init(&test_batch_info);
+
+    g_assert(!qemu_net_sending_batch(&tx->nc));
+    g_assert(!qemu_net_in_batch(&rx->nc));
+
+    qemu_net_batch_begin(&tx->nc);
+    g_assert(qemu_net_sending_batch(&tx->nc));
+    g_assert(qemu_net_in_batch(&rx->nc));
+    send_one();
+
+    /* An inner burst only ends with the outer one */
+    qemu_net_batch_begin(&tx->nc);
+    send_one();
+    qemu_net_batch_end(&tx->nc);
+    g_assert(qemu_net_sending_batch(&tx->nc));
+    g_assert(qemu_net_in_batch(&rx->nc));
+    g_assert_cmpint(rx->batch_ends, ==, 0);
+
+    send_one();
+    qemu_net_batch_end(&tx->nc);
+    g_assert(!qemu_net_sending_batch(&tx->nc));
+    g_assert(!qemu_net_in_batch(&rx->nc));
+    g_assert_cmpint(rx->batch_ends, ==, 1);
+    g_assert_cmpint(rx->packets, ==, 3);
+    g_assert_cmpint(rx->packets_in_batch, ==, 3);
+
+    /* Outside of a burst, packets go one by one */
+    send_one();
+    g_assert_cmpint(rx->packets, ==, 4);
+    g_assert_cmpint(rx->packets_in_batch, ==, 3);
+    g_assert_cmpint(rx->batch_ends, ==, 1);
+
+    /* An empty burst still ends */
+    qemu_net_batch_begin(&tx->nc);
+    qemu_net_batch_end(&tx->nc);
+    g_assert_cmpint(rx->batch_ends, ==, 2);
+
+    clients_cleanup();
+}
+
+/* A peer that cannot batch sees single packets, but the count stays right */
+static void test_no_batch_end(void)
+{
+    clients_init(&test_info);
+
+    qemu_net_batch_begin(&tx->nc);
+    qemu_net_batch_begin(&tx->nc);
+    g_assert(!qemu_net_in_batch(&rx->nc));
+    send_one();
+    qemu_net_batch_end(&tx->nc);
+    g_assert(qemu_net_sending_batch(&tx->nc));
+    qemu_net_batch_end(&tx->nc);
+    g_assert(!qemu_net_sending_batch(&tx->nc));
+
+    g_assert_cmpint(rx->packets, ==, 1);
+    g_assert_cmpint(rx->packets_in_batch, ==, 0);
+    g_assert_cmpint(rx->nc.receive_batch, ==, 0);
+
+    clients_cleanup();
+}
+
+static void test_unbalanced_subprocess(void)
+{
+    clients_init(&test_batch_info);
+    qemu_net_batch_begin(&tx->nc);
+    qemu_net_batch_end(&tx->nc);
+    qemu_net_batch_end(&tx->nc);
+}
+
+static void test_unbalanced(void)
+{
+    g_test_trap_subprocess("/net/batch/unbalanced/subprocess", 0, 0);
+    g_test_trap_assert_failed();
+    g_test_trap_assert_stderr("*send_batch*");
+}
+
+#ifdef CONFIG_L2TPV3
+/*
+ * The test stands for the network behind l2tpv3: its socket receives what
+ * the guest sends.  sendmmsg is wrapped so that the socket can be made to
+ * look full, or to take only some of the packets at a time.
+ */
+static int peer_fd = -1;
+static int sendmmsg_calls;
+static int sendmmsg_eagain;
+static unsigned int sendmmsg_max;
+
+int sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    sendmmsg_calls++;
+    if (sendmmsg_eagain) {
+        sendmmsg_eagain--;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (sendmmsg_max) {
+        vlen = MIN(vlen, sendmmsg_max);
+    }
+    return syscall(SYS_sendmmsg, fd, msgvec, vlen, flags);
+}
+
+static void l2tpv3_init(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    char *dstport;
+    Netdev netdev = {
+        .type = NET_CLIENT_DRIVER_L2TPV3,
+    };
+    int ret;
+
+    peer_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert(peer_fd >= 0);
+    ret = bind(peer_fd, (struct sockaddr *)&addr, sizeof(addr));
+    g_assert_cmpint(ret, ==, 0);
+    ret = getsockname(peer_fd, (struct sockaddr *)&addr, &len);
+    g_assert_cmpint(ret, ==, 0);
+    dstport = g_strdup_printf("%d", ntohs(addr.sin_port));
+
+    netdev.u.l2tpv3 = (NetdevL2TPv3Options) {
+        .src = (char *)"127.0.0.1",
+        .dst = (char *)"127.0.0.1",
+        .has_srcport = true,
+        .srcport = (char *)"0",
+        .has_dstport = true,
+        .dstport = dstport,
+        .has_udp = true,
+        .udp = true,
+        .txsession = TX_SESSION,
+    };
+
+    tx = DO_UPCAST(TestClient, nc,
+                   qemu_new_net_client(&test_info, NULL, "test", "tx"));
+    ret = net_init_l2tpv3(&netdev, "l2tpv3", &tx->nc, &error_abort);
+    g_assert_cmpint(ret, ==, 0);
+    g_free(dstport);
+
+    sendmmsg_calls = 0;
+    sendmmsg_eagain = 0;
+    sendmmsg_max = 0;
+}
+
+static void l2tpv3_cleanup(void)
+{
+    qemu_del_net_client(tx->nc.peer);
+    qemu_del_net_client(&tx->nc);
+    close(peer_fd);
+}
+
+static ssize_t l2tpv3_send(int seq)
+{
+    uint8_t pkt[PKT_SIZE];
+
+    memset(pkt, seq, sizeof(pkt));
+    stl_be_p(pkt, seq);
+    return qemu_send_packet_async(&tx->nc, pkt, sizeof(pkt), NULL);
+}
+
+static void l2tpv3_send_burst(int first, int n)
+{
+    int i;
+
+    qemu_net_batch_begin(&tx->nc);
+    for (i = first; i < first + n; i++) {
+        g_assert_cmpint(l2tpv3_send(i), ==, PKT_SIZE);
+    }
+    qemu_net_batch_end(&tx->nc);
+}
+
+/* Whatever came out of l2tpv3 must be packets @first to @first + @n - 1 */
+static void l2tpv3_expect(int first, int n)
+{
+    uint8_t buf[8 + PKT_SIZE + 1], pkt[PKT_SIZE];
+    ssize_t len;
+    int i;
+
+    for (i = first; i < first + n; i++) {
+        len = recv(peer_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        g_assert_cmpint(len, ==, 8 + PKT_SIZE);
+        g_assert_cmphex(ldl_be_p(buf), ==, 0x30000);
+        g_assert_cmphex(ldl_be_p(buf + 4), ==, TX_SESSION);
+        memset(pkt, i, sizeof(pkt));
+        stl_be_p(pkt, i);
+        g_assert(!memcmp(buf + 8, pkt, PKT_SIZE));
+    }
+    len = recv(peer_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    g_assert_cmpint(len, ==, -1);
+    g_assert_cmpint(errno, ==, EAGAIN);
+}
+
+/* A burst goes out in one sendmmsg when it ends, or when the vector fills */
+static void test_l2tpv3_burst(void)
+{
+    l2tpv3_init();
+
+    qemu_net_batch_begin(&tx->nc);
+    g_assert_cmpint(l2tpv3_send(0), ==, PKT_SIZE);
+    g_assert_cmpint(l2tpv3_send(1), ==, PKT_SIZE);
+    l2tpv3_expect(0, 0);
+    qemu_net_batch_end(&tx->nc);
+    g_assert_cmpint(sendmmsg_calls, ==, 1);
+    l2tpv3_expect(0, 2);
+
+    /* More packets than the vector holds */
+    l2tpv3_send_burst(2, 100);
+    g_assert_cmpint(sendmmsg_calls, ==, 3);
+    l2tpv3_expect(2, 100);
+
+    /* Single packets still use sendmsg */
+    g_assert_cmpint(l2tpv3_send(102), ==, PKT_SIZE);
+    g_assert_cmpint(sendmmsg_calls, ==, 3);
+    l2tpv3_expect(102, 1);
+
+    l2tpv3_cleanup();
+}
+
+/* Packets staged when the socket is full go out first, and in order */
+static void test_l2tpv3_eagain(void)
+{
+    int i;
+
+    l2tpv3_init();
+
+    /* The next single packet sends the staged ones first */
+    sendmmsg_eagain = 1;
+    sendmmsg_max = 3;
+    l2tpv3_send_burst(0, 10);
+    l2tpv3_expect(0, 0);
+    g_assert_cmpint(l2tpv3_send(10), ==, PKT_SIZE);
+    g_assert_cmpint(sendmmsg_calls, ==, 1 + 4);
+    l2tpv3_expect(0, 11);
+
+    /* A burst while the socket is full stages behind the earlier one */
+    sendmmsg_eagain = 2;
+    l2tpv3_send_burst(11, 5);
+    l2tpv3_send_burst(16, 5);
+    l2tpv3_expect(0, 0);
+
+    /* A single packet waits in the queue of l2tpv3 */
+    sendmmsg_eagain = 1;
+    g_assert_cmpint(l2tpv3_send(21), ==, 0);
+    l2tpv3_expect(0, 0);
+
+    /* Until the socket is writable again */
+    for (i = 0; i < 10; i++) {
+        main_loop_wait(true);
+    }
+    l2tpv3_expect(11, 11);
+
+    l2tpv3_cleanup();
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/batch/nesting", test_nesting);
+    g_test_add_func("/net/batch/no-batch-end", test_no_batch_end);
+    g_test_add_func("/net/batch/unbalanced/subprocess",
+                    test_unbalanced_subprocess);
+    g_test_add_func("/net/batch/unbalanced", test_unbalanced);
+#ifdef CONFIG_L2TPV3
+    g_test_add_func("/net/batch/l2tpv3/burst", test_l2tpv3_burst);
+    g_test_add_func("/net/batch/l2tpv3/eagain", test_l2tpv3_eagain);
+#endif
+
+    return g_test_run();
+}
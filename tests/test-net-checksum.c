@@ -0,0 +1,107 @@
+/*
+ * Internet checksum test
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE 2048
+
+static uint8_t buffer[BUF_SIZE + 64];
+
+/* The byte-at-a-time sum that net_checksum_add_cont() must agree with.  */
+static uint32_t ref_checksum_add(int len, const uint8_t *buf, int seq)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = seq; i < seq + len; i++) {
+        if (i & 1) {
+            sum += buf[i - seq];
+        } else {
+            sum += (uint32_t)buf[i - seq] << 8;
+        }
+    }
+    return sum;
+}
+
+static void fill(uint8_t *buf, size_t len, int pattern)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        switch (pattern) {
+        case 0:
+            buf[i] = g_test_rand_int();
+            break;
+        case 1:
+            buf[i] = 0xff;
+            break;
+        default:
+            buf[i] = 0;
+            break;
+        }
+    }
+}
+
+/* Check every alignment and length, both seq parities and a few data
+ * patterns that stress the carries.  */
+static void test_add_cont(void)
+{
+    int pattern, a, len, seq;
+
+    for (pattern = 0; pattern < 3; pattern++) {
+        for (a = 0; a < 16; a++) {
+            for (len = 0; len <= BUF_SIZE;
+                 len = len < 160 ? len + 1 : len + 97) {
+                fill(buffer + a, len, pattern);
+                for (seq = 0; seq < 2; seq++) {
+                    uint32_t sum = net_checksum_add_cont(len, buffer + a, seq);
+                    uint32_t ref = ref_checksum_add(len, buffer + a, seq);
+
+                    g_assert_cmphex(net_checksum_finish(sum), ==,
+                                    net_checksum_finish(ref));
+                }
+            }
+        }
+    }
+}
+
+/* A buffer split at arbitrary points sums like the whole buffer.  */
+static void test_add_iov(void)
+{
+    struct iovec iov[3];
+    int i;
+
+    fill(buffer, BUF_SIZE, 0);
+    for (i = 0; i < 200; i++) {
+        size_t first = g_test_rand_int_range(0, BUF_SIZE);
+        size_t second = g_test_rand_int_range(first, BUF_SIZE);
+        size_t off = g_test_rand_int_range(0, BUF_SIZE);
+        size_t size = BUF_SIZE - off;
+        uint32_t sum;
+
+        iov[0].iov_base = buffer;
+        iov[0].iov_len = first;
+        iov[1].iov_base = buffer + first;
+        iov[1].iov_len = second - first;
+        iov[2].iov_base = buffer + second;
+        iov[2].iov_len = BUF_SIZE - second;
+
+        sum = net_checksum_add_iov(iov, 3, off, size, 0);
+        g_assert_cmphex(net_checksum_finish(sum), ==,
+                        net_checksum_finish(ref_checksum_add(size,
+                                                             buffer + off, 0)));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/add_cont", test_add_cont);
+    g_test_add_func("/net/checksum/add_iov", test_add_iov);
+    return g_test_run();
+}
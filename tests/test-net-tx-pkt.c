@@ -0,0 +1,250 @@
+/*
+ * Software TCP segmentation test for NetTxPkt
+ *
+ * A TSO packet is handed to net_tx_pkt in several guest fragments that
+ * split the headers and the payload at odd places, and the segments that
+ * come out of the loopback path are checked one by one.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "hw/pci/pci.h"
+#include "hw/net/net_tx_pkt.h"
+#include "net/eth.h"
+#include "net/net.h"
+
+#define ETH_HLEN        14
+#define IP4_HLEN        20
+#define IP6_HLEN        40
+#define TCP_HLEN_OPTS   32
+#define TCP_HLEN        20
+#define MSS             1000
+#define PAYLOAD_LEN     3500
+#define MAX_FRAGS       16
+#define MAX_SEGS        8
+#define SEQ0            0xfffffe00u
+#define IP_ID0          0xfffe
+#define TCP_FLAGS       (TH_ACK | TH_PUSH | TH_FIN | TH_CWR)
+
+/*
+ * Guest memory is the test's own: DMA addresses are host pointers, and
+ * there is no peer behind the loopback path.
+ */
+void *address_space_map(AddressSpace *as, hwaddr addr, hwaddr *plen,
+                        bool is_write)
+{
+    return (void *)(uintptr_t)addr;
+}
+
+void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
+                         int is_write, hwaddr access_len)
+{
+}
+
+ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                          int iovcnt)
+{
+    g_assert_not_reached();
+}
+
+void qemu_net_batch_begin(NetClientState *nc)
+{
+    g_assert_not_reached();
+}
+
+void qemu_net_batch_end(NetClientState *nc)
+{
+    g_assert_not_reached();
+}
+
+static PCIDevice pci_dev;
+static uint8_t packet[ETH_HLEN + IP6_HLEN + TCP_HLEN_OPTS + PAYLOAD_LEN];
+static GByteArray *segs[MAX_SEGS];
+static int nsegs;
+
+static ssize_t receive_segment(NetClientState *nc, const struct iovec *iov,
+                               int iovcnt)
+{
+    size_t len = iov_size(iov, iovcnt);
+
+    g_assert_cmpint(nsegs, <, MAX_SEGS);
+    segs[nsegs] = g_byte_array_set_size(g_byte_array_new(), len);
+    iov_to_buf(iov, iovcnt, 0, segs[nsegs]->data, len);
+    nsegs++;
+    return len;
+}
+
+static NetClientInfo loopback_info = {
+    .receive_iov = receive_segment,
+};
+
+static NetClientState loopback = {
+    .info = &loopback_info,
+};
+
+/* The plain big-endian one's complement sum, without any of net/checksum.c */
+static uint32_t ref_sum(const uint8_t *buf, size_t len, uint32_t sum)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += (i & 1) ? buf[i] : buf[i] << 8;
+    }
+    return sum;
+}
+
+static bool ref_sum_ok(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum == 0xffff;
+}
+
+static size_t build_packet(bool ip6)
+{
+    size_t l3_hlen = ip6 ? IP6_HLEN : IP4_HLEN;
+    size_t tcp_hlen = ip6 ? TCP_HLEN : TCP_HLEN_OPTS;
+    size_t l4_len = tcp_hlen + PAYLOAD_LEN;
+    uint8_t *l3 = packet + ETH_HLEN;
+    uint8_t *tcp = l3 + l3_hlen;
+    size_t i;
+
+    memset(packet, 0, sizeof(packet));
+    memcpy(packet, "\x52\x54\x00\x12\x34\x56\x52\x54\x00\x65\x43\x21", 12);
+    if (ip6) {
+        stw_be_p(packet + 12, ETH_P_IPV6);
+        l3[0] = 0x60;
+        stw_be_p(l3 + 4, l4_len);
+        l3[6] = IP_PROTO_TCP;
+        l3[7] = 64;
+        for (i = 0; i < 32; i++) {
+            l3[8 + i] = 0x20 + i;
+        }
+    } else {
+        stw_be_p(packet + 12, ETH_P_IP);
+        l3[0] = 0x45;
+        stw_be_p(l3 + 2, l3_hlen + l4_len);
+        stw_be_p(l3 + 4, IP_ID0);
+        l3[8] = 64;
+        l3[9] = IP_PROTO_TCP;
+        memcpy(l3 + 12, "\x0a\x00\x02\x0f\x0a\x00\x02\x02", 8);
+    }
+
+    stw_be_p(tcp, 40000);
+    stw_be_p(tcp + 2, 80);
+    stl_be_p(tcp + 4, SEQ0);
+    stl_be_p(tcp + 8, 0x12345678);
+    tcp[12] = (tcp_hlen / 4) << 4;
+    tcp[13] = TCP_FLAGS;
+    stw_be_p(tcp + 14, 0xffff);
+    for (i = TCP_HLEN; i < tcp_hlen; i++) {
+        tcp[i] = 1;                     /* NOP option */
+    }
+    for (i = 0; i < PAYLOAD_LEN; i++) {
+        tcp[tcp_hlen + i] = g_test_rand_int();
+    }
+
+    return ETH_HLEN + l3_hlen + l4_len;
+}
+
+static void check_segment(bool ip6, int i, size_t data_off, size_t seg_len)
+{
+    size_t l3_hlen = ip6 ? IP6_HLEN : IP4_HLEN;
+    size_t tcp_hlen = ip6 ? TCP_HLEN : TCP_HLEN_OPTS;
+    size_t l4_len = tcp_hlen + seg_len;
+    const uint8_t *orig_l3 = packet + ETH_HLEN;
+    const uint8_t *orig_tcp = orig_l3 + l3_hlen;
+    uint8_t *seg = segs[i]->data;
+    uint8_t *l3 = seg + ETH_HLEN;
+    uint8_t *tcp = l3 + l3_hlen;
+    uint8_t flags = TCP_FLAGS;
+    uint8_t pseudo[40];
+    uint32_t sum;
+
+    g_assert_cmpint(segs[i]->len, ==, ETH_HLEN + l3_hlen + l4_len);
+    g_assert(!memcmp(seg, packet, ETH_HLEN));
+
+    if (ip6) {
+        g_assert(!memcmp(l3, orig_l3, 4));
+        g_assert_cmpint(lduw_be_p(l3 + 4), ==, l4_len);
+        g_assert(!memcmp(l3 + 6, orig_l3 + 6, IP6_HLEN - 6));
+        memcpy(pseudo, l3 + 8, 32);
+        stl_be_p(pseudo + 32, l4_len);
+        stl_be_p(pseudo + 36, IP_PROTO_TCP);
+        sum = ref_sum(pseudo, 40, 0);
+    } else {
+        g_assert_cmpint(lduw_be_p(l3 + 2), ==, l3_hlen + l4_len);
+        g_assert_cmpint(lduw_be_p(l3 + 4), ==, (uint16_t)(IP_ID0 + i));
+        g_assert(ref_sum_ok(ref_sum(l3, l3_hlen, 0)));
+        g_assert(!memcmp(l3 + 12, orig_l3 + 12, 8));
+        memcpy(pseudo, l3 + 12, 8);
+        pseudo[8] = 0;
+        pseudo[9] = IP_PROTO_TCP;
+        stw_be_p(pseudo + 10, l4_len);
+        sum = ref_sum(pseudo, 12, 0);
+    }
+
+    g_assert_cmphex(ldl_be_p(tcp + 4), ==, (uint32_t)(SEQ0 + data_off));
+    if (data_off + seg_len < PAYLOAD_LEN) {
+        flags &= ~(TH_FIN | TH_PUSH);
+    }
+    if (i > 0) {
+        flags &= ~TH_CWR;
+    }
+    g_assert_cmphex(tcp[13], ==, flags);
+    g_assert(!memcmp(tcp, orig_tcp, 4));
+    g_assert(!memcmp(tcp + 8, orig_tcp + 8, 5));
+    g_assert(!memcmp(tcp + 14, orig_tcp + 14, 2));
+    g_assert(!memcmp(tcp + 18, orig_tcp + 18, tcp_hlen - 18));
+    g_assert(!memcmp(tcp + tcp_hlen, orig_tcp + tcp_hlen + data_off,
+                     seg_len));
+    g_assert(ref_sum_ok(ref_sum(tcp, l4_len, sum)));
+}
+
+static void test_tso(gconstpointer opaque)
+{
+    bool ip6 = GPOINTER_TO_INT(opaque);
+    /* In the MAC, IP and TCP headers and at odd places of the payload */
+    static const size_t splits[] = { 5, 30, 61, 62, 700, 1701, 2500, 3001 };
+    struct NetTxPkt *pkt;
+    size_t len = build_packet(ip6);
+    size_t start = 0, data_off;
+    int i;
+
+    net_tx_pkt_init(&pkt, &pci_dev, MAX_FRAGS, false);
+    for (i = 0; i <= ARRAY_SIZE(splits); i++) {
+        size_t end = i < ARRAY_SIZE(splits) ? splits[i] : len;
+
+        g_assert(net_tx_pkt_add_raw_fragment(pkt,
+                                             (uintptr_t)(packet + start),
+                                             end - start));
+        start = end;
+    }
+    g_assert(net_tx_pkt_parse(pkt));
+    net_tx_pkt_build_vheader(pkt, true, true, MSS);
+
+    nsegs = 0;
+    g_assert(net_tx_pkt_send_loopback(pkt, &loopback));
+    g_assert_cmpint(nsegs, ==, DIV_ROUND_UP(PAYLOAD_LEN, MSS));
+
+    for (i = 0, data_off = 0; i < nsegs; i++, data_off += MSS) {
+        check_segment(ip6, i, data_off, MIN(MSS, PAYLOAD_LEN - data_off));
+        g_byte_array_free(segs[i], true);
+    }
+
+    net_tx_pkt_reset(pkt);
+    net_tx_pkt_uninit(pkt);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/net/tx-pkt/tso/ipv4", GINT_TO_POINTER(false),
+                         test_tso);
+    g_test_add_data_func("/net/tx-pkt/tso/ipv6", GINT_TO_POINTER(true),
+                         test_tso);
+    return g_test_run();
+}
@@ -0,0 +1,193 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+/* With 8 pages there are two sets of four ways; even pages go to set 0 */
+#define NUM_PAGES 8
+#define SET0(n)   ((uint64_t)(n) * 2 * PAGE_SIZE)
+
+static uint8_t page[PAGE_SIZE];
+
+static void insert(PageCache *cache, uint64_t addr, uint8_t fill,
+                   uint64_t age)
+{
+    memset(page, fill, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, addr, page, age), ==, 0);
+}
+
+static void assert_cached(PageCache *cache, uint64_t addr, uint8_t fill)
+{
+    uint8_t *data = get_cached_data(cache, addr);
+
+    g_assert(data);
+    memset(page, fill, PAGE_SIZE);
+    g_assert(!memcmp(data, page, PAGE_SIZE));
+}
+
+static void good_deltas(PageCache *cache, uint64_t addr, int n)
+{
+    while (n--) {
+        cache_update_delta(cache, addr, true);
+    }
+}
+
+static int count_skips(PageCache *cache, uint64_t addr)
+{
+    int n = 0;
+
+    while (cache_skip_delta(cache, addr)) {
+        n++;
+        g_assert_cmpint(n, <=, 64);
+    }
+    return n;
+}
+
+/* The lowest scoring page of a set is replaced, unless it is fresh */
+static void test_victim(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        insert(cache, SET0(i), i, 0);
+    }
+    good_deltas(cache, SET0(0), 16);
+    good_deltas(cache, SET0(1), 4);
+    good_deltas(cache, SET0(2), 8);
+
+    /* The other set still has room */
+    insert(cache, PAGE_SIZE, 0xf0, 1);
+
+    /* Every page of the set is fresh */
+    memset(page, 0xe0, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, SET0(4), page, 1), ==, -1);
+    g_assert(!get_cached_data(cache, SET0(4)));
+
+    /* Page 3 has no hits, but a lookup makes it fresh again; page 1
+     * scores lowest of the others, even with the scores decayed */
+    g_assert(cache_is_cached(cache, SET0(3), 2));
+    insert(cache, SET0(4), 0xe0, 2);
+    g_assert(!get_cached_data(cache, SET0(1)));
+    assert_cached(cache, SET0(0), 0);
+    assert_cached(cache, SET0(2), 2);
+    assert_cached(cache, SET0(3), 3);
+    assert_cached(cache, SET0(4), 0xe0);
+    assert_cached(cache, PAGE_SIZE, 0xf0);
+
+    /* Inserting a cached page again updates it in place */
+    insert(cache, SET0(0), 0x55, 3);
+    assert_cached(cache, SET0(0), 0x55);
+    assert_cached(cache, SET0(2), 2);
+    assert_cached(cache, SET0(3), 3);
+    assert_cached(cache, SET0(4), 0xe0);
+
+    cache_fini(cache);
+
+    /* On equal scores, the page that has been idle longest goes */
+    cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    for (i = 0; i < 4; i++) {
+        insert(cache, SET0(i), i, i);
+    }
+    insert(cache, SET0(4), 4, 10);
+    g_assert(!get_cached_data(cache, SET0(0)));
+    for (i = 1; i <= 4; i++) {
+        assert_cached(cache, SET0(i), i);
+    }
+    cache_fini(cache);
+}
+
+/* After poor deltas a page is sent whole for 1, 2, 4... rounds */
+static void test_skip_delta(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    int i;
+
+    insert(cache, 0, 0, 0);
+    g_assert(!cache_skip_delta(cache, 0));
+
+    for (i = 0; i < 8; i++) {
+        cache_update_delta(cache, 0, false);
+        g_assert_cmpint(count_skips(cache, 0), ==, MIN(1 << i, 32));
+    }
+
+    /* A good delta resets the backoff */
+    cache_update_delta(cache, 0, true);
+    g_assert(!cache_skip_delta(cache, 0));
+    cache_update_delta(cache, 0, false);
+    g_assert_cmpint(count_skips(cache, 0), ==, 1);
+    cache_update_delta(cache, 0, false);
+    g_assert_cmpint(count_skips(cache, 0), ==, 2);
+
+    /* A page taking over the slot starts afresh */
+    cache_update_delta(cache, 0, false);
+    for (i = 1; i < 4; i++) {
+        insert(cache, SET0(i), i, 0);
+    }
+    insert(cache, SET0(4), 4, 2);
+    g_assert(!get_cached_data(cache, 0));
+    g_assert(!cache_skip_delta(cache, SET0(4)));
+
+    /* Pages that are not cached are never skipped */
+    cache_update_delta(cache, 0, false);
+    g_assert(!cache_skip_delta(cache, 0));
+
+    cache_fini(cache);
+}
+
+/* Shrinking the cache keeps the pages with most hits, then the newest */
+static void test_resize(void)
+{
+    static const int hits[NUM_PAGES] = { 5, 0, 7, 1, 5, 5, 0, 6 };
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint64_t addr;
+    int i;
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES), ==, NUM_PAGES);
+
+    for (i = 0; i < NUM_PAGES; i++) {
+        addr = (uint64_t)i * PAGE_SIZE;
+        insert(cache, addr, i, i);
+        good_deltas(cache, addr, hits[i]);
+    }
+
+    /* One set of four: pages 2 and 7 win on hits, 5 and 4 on age */
+    g_assert_cmpint(cache_resize(cache, 4), ==, 4);
+    for (i = 0; i < NUM_PAGES; i++) {
+        addr = (uint64_t)i * PAGE_SIZE;
+        if (i == 2 || i == 4 || i == 5 || i == 7) {
+            assert_cached(cache, addr, i);
+        } else {
+            g_assert(!get_cached_data(cache, addr));
+        }
+    }
+
+    /* Growing keeps everything, and the hits come along */
+    g_assert_cmpint(cache_resize(cache, 20), ==, 16);
+    assert_cached(cache, 2 * PAGE_SIZE, 2);
+    assert_cached(cache, 4 * PAGE_SIZE, 4);
+    assert_cached(cache, 5 * PAGE_SIZE, 5);
+    assert_cached(cache, 7 * PAGE_SIZE, 7);
+    g_assert_cmpint(cache_resize(cache, 1), ==, 1);
+    assert_cached(cache, 2 * PAGE_SIZE, 2);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/victim", test_victim);
+    g_test_add_func("/page-cache/skip-delta", test_skip_delta);
+    g_test_add_func("/page-cache/resize", test_resize);
+
+    return g_test_run();
+}
@@ -280,6 +280,64 @@ static void test_simple_primitive(void)
 }
 #undef FIELD_EQUAL
 
+/* Arrays of integers take the bulk copy path */
+
+typedef struct TestArray {
+    uint8_t  u8[3];
+    uint16_t u16[3];
+    uint32_t u32[2];
+    int64_t  i64[2];
+} TestArray;
+
+TestArray obj_array = {
+    .u8 = { 1, 2, 0xff },
+    .u16 = { 0x102, 0x304, 0xfffe },
+    .u32 = { 0x1020304, 0xfffffffe },
+    .i64 = { 0x102030405060708LL, -2 },
+};
+
+static const VMStateDescription vmstate_array_primitive = {
+    .name = "array/primitive",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(u8, TestArray, 3),
+        VMSTATE_UINT16_ARRAY(u16, TestArray, 3),
+        VMSTATE_UINT32_ARRAY(u32, TestArray, 2),
+        VMSTATE_INT64_ARRAY(i64, TestArray, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+uint8_t wire_array_primitive[] = {
+    /* u8 */  0x01, 0x02, 0xff,
+    /* u16 */ 0x01, 0x02, 0x03, 0x04, 0xff, 0xfe,
+    /* u32 */ 0x01, 0x02, 0x03, 0x04, 0xff, 0xff, 0xff, 0xfe,
+    /* i64 */ 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+              0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_array_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestArray));
+}
+
+static void test_array_primitive(void)
+{
+    TestArray obj, obj_clone;
+
+    memset(&obj, 0, sizeof(obj));
+    save_vmstate(&vmstate_array_primitive, &obj_array);
+
+    compare_vmstate(wire_array_primitive, sizeof(wire_array_primitive));
+
+    SUCCESS(load_vmstate(&vmstate_array_primitive, &obj, &obj_clone,
+                         obj_array_copy, 1, wire_array_primitive,
+                         sizeof(wire_array_primitive)));
+    SUCCESS(memcmp(&obj, &obj_array, sizeof(obj)));
+}
+
 typedef struct TestStruct {
     uint32_t a, b, c, e;
     uint64_t d, f;
@@ -479,6 +537,7 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
+    g_test_add_func("/vmstate/array/primitive", test_array_primitive);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
@@ -174,6 +174,78 @@ static void test_encode_decode(void)
     }
 }
 
+#define NUM_ACCEL_CASES 200
+
+/* Every encoder implementation must produce the same output */
+static void test_encode_accels(void)
+{
+    uint8_t *old = g_malloc(NUM_ACCEL_CASES * PAGE_SIZE);
+    uint8_t *new = g_malloc(NUM_ACCEL_CASES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(NUM_ACCEL_CASES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int ref_len[NUM_ACCEL_CASES];
+    bool first = true;
+    int i, j, k;
+
+    for (i = 0; i < NUM_ACCEL_CASES; i++) {
+        uint8_t *o = old + i * PAGE_SIZE, *n = new + i * PAGE_SIZE;
+        int nr_runs = g_test_rand_int_range(0, 64);
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            o[j] = g_test_rand_int();
+        }
+        memcpy(n, o, PAGE_SIZE);
+        /* short and long runs of changed bytes, some of them touching */
+        for (k = 0; k < nr_runs; k++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, i % 2 ? 9 : 300);
+
+            for (j = start; j < MIN(start + len, PAGE_SIZE); j++) {
+                n[j] = o[j] + 1;
+            }
+        }
+    }
+
+    do {
+        if (g_test_verbose()) {
+            g_test_message("accel %s", test_xbzrle_encode_accel_name());
+        }
+        for (i = 0; i < NUM_ACCEL_CASES; i++) {
+            uint8_t *o = old + i * PAGE_SIZE, *n = new + i * PAGE_SIZE;
+            int dlen, rc;
+
+            dlen = xbzrle_encode_buffer(o, n, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            if (first) {
+                ref_len[i] = dlen;
+                if (dlen > 0) {
+                    memcpy(ref + i * PAGE_SIZE, compressed, dlen);
+                }
+            } else {
+                g_assert_cmpint(dlen, ==, ref_len[i]);
+                g_assert(dlen <= 0 ||
+                         memcmp(ref + i * PAGE_SIZE, compressed, dlen) == 0);
+            }
+
+            if (dlen > 0) {
+                memcpy(decoded, o, PAGE_SIZE);
+                rc = xbzrle_decode_buffer(compressed, dlen, decoded,
+                                          PAGE_SIZE);
+                g_assert(rc > 0);
+                g_assert(memcmp(decoded, n, PAGE_SIZE) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+    g_free(decoded);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +258,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accels", test_encode_accels);
 
     return g_test_run();
 }
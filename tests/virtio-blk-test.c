@@ -30,6 +30,10 @@
 #define PCI_SLOT                0x04
 #define PCI_FN                  0x00
 
+#define MQ_NUM_QUEUES           4
+#define MQ_REQS_PER_QUEUE       8
+#define MQ_REQ_SIZE             4096
+
 #define MMIO_PAGE_SIZE          4096
 #define MMIO_DEV_BASE_ADDR      0x0A003E00
 #define MMIO_RAM_ADDR           0x40000000
@@ -710,6 +714,144 @@ static void pci_hotplug(void)
     test_end();
 }
 
+/* Wait until the device has written the status byte at @addr */
+static uint8_t virtio_blk_wait_status(uint64_t addr)
+{
+    gint64 deadline = g_get_monotonic_time() + QVIRTIO_BLK_TIMEOUT_US;
+    uint8_t status;
+
+    while ((status = readb(addr)) == 0xFF) {
+        g_assert(g_get_monotonic_time() < deadline);
+        clock_step(100);
+    }
+    return status;
+}
+
+/* Submit request @j of the batch on queue @q, without waiting for it */
+static uint64_t virtio_blk_mq_submit(QVirtioDevice *dev, QVirtQueue *vq,
+                                     QGuestAllocator *alloc, int q, int j,
+                                     bool write)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+
+    req.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = (q * MQ_REQS_PER_QUEUE + j) * (MQ_REQ_SIZE / 512);
+    req.data = g_malloc0(MQ_REQ_SIZE);
+    if (write) {
+        memset(req.data, q * MQ_REQS_PER_QUEUE + j + 1, MQ_REQ_SIZE);
+    }
+    req_addr = virtio_blk_request(alloc, &req, MQ_REQ_SIZE);
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, MQ_REQ_SIZE, !write, true);
+    qvirtqueue_add(vq, req_addr + 16 + MQ_REQ_SIZE, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, dev, vq, free_head);
+
+    return req_addr;
+}
+
+/*
+ * Every queue is serviced by its own IOThread, which submits straight to
+ * the image; requests run on all queues at once, and what one queue wrote
+ * is read back through another.
+ */
+static void pci_multiqueue(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci[MQ_NUM_QUEUES];
+    QGuestAllocator *alloc;
+    uint64_t req_addr[MQ_NUM_QUEUES][MQ_REQS_PER_QUEUE];
+    uint32_t features;
+    char *tmp_path, *cmdline;
+    char *data, *expected;
+    int q, j, pass;
+
+    tmp_path = drive_create();
+    cmdline = g_strdup_printf("-object iothread,id=iothread0 "
+                              "-object iothread,id=iothread1 "
+                              "-object iothread,id=iothread2 "
+                              "-object iothread,id=iothread3 "
+                              "-drive if=none,id=drive0,file=%s,format=raw "
+                              "-device virtio-blk-pci,id=drv0,drive=drive0,"
+                              "num-queues=%d,iothread=iothread0,"
+                              "iothreads=iothread1:iothread2:iothread3,"
+                              "addr=%x.%x",
+                              tmp_path, MQ_NUM_QUEUES, PCI_SLOT, PCI_FN);
+    qtest_start(cmdline);
+    unlink(tmp_path);
+    g_free(tmp_path);
+    g_free(cmdline);
+
+    bus = qpci_init_pc();
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert(features & (1u << VIRTIO_BLK_F_MQ));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    for (q = 0; q < MQ_NUM_QUEUES; q++) {
+        vqpci[q] = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci,
+                                                     &dev->vdev, alloc, q);
+    }
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Write from every queue, then read through the next one */
+    data = g_malloc(MQ_REQ_SIZE);
+    expected = g_malloc(MQ_REQ_SIZE);
+    for (pass = 0; pass < 2; pass++) {
+        bool write = pass == 0;
+
+        for (j = 0; j < MQ_REQS_PER_QUEUE; j++) {
+            for (q = 0; q < MQ_NUM_QUEUES; q++) {
+                req_addr[q][j] = virtio_blk_mq_submit(&dev->vdev,
+                                                      &vqpci[q]->vq, alloc,
+                                                      write ? q :
+                                                      (q + 1) % MQ_NUM_QUEUES,
+                                                      j, write);
+            }
+        }
+
+        for (q = 0; q < MQ_NUM_QUEUES; q++) {
+            for (j = 0; j < MQ_REQS_PER_QUEUE; j++) {
+                uint64_t addr = req_addr[q][j];
+                int src = write ? q : (q + 1) % MQ_NUM_QUEUES;
+
+                g_assert_cmpint(virtio_blk_wait_status(addr + 16 +
+                                                       MQ_REQ_SIZE), ==, 0);
+                if (!write) {
+                    memread(addr + 16, data, MQ_REQ_SIZE);
+                    memset(expected, src * MQ_REQS_PER_QUEUE + j + 1,
+                           MQ_REQ_SIZE);
+                    g_assert(!memcmp(data, expected, MQ_REQ_SIZE));
+                }
+                guest_free(alloc, addr);
+            }
+        }
+    }
+    g_free(data);
+    g_free(expected);
+
+    /* End test */
+    for (q = 0; q < MQ_NUM_QUEUES; q++) {
+        qvirtqueue_cleanup(&qvirtio_pci, &vqpci[q]->vq, alloc);
+    }
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void mmio_basic(void)
 {
     QVirtioMMIODevice *dev;
@@ -764,6 +906,7 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
+        qtest_add_func("/virtio/blk/pci/multiqueue", pci_multiqueue);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
     }
@@ -0,0 +1,218 @@
+/*
+ * QTest testcase for migrating a virtio-pci device with modern rings
+ *
+ * A virtio 1.0 driver places the avail and used rings wherever it likes,
+ * unlike the legacy layout that follows from the descriptor table alone.
+ * The destination must use the ring addresses it received, so the test
+ * puts the rings apart and has the device complete a request after
+ * migration.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_pci.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+#define RNG_DEVICE  "-device virtio-rng-pci,disable-legacy=on," \
+                    "disable-modern=off,addr=04.0 "
+#define RNG_BUF_LEN 64
+#define TIMEOUT_US  (30 * 1000 * 1000)
+
+static char mig_socket[] = "/tmp/qtest-migration.XXXXXX";
+
+typedef struct ModernDev {
+    QPCIBus *bus;
+    QPCIDevice *pdev;
+    /* BARs are mapped once; qpci_iomap() moves them every time */
+    void *bars[6];
+    void *common;
+    void *notify;
+    uint16_t qsize;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t avail_idx;
+} ModernDev;
+
+/* Map the region that the virtio capability of @cfg_type points to */
+static void *modern_map_cap(ModernDev *d, uint8_t cfg_type,
+                            uint32_t *notify_mult)
+{
+    uint8_t pos = qpci_config_readb(d->pdev, PCI_CAPABILITY_LIST);
+
+    while (pos) {
+        if (qpci_config_readb(d->pdev, pos) == PCI_CAP_ID_VNDR &&
+            qpci_config_readb(d->pdev,
+                              pos + VIRTIO_PCI_CAP_CFG_TYPE) == cfg_type) {
+            uint8_t bar = qpci_config_readb(d->pdev,
+                                            pos + VIRTIO_PCI_CAP_BAR);
+            uint32_t offset = qpci_config_readl(d->pdev,
+                                                pos + VIRTIO_PCI_CAP_OFFSET);
+
+            if (notify_mult) {
+                *notify_mult = qpci_config_readl(d->pdev, pos +
+                                                 sizeof(struct virtio_pci_cap));
+            }
+            g_assert_cmpint(bar, <, ARRAY_SIZE(d->bars));
+            if (!d->bars[bar]) {
+                d->bars[bar] = qpci_iomap(d->pdev, bar, NULL);
+            }
+            return (uint8_t *)d->bars[bar] + offset;
+        }
+        pos = qpci_config_readb(d->pdev, pos + PCI_CAP_LIST_NEXT);
+    }
+    g_assert_not_reached();
+}
+
+static void modern_setup(ModernDev *d, QOSState *qs)
+{
+    uint32_t notify_mult;
+    uint16_t notify_off;
+    uint8_t status;
+
+    d->bus = qpci_init_pc();
+    d->pdev = qpci_device_find(d->bus, QPCI_DEVFN(4, 0));
+    g_assert(d->pdev);
+    qpci_device_enable(d->pdev);
+
+    d->common = modern_map_cap(d, VIRTIO_PCI_CAP_COMMON_CFG, NULL);
+    d->notify = modern_map_cap(d, VIRTIO_PCI_CAP_NOTIFY_CFG, &notify_mult);
+
+    status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    qpci_io_writeb(d->pdev, d->common + VIRTIO_PCI_COMMON_STATUS, status);
+
+    /* VIRTIO_F_VERSION_1 is bit 0 of the second feature word */
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GF,
+                   1u << (VIRTIO_F_VERSION_1 - 32));
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GF, 0);
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    qpci_io_writeb(d->pdev, d->common + VIRTIO_PCI_COMMON_STATUS, status);
+    g_assert_cmphex(qpci_io_readb(d->pdev,
+                                  d->common + VIRTIO_PCI_COMMON_STATUS),
+                    ==, status);
+
+    qpci_io_writew(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_SELECT, 0);
+    d->qsize = qpci_io_readw(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_SIZE);
+    g_assert_cmpint(d->qsize, >, 0);
+
+    /*
+     * The used ring goes first and the avail ring last, so that neither is
+     * where the legacy layout would put it.
+     */
+    d->used = guest_alloc(qs->alloc, sizeof(struct vring_used) +
+                          d->qsize * sizeof(struct vring_used_elem) + 2);
+    d->desc = guest_alloc(qs->alloc, d->qsize * sizeof(struct vring_desc));
+    d->avail = guest_alloc(qs->alloc, sizeof(struct vring_avail) +
+                           d->qsize * sizeof(uint16_t) + 2);
+    g_assert_cmphex(d->avail, !=, d->desc + d->qsize *
+                    sizeof(struct vring_desc));
+    qmemset(d->used, 0, sizeof(struct vring_used) +
+            d->qsize * sizeof(struct vring_used_elem) + 2);
+    qmemset(d->avail, 0, sizeof(struct vring_avail) +
+            d->qsize * sizeof(uint16_t) + 2);
+
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_DESCLO, d->desc);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_DESCHI,
+                   d->desc >> 32);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_AVAILLO,
+                   d->avail);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_AVAILHI,
+                   d->avail >> 32);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_USEDLO, d->used);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_USEDHI,
+                   d->used >> 32);
+    notify_off = qpci_io_readw(d->pdev,
+                               d->common + VIRTIO_PCI_COMMON_Q_NOFF);
+    d->notify = (uint8_t *)d->notify + notify_off * notify_mult;
+    qpci_io_writew(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+
+    status |= VIRTIO_CONFIG_S_DRIVER_OK;
+    qpci_io_writeb(d->pdev, d->common + VIRTIO_PCI_COMMON_STATUS, status);
+}
+
+/* Hand the device a buffer to fill and wait until it is used */
+static void modern_rng_request(ModernDev *d, QOSState *qs)
+{
+    uint16_t slot = d->avail_idx % d->qsize;
+    uint64_t buf = guest_alloc(qs->alloc, RNG_BUF_LEN);
+    uint64_t desc = d->desc + slot * sizeof(struct vring_desc);
+    uint64_t elem;
+    gint64 deadline;
+
+    writeq(desc + offsetof(struct vring_desc, addr), buf);
+    writel(desc + offsetof(struct vring_desc, len), RNG_BUF_LEN);
+    writew(desc + offsetof(struct vring_desc, flags), VRING_DESC_F_WRITE);
+    writew(desc + offsetof(struct vring_desc, next), 0);
+    writew(d->avail + offsetof(struct vring_avail, ring) +
+           slot * sizeof(uint16_t), slot);
+    d->avail_idx++;
+    writew(d->avail + offsetof(struct vring_avail, idx), d->avail_idx);
+    qpci_io_writew(d->pdev, d->notify, 0);
+
+    deadline = g_get_monotonic_time() + TIMEOUT_US;
+    while (readw(d->used + offsetof(struct vring_used, idx)) !=
+           d->avail_idx) {
+        g_assert(g_get_monotonic_time() < deadline);
+        clock_step(100);
+    }
+
+    elem = d->used + offsetof(struct vring_used, ring) +
+           slot * sizeof(struct vring_used_elem);
+    g_assert_cmpint(readl(elem + offsetof(struct vring_used_elem, id)), ==,
+                    slot);
+    g_assert_cmpint(readl(elem + offsetof(struct vring_used_elem, len)), >,
+                    0);
+    guest_free(qs->alloc, buf);
+}
+
+static void test_migrate_modern_rings(void)
+{
+    QOSState *src, *dst;
+    ModernDev d = { 0 };
+    char *uri = g_strdup_printf("unix:%s", mig_socket);
+
+    src = qtest_pc_boot(RNG_DEVICE);
+    dst = qtest_pc_boot(RNG_DEVICE "-incoming %s", uri);
+
+    set_context(src);
+    modern_setup(&d, src);
+    modern_rng_request(&d, src);
+
+    migrate(src, dst, uri);
+
+    /* The device must find the rings where the driver put them */
+    modern_rng_request(&d, dst);
+    modern_rng_request(&d, dst);
+
+    g_free(d.pdev);
+    qpci_free_pc(d.bus);
+    qtest_pc_shutdown(src);
+    qtest_pc_shutdown(dst);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(mig_socket);
+    g_assert(fd >= 0);
+    close(fd);
+    unlink(mig_socket);
+
+    qtest_add_func("/virtio/pci/modern/migrate", test_migrate_modern_rings);
+    ret = g_test_run();
+
+    return ret;
+}
@@ -19,17 +19,27 @@
 #include "libqos/malloc-pc.h"
 #include "libqos/malloc-generic.h"
 #include "qemu/bswap.h"
+#include "hw/pci/pci_regs.h"
 #include "hw/virtio/virtio-net.h"
 #include "standard-headers/linux/virtio_ids.h"
 #include "standard-headers/linux/virtio_ring.h"
 
 #define PCI_SLOT_HP             0x06
 #define PCI_SLOT                0x04
+#define PCI_SLOT_TESTDEV        0x05
 #define PCI_FN                  0x00
 
 #define QVIRTIO_NET_TIMEOUT_US (30 * 1000 * 1000)
 #define VNET_HDR_SIZE sizeof(struct virtio_net_hdr_mrg_rxbuf)
 
+#define RX_BURST                8
+#define RX_BURST_INTERVAL_US    1000
+
+/* The header of the current pci-testdev test */
+#define TESTDEV_OFFSET          4
+#define TESTDEV_DATA            8
+#define TESTDEV_COUNT           12
+
 static void test_end(void)
 {
     qtest_end();
@@ -202,6 +212,152 @@ static void stop_cont_test(const QVirtioBus *bus, QVirtioDevice *dev,
     rx_stop_cont_test(bus, dev, alloc, rvq, socket);
 }
 
+static void rx_burst_send(int socket, int first)
+{
+    char pkt[8];
+    uint32_t len = htonl(sizeof(pkt));
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = pkt,
+            .iov_len = sizeof(pkt),
+        },
+    };
+    int ret, i;
+
+    for (i = first; i < first + RX_BURST; i++) {
+        snprintf(pkt, sizeof(pkt), "BURST%02d", i);
+        ret = iov_send(socket, iov, 2, 0, sizeof(len) + sizeof(pkt));
+        g_assert_cmpint(ret, ==, sizeof(len) + sizeof(pkt));
+    }
+}
+
+static void rx_burst_wait(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (readw(vq->used + offsetof(struct vring_used, idx)) != idx) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+}
+
+/*
+ * Packets that the socket backend sends one by one are notified one by
+ * one; when filter-buffer releases them as a burst, the guest gets a
+ * single interrupt.  pci-testdev counts the writes that match its current
+ * test, so the MSI-X vector of the receive queue points there.
+ */
+static void pci_rx_burst(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIDevice *tdev;
+    QPCIBus *bus;
+    QVirtQueuePCI *tx, *rx;
+    QGuestAllocator *alloc;
+    uint64_t bufs[2 * RX_BURST], msi_addr;
+    uint32_t free_head;
+    uint8_t msi_data;
+    void *tbar, *entry;
+    char *cmdline, buffer[8], pkt[8];
+    QDict *rsp;
+    int sv[2], ret, i;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    cmdline = g_strdup_printf("-netdev socket,fd=%d,id=hs0 "
+                              "-device virtio-net-pci,netdev=hs0 "
+                              "-device pci-testdev,addr=%02x.0",
+                              sv[1], PCI_SLOT_TESTDEV);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    bus = qpci_init_pc();
+
+    /* Test 0 counts the byte writes of its data at its offset in BAR 0 */
+    tdev = qpci_device_find(bus, QPCI_DEVFN(PCI_SLOT_TESTDEV, 0));
+    g_assert(tdev != NULL);
+    qpci_device_enable(tdev);
+    tbar = qpci_iomap(tdev, 0, NULL);
+    qpci_io_writeb(tdev, tbar, 0);
+    msi_addr = (uintptr_t)tbar + qpci_io_readl(tdev, tbar + TESTDEV_OFFSET);
+    msi_data = qpci_io_readb(tdev, tbar + TESTDEV_DATA);
+    g_assert_cmpint(qpci_io_readl(tdev, tbar + TESTDEV_COUNT), ==, 0);
+
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+    qpci_msix_enable(dev->pdev);
+    alloc = pc_alloc_init();
+    qvirtio_pci_set_msix_configuration_vector(dev, alloc, 0);
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                           alloc, 1);
+    qvirtqueue_pci_msix_setup(dev, rx, alloc, 1);
+    entry = dev->pdev->msix_table + rx->msix_entry * PCI_MSIX_ENTRY_SIZE;
+    qpci_io_writel(dev->pdev, entry + PCI_MSIX_ENTRY_LOWER_ADDR, msi_addr);
+    qpci_io_writel(dev->pdev, entry + PCI_MSIX_ENTRY_UPPER_ADDR,
+                   msi_addr >> 32);
+    qpci_io_writel(dev->pdev, entry + PCI_MSIX_ENTRY_DATA, msi_data);
+    driver_init(&qvirtio_pci, &dev->vdev);
+
+    for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+        bufs[i] = guest_alloc(alloc, 64);
+        free_head = qvirtqueue_add(&rx->vq, bufs[i], 64, true, false);
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &rx->vq, free_head);
+    }
+
+    /* Straight from the socket, one interrupt per packet */
+    rx_burst_send(sv[0], 0);
+    rx_burst_wait(&rx->vq, RX_BURST);
+    g_assert_cmpint(qpci_io_readl(tdev, tbar + TESTDEV_COUNT), ==, RX_BURST);
+
+    /* Held by filter-buffer until its timer fires */
+    rsp = qmp("{'execute': 'object-add',"
+              " 'arguments': {"
+              "   'qom-type': 'filter-buffer',"
+              "   'id': 'qtest-f0',"
+              "   'props': {"
+              "     'netdev': 'hs0',"
+              "     'queue': 'tx',"
+              "     'interval': %d"
+              "}}}", RX_BURST_INTERVAL_US);
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    rx_burst_send(sv[0], RX_BURST);
+    /* Make sure that QEMU has read the packets */
+    rsp = qmp("{ 'execute' : 'query-status'}");
+    QDECREF(rsp);
+    g_assert_cmpint(readw(rx->vq.used + offsetof(struct vring_used, idx)),
+                    ==, RX_BURST);
+
+    clock_step(RX_BURST_INTERVAL_US * 1000);
+    rx_burst_wait(&rx->vq, 2 * RX_BURST);
+    g_assert_cmpint(qpci_io_readl(tdev, tbar + TESTDEV_COUNT), ==,
+                    RX_BURST + 1);
+
+    for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+        snprintf(pkt, sizeof(pkt), "BURST%02d", i);
+        memread(bufs[i] + VNET_HDR_SIZE, buffer, sizeof(buffer));
+        g_assert(!memcmp(buffer, pkt, sizeof(pkt)));
+        guest_free(alloc, bufs[i]);
+    }
+
+    close(sv[0]);
+    qvirtqueue_cleanup(&qvirtio_pci, &tx->vq, alloc);
+    qvirtqueue_cleanup(&qvirtio_pci, &rx->vq, alloc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    g_free(tdev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void pci_basic(gconstpointer data)
 {
     QVirtioPCIDevice *dev;
@@ -261,6 +417,7 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_func("/virtio/net/pci/rx_burst", pci_rx_burst);
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
@@ -0,0 +1,780 @@
+/*
+ * QTest testcase for the packed virtqueue layout
+ *
+ * The test drives virtio-blk and virtio-net with packed=on through its own
+ * packed ring driver: requests run through the ring several times so that
+ * the wrap counters flip with chains straddling the end of the ring, go
+ * through indirect tables, come back as batches of used descriptors and
+ * honour both event suppression areas.  A request is also left in the ring
+ * across migration, for the destination to find where the source stopped.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "standard-headers/linux/virtio_pci.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+#define DEVICE_OPTS     "packed=on,disable-legacy=on,disable-modern=off," \
+                        "addr=04.0"
+#define TIMEOUT_US      (30 * 1000 * 1000)
+#define MAX_QUEUE_SIZE  1024
+#define MAX_CHAIN       8
+
+#define DESC_SIZE       16
+#define DESC_ADDR       0
+#define DESC_LEN        8
+#define DESC_ID         12
+#define DESC_FLAGS      14
+#define EVENT_OFF_WRAP  0
+#define EVENT_FLAGS     2
+
+#define BLK_IMG_SIZE    (1024 * 1024)
+#define BLK_SECTOR      512
+#define BLK_HDR_SIZE    16
+
+#define NET_HDR_SIZE    sizeof(struct virtio_net_hdr_mrg_rxbuf)
+#define NET_RX_BUFS     5
+#define NET_RX_BUF_LEN  200
+/* Just enough to fill NET_RX_BUFS buffers, header included */
+#define NET_PKT_LEN     (NET_RX_BUFS * NET_RX_BUF_LEN - NET_HDR_SIZE)
+
+static char mig_socket[] = "/tmp/qtest-packed-migration.XXXXXX";
+static char blk_img[] = "/tmp/qtest-packed.XXXXXX";
+
+typedef struct PackedQueue {
+    uint16_t index;
+    uint16_t size;
+    uint64_t ring;
+    uint64_t driver_event;
+    uint64_t device_event;
+    void *notify;
+
+    /* Where the driver puts the next buffer and expects the next used one */
+    uint16_t avail_idx;
+    bool avail_wrap;
+    uint16_t used_idx;
+    bool used_wrap;
+
+    uint16_t next_id;
+    /* Ring slots taken by each buffer id */
+    uint16_t ndescs[MAX_QUEUE_SIZE];
+} PackedQueue;
+
+typedef struct PackedDev {
+    QPCIBus *bus;
+    QPCIDevice *pdev;
+    void *bars[6];
+    void *common;
+    void *notify;
+    void *isr;
+    uint32_t notify_mult;
+    uint64_t features;
+} PackedDev;
+
+typedef struct PackedBuf {
+    uint64_t addr;
+    uint32_t len;
+    bool write;
+} PackedBuf;
+
+/* Map the region that the virtio capability of @cfg_type points to */
+static void *packed_map_cap(PackedDev *d, uint8_t cfg_type,
+                            uint32_t *notify_mult)
+{
+    uint8_t pos = qpci_config_readb(d->pdev, PCI_CAPABILITY_LIST);
+
+    while (pos) {
+        if (qpci_config_readb(d->pdev, pos) == PCI_CAP_ID_VNDR &&
+            qpci_config_readb(d->pdev,
+                              pos + VIRTIO_PCI_CAP_CFG_TYPE) == cfg_type) {
+            uint8_t bar = qpci_config_readb(d->pdev,
+                                            pos + VIRTIO_PCI_CAP_BAR);
+            uint32_t offset = qpci_config_readl(d->pdev,
+                                                pos + VIRTIO_PCI_CAP_OFFSET);
+
+            if (notify_mult) {
+                *notify_mult = qpci_config_readl(d->pdev, pos +
+                                                 sizeof(struct virtio_pci_cap));
+            }
+            g_assert_cmpint(bar, <, ARRAY_SIZE(d->bars));
+            if (!d->bars[bar]) {
+                d->bars[bar] = qpci_iomap(d->pdev, bar, NULL);
+            }
+            return (uint8_t *)d->bars[bar] + offset;
+        }
+        pos = qpci_config_readb(d->pdev, pos + PCI_CAP_LIST_NEXT);
+    }
+    g_assert_not_reached();
+}
+
+/* Negotiate the packed layout and the optional @want features */
+static void packed_dev_init(PackedDev *d, uint64_t want)
+{
+    uint64_t features;
+    uint8_t status;
+
+    d->bus = qpci_init_pc();
+    d->pdev = qpci_device_find(d->bus, QPCI_DEVFN(4, 0));
+    g_assert(d->pdev);
+    qpci_device_enable(d->pdev);
+
+    d->common = packed_map_cap(d, VIRTIO_PCI_CAP_COMMON_CFG, NULL);
+    d->notify = packed_map_cap(d, VIRTIO_PCI_CAP_NOTIFY_CFG, &d->notify_mult);
+    d->isr = packed_map_cap(d, VIRTIO_PCI_CAP_ISR_CFG, NULL);
+
+    status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    qpci_io_writeb(d->pdev, d->common + VIRTIO_PCI_COMMON_STATUS, status);
+
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_DFSELECT, 1);
+    features = (uint64_t)qpci_io_readl(d->pdev,
+                                       d->common + VIRTIO_PCI_COMMON_DF) << 32;
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_DFSELECT, 0);
+    features |= qpci_io_readl(d->pdev, d->common + VIRTIO_PCI_COMMON_DF);
+
+    want |= (1ull << VIRTIO_F_VERSION_1) | (1ull << VIRTIO_F_RING_PACKED);
+    g_assert_cmphex(features & want, ==, want);
+    d->features = want;
+
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GF, want >> 32);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_GF, want);
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    qpci_io_writeb(d->pdev, d->common + VIRTIO_PCI_COMMON_STATUS, status);
+    g_assert_cmphex(qpci_io_readb(d->pdev,
+                                  d->common + VIRTIO_PCI_COMMON_STATUS),
+                    ==, status);
+}
+
+static void packed_dev_driver_ok(PackedDev *d)
+{
+    uint8_t status = qpci_io_readb(d->pdev,
+                                   d->common + VIRTIO_PCI_COMMON_STATUS);
+
+    qpci_io_writeb(d->pdev, d->common + VIRTIO_PCI_COMMON_STATUS,
+                   status | VIRTIO_CONFIG_S_DRIVER_OK);
+}
+
+static void packed_dev_cleanup(PackedDev *d)
+{
+    g_free(d->pdev);
+    qpci_free_pc(d->bus);
+}
+
+static void packed_queue_init(PackedDev *d, PackedQueue *q, QOSState *qs,
+                              uint16_t index)
+{
+    uint16_t notify_off;
+
+    memset(q, 0, sizeof(*q));
+    q->index = index;
+    q->avail_wrap = true;
+    q->used_wrap = true;
+
+    qpci_io_writew(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_SELECT, index);
+    q->size = qpci_io_readw(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_SIZE);
+    g_assert_cmpint(q->size, >, 0);
+    g_assert_cmpint(q->size, <=, MAX_QUEUE_SIZE);
+
+    q->ring = guest_alloc(qs->alloc, q->size * DESC_SIZE);
+    q->driver_event = guest_alloc(qs->alloc, 4);
+    q->device_event = guest_alloc(qs->alloc, 4);
+    qmemset(q->ring, 0, q->size * DESC_SIZE);
+    qmemset(q->driver_event, 0, 4);
+    qmemset(q->device_event, 0, 4);
+
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_DESCLO, q->ring);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_DESCHI,
+                   q->ring >> 32);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_AVAILLO,
+                   q->driver_event);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_AVAILHI,
+                   q->driver_event >> 32);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_USEDLO,
+                   q->device_event);
+    qpci_io_writel(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_USEDHI,
+                   q->device_event >> 32);
+    notify_off = qpci_io_readw(d->pdev,
+                               d->common + VIRTIO_PCI_COMMON_Q_NOFF);
+    q->notify = (uint8_t *)d->notify + notify_off * d->notify_mult;
+    qpci_io_writew(d->pdev, d->common + VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+}
+
+static void packed_desc_write(uint64_t desc, uint64_t addr, uint32_t len,
+                              uint16_t id)
+{
+    writeq(desc + DESC_ADDR, addr);
+    writel(desc + DESC_LEN, len);
+    writew(desc + DESC_ID, id);
+}
+
+/*
+ * Make @n buffers available as one chain, or through an indirect table
+ * at @table if it is not zero.  The flags of the head descriptor make
+ * the chain visible to the device, so they go last.  Returns the buffer id.
+ */
+static uint16_t packed_add(PackedQueue *q, const PackedBuf *bufs, int n,
+                           uint64_t table)
+{
+    uint16_t id = q->next_id;
+    uint16_t head = q->avail_idx;
+    uint16_t head_flags = 0;
+    int ndescs = table ? 1 : n;
+    int i;
+
+    q->next_id = (q->next_id + 1) % q->size;
+
+    if (table) {
+        for (i = 0; i < n; i++) {
+            packed_desc_write(table + i * DESC_SIZE, bufs[i].addr,
+                              bufs[i].len, 0);
+            writew(table + i * DESC_SIZE + DESC_FLAGS,
+                   bufs[i].write ? VRING_DESC_F_WRITE : 0);
+        }
+    }
+
+    for (i = 0; i < ndescs; i++) {
+        uint64_t desc = q->ring + q->avail_idx * DESC_SIZE;
+        uint16_t flags;
+
+        if (table) {
+            packed_desc_write(desc, table, n * DESC_SIZE, id);
+            flags = VRING_DESC_F_INDIRECT;
+        } else {
+            packed_desc_write(desc, bufs[i].addr, bufs[i].len, id);
+            flags = bufs[i].write ? VRING_DESC_F_WRITE : 0;
+            if (i + 1 < n) {
+                flags |= VRING_DESC_F_NEXT;
+            }
+        }
+        flags |= q->avail_wrap ? 1 << VRING_PACKED_DESC_F_AVAIL
+                               : 1 << VRING_PACKED_DESC_F_USED;
+
+        if (i == 0) {
+            head_flags = flags;
+        } else {
+            writew(desc + DESC_FLAGS, flags);
+        }
+        if (++q->avail_idx == q->size) {
+            q->avail_idx = 0;
+            q->avail_wrap = !q->avail_wrap;
+        }
+    }
+    writew(q->ring + head * DESC_SIZE + DESC_FLAGS, head_flags);
+
+    q->ndescs[id] = ndescs;
+    return id;
+}
+
+static void packed_kick(PackedDev *d, PackedQueue *q)
+{
+    qpci_io_writew(d->pdev, q->notify, q->index);
+}
+
+/* Take the next used buffer if the device has handed one back */
+static bool packed_get_used(PackedQueue *q, uint16_t *id, uint32_t *len)
+{
+    uint64_t desc = q->ring + q->used_idx * DESC_SIZE;
+    uint16_t flags = readw(desc + DESC_FLAGS);
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    if (avail != used || used != q->used_wrap) {
+        return false;
+    }
+
+    *id = readw(desc + DESC_ID);
+    *len = readl(desc + DESC_LEN);
+    g_assert_cmpint(*id, <, q->size);
+    g_assert_cmpint(q->ndescs[*id], >, 0);
+
+    q->used_idx += q->ndescs[*id];
+    q->ndescs[*id] = 0;
+    if (q->used_idx >= q->size) {
+        q->used_idx -= q->size;
+        q->used_wrap = !q->used_wrap;
+    }
+    return true;
+}
+
+static uint16_t packed_wait_used(PackedQueue *q, uint32_t *len)
+{
+    gint64 deadline = g_get_monotonic_time() + TIMEOUT_US;
+    uint16_t id;
+
+    while (!packed_get_used(q, &id, len)) {
+        g_assert(g_get_monotonic_time() < deadline);
+        clock_step(100);
+    }
+    return id;
+}
+
+/* Reading the ISR acknowledges the interrupt */
+static bool packed_isr(PackedDev *d)
+{
+    return qpci_io_readb(d->pdev, d->isr) & 1;
+}
+
+static void set_driver_event(PackedQueue *q, uint16_t flags, uint16_t off,
+                             bool wrap)
+{
+    writew(q->driver_event + EVENT_OFF_WRAP,
+           off | wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+    writew(q->driver_event + EVENT_FLAGS, flags);
+}
+
+/* virtio-blk */
+
+static void blk_fill(uint8_t *buf, uint64_t sector, unsigned int seq)
+{
+    int i;
+
+    for (i = 0; i < BLK_SECTOR; i++) {
+        buf[i] = sector * 31 + seq * 7 + i;
+    }
+}
+
+/* Submit one request for @sector, direct or through an indirect table */
+static uint16_t blk_submit(PackedDev *d, PackedQueue *q, QOSState *qs,
+                           uint32_t type, uint64_t sector, uint64_t data,
+                           bool indirect, bool kick, uint64_t *allocs)
+{
+    PackedBuf bufs[3];
+    uint64_t hdr = guest_alloc(qs->alloc, BLK_HDR_SIZE);
+    uint64_t status = guest_alloc(qs->alloc, 1);
+    uint64_t table = indirect ? guest_alloc(qs->alloc, 3 * DESC_SIZE) : 0;
+    uint16_t id;
+
+    writel(hdr, type);
+    writel(hdr + 4, 0);
+    writeq(hdr + 8, sector);
+    writeb(status, 0xff);
+
+    bufs[0] = (PackedBuf) { hdr, BLK_HDR_SIZE, false };
+    bufs[1] = (PackedBuf) { data, BLK_SECTOR, type == VIRTIO_BLK_T_IN };
+    bufs[2] = (PackedBuf) { status, 1, true };
+    id = packed_add(q, bufs, 3, table);
+    if (kick) {
+        packed_kick(d, q);
+    }
+
+    allocs[0] = hdr;
+    allocs[1] = status;
+    allocs[2] = table;
+    return id;
+}
+
+static void blk_complete(PackedQueue *q, QOSState *qs, uint16_t id,
+                         uint32_t type, uint64_t *allocs)
+{
+    uint32_t len;
+
+    g_assert_cmpint(packed_wait_used(q, &len), ==, id);
+    g_assert_cmpint(len, ==, type == VIRTIO_BLK_T_IN ? BLK_SECTOR + 1 : 1);
+    g_assert_cmpint(readb(allocs[1]), ==, VIRTIO_BLK_S_OK);
+
+    guest_free(qs->alloc, allocs[0]);
+    guest_free(qs->alloc, allocs[1]);
+    if (allocs[2]) {
+        guest_free(qs->alloc, allocs[2]);
+    }
+}
+
+/* Write and read back a sector, returns after both requests completed */
+static void blk_rw(PackedDev *d, PackedQueue *q, QOSState *qs,
+                   uint64_t sector, unsigned int seq, bool indirect)
+{
+    uint8_t buf[BLK_SECTOR], check[BLK_SECTOR];
+    uint64_t data = guest_alloc(qs->alloc, BLK_SECTOR);
+    uint64_t allocs[3];
+    uint16_t id;
+
+    blk_fill(buf, sector, seq);
+    memwrite(data, buf, BLK_SECTOR);
+    id = blk_submit(d, q, qs, VIRTIO_BLK_T_OUT, sector, data, indirect,
+                    true, allocs);
+    blk_complete(q, qs, id, VIRTIO_BLK_T_OUT, allocs);
+
+    qmemset(data, 0, BLK_SECTOR);
+    id = blk_submit(d, q, qs, VIRTIO_BLK_T_IN, sector, data, indirect,
+                    true, allocs);
+    blk_complete(q, qs, id, VIRTIO_BLK_T_IN, allocs);
+    memread(data, check, BLK_SECTOR);
+    g_assert(!memcmp(buf, check, BLK_SECTOR));
+
+    guest_free(qs->alloc, data);
+}
+
+static QOSState *blk_boot(const char *extra)
+{
+    return qtest_pc_boot("-drive if=none,id=drive0,file=%s,format=raw "
+                         "-device virtio-blk-pci,drive=drive0," DEVICE_OPTS
+                         " %s", blk_img, extra);
+}
+
+/*
+ * Three descriptors per request do not divide the ring size, so over
+ * several laps chains straddle the end of the ring in every position.
+ */
+static void test_blk_wrap(void)
+{
+    QOSState *qs = blk_boot("");
+    PackedDev d = { 0 };
+    PackedQueue q;
+    unsigned int i, laps;
+
+    packed_dev_init(&d, 0);
+    packed_queue_init(&d, &q, qs, 0);
+    packed_dev_driver_ok(&d);
+    g_assert_cmpint(q.size % 3, !=, 0);
+
+    for (i = 0, laps = 0; laps < 3; i++) {
+        bool wrap = q.used_wrap;
+
+        blk_rw(&d, &q, qs, i % 16, i, false);
+        laps += q.used_wrap != wrap;
+    }
+    g_assert_cmpint(q.used_idx, ==, q.avail_idx);
+
+    packed_dev_cleanup(&d);
+    qtest_pc_shutdown(qs);
+}
+
+/* Indirect tables take a single slot, mixed with direct chains */
+static void test_blk_indirect(void)
+{
+    QOSState *qs = blk_boot("");
+    PackedDev d = { 0 };
+    PackedQueue q;
+    unsigned int i;
+
+    packed_dev_init(&d, 1ull << VIRTIO_RING_F_INDIRECT_DESC);
+    packed_queue_init(&d, &q, qs, 0);
+    packed_dev_driver_ok(&d);
+
+    for (i = 0; i < 2 * q.size; i++) {
+        uint16_t avail = q.avail_idx;
+
+        blk_rw(&d, &q, qs, i % 16, i, i % 3 != 0);
+        if (i % 3 != 0) {
+            g_assert_cmpint((avail + 2) % q.size, ==, q.avail_idx);
+        }
+    }
+
+    packed_dev_cleanup(&d);
+    qtest_pc_shutdown(qs);
+}
+
+/* Both event suppression areas, with and without an event offset */
+static void test_blk_event_suppression(void)
+{
+    QOSState *qs = blk_boot("");
+    PackedDev d = { 0 };
+    PackedQueue q;
+    uint64_t data, allocs[3];
+    uint16_t id, off;
+    bool wrap;
+
+    packed_dev_init(&d, 1ull << VIRTIO_RING_F_EVENT_IDX);
+    packed_queue_init(&d, &q, qs, 0);
+    packed_dev_driver_ok(&d);
+    data = guest_alloc(qs->alloc, BLK_SECTOR);
+
+    /* No interrupt when the driver disables them */
+    set_driver_event(&q, VRING_PACKED_EVENT_FLAG_DISABLE, 0, 0);
+    packed_isr(&d);
+    id = blk_submit(&d, &q, qs, VIRTIO_BLK_T_IN, 0, data, false, true,
+                    allocs);
+    blk_complete(&q, qs, id, VIRTIO_BLK_T_IN, allocs);
+    g_assert(!packed_isr(&d));
+
+    /* One for every used buffer when they are enabled */
+    set_driver_event(&q, VRING_PACKED_EVENT_FLAG_ENABLE, 0, 0);
+    id = blk_submit(&d, &q, qs, VIRTIO_BLK_T_IN, 1, data, false, true,
+                    allocs);
+    blk_complete(&q, qs, id, VIRTIO_BLK_T_IN, allocs);
+    g_assert(packed_isr(&d));
+
+    /* The device asks to be kicked for the next slot the driver fills */
+    g_assert_cmpint(readw(q.device_event + EVENT_FLAGS), ==,
+                    VRING_PACKED_EVENT_FLAG_DESC);
+    g_assert_cmphex(readw(q.device_event + EVENT_OFF_WRAP), ==,
+                    q.avail_idx | q.avail_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    /* Only once the used index goes past the offset: that is with the
+     * second of the next two requests */
+    off = q.used_idx + 3;
+    wrap = q.used_wrap;
+    if (off >= q.size) {
+        off -= q.size;
+        wrap = !wrap;
+    }
+    set_driver_event(&q, VRING_PACKED_EVENT_FLAG_DESC, off, wrap);
+    id = blk_submit(&d, &q, qs, VIRTIO_BLK_T_IN, 2, data, false, true,
+                    allocs);
+    blk_complete(&q, qs, id, VIRTIO_BLK_T_IN, allocs);
+    g_assert(!packed_isr(&d));
+    id = blk_submit(&d, &q, qs, VIRTIO_BLK_T_IN, 3, data, false, true,
+                    allocs);
+    blk_complete(&q, qs, id, VIRTIO_BLK_T_IN, allocs);
+    g_assert(packed_isr(&d));
+
+    guest_free(qs->alloc, data);
+    packed_dev_cleanup(&d);
+    qtest_pc_shutdown(qs);
+}
+
+/*
+ * Migrate with the ring past its first wrap and a request that the
+ * source never saw: the destination must pick it up where the source
+ * stopped, with the same wrap counters.
+ */
+static void test_blk_migrate(void)
+{
+    char *uri = g_strdup_printf("unix:%s", mig_socket);
+    QOSState *src, *dst;
+    PackedDev d = { 0 };
+    PackedQueue q;
+    uint8_t buf[BLK_SECTOR], check[BLK_SECTOR];
+    uint64_t data, allocs[3];
+    unsigned int i;
+    uint16_t id;
+
+    src = blk_boot("");
+    dst = qtest_pc_boot("-drive if=none,id=drive0,file=%s,format=raw "
+                        "-device virtio-blk-pci,drive=drive0," DEVICE_OPTS
+                        " -incoming %s", blk_img, uri);
+
+    set_context(src);
+    packed_dev_init(&d, 0);
+    packed_queue_init(&d, &q, src, 0);
+    packed_dev_driver_ok(&d);
+
+    for (i = 0; q.used_wrap || q.used_idx < q.size / 2; i++) {
+        blk_rw(&d, &q, src, i % 16, i, false);
+    }
+
+    data = guest_alloc(src->alloc, BLK_SECTOR);
+    blk_fill(buf, 20, i);
+    memwrite(data, buf, BLK_SECTOR);
+    id = blk_submit(&d, &q, src, VIRTIO_BLK_T_OUT, 20, data, false, false,
+                    allocs);
+
+    migrate(src, dst, uri);
+
+    packed_kick(&d, &q);
+    blk_complete(&q, dst, id, VIRTIO_BLK_T_OUT, allocs);
+
+    qmemset(data, 0, BLK_SECTOR);
+    id = blk_submit(&d, &q, dst, VIRTIO_BLK_T_IN, 20, data, false, true,
+                    allocs);
+    blk_complete(&q, dst, id, VIRTIO_BLK_T_IN, allocs);
+    memread(data, check, BLK_SECTOR);
+    g_assert(!memcmp(buf, check, BLK_SECTOR));
+    guest_free(dst->alloc, data);
+
+    /* And the rest of the lap, across the next wrap */
+    for (i = 0; !q.used_wrap; i++) {
+        blk_rw(&d, &q, dst, i % 16, i, false);
+    }
+
+    packed_dev_cleanup(&d);
+    qtest_pc_shutdown(src);
+    qtest_pc_shutdown(dst);
+    g_free(uri);
+}
+
+/* virtio-net */
+
+static void net_post_rx(PackedQueue *q, uint64_t *bufs, uint16_t *ids)
+{
+    int i;
+
+    for (i = 0; i < NET_RX_BUFS; i++) {
+        PackedBuf buf = { bufs[i], NET_RX_BUF_LEN, true };
+
+        ids[i] = packed_add(q, &buf, 1, 0);
+    }
+}
+
+/*
+ * A packet that takes several mergeable receive buffers comes back as one
+ * batch of used descriptors, with a single interrupt; five buffers a
+ * packet make the batches straddle the end of the ring.
+ */
+static void test_net_rx_batch(void)
+{
+    int sv[2], ret;
+    QOSState *qs;
+    PackedDev d = { 0 };
+    PackedQueue rx, tx;
+    uint64_t bufs[NET_RX_BUFS];
+    uint16_t ids[NET_RX_BUFS], id;
+    uint8_t pkt[NET_PKT_LEN], got[NET_RX_BUFS * NET_RX_BUF_LEN];
+    uint32_t be_len = htonl(NET_PKT_LEN), len;
+    unsigned int n, i, laps = 0;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    qs = qtest_pc_boot("-netdev socket,fd=%d,id=hs0 "
+                       "-device virtio-net-pci,netdev=hs0," DEVICE_OPTS,
+                       sv[1]);
+
+    packed_dev_init(&d, 1ull << VIRTIO_NET_F_MRG_RXBUF);
+    packed_queue_init(&d, &rx, qs, 0);
+    packed_queue_init(&d, &tx, qs, 1);
+    packed_dev_driver_ok(&d);
+    g_assert_cmpint(rx.size % NET_RX_BUFS, !=, 0);
+
+    for (i = 0; i < NET_RX_BUFS; i++) {
+        bufs[i] = guest_alloc(qs->alloc, NET_RX_BUF_LEN);
+    }
+
+    for (n = 0; laps < 2; n++) {
+        bool wrap = rx.used_wrap;
+        struct iovec iov[] = {
+            { .iov_base = &be_len, .iov_len = sizeof(be_len) },
+            { .iov_base = pkt, .iov_len = sizeof(pkt) },
+        };
+
+        net_post_rx(&rx, bufs, ids);
+        packed_kick(&d, &rx);
+        packed_isr(&d);
+
+        for (i = 0; i < sizeof(pkt); i++) {
+            pkt[i] = n + i * 3;
+        }
+        ret = iov_send(sv[0], iov, 2, 0, sizeof(be_len) + sizeof(pkt));
+        g_assert_cmpint(ret, ==, sizeof(be_len) + sizeof(pkt));
+
+        /* The whole batch is visible once its first buffer is */
+        id = packed_wait_used(&rx, &len);
+        g_assert_cmpint(id, ==, ids[0]);
+        g_assert_cmpint(len, ==, NET_RX_BUF_LEN);
+        for (i = 1; i < NET_RX_BUFS; i++) {
+            g_assert(packed_get_used(&rx, &id, &len));
+            g_assert_cmpint(id, ==, ids[i]);
+            g_assert_cmpint(len, ==, NET_RX_BUF_LEN);
+        }
+        g_assert(!packed_get_used(&rx, &id, &len));
+        g_assert(packed_isr(&d));
+
+        for (i = 0; i < NET_RX_BUFS; i++) {
+            memread(bufs[i], got + i * NET_RX_BUF_LEN, NET_RX_BUF_LEN);
+        }
+        g_assert_cmpint(lduw_le_p(got + offsetof(struct virtio_net_hdr_mrg_rxbuf,
+                                                 num_buffers)),
+                        ==, NET_RX_BUFS);
+        g_assert(!memcmp(got + NET_HDR_SIZE, pkt, sizeof(pkt)));
+
+        laps += rx.used_wrap != wrap;
+    }
+
+    for (i = 0; i < NET_RX_BUFS; i++) {
+        guest_free(qs->alloc, bufs[i]);
+    }
+    packed_dev_cleanup(&d);
+    qtest_pc_shutdown(qs);
+    close(sv[0]);
+}
+
+/* Transmit a header and payload chain and get it out of the socket */
+static void test_net_tx(void)
+{
+    int sv[2], ret;
+    QOSState *qs;
+    PackedDev d = { 0 };
+    PackedQueue rx, tx;
+    PackedBuf bufs[2];
+    uint64_t hdr, data;
+    uint8_t pkt[100], got[sizeof(pkt)];
+    uint32_t be_len, len;
+    unsigned int n, i;
+    uint16_t id;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    qs = qtest_pc_boot("-netdev socket,fd=%d,id=hs0 "
+                       "-device virtio-net-pci,netdev=hs0," DEVICE_OPTS,
+                       sv[1]);
+
+    packed_dev_init(&d, 0);
+    packed_queue_init(&d, &rx, qs, 0);
+    packed_queue_init(&d, &tx, qs, 1);
+    packed_dev_driver_ok(&d);
+
+    hdr = guest_alloc(qs->alloc, NET_HDR_SIZE);
+    data = guest_alloc(qs->alloc, sizeof(pkt));
+    qmemset(hdr, 0, NET_HDR_SIZE);
+
+    /* Two descriptors a packet, through the end of the ring and back */
+    for (n = 0; n < tx.size / 2 + 3; n++) {
+        for (i = 0; i < sizeof(pkt); i++) {
+            pkt[i] = n * 5 + i;
+        }
+        memwrite(data, pkt, sizeof(pkt));
+        bufs[0] = (PackedBuf) { hdr, NET_HDR_SIZE, false };
+        bufs[1] = (PackedBuf) { data, sizeof(pkt), false };
+        id = packed_add(&tx, bufs, 2, 0);
+        packed_kick(&d, &tx);
+
+        g_assert_cmpint(packed_wait_used(&tx, &len), ==, id);
+
+        ret = qemu_recv(sv[0], &be_len, sizeof(be_len), 0);
+        g_assert_cmpint(ret, ==, sizeof(be_len));
+        g_assert_cmpint(ntohl(be_len), ==, sizeof(pkt));
+        ret = qemu_recv(sv[0], got, sizeof(got), 0);
+        g_assert_cmpint(ret, ==, sizeof(got));
+        g_assert(!memcmp(got, pkt, sizeof(pkt)));
+    }
+    g_assert(!tx.used_wrap);
+
+    guest_free(qs->alloc, hdr);
+    guest_free(qs->alloc, data);
+    packed_dev_cleanup(&d);
+    qtest_pc_shutdown(qs);
+    close(sv[0]);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(mig_socket);
+    g_assert(fd >= 0);
+    close(fd);
+    unlink(mig_socket);
+
+    fd = mkstemp(blk_img);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, BLK_IMG_SIZE);
+    g_assert(ret == 0);
+    close(fd);
+
+    qtest_add_func("/virtio/packed/blk/wrap", test_blk_wrap);
+    qtest_add_func("/virtio/packed/blk/indirect", test_blk_indirect);
+    qtest_add_func("/virtio/packed/blk/event-suppression",
+                   test_blk_event_suppression);
+    qtest_add_func("/virtio/packed/blk/migrate", test_blk_migrate);
+    qtest_add_func("/virtio/packed/net/rx-batch", test_net_rx_batch);
+    qtest_add_func("/virtio/packed/net/tx", test_net_tx);
+    ret = g_test_run();
+
+    unlink(blk_img);
+    return ret;
+}
@@ -0,0 +1,325 @@
+/*
+ * Simple C functions to supplement the C library
+ *
+ * Copyright (c) 2006 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/cutils.h"
+#include "qemu/bswap.h"
+
+/* Buffers at least this large are handed to the vector implementations,
+ * which may rely on it. */
+#define BUFFER_ACCEL_MIN_LEN 64
+
+/* Buffers at least this large get their first and last cache line probed
+ * before the full scan. */
+#define BUFFER_PROBE_MIN_LEN 256
+
+static bool buffer_zero_int(const void *buf, size_t len)
+{
+    if (unlikely(len < 8)) {
+        /* For a very small buffer, simply accumulate all the bytes.  */
+        const unsigned char *p = buf;
+        const unsigned char *e = buf + len;
+        unsigned char t = 0;
+
+        do {
+            t |= *p++;
+        } while (p < e);
+
+        return t == 0;
+    } else {
+        /* Otherwise, use the unaligned memory access functions to
+         * handle the beginning and end of the buffer, with a couple
+         * of loops handling the middle aligned section.  */
+        uint64_t t = ldq_he_p(buf) | ldq_he_p(buf + len - 8);
+        const uint64_t *p = (uint64_t *)(((uintptr_t)buf + 8) & -8);
+        const uint64_t *e = (uint64_t *)(((uintptr_t)buf + len) & -8);
+
+        for (; p + 8 <= e; p += 8) {
+            if (t) {
+                return false;
+            }
+            t = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+        }
+        while (p < e) {
+            t |= *p++;
+        }
+
+        return t == 0;
+    }
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512F_OPT) || \
+    defined(__SSE2__)
+#include <immintrin.h>
+#include "qemu/cpuid.h"
+
+/*
+ * Each of the vector implementations below ORs an unaligned vector from the
+ * head and from the tail of the buffer into the accumulator and walks the
+ * aligned middle in blocks of four vectors, checking the accumulator once
+ * per block so that non-zero data is found early.  They require
+ * len >= BUFFER_ACCEL_MIN_LEN.
+ */
+
+#ifdef __SSE2__
+static bool buffer_zero_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = (__m128i *)(((uintptr_t)buf + 16) & -16);
+    const __m128i *e = (__m128i *)(((uintptr_t)buf + len) & -16);
+    __m128i zero = _mm_setzero_si128();
+    __m128i t = _mm_or_si128(_mm_loadu_si128(buf),
+                             _mm_loadu_si128(buf + len - 16));
+
+    for (; p + 4 <= e; p += 4) {
+        if (unlikely(_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF)) {
+            return false;
+        }
+        t = _mm_or_si128(_mm_or_si128(p[0], p[1]),
+                         _mm_or_si128(p[2], p[3]));
+    }
+    while (p < e) {
+        t = _mm_or_si128(t, *p++);
+    }
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) == 0xFFFF;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static bool buffer_zero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = (__m256i *)(((uintptr_t)buf + 32) & -32);
+    const __m256i *e = (__m256i *)(((uintptr_t)buf + len) & -32);
+    __m256i t = _mm256_or_si256(_mm256_loadu_si256(buf),
+                                _mm256_loadu_si256(buf + len - 32));
+
+    for (; p + 4 <= e; p += 4) {
+        if (unlikely(!_mm256_testz_si256(t, t))) {
+            return false;
+        }
+        t = _mm256_or_si256(_mm256_or_si256(p[0], p[1]),
+                            _mm256_or_si256(p[2], p[3]));
+    }
+    while (p < e) {
+        t = _mm256_or_si256(t, *p++);
+    }
+
+    return _mm256_testz_si256(t, t);
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+static bool buffer_zero_avx512(const void *buf, size_t len)
+{
+    const __m512i *p = (__m512i *)(((uintptr_t)buf + 64) & -64);
+    const __m512i *e = (__m512i *)(((uintptr_t)buf + len) & -64);
+    __m512i t = _mm512_or_si512(_mm512_loadu_si512(buf),
+                                _mm512_loadu_si512(buf + len - 64));
+
+    for (; p + 4 <= e; p += 4) {
+        if (unlikely(_mm512_test_epi64_mask(t, t))) {
+            return false;
+        }
+        t = _mm512_or_si512(_mm512_or_si512(p[0], p[1]),
+                            _mm512_or_si512(p[2], p[3]));
+    }
+    while (p < e) {
+        t = _mm512_or_si512(t, *p++);
+    }
+
+    return !_mm512_test_epi64_mask(t, t);
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
+
+#elif defined(__aarch64__)
+#include "arm_neon.h"
+
+/* Advanced SIMD is architecturally guaranteed on AArch64, so this one is
+ * selected at build time. */
+static bool buffer_zero_neon(const void *buf, size_t len)
+{
+    const uint64x2_t *p = (uint64x2_t *)(((uintptr_t)buf + 16) & -16);
+    const uint64x2_t *e = (uint64x2_t *)(((uintptr_t)buf + len) & -16);
+    uint64x2_t t = vorrq_u64(vreinterpretq_u64_u8(vld1q_u8(buf)),
+                             vreinterpretq_u64_u8(vld1q_u8(buf + len - 16)));
+
+    for (; p + 4 <= e; p += 4) {
+        if (unlikely(vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1))) {
+            return false;
+        }
+        t = vorrq_u64(vorrq_u64(p[0], p[1]), vorrq_u64(p[2], p[3]));
+    }
+    while (p < e) {
+        t = vorrq_u64(t, *p++);
+    }
+
+    return !(vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1));
+}
+
+#elif defined(__ALTIVEC__)
+#include <altivec.h>
+/* The altivec.h header says we're allowed to undef these for
+ * C++ compatibility.  Here we don't care about C++, but we
+ * undef them anyway to avoid namespace pollution.
+ * altivec.h may redefine the bool macro as vector type.
+ * Reset it to POSIX semantics. */
+#undef vector
+#undef pixel
+#undef bool
+#define bool _Bool
+
+/* AltiVec loads ignore the low bits of the address, so the unaligned head
+ * and tail of the buffer go through the integer loads instead. */
+static bool buffer_zero_altivec(const void *buf, size_t len)
+{
+    const __vector unsigned char *p =
+        (__vector unsigned char *)(((uintptr_t)buf + 16) & -16);
+    const __vector unsigned char *e =
+        (__vector unsigned char *)(((uintptr_t)buf + len) & -16);
+    const __vector unsigned char zero = vec_splat_u8(0);
+    __vector unsigned char t = zero;
+
+    if (ldq_he_p(buf) | ldq_he_p(buf + 8) |
+        ldq_he_p(buf + len - 16) | ldq_he_p(buf + len - 8)) {
+        return false;
+    }
+
+    for (; p + 4 <= e; p += 4) {
+        if (unlikely(vec_any_ne(t, zero))) {
+            return false;
+        }
+        t = vec_or(vec_or(p[0], p[1]), vec_or(p[2], p[3]));
+    }
+    while (p < e) {
+        t = vec_or(t, *p++);
+    }
+
+    return vec_all_eq(t, zero);
+}
+#endif
+
+/*
+ * The implementations usable on this host, best first.  buffer_accel is
+ * picked at startup; test_buffer_is_zero_next_accel() steps down the list so
+ * that the tests can exercise every implementation.
+ */
+typedef struct BufferZeroAccel {
+    const char *name;
+    bool (*fn)(const void *, size_t);
+    bool (*available)(void);
+} BufferZeroAccel;
+
+static const BufferZeroAccel buffer_zero_accels[] = {
+#ifdef CONFIG_AVX512F_OPT
+    { "avx512f", buffer_zero_avx512, cpuid_has_avx512f },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", buffer_zero_avx2, cpuid_has_avx2 },
+#endif
+#if defined(__SSE2__)
+    { "sse2", buffer_zero_sse2, NULL },
+#elif defined(__aarch64__)
+    { "neon", buffer_zero_neon, NULL },
+#elif defined(__ALTIVEC__)
+    { "altivec", buffer_zero_altivec, NULL },
+#endif
+    { "int", buffer_zero_int, NULL },
+};
+
+static unsigned buffer_accel_index;
+static bool (*buffer_accel)(const void *, size_t) = buffer_zero_int;
+
+static void select_accel(unsigned first)
+{
+    unsigned i;
+
+    for (i = first; i < ARRAY_SIZE(buffer_zero_accels); i++) {
+        const BufferZeroAccel *a = &buffer_zero_accels[i];
+
+        if (!a->available || a->available()) {
+            buffer_accel_index = i;
+            buffer_accel = a->fn;
+            return;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    select_accel(0);
+}
+
+bool test_buffer_is_zero_next_accel(void)
+{
+    if (buffer_accel_index + 1 >= ARRAY_SIZE(buffer_zero_accels)) {
+        return false;
+    }
+    select_accel(buffer_accel_index + 1);
+    return true;
+}
+
+const char *test_buffer_is_zero_accel_name(void)
+{
+    return buffer_zero_accels[buffer_accel_index].name;
+}
+
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * There are no length or alignment requirements on @buf.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    if (unlikely(len == 0)) {
+        return true;
+    }
+
+    /* Fetch the beginning of the buffer while we select the accelerator.  */
+    __builtin_prefetch(buf);
+
+    if (len < BUFFER_ACCEL_MIN_LEN) {
+        return buffer_zero_int(buf, len);
+    }
+
+    /* Most buffers that are not all zeroes have data at either end (think
+     * of file system blocks or of guest pages), so look there before
+     * paying for a scan of the whole buffer.  */
+    if (len >= BUFFER_PROBE_MIN_LEN &&
+        (!buffer_zero_int(buf, 64) || !buffer_zero_int(buf + len - 64, 64))) {
+        return false;
+    }
+
+    return buffer_accel(buf, len);
+}
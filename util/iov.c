@@ -360,16 +360,9 @@ bool qemu_iovec_is_zero(QEMUIOVector *qiov)
 {
     int i;
     for (i = 0; i < qiov->niov; i++) {
-        size_t offs = QEMU_ALIGN_DOWN(qiov->iov[i].iov_len, 4 * sizeof(long));
-        uint8_t *ptr = qiov->iov[i].iov_base;
-        if (offs && !buffer_is_zero(qiov->iov[i].iov_base, offs)) {
+        if (!buffer_is_zero(qiov->iov[i].iov_base, qiov->iov[i].iov_len)) {
             return false;
         }
-        for (; offs < qiov->iov[i].iov_len; offs++) {
-            if (ptr[offs]) {
-                return false;
-            }
-        }
     }
     return true;
 }